@@ -26,6 +26,7 @@
 #include "edgetpu-debug-dump.h"
 #include "edgetpu-device-group.h"
 #include "edgetpu-dram.h"
+#include "edgetpu-flight-recorder.h"
 #include "edgetpu-internal.h"
 #include "edgetpu-kci.h"
 #include "edgetpu-mailbox.h"
@@ -33,6 +34,7 @@
 #include "edgetpu-mmu.h"
 #include "edgetpu-sw-watchdog.h"
 #include "edgetpu-telemetry.h"
+#include "edgetpu-thermal.h"
 #include "edgetpu-usage-stats.h"
 #include "edgetpu-wakelock.h"
 #include "edgetpu.h"
@@ -278,7 +280,11 @@ int edgetpu_mmap(struct edgetpu_client *client, struct vm_area_struct *vma)
 	if (!pvt)
 		return -ENOMEM;
 
-	/* Mark the VMA's pages as uncacheable. */
+	/*
+	 * Mark the VMA's pages as uncacheable. VII queues of DMA coherent
+	 * devices without an iremap pool are remapped cacheable by
+	 * edgetpu_mmap_queue().
+	 */
 	vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
 	/* Disable fancy things to ensure our event counters work. */
 	vma->vm_flags |= VM_DONTCOPY | VM_DONTEXPAND | VM_DONTDUMP;
@@ -436,6 +442,7 @@ int edgetpu_device_add(struct edgetpu_dev *etdev,
 	etdev->state = ETDEV_STATE_NOFW;
 	etdev->freq_count = 0;
 	mutex_init(&etdev->freq_lock);
+	edgetpu_flight_recorder_init(etdev);
 
 	ret = edgetpu_fs_add(etdev, iface_params, num_ifaces);
 	if (ret) {
@@ -457,6 +464,7 @@ int edgetpu_device_add(struct edgetpu_dev *etdev,
 		goto remove_dev;
 
 	edgetpu_usage_stats_init(etdev);
+	edgetpu_group_pool_init(etdev);
 
 	etdev->kci = devm_kzalloc(etdev->dev, sizeof(*etdev->kci), GFP_KERNEL);
 	if (!etdev->kci) {
@@ -496,11 +504,13 @@ remove_kci:
 	/* releases the resources of KCI */
 	edgetpu_mailbox_remove_all(etdev->mailbox_manager);
 remove_usage_stats:
+	edgetpu_group_pool_exit(etdev);
 	edgetpu_usage_stats_exit(etdev);
 	edgetpu_chip_remove_mmu(etdev);
 remove_dev:
 	edgetpu_mark_probe_fail(etdev);
 	edgetpu_fs_remove(etdev);
+	edgetpu_flight_recorder_exit(etdev);
 	return ret;
 }
 
@@ -510,9 +520,11 @@ void edgetpu_device_remove(struct edgetpu_dev *etdev)
 	edgetpu_debug_dump_exit(etdev);
 	edgetpu_device_dram_exit(etdev);
 	edgetpu_mailbox_remove_all(etdev->mailbox_manager);
+	edgetpu_group_pool_exit(etdev);
 	edgetpu_usage_stats_exit(etdev);
 	edgetpu_chip_remove_mmu(etdev);
 	edgetpu_fs_remove(etdev);
+	edgetpu_flight_recorder_exit(etdev);
 }
 
 struct edgetpu_client *edgetpu_client_add(struct edgetpu_dev_iface *etiface)
@@ -606,6 +618,9 @@ void edgetpu_client_remove(struct edgetpu_client *client)
 	if (client->perdie_events &
 	    1 << perdie_event_id_to_num(EDGETPU_PERDIE_EVENT_TRACES_AVAILABLE))
 		edgetpu_telemetry_unset_event(etdev, EDGETPU_TELEMETRY_TRACE);
+	if (client->perdie_events &
+	    1 << perdie_event_id_to_num(EDGETPU_PERDIE_EVENT_THERMAL_BUDGET))
+		edgetpu_thermal_unset_event(etdev->thermal, client);
 
 	edgetpu_client_put(client);
 }
@@ -627,27 +642,52 @@ void edgetpu_unregister_irq(struct edgetpu_dev *etdev, int irq)
 	devm_free_irq(etdev->dev, irq, etdev);
 }
 
+int edgetpu_coherent_mem_tpu_map(struct edgetpu_dev *etdev, struct edgetpu_coherent_mem *mem,
+				 enum edgetpu_context_id context_id)
+{
+	const u32 flags = EDGETPU_MMU_DIE | EDGETPU_MMU_32 | EDGETPU_MMU_HOST |
+			  EDGETPU_MMU_COHERENT;
+
+	mem->tpu_addr =
+		edgetpu_mmu_tpu_map(etdev, mem->dma_addr, mem->size,
+				    DMA_BIDIRECTIONAL, context_id, flags);
+	if (!mem->tpu_addr)
+		return -EINVAL;
+	return 0;
+}
+
+void edgetpu_coherent_mem_tpu_unmap(struct edgetpu_dev *etdev, struct edgetpu_coherent_mem *mem,
+				    enum edgetpu_context_id context_id)
+{
+	edgetpu_mmu_tpu_unmap(etdev, mem->tpu_addr, mem->size, context_id);
+	mem->tpu_addr = 0;
+}
+
+void edgetpu_free_coherent_unmapped(struct edgetpu_dev *etdev, struct edgetpu_coherent_mem *mem)
+{
+	edgetpu_x86_coherent_mem_set_wb(mem);
+	dma_free_coherent(etdev->dev, mem->size, mem->vaddr, mem->dma_addr);
+	mem->vaddr = NULL;
+}
+
 int edgetpu_alloc_coherent(struct edgetpu_dev *etdev, size_t size,
 			   struct edgetpu_coherent_mem *mem,
 			   enum edgetpu_context_id context_id)
 {
-	const u32 flags = EDGETPU_MMU_DIE | EDGETPU_MMU_32 | EDGETPU_MMU_HOST |
-			  EDGETPU_MMU_COHERENT;
+	int ret;
 
 	mem->vaddr = dma_alloc_coherent(etdev->dev, size, &mem->dma_addr,
 					GFP_KERNEL);
 	if (!mem->vaddr)
 		return -ENOMEM;
 	edgetpu_x86_coherent_mem_init(mem);
-	mem->tpu_addr =
-		edgetpu_mmu_tpu_map(etdev, mem->dma_addr, size,
-				    DMA_BIDIRECTIONAL, context_id, flags);
-	if (!mem->tpu_addr) {
+	mem->size = size;
+	ret = edgetpu_coherent_mem_tpu_map(etdev, mem, context_id);
+	if (ret) {
 		dma_free_coherent(etdev->dev, size, mem->vaddr, mem->dma_addr);
 		mem->vaddr = NULL;
-		return -EINVAL;
+		return ret;
 	}
-	mem->size = size;
 	return 0;
 }
 
@@ -655,15 +695,14 @@ void edgetpu_free_coherent(struct edgetpu_dev *etdev,
 			   struct edgetpu_coherent_mem *mem,
 			   enum edgetpu_context_id context_id)
 {
-	edgetpu_mmu_tpu_unmap(etdev, mem->tpu_addr, mem->size, context_id);
-	edgetpu_x86_coherent_mem_set_wb(mem);
-	dma_free_coherent(etdev->dev, mem->size, mem->vaddr, mem->dma_addr);
-	mem->vaddr = NULL;
+	edgetpu_coherent_mem_tpu_unmap(etdev, mem, context_id);
+	edgetpu_free_coherent_unmapped(etdev, mem);
 }
 
 void edgetpu_handle_firmware_crash(struct edgetpu_dev *etdev,
 				   enum edgetpu_fw_crash_type crash_type)
 {
+	edgetpu_fr_record(etdev, EDGETPU_FR_FW_CRASH, crash_type, 0);
 	if (crash_type == EDGETPU_FW_CRASH_UNRECOV_FAULT) {
 		etdev_err(etdev, "firmware unrecoverable crash");
 		etdev->firmware_crash_count++;
@@ -24,6 +24,14 @@ enum edgetpu_dump_type_bit_position {
 	DUMP_TYPE_KERNEL_CLIENTS_BIT = 33,
 	DUMP_TYPE_KERNEL_GROUPS_BIT = 34,
 	DUMP_TYPE_KERNEL_MAPPINGS_BIT = 35,
+	DUMP_TYPE_KERNEL_FLIGHT_RECORDER_BIT = 36,
+
+	/*
+	 * Set on segments the host compressed with LZ4. The payload is the
+	 * uncompressed size (u64) followed by the compressed original segment,
+	 * header included.
+	 */
+	DUMP_TYPE_HOST_LZ4_BIT = 62,
 
 	DUMP_TYPE_MAX_BIT = 63
 };
@@ -7,6 +7,7 @@
 
 #include <linux/atomic.h>
 #include <linux/bitops.h>
+#include <linux/build_bug.h>
 #include <linux/cred.h>
 #include <linux/dma-direction.h>
 #include <linux/dma-mapping.h>
@@ -14,20 +15,29 @@
 #include <linux/iommu.h>
 #include <linux/kconfig.h>
 #include <linux/kernel.h>
+#include <linux/ktime.h>
 #include <linux/list.h>
+#include <linux/math64.h>
 #include <linux/mm.h>
+#include <linux/moduleparam.h>
+#include <linux/overflow.h>
+#include <linux/rcupdate.h>
 #include <linux/refcount.h>
 #include <linux/scatterlist.h>
+#include <linux/sched/mm.h>
 #include <linux/seq_file.h>
 #include <linux/slab.h>
+#include <linux/sort.h>
 #include <linux/spinlock.h>
 #include <linux/uaccess.h>
 #include <linux/uidgid.h>
+#include <linux/version.h>
 
 #include "edgetpu-async.h"
 #include "edgetpu-config.h"
 #include "edgetpu-device-group.h"
 #include "edgetpu-dram.h"
+#include "edgetpu-flight-recorder.h"
 #include "edgetpu-internal.h"
 #include "edgetpu-iremap-pool.h"
 #include "edgetpu-kci.h"
@@ -35,6 +45,7 @@
 #include "edgetpu-mcp.h"
 #include "edgetpu-mmu.h"
 #include "edgetpu-sw-watchdog.h"
+#include "edgetpu-usage-stats.h"
 #include "edgetpu-usr.h"
 #include "edgetpu-wakelock.h"
 #include "edgetpu.h"
@@ -47,6 +58,9 @@
 #define for_each_list_group_client_safe(c, n, group) \
 	list_for_each_entry_safe(c, n, &group->clients, list)
 
+/* Number of user pages pinned at once by a buffer map request. */
+#define EDGETPU_PIN_BATCH_PAGES 512
+
 /* Records the mapping and other fields needed for a host buffer mapping */
 struct edgetpu_host_map {
 	struct edgetpu_mapping map;
@@ -59,6 +73,12 @@ struct edgetpu_host_map {
 	 * group uses @map->sgt as its SG table.
 	 */
 	struct sg_table *sg_tables;
+	/* number of SG entries allocated for @map.sgt, see edgetpu_free_pinned_sgt() */
+	uint sgt_total_nents;
+	/* number of pinned pages charged for this mapping */
+	uint num_pages;
+	/* the mm whose RLIMIT_MEMLOCK @num_pages are charged to, NULL if not charged */
+	struct mm_struct *mm;
 };
 
 /*
@@ -140,12 +160,18 @@ static int edgetpu_group_activate(struct edgetpu_device_group *group)
 		return 0;
 
 	mailbox_id = edgetpu_group_context_id_locked(group);
-	ret = edgetpu_mailbox_activate(group->etdev, mailbox_id, group->vcid, !group->activated);
+	/* the runtime hasn't acknowledged the reset yet, see edgetpu_group_ack_vii_reset() */
+	if (group->vii_reset_pending)
+		ret = 0;
+	else
+		ret = edgetpu_mailbox_activate(group->etdev, mailbox_id, group->vcid,
+					       !group->activated);
 	if (ret) {
 		etdev_err(group->etdev, "activate mailbox for VCID %d failed with %d", group->vcid,
 			  ret);
 	} else {
 		group->activated = true;
+		group->vii_open = !group->vii_reset_pending;
 		for (i = 0; i < group->n_clients; i++) {
 			etdev = edgetpu_device_group_nth_etdev(group, i);
 			edgetpu_sw_wdt_inc_active_ref(etdev);
@@ -174,6 +200,12 @@ static void edgetpu_group_deactivate(struct edgetpu_device_group *group)
 
 	if (edgetpu_group_mailbox_detached_locked(group))
 		return;
+	/* already closed by edgetpu_group_quota_work() */
+	if (group->quota_throttled) {
+		group->quota_throttled = false;
+		return;
+	}
+	group->vii_open = false;
 
 	for (i = 0; i < group->n_clients; i++) {
 		etdev = edgetpu_device_group_nth_etdev(group, i);
@@ -393,17 +425,400 @@ static int do_attach_mailbox_locked(struct edgetpu_device_group *group)
  * Does detach domain, remove VII, and invalidate @group->context_id without
  * checking @group->mailbox_detachable and whether the mailbox is detached.
  *
+ * The VII queues of a detachable group are kept allocated and mapped in its
+ * domain, so apps toggling wakelocks don't pay the queue allocation and
+ * mapping on every attach. They are freed when the group is released.
+ *
  * Caller holds @group->lock.
  */
 static void do_detach_mailbox_locked(struct edgetpu_device_group *group)
 {
-	edgetpu_mailbox_remove_vii(&group->vii);
-	edgetpu_mmu_detach_domain(group->etdev, group->etdomain);
+	enum edgetpu_context_id context_id = EDGETPU_CONTEXT_INVALID;
+
 	if (group->etdomain->token != EDGETPU_DOMAIN_TOKEN_END)
-		group->context_id =
-			EDGETPU_CONTEXT_DOMAIN_TOKEN | group->etdomain->token;
+		context_id = EDGETPU_CONTEXT_DOMAIN_TOKEN | group->etdomain->token;
+	if (group->mailbox_detachable && context_id != EDGETPU_CONTEXT_INVALID)
+		edgetpu_mailbox_park_vii(&group->vii, context_id);
 	else
-		group->context_id = EDGETPU_CONTEXT_INVALID;
+		edgetpu_mailbox_remove_vii(&group->vii);
+	edgetpu_mmu_detach_domain(group->etdev, group->etdomain);
+	group->context_id = context_id;
+}
+
+/*
+ * Minimum time a group keeps its VII mailbox before another group may take it
+ * when all the VII mailboxes are in use, i.e. the time slice of oversubscribed
+ * mailboxes.
+ */
+static uint mailbox_min_residency_ms = 10;
+module_param(mailbox_min_residency_ms, uint, 0660);
+MODULE_PARM_DESC(mailbox_min_residency_ms,
+		 "Minimum time an idle group keeps its VII mailbox before being evicted");
+
+static void edgetpu_evict_stats_record(struct edgetpu_dev *etdev, bool swap_in, ktime_t start)
+{
+	struct edgetpu_mailbox_evict_stats *stats = &etdev->mailbox_manager->evict_stats;
+	u64 ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	spin_lock(&stats->lock);
+	if (swap_in) {
+		stats->swap_ins++;
+		stats->swap_in_ns_total += ns;
+		stats->swap_in_ns_max = max(stats->swap_in_ns_max, ns);
+	} else {
+		stats->evictions++;
+		stats->evict_ns_total += ns;
+		stats->evict_ns_max = max(stats->evict_ns_max, ns);
+	}
+	spin_unlock(&stats->lock);
+}
+
+/*
+ * Rank of @group for VII mailbox admission: the deadline class, then the
+ * mailbox priority. Higher ranks are admitted first and may preempt lower ones.
+ */
+static u32 edgetpu_group_rank(const struct edgetpu_device_group *group)
+{
+	return (group->deadline_class << 3) |
+	       (group->mbox_attr.priority & ~EDGETPU_PRIORITY_DETACHABLE);
+}
+
+/*
+ * Returns whether the VII mailbox of @group can be given to a group of rank
+ * @rank.
+ *
+ * Only idle detachable groups are evictable. They must also not have used the
+ * mailbox within the time slice, unless they rank lower than @rank, in which
+ * case @preempt is set. Groups with the mailbox CSRs mapped to user space are
+ * not evictable, since the mappings point to the physical mailbox; a racing
+ * mmap() of the CSRs attaches the mailbox again, see edgetpu_mmap_csr().
+ *
+ * Caller holds @group->lock.
+ */
+static bool edgetpu_group_mailbox_evictable_locked(struct edgetpu_device_group *group, u32 rank,
+						   bool *preempt)
+{
+	struct edgetpu_wakelock *wakelock;
+	uint residency_ms = READ_ONCE(mailbox_min_residency_ms);
+	int i;
+
+	if (!group->mailbox_detachable || group->ext_mailbox || group->dev_inaccessible ||
+	    !edgetpu_group_finalized_and_attached(group))
+		return false;
+	*preempt = time_before(jiffies,
+			       group->mailbox_last_used + msecs_to_jiffies(residency_ms));
+	if (*preempt && edgetpu_group_rank(group) >= rank)
+		return false;
+	for (i = 0; i < group->n_clients; i++) {
+		wakelock = group->members[i]->wakelock;
+		if (NO_WAKELOCK(wakelock) ||
+		    READ_ONCE(wakelock->event_count[EDGETPU_WAKELOCK_EVENT_MBOX_CSR]))
+			return false;
+	}
+	return edgetpu_mailbox_vii_idle(&group->vii);
+}
+
+struct edgetpu_evict_candidate {
+	struct edgetpu_device_group *group;
+	u32 rank;
+	unsigned long last_used;
+};
+
+/* Returns whether @a should be evicted before @b: lowest rank, then least recently used. */
+static bool edgetpu_evict_before(const struct edgetpu_evict_candidate *a,
+				 const struct edgetpu_evict_candidate *b)
+{
+	if (a->rank != b->rank)
+		return a->rank < b->rank;
+	return time_before(a->last_used, b->last_used);
+}
+
+/*
+ * Releases the VII mailbox of an evictable group on the device of @group,
+ * trying the lowest ranked then least recently used groups first. The evicted
+ * group keeps its queues, see edgetpu_mailbox_park_vii(), and gets a mailbox
+ * again on its next use.
+ *
+ * Victims are only trylock'ed, so groups evicting each other can't deadlock.
+ *
+ * Caller holds @group->lock.
+ *
+ * Returns 0 if a mailbox was released, -EBUSY if no group can be evicted.
+ */
+static int edgetpu_group_evict_lru_locked(struct edgetpu_device_group *group)
+{
+	struct edgetpu_dev *etdev = group->etdev;
+	struct edgetpu_evict_candidate *cands, victim;
+	struct edgetpu_device_group *tgroup;
+	struct edgetpu_list_group *g;
+	u32 rank = edgetpu_group_rank(group);
+	ktime_t start = ktime_get();
+	uint i, n = 0, first;
+	bool preempt = false;
+	int ret = -EBUSY;
+
+	mutex_lock(&etdev->groups_lock);
+	cands = kmalloc_array(etdev->n_groups, sizeof(*cands), GFP_KERNEL);
+	if (!cands) {
+		mutex_unlock(&etdev->groups_lock);
+		return -ENOMEM;
+	}
+	etdev_for_each_group(etdev, g, tgroup) {
+		if (tgroup == group || !tgroup->mailbox_detachable)
+			continue;
+		cands[n].group = edgetpu_device_group_get(tgroup);
+		cands[n].rank = edgetpu_group_rank(tgroup);
+		cands[n].last_used = READ_ONCE(tgroup->mailbox_last_used);
+		n++;
+	}
+	mutex_unlock(&etdev->groups_lock);
+
+	while (n && ret) {
+		first = 0;
+		for (i = 1; i < n; i++) {
+			if (edgetpu_evict_before(&cands[i], &cands[first]))
+				first = i;
+		}
+		victim = cands[first];
+		cands[first] = cands[--n];
+		if (mutex_trylock(&victim.group->lock)) {
+			if (edgetpu_group_mailbox_evictable_locked(victim.group, rank, &preempt)) {
+				edgetpu_group_deactivate(victim.group);
+				do_detach_mailbox_locked(victim.group);
+				victim.group->mailbox_evicted = true;
+				etdev_dbg(etdev, "VCID %u %s the mailbox of VCID %u", group->vcid,
+					  preempt ? "preempts" : "takes", victim.group->vcid);
+				ret = 0;
+			}
+			mutex_unlock(&victim.group->lock);
+		}
+		edgetpu_device_group_put(victim.group);
+	}
+	for (i = 0; i < n; i++)
+		edgetpu_device_group_put(cands[i].group);
+	kfree(cands);
+	if (!ret) {
+		edgetpu_evict_stats_record(etdev, false, start);
+		if (preempt)
+			edgetpu_usage_counter_add(etdev, EDGETPU_COUNTER_CONTEXT_PREEMPTS, 1);
+	}
+	return ret;
+}
+
+/*
+ * Attaches the mailbox of @group, evicting idle groups while all the VII
+ * mailboxes are in use.
+ *
+ * Caller holds @group->lock.
+ */
+static int edgetpu_group_attach_or_evict_locked(struct edgetpu_device_group *group)
+{
+	int ret;
+
+	while ((ret = do_attach_mailbox_locked(group)) == -EBUSY) {
+		if (edgetpu_group_evict_lru_locked(group))
+			break;
+	}
+	if (!ret) {
+		group->mailbox_evicted = false;
+		group->mailbox_last_used = jiffies;
+	}
+	return ret;
+}
+
+/*
+ * How long a group waits for a VII mailbox when all are in use and none can be
+ * evicted. 0 fails the request right away.
+ */
+static uint mailbox_admission_wait_ms;
+module_param(mailbox_admission_wait_ms, uint, 0660);
+MODULE_PARM_DESC(mailbox_admission_wait_ms,
+		 "Time a wakelock request waits in the priority ordered queue for a VII mailbox");
+
+/* Removes @group from the admission queue if it's queued, and lets the next waiter try. */
+static void edgetpu_group_admission_dequeue(struct edgetpu_device_group *group)
+{
+	struct edgetpu_mailbox_admission *adm = &group->etdev->mailbox_manager->admission;
+	struct edgetpu_admission_waiter *waiter = &group->admission;
+	bool queued;
+
+	mutex_lock(&adm->lock);
+	queued = waiter->queued;
+	if (queued) {
+		list_del(&waiter->list);
+		waiter->queued = false;
+	}
+	mutex_unlock(&adm->lock);
+	if (queued) {
+		atomic_inc(&adm->seq);
+		wake_up_all(&adm->waitq);
+	}
+}
+
+/*
+ * Attaches the mailbox of @group like edgetpu_group_attach_or_evict_locked(),
+ * but queues @group for up to mailbox_admission_wait_ms when all the mailboxes
+ * are busy.
+ *
+ * Waiting groups are served in order of rank: a group doesn't take a mailbox
+ * while a group of higher or equal rank waits for one.
+ *
+ * This never sleeps waiting for a mailbox, since the caller holds locks other
+ * groups may need to release theirs. Instead -EAGAIN is returned while @group
+ * is queued, the caller drops its locks, calls edgetpu_group_admission_wait()
+ * and tries again.
+ *
+ * Caller holds @group->lock.
+ */
+static int edgetpu_group_admit_locked(struct edgetpu_device_group *group)
+{
+	struct edgetpu_mailbox_admission *adm = &group->etdev->mailbox_manager->admission;
+	struct edgetpu_admission_waiter *waiter = &group->admission;
+	struct edgetpu_admission_waiter *first, *cur;
+	uint wait_ms = READ_ONCE(mailbox_admission_wait_ms);
+	u32 rank = edgetpu_group_rank(group);
+	bool may_try;
+	int ret = -EBUSY;
+
+	mutex_lock(&adm->lock);
+	/* drop waiters whose owner gave up without leaving the queue */
+	while ((first = list_first_entry_or_null(&adm->waiters, struct edgetpu_admission_waiter,
+						 list)) &&
+	       first != waiter && time_after_eq(jiffies, first->deadline)) {
+		list_del(&first->list);
+		first->queued = false;
+	}
+	may_try = !first || first == waiter || (!waiter->queued && first->rank < rank);
+	waiter->seq = atomic_read(&adm->seq);
+	mutex_unlock(&adm->lock);
+
+	if (may_try)
+		ret = edgetpu_group_attach_or_evict_locked(group);
+	if (ret != -EBUSY || !wait_ms) {
+		edgetpu_group_admission_dequeue(group);
+		return ret;
+	}
+
+	mutex_lock(&adm->lock);
+	if (!waiter->queued) {
+		waiter->rank = rank;
+		waiter->deadline = jiffies + msecs_to_jiffies(wait_ms);
+		list_for_each_entry(cur, &adm->waiters, list) {
+			if (cur->rank < rank)
+				break;
+		}
+		list_add_tail(&waiter->list, &cur->list);
+		waiter->queued = true;
+		ret = -EAGAIN;
+	} else if (time_before(jiffies, waiter->deadline)) {
+		ret = -EAGAIN;
+	}
+	mutex_unlock(&adm->lock);
+	if (ret == -EBUSY)
+		edgetpu_group_admission_dequeue(group);
+	return ret;
+}
+
+int edgetpu_group_admission_wait(struct edgetpu_device_group *group)
+{
+	struct edgetpu_mailbox_admission *adm = &group->etdev->mailbox_manager->admission;
+	struct edgetpu_admission_waiter *waiter = &group->admission;
+	long timeout;
+	int seq;
+
+	mutex_lock(&adm->lock);
+	if (!waiter->queued) {
+		mutex_unlock(&adm->lock);
+		return 0;
+	}
+	timeout = (long)(waiter->deadline - jiffies);
+	seq = waiter->seq;
+	mutex_unlock(&adm->lock);
+	if (timeout <= 0)
+		return 0;
+	/* idle groups become evictable once their time slice ends, poll at that rate */
+	timeout = min_t(long, timeout,
+			msecs_to_jiffies(max(READ_ONCE(mailbox_min_residency_ms), 1u)));
+	timeout = wait_event_interruptible_timeout(adm->waitq, atomic_read(&adm->seq) != seq,
+						   timeout);
+	if (timeout < 0) {
+		edgetpu_group_admission_dequeue(group);
+		return timeout;
+	}
+	return 0;
+}
+
+/*
+ * Gets the VII mailbox back for a group whose mailbox was evicted, and marks
+ * the mailbox as used.
+ *
+ * Caller holds @group->lock and a wakelock of the group.
+ *
+ * Returns -EAGAIN while waiting for a mailbox, see edgetpu_group_admit_locked().
+ */
+static int edgetpu_group_swap_in_locked(struct edgetpu_device_group *group)
+{
+	ktime_t start;
+	int ret;
+
+	if (!group->mailbox_evicted) {
+		group->mailbox_last_used = jiffies;
+		return 0;
+	}
+	if (!edgetpu_device_group_is_finalized(group))
+		return edgetpu_group_errno(group);
+	start = ktime_get();
+	ret = edgetpu_group_admit_locked(group);
+	if (ret)
+		return ret;
+	ret = edgetpu_group_activate(group);
+	if (ret) {
+		do_detach_mailbox_locked(group);
+		group->mailbox_evicted = true;
+		return ret;
+	}
+	edgetpu_evict_stats_record(group->etdev, true, start);
+	return 0;
+}
+
+/*
+ * Locks @group and swaps its mailbox in, waiting for a mailbox with the lock
+ * released if needed.
+ *
+ * Returns with @group->lock held, also on error.
+ */
+static int edgetpu_group_lock_swapped_in(struct edgetpu_device_group *group)
+{
+	int ret;
+
+	for (;;) {
+		mutex_lock(&group->lock);
+		ret = edgetpu_group_swap_in_locked(group);
+		if (ret != -EAGAIN)
+			return ret;
+		mutex_unlock(&group->lock);
+		ret = edgetpu_group_admission_wait(group);
+		if (ret) {
+			mutex_lock(&group->lock);
+			return ret;
+		}
+	}
+}
+
+void edgetpu_group_mailbox_evict_show(struct edgetpu_dev *etdev, struct seq_file *s)
+{
+	struct edgetpu_mailbox_evict_stats *stats = &etdev->mailbox_manager->evict_stats;
+	struct edgetpu_mailbox_evict_stats snap;
+
+	spin_lock(&stats->lock);
+	snap = *stats;
+	spin_unlock(&stats->lock);
+	seq_printf(s, "evictions: %llu avg_ns: %llu max_ns: %llu\n", snap.evictions,
+		   snap.evictions ? div64_u64(snap.evict_ns_total, snap.evictions) : 0,
+		   snap.evict_ns_max);
+	seq_printf(s, "swap_ins: %llu avg_ns: %llu max_ns: %llu\n", snap.swap_ins,
+		   snap.swap_ins ? div64_u64(snap.swap_in_ns_total, snap.swap_ins) : 0,
+		   snap.swap_in_ns_max);
 }
 
 static inline bool is_finalized_or_errored(struct edgetpu_device_group *group)
@@ -482,9 +897,23 @@ void edgetpu_group_notify(struct edgetpu_device_group *group, uint event_id)
  *
  * The lock of group must be held.
  */
+/*
+ * Makes the queued EDGETPU_PREFETCH_BUFFERS works of @group skip their
+ * remaining KCIs, and waits for them.
+ *
+ * Caller holds @group->lock, which the works don't take.
+ */
+static void edgetpu_group_cancel_prefetch(struct edgetpu_device_group *group)
+{
+	WRITE_ONCE(group->prefetch_cancel, true);
+	wait_event(group->prefetch_waitq, !atomic_read(&group->prefetch_inflight));
+}
+
 static void edgetpu_device_group_release(struct edgetpu_device_group *group)
 {
+	edgetpu_group_cancel_prefetch(group);
 	edgetpu_group_clear_events(group);
+	edgetpu_group_admission_dequeue(group);
 	if (is_finalized_or_errored(group)) {
 		edgetpu_device_group_kci_leave(group);
 		/*
@@ -499,6 +928,7 @@ static void edgetpu_device_group_release(struct edgetpu_device_group *group)
 #endif
 		edgetpu_mailbox_external_disable_free_locked(group);
 		edgetpu_mailbox_remove_vii(&group->vii);
+		edgetpu_mailbox_release_vii_overflow(&group->vii);
 		group_release_members(group);
 	}
 	if (group->etdomain) {
@@ -566,11 +996,17 @@ static bool edgetpu_group_check_contiguity(struct edgetpu_device_group *group)
 static int edgetpu_dev_add_group(struct edgetpu_dev *etdev,
 				 struct edgetpu_device_group *group)
 {
-	struct edgetpu_list_group *l = kmalloc(sizeof(*l), GFP_KERNEL);
+	struct edgetpu_list_group *l;
 	int ret;
 
-	if (!l)
-		return -ENOMEM;
+	if (group->etdev == etdev && group->dev_node) {
+		l = group->dev_node;
+		group->dev_node = NULL;
+	} else {
+		l = kmalloc(sizeof(*l), GFP_KERNEL);
+		if (!l)
+			return -ENOMEM;
+	}
 	mutex_lock(&etdev->groups_lock);
 	if (etdev->group_join_lockout) {
 		ret = -EAGAIN;
@@ -597,6 +1033,7 @@ static int edgetpu_dev_add_group(struct edgetpu_dev *etdev,
 		}
 		group->vcid = ffs(vcid_pool) - 1;
 		etdev->vcid_pool &= ~BIT(group->vcid);
+		rcu_assign_pointer(etdev->vcid_groups[group->vcid], group);
 	}
 	l->grp = edgetpu_device_group_get(group);
 	list_add_tail(&l->list, &etdev->groups);
@@ -615,8 +1052,41 @@ void edgetpu_device_group_put(struct edgetpu_device_group *group)
 {
 	if (!group)
 		return;
-	if (refcount_dec_and_test(&group->ref_count))
-		kfree(group);
+	if (refcount_dec_and_test(&group->ref_count)) {
+		kfree(group->dev_node);
+		kfree(group->leader_node);
+		kfree_rcu(group, rcu);
+	}
+}
+
+struct edgetpu_device_group *edgetpu_device_group_get_by_vcid(struct edgetpu_dev *etdev,
+							      u16 vcid)
+{
+	struct edgetpu_device_group *group;
+
+	if (vcid >= EDGETPU_NUM_VCIDS)
+		return NULL;
+	rcu_read_lock();
+	group = rcu_dereference(etdev->vcid_groups[vcid]);
+	if (group && !refcount_inc_not_zero(&group->ref_count))
+		group = NULL;
+	rcu_read_unlock();
+	return group;
+}
+
+struct edgetpu_device_group *edgetpu_device_group_get_by_mailbox(struct edgetpu_dev *etdev,
+								 uint mailbox_id)
+{
+	struct edgetpu_device_group *group;
+
+	if (mailbox_id >= EDGETPU_NUM_MAILBOXES)
+		return NULL;
+	rcu_read_lock();
+	group = rcu_dereference(etdev->mailbox_groups[mailbox_id]);
+	if (group && !refcount_inc_not_zero(&group->ref_count))
+		group = NULL;
+	rcu_read_unlock();
+	return group;
 }
 
 /* caller must hold @etdev->groups_lock. */
@@ -672,8 +1142,10 @@ void edgetpu_device_group_leave(struct edgetpu_client *client)
 	mutex_lock(&client->etdev->groups_lock);
 	list_for_each_entry(l, &client->etdev->groups, list) {
 		if (l->grp == group) {
-			if (group->etdev == client->etdev)
+			if (group->etdev == client->etdev) {
+				RCU_INIT_POINTER(client->etdev->vcid_groups[group->vcid], NULL);
 				client->etdev->vcid_pool |= BIT(group->vcid);
+			}
 			list_del(&l->list);
 			edgetpu_device_group_put(l->grp);
 			kfree(l);
@@ -684,16 +1156,425 @@ void edgetpu_device_group_leave(struct edgetpu_client *client)
 	mutex_unlock(&client->etdev->groups_lock);
 }
 
+/*
+ * Recovers the VII of @group only: sends CLOSE_DEVICE, resets the queues,
+ * dropping the commands in flight, and sends OPEN_DEVICE with first_open set
+ * so the firmware clears the state of the VCID. Groups on other VCIDs are not
+ * interrupted.
+ *
+ * If the runtime opted in, the mailbox is kept closed instead until the runtime
+ * has rewound its own copies of the queue indexes and acknowledges the reset,
+ * see edgetpu_group_ack_vii_reset().
+ *
+ * Caller holds @group->lock and ensures @group is finalized, has mailbox
+ * attached and the device is powered.
+ *
+ * Returns 0 on success, otherwise what edgetpu_kci_close_device() or
+ * edgetpu_kci_open_device() returned: the firmware didn't release or take back
+ * the VCID, e.g. because the core is hung.
+ */
+static int edgetpu_group_reset_locked(struct edgetpu_device_group *group)
+{
+	u8 mailbox_id = edgetpu_group_context_id_locked(group);
+	int ret;
+
+	ret = edgetpu_mailbox_deactivate(group->etdev, mailbox_id);
+	group->vii_open = false;
+	if (ret)
+		return ret;
+	edgetpu_mailbox_reset_vii(&group->vii);
+	if (group->vii_reset_ack) {
+		group->vii_reset_pending = true;
+	} else {
+		ret = edgetpu_mailbox_activate(group->etdev, mailbox_id, group->vcid, true);
+		if (ret)
+			return ret;
+		group->vii_open = true;
+	}
+	/* the runtime still has to learn its in-flight jobs were dropped */
+	group->fatal_errors |= EDGETPU_ERROR_RUNTIME_TIMEOUT;
+	return 0;
+}
+
+/*
+ * Handles a job lockup reported on @group. Tries resetting the VII of the group
+ * first and falls back to restarting the firmware, which affects all groups.
+ * A group that isn't running is only marked errored.
+ *
+ * Puts the reference of @group held by edgetpu_handle_job_lockup().
+ */
+static void edgetpu_group_lockup_work(struct work_struct *work)
+{
+	struct edgetpu_device_group *group =
+		container_of(work, struct edgetpu_device_group, lockup_work);
+	struct edgetpu_dev *etdev = group->etdev;
+	int ret = -EAGAIN;
+
+	mutex_lock(&group->lock);
+	if (edgetpu_group_finalized_and_attached(group) && !group->dev_inaccessible &&
+	    edgetpu_pm_get_if_powered(etdev->pm)) {
+		ret = edgetpu_group_reset_locked(group);
+		edgetpu_pm_put(etdev->pm);
+		if (ret)
+			etdev_err(etdev, "reset VCID %u failed: %d, restarting firmware",
+				  group->vcid, ret);
+	}
+	mutex_unlock(&group->lock);
+
+	if (!ret) {
+		etdev_info(etdev, "VCID %u reset after job lockup", group->vcid);
+		edgetpu_group_notify(group, EDGETPU_EVENT_FATAL_ERROR);
+	} else {
+		edgetpu_group_fatal_error_notify(group, EDGETPU_ERROR_RUNTIME_TIMEOUT);
+		/* -EAGAIN: the group wasn't running, nothing to restart for it */
+		if (ret != -EAGAIN)
+			edgetpu_watchdog_bite(etdev, false);
+	}
+	edgetpu_device_group_put(group);
+}
+
+/*
+ * Returns whether the VII of @group is open and idle, i.e. can be closed
+ * without dropping jobs.
+ *
+ * Caller holds @group->lock.
+ */
+static bool edgetpu_group_quota_closable_locked(struct edgetpu_device_group *group)
+{
+	if (!edgetpu_group_finalized_and_attached(group) || group->dev_inaccessible ||
+	    !group->vii_open || group->ext_mailbox)
+		return false;
+	return edgetpu_mailbox_vii_idle(&group->vii);
+}
+
+/*
+ * Enforces the TPU time quota of @group->uid on the VII: while the UID is over
+ * its quota, the idle VII is closed like for eviction but stays attached, so
+ * the queues and CSRs mmapped by the runtime still belong to the group, and
+ * commands written meanwhile run once the VII is opened again at the end of
+ * the quota period. This throttles runtimes that never enter the kernel to
+ * submit commands.
+ *
+ * Puts the reference of @group held by edgetpu_group_quota_kick() unless the
+ * work is scheduled again for the end of the quota period.
+ */
+static void edgetpu_group_quota_work(struct work_struct *work)
+{
+	struct edgetpu_device_group *group =
+		container_of(to_delayed_work(work), struct edgetpu_device_group, quota_work);
+	struct edgetpu_dev *etdev = group->etdev;
+	unsigned long wait;
+
+	mutex_lock(&group->lock);
+	/* a closed VII of an errored group stays closed, edgetpu_group_deactivate() knows */
+	if (!edgetpu_device_group_is_finalized(group))
+		goto out_put;
+	wait = edgetpu_usage_quota_wait(etdev, group->uid);
+	if (!wait) {
+		if (group->quota_throttled) {
+			group->quota_throttled = false;
+			if (!edgetpu_group_activate(group))
+				etdev_dbg(etdev, "VCID %u reopened in a new quota period",
+					  group->vcid);
+		}
+		goto out_put;
+	}
+	if (!group->quota_throttled) {
+		/* the next response IRQ tries again */
+		if (!edgetpu_group_quota_closable_locked(group))
+			goto out_put;
+		edgetpu_group_deactivate(group);
+		group->quota_throttled = true;
+		etdev_dbg(etdev, "VCID %u closed, uid %d is over its TPU time quota", group->vcid,
+			  group->uid);
+	}
+	mutex_unlock(&group->lock);
+	if (!schedule_delayed_work(&group->quota_work, wait))
+		edgetpu_device_group_put(group);
+	return;
+
+out_put:
+	mutex_unlock(&group->lock);
+	edgetpu_device_group_put(group);
+}
+
+void edgetpu_group_quota_kick(struct edgetpu_device_group *group)
+{
+	if (!edgetpu_usage_has_quotas(group->etdev))
+		return;
+	edgetpu_device_group_get(group);
+	if (!schedule_delayed_work(&group->quota_work, 0))
+		edgetpu_device_group_put(group);
+}
+
+/*
+ * Number of group shells kept ready for EDGETPU_CREATE_GROUP, each holding an
+ * IOMMU domain. Capped to EDGETPU_GROUP_POOL_MAX and to the domains left in the
+ * domain pool.
+ */
+static uint group_pool_size = 2;
+module_param(group_pool_size, uint, 0660);
+MODULE_PARM_DESC(group_pool_size, "Number of preallocated device groups kept for fast creation");
+
+/* Allocates the IOMMU domain of @group and the context ID from its token. */
+static int edgetpu_group_alloc_domain(struct edgetpu_device_group *group)
+{
+	struct edgetpu_iommu_domain *etdomain;
+
+	etdomain = edgetpu_mmu_alloc_domain(group->etdev);
+	if (!etdomain)
+		return -ENOMEM;
+	group->etdomain = etdomain;
+	if (etdomain->token != EDGETPU_DOMAIN_TOKEN_END)
+		group->context_id =
+			EDGETPU_CONTEXT_DOMAIN_TOKEN | etdomain->token;
+	else
+		group->context_id = EDGETPU_CONTEXT_INVALID;
+	return 0;
+}
+
+/*
+ * Allocates a group in the waiting state with its IOMMU domain and list nodes,
+ * the fields depending on the caller are set by edgetpu_device_group_alloc().
+ */
+static struct edgetpu_device_group *edgetpu_group_shell_alloc(struct edgetpu_dev *etdev)
+{
+	struct edgetpu_device_group *group;
+
+	/* see the layout notes of struct edgetpu_device_group */
+	BUILD_BUG_ON(IS_ENABLED(CONFIG_SMP) &&
+		     (offsetof(struct edgetpu_device_group, events) / SMP_CACHE_BYTES ==
+		      offsetof(struct edgetpu_device_group, mailbox_last_used) / SMP_CACHE_BYTES ||
+		      offsetof(struct edgetpu_device_group, mailbox_last_used) / SMP_CACHE_BYTES ==
+		      offsetof(struct edgetpu_device_group, lock) / SMP_CACHE_BYTES));
+
+	group = kzalloc(sizeof(*group), GFP_KERNEL);
+	if (!group)
+		return NULL;
+
+	refcount_set(&group->ref_count, 1);
+	INIT_LIST_HEAD(&group->clients);
+	group->n_clients = 0;
+	group->status = EDGETPU_DEVICE_GROUP_WAITING;
+	group->etdev = etdev;
+	group->vii.etdev = etdev;
+	mutex_init(&group->lock);
+	rwlock_init(&group->events.lock);
+	INIT_WORK(&group->lockup_work, edgetpu_group_lockup_work);
+	INIT_DELAYED_WORK(&group->quota_work, edgetpu_group_quota_work);
+	init_waitqueue_head(&group->prefetch_waitq);
+	edgetpu_mapping_init(&group->host_mappings);
+	edgetpu_mapping_init(&group->dmabuf_mappings);
+	group->dev_node = kmalloc(sizeof(*group->dev_node), GFP_KERNEL);
+	group->leader_node = kzalloc(sizeof(*group->leader_node), GFP_KERNEL);
+	if (!group->dev_node || !group->leader_node || edgetpu_group_alloc_domain(group)) {
+		edgetpu_device_group_put(group);
+		return NULL;
+	}
+	return group;
+}
+
+static void edgetpu_group_shell_free(struct edgetpu_device_group *group)
+{
+	if (group->etdomain)
+		edgetpu_mmu_free_domain(group->etdev, group->etdomain);
+	edgetpu_device_group_put(group);
+}
+
+static uint edgetpu_group_pool_target(void)
+{
+	return min_t(uint, READ_ONCE(group_pool_size), EDGETPU_GROUP_POOL_MAX);
+}
+
+static void edgetpu_group_pool_refill_work(struct work_struct *work)
+{
+	struct edgetpu_group_pool *pool = container_of(work, struct edgetpu_group_pool, refill_work);
+	struct edgetpu_device_group *group;
+	bool full;
+
+	for (;;) {
+		mutex_lock(&pool->lock);
+		full = pool->exiting || pool->count >= edgetpu_group_pool_target();
+		mutex_unlock(&pool->lock);
+		/* idle shells must not starve the groups being created of domains */
+		if (full || !edgetpu_mmu_domain_headroom(pool->etdev))
+			return;
+		/* allocate without @pool->lock so taking a shell never waits on this */
+		group = edgetpu_group_shell_alloc(pool->etdev);
+		if (!group)
+			return;
+		mutex_lock(&pool->lock);
+		if (!pool->exiting && pool->count < edgetpu_group_pool_target()) {
+			pool->shells[pool->count++] = group;
+			group = NULL;
+		}
+		mutex_unlock(&pool->lock);
+		if (group) {
+			edgetpu_group_shell_free(group);
+			return;
+		}
+	}
+}
+
+/* Takes a shell from the pool of @etdev, returns NULL if there is none. */
+static struct edgetpu_device_group *edgetpu_group_pool_take(struct edgetpu_dev *etdev)
+{
+	struct edgetpu_group_pool *pool = etdev->group_pool;
+	struct edgetpu_device_group *group = NULL;
+
+	if (!pool)
+		return NULL;
+	mutex_lock(&pool->lock);
+	if (pool->exiting) {
+		mutex_unlock(&pool->lock);
+		return NULL;
+	}
+	if (pool->count)
+		group = pool->shells[--pool->count];
+	/* scheduled under the lock so edgetpu_group_pool_exit() can cancel it for good */
+	schedule_work(&pool->refill_work);
+	mutex_unlock(&pool->lock);
+	spin_lock(&pool->stats_lock);
+	if (group)
+		pool->hits++;
+	else
+		pool->misses++;
+	spin_unlock(&pool->stats_lock);
+	return group;
+}
+
+/*
+ * Waits for a running refill of the pool of @etdev and takes the shell it may
+ * have added, which can hold the last domain of the domain pool.
+ */
+static struct edgetpu_device_group *edgetpu_group_pool_take_sync(struct edgetpu_dev *etdev)
+{
+	if (!etdev->group_pool)
+		return NULL;
+	flush_work(&etdev->group_pool->refill_work);
+	return edgetpu_group_pool_take(etdev);
+}
+
+static void edgetpu_group_setup_record(struct edgetpu_dev *etdev, bool finalize, u64 start_ns)
+{
+	struct edgetpu_group_pool *pool = etdev->group_pool;
+	struct edgetpu_group_setup_stats *stats;
+	u64 ns = ktime_get_ns() - start_ns;
+
+	if (!pool)
+		return;
+	stats = finalize ? &pool->finalize : &pool->create;
+	spin_lock(&pool->stats_lock);
+	stats->latency_ns[stats->count++ % EDGETPU_GROUP_SETUP_SAMPLES] = min_t(u64, ns, U32_MAX);
+	spin_unlock(&pool->stats_lock);
+}
+
+void edgetpu_group_pool_init(struct edgetpu_dev *etdev)
+{
+	/* device managed, groups may still be created while the device is being removed */
+	struct edgetpu_group_pool *pool = devm_kzalloc(etdev->dev, sizeof(*pool), GFP_KERNEL);
+
+	if (!pool) {
+		etdev_warn(etdev, "group pool disabled: out of memory");
+		return;
+	}
+	pool->etdev = etdev;
+	mutex_init(&pool->lock);
+	INIT_WORK(&pool->refill_work, edgetpu_group_pool_refill_work);
+	spin_lock_init(&pool->stats_lock);
+	etdev->group_pool = pool;
+	schedule_work(&pool->refill_work);
+}
+
+void edgetpu_group_pool_exit(struct edgetpu_dev *etdev)
+{
+	struct edgetpu_group_pool *pool = etdev->group_pool;
+
+	if (!pool)
+		return;
+	/* stop taking shells and scheduling refills, then wait for a running refill */
+	mutex_lock(&pool->lock);
+	pool->exiting = true;
+	mutex_unlock(&pool->lock);
+	cancel_work_sync(&pool->refill_work);
+	mutex_lock(&pool->lock);
+	while (pool->count)
+		edgetpu_group_shell_free(pool->shells[--pool->count]);
+	mutex_unlock(&pool->lock);
+}
+
+static int edgetpu_group_setup_cmp(const void *a, const void *b)
+{
+	u32 la = *(const u32 *)a, lb = *(const u32 *)b;
+
+	if (la < lb)
+		return -1;
+	return la > lb;
+}
+
+static void edgetpu_group_setup_stats_show(struct seq_file *s, const char *name,
+					   struct edgetpu_group_setup_stats *stats)
+{
+	uint n = min_t(uint, stats->count, EDGETPU_GROUP_SETUP_SAMPLES);
+
+	if (!n) {
+		seq_printf(s, "%s: count: 0\n", name);
+		return;
+	}
+	sort(stats->latency_ns, n, sizeof(stats->latency_ns[0]), edgetpu_group_setup_cmp, NULL);
+	seq_printf(s, "%s: count: %u p50_us: %u p90_us: %u p99_us: %u max_us: %u\n", name,
+		   stats->count, stats->latency_ns[(n - 1) * 50 / 100] / NSEC_PER_USEC,
+		   stats->latency_ns[(n - 1) * 90 / 100] / NSEC_PER_USEC,
+		   stats->latency_ns[(n - 1) * 99 / 100] / NSEC_PER_USEC,
+		   stats->latency_ns[n - 1] / NSEC_PER_USEC);
+}
+
+void edgetpu_group_pool_show(struct edgetpu_dev *etdev, struct seq_file *s)
+{
+	struct edgetpu_group_pool *pool = etdev->group_pool;
+	struct edgetpu_group_setup_stats *create, *finalize;
+	u64 hits, misses;
+	uint count;
+
+	if (!pool) {
+		seq_puts(s, "group pool disabled\n");
+		return;
+	}
+	/* percentiles are computed on copies, sorting under the spinlock would stall setups */
+	create = kmalloc(sizeof(*create), GFP_KERNEL);
+	finalize = kmalloc(sizeof(*finalize), GFP_KERNEL);
+	if (!create || !finalize) {
+		seq_puts(s, "out of memory\n");
+		goto out;
+	}
+	mutex_lock(&pool->lock);
+	count = pool->count;
+	mutex_unlock(&pool->lock);
+	spin_lock(&pool->stats_lock);
+	hits = pool->hits;
+	misses = pool->misses;
+	*create = pool->create;
+	*finalize = pool->finalize;
+	spin_unlock(&pool->stats_lock);
+	seq_printf(s, "shells: %u/%u hits: %llu misses: %llu\n", count,
+		   edgetpu_group_pool_target(), hits, misses);
+	edgetpu_group_setup_stats_show(s, "create", create);
+	edgetpu_group_setup_stats_show(s, "finalize", finalize);
+out:
+	kfree(create);
+	kfree(finalize);
+}
+
 struct edgetpu_device_group *
 edgetpu_device_group_alloc(struct edgetpu_client *client,
-			   const struct edgetpu_mailbox_attr *attr)
+			   const struct edgetpu_create_group_ext *ext)
 {
 	static uint cur_workload_id;
 	int ret;
 	struct edgetpu_device_group *group;
-	struct edgetpu_iommu_domain *etdomain;
+	u64 start_ns = ktime_get_ns();
 
-	ret = edgetpu_mailbox_validate_attr(attr);
+	ret = edgetpu_mailbox_validate_attr_ext(ext);
 	if (ret)
 		goto error;
 	/*
@@ -706,52 +1587,36 @@ edgetpu_device_group_alloc(struct edgetpu_client *client,
 		goto error;
 	}
 
-	group = kzalloc(sizeof(*group), GFP_KERNEL);
+	group = edgetpu_group_pool_take(client->etdev);
+	if (!group)
+		group = edgetpu_group_shell_alloc(client->etdev);
+	if (!group)
+		group = edgetpu_group_pool_take_sync(client->etdev);
 	if (!group) {
 		ret = -ENOMEM;
 		goto error;
 	}
 
-	refcount_set(&group->ref_count, 1);
 	group->workload_id = cur_workload_id++;
-	INIT_LIST_HEAD(&group->clients);
-	group->n_clients = 0;
-	group->status = EDGETPU_DEVICE_GROUP_WAITING;
-	group->etdev = client->etdev;
-	group->vii.etdev = client->etdev;
-	mutex_init(&group->lock);
-	rwlock_init(&group->events.lock);
-	edgetpu_mapping_init(&group->host_mappings);
-	edgetpu_mapping_init(&group->dmabuf_mappings);
-	group->mbox_attr = *attr;
-	if (attr->priority & EDGETPU_PRIORITY_DETACHABLE)
+	group->uid = from_kuid(&init_user_ns, current_uid());
+	group->mbox_attr = ext->attr;
+	group->cmdq_overflow_order = ext->cmdq_overflow_order;
+	group->deadline_class = ext->deadline_class;
+	if (ext->attr.priority & EDGETPU_PRIORITY_DETACHABLE)
 		group->mailbox_detachable = true;
 
-	etdomain = edgetpu_mmu_alloc_domain(group->etdev);
-	if (!etdomain) {
-		ret = -ENOMEM;
-		goto error_put_group;
-	}
-	group->etdomain = etdomain;
-	if (etdomain->token != EDGETPU_DOMAIN_TOKEN_END)
-		group->context_id =
-			EDGETPU_CONTEXT_DOMAIN_TOKEN | etdomain->token;
-	else
-		group->context_id = EDGETPU_CONTEXT_INVALID;
-
 	/* adds @client as the first entry */
 	ret = edgetpu_device_group_add(group, client);
 	if (ret) {
 		etdev_dbg(group->etdev, "%s: group %u add failed ret=%d",
 			  __func__, group->workload_id, ret);
-		goto error_free_mmu_domain;
+		goto error_free_shell;
 	}
+	edgetpu_group_setup_record(group->etdev, false, start_ns);
 	return group;
 
-error_free_mmu_domain:
-	edgetpu_mmu_free_domain(group->etdev, group->etdomain);
-error_put_group:
-	edgetpu_device_group_put(group);
+error_free_shell:
+	edgetpu_group_shell_free(group);
 error:
 	return ERR_PTR(ret);
 }
@@ -781,10 +1646,15 @@ int edgetpu_device_group_add(struct edgetpu_device_group *group,
 		}
 	}
 
-	c = kzalloc(sizeof(*c), GFP_KERNEL);
-	if (!c) {
-		ret = -ENOMEM;
-		goto out;
+	if (group->leader_node) {
+		c = group->leader_node;
+		group->leader_node = NULL;
+	} else {
+		c = kzalloc(sizeof(*c), GFP_KERNEL);
+		if (!c) {
+			ret = -ENOMEM;
+			goto out;
+		}
 	}
 
 	ret = edgetpu_dev_add_group(client->etdev, group);
@@ -823,6 +1693,7 @@ int edgetpu_device_group_finalize(struct edgetpu_device_group *group)
 	int ret = 0;
 	bool mailbox_attached = false;
 	struct edgetpu_client *leader;
+	u64 start_ns = ktime_get_ns();
 
 	mutex_lock(&group->lock);
 	/* do nothing if the group is finalized */
@@ -862,7 +1733,7 @@ int edgetpu_device_group_finalize(struct edgetpu_device_group *group)
 	if (!group->mailbox_detachable ||
 	    edgetpu_wakelock_count_locked(leader->wakelock)) {
 		mailbox_attached = true;
-		ret = do_attach_mailbox_locked(group);
+		ret = edgetpu_group_attach_or_evict_locked(group);
 		if (ret) {
 			etdev_err(group->etdev,
 				  "finalize attach mailbox failed: %d", ret);
@@ -897,6 +1768,7 @@ int edgetpu_device_group_finalize(struct edgetpu_device_group *group)
 	group->status = EDGETPU_DEVICE_GROUP_FINALIZED;
 
 	mutex_unlock(&group->lock);
+	edgetpu_group_setup_record(group->etdev, true, start_ns);
 	return 0;
 
 err_remove_remote_dram:
@@ -1064,6 +1936,98 @@ edgetpu_device_group_unmap_iova_sgt(struct edgetpu_device_group *group,
 	}
 }
 
+/*
+ * Limit of host memory pinned by the buffer mappings of all groups on a
+ * device, in MB. 0 means no limit.
+ */
+static uint pinned_limit_mb;
+module_param(pinned_limit_mb, uint, 0660);
+MODULE_PARM_DESC(pinned_limit_mb, "Limit of host memory pinned by buffer mappings per device in MB");
+
+/* Charge pinned host buffers to RLIMIT_MEMLOCK of the process mapping them. */
+static bool pinned_charge_memlock;
+module_param(pinned_charge_memlock, bool, 0660);
+MODULE_PARM_DESC(pinned_charge_memlock, "Charge pinned host buffers to RLIMIT_MEMLOCK");
+
+/*
+ * Charges @num_pages pages about to be pinned to @group, to the device-wide
+ * limit and, if enabled, to RLIMIT_MEMLOCK of the current process. @pmm is set
+ * to the charged mm, with a reference held, or NULL.
+ *
+ * Charging happens before pinning so a request over a limit fails without
+ * pinning anything.
+ *
+ * Returns -ENOMEM if a limit would be exceeded.
+ */
+static int edgetpu_pinned_charge(struct edgetpu_device_group *group, uint num_pages,
+				 struct mm_struct **pmm)
+{
+	struct edgetpu_dev *etdev = group->etdev;
+	ulong limit = (ulong)READ_ONCE(pinned_limit_mb) << (20 - PAGE_SHIFT);
+	int ret;
+
+	if (atomic_long_add_return(num_pages, &etdev->pinned_pages) > limit && limit) {
+		atomic_long_sub(num_pages, &etdev->pinned_pages);
+		etdev_dbg(etdev, "%s: %u pages exceed the pinned limit of %u MB", __func__,
+			  num_pages, pinned_limit_mb);
+		return -ENOMEM;
+	}
+	*pmm = NULL;
+	if (READ_ONCE(pinned_charge_memlock)) {
+		ret = account_locked_vm(current->mm, num_pages, true);
+		if (ret) {
+			atomic_long_sub(num_pages, &etdev->pinned_pages);
+			return ret;
+		}
+		mmgrab(current->mm);
+		*pmm = current->mm;
+	}
+	atomic_long_add(num_pages, &group->pinned_pages);
+	return 0;
+}
+
+/* Reverts edgetpu_pinned_charge(). */
+static void edgetpu_pinned_uncharge_pages(struct edgetpu_device_group *group, uint num_pages,
+					  struct mm_struct *mm)
+{
+	if (!num_pages)
+		return;
+	if (mm) {
+		account_locked_vm(mm, num_pages, false);
+		mmdrop(mm);
+	}
+	atomic_long_sub(num_pages, &group->pinned_pages);
+	atomic_long_sub(num_pages, &group->etdev->pinned_pages);
+}
+
+/* Reverts the charge of the pages pinned for @hmap. */
+static void edgetpu_pinned_uncharge(struct edgetpu_device_group *group,
+				    struct edgetpu_host_map *hmap)
+{
+	edgetpu_pinned_uncharge_pages(group, hmap->num_pages, hmap->mm);
+}
+
+/*
+ * Frees @sgt built by edgetpu_pin_user_pages() with @total_nents entries.
+ *
+ * A table built by appending batches of pages may have more entries allocated
+ * than its orig_nents, sg_free_table() alone would leak the surplus.
+ */
+static void edgetpu_free_pinned_sgt(struct sg_table *sgt, uint total_nents)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0)
+	struct sg_append_table append = {
+		.sgt = *sgt,
+		.total_nents = total_nents,
+	};
+
+	sg_free_append_table(&append);
+	sgt->sgl = NULL;
+#else
+	sg_free_table(sgt);
+#endif
+}
+
 /*
  * Unmap a mapping specified by @map. Unmaps from IOMMU and unpins pages,
  * frees mapping node, which is invalid upon return.
@@ -1103,94 +2067,253 @@ static void edgetpu_unmap_node(struct edgetpu_mapping *map)
 
 		unpin_user_page(page);
 	}
-
-	sg_free_table(&map->sgt);
-	if (IS_MIRRORED(map->flags)) {
-		for (i = 1; i < group->n_clients; i++)
-			sg_free_table(&hmap->sg_tables[i]);
-		kfree(hmap->sg_tables);
+
+	edgetpu_free_pinned_sgt(&map->sgt, hmap->sgt_total_nents);
+	if (IS_MIRRORED(map->flags)) {
+		for (i = 1; i < group->n_clients; i++)
+			sg_free_table(&hmap->sg_tables[i]);
+		kfree(hmap->sg_tables);
+	}
+	edgetpu_pinned_uncharge(group, hmap);
+	edgetpu_device_group_put(map->priv);
+	kfree(hmap);
+}
+
+static void edgetpu_host_map_show(struct edgetpu_mapping *map,
+				  struct seq_file *s)
+{
+	struct scatterlist *sg;
+	int i;
+	size_t cur_offset = 0;
+
+	for_each_sg(map->sgt.sgl, sg, map->sgt.nents, i) {
+		dma_addr_t phys_addr = sg_phys(sg);
+		dma_addr_t dma_addr = sg_dma_address(sg);
+
+		if (IS_MIRRORED(map->flags))
+			seq_puts(s, "  mirrored: ");
+		else
+			seq_printf(s, "  die %u: ", map->die_index);
+		seq_printf(s, "%#llx %lu %s %#llx %pap %pad\n",
+			   map->device_address + cur_offset,
+			   DIV_ROUND_UP(sg_dma_len(sg), PAGE_SIZE),
+			   edgetpu_dma_dir_rw_s(map->dir),
+			   map->host_address + cur_offset, &phys_addr,
+			   &dma_addr);
+		cur_offset += sg_dma_len(sg);
+	}
+}
+
+size_t edgetpu_group_mappings_total_size(struct edgetpu_device_group *group)
+{
+	return edgetpu_mappings_total_size(&group->host_mappings) +
+		edgetpu_mappings_total_size(&group->dmabuf_mappings);
+}
+
+/* Unpins the first @num_pages pages of the first @nents entries of @sgl. */
+static void edgetpu_unpin_sg_pages(struct scatterlist *sgl, uint nents, uint num_pages)
+{
+	struct sg_page_iter sg_iter;
+
+	if (!num_pages)
+		return;
+	for_each_sg_page(sgl, &sg_iter, nents, 0) {
+		unpin_user_page(sg_page_iter_page(&sg_iter));
+		if (!--num_pages)
+			break;
+	}
+}
+
+/*
+ * Pins @num_pages pages from user-space address @addr to @pages.
+ *
+ * Partial progress of the pin call is kept and the rest is pinned by the next
+ * call. If the pages can't be pinned for write, FOLL_WRITE is dropped from
+ * @foll_flags and *@preadonly is set.
+ *
+ * Returns 0 on success. Otherwise returns -errno with no pages pinned.
+ */
+static int edgetpu_pin_pages_batch(struct edgetpu_device_group *group, ulong addr,
+				   uint num_pages, unsigned int *foll_flags, bool *preadonly,
+				   struct page **pages)
+{
+	struct edgetpu_dev *etdev = group->etdev;
+	uint pinned = 0;
+	int ret;
+	int i;
+
+	while (pinned < num_pages) {
+		ret = pin_user_pages_fast(addr + (ulong)pinned * PAGE_SIZE, num_pages - pinned,
+					  *foll_flags, pages + pinned);
+		if (ret == -EFAULT && !*preadonly) {
+			*foll_flags &= ~FOLL_WRITE;
+			*preadonly = true;
+			continue;
+		}
+		if (ret <= 0) {
+			if (!ret)
+				ret = -EFAULT;
+			etdev_dbg(etdev, "pin_user_pages failed %u:%#lx-%u: %d", group->workload_id,
+				  addr, num_pages, ret);
+			if (ret == -EFAULT)
+				etdev_err(etdev, "bad address locking %u pages for %s",
+					  num_pages - pinned, *preadonly ? "read" : "write");
+			else if (ret == -ENOMEM)
+				etdev_err(etdev, "system out of memory locking %u pages",
+					  num_pages - pinned);
+			for (i = 0; i < pinned; i++)
+				unpin_user_page(pages[i]);
+			return ret;
+		}
+		pinned += ret;
+	}
+	return 0;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0)
+/*
+ * Pins @num_pages pages from @addr in batches of EDGETPU_PIN_BATCH_PAGES and
+ * appends each batch to @sgt, so only one batch of page pointers is ever
+ * allocated regardless of the buffer size.
+ */
+static int edgetpu_pin_user_pages_to_sgt(struct edgetpu_device_group *group, ulong addr,
+					 uint num_pages, unsigned int foll_flags,
+					 bool *preadonly, struct sg_table *sgt,
+					 uint *ptotal_nents)
+{
+	struct sg_append_table append = {};
+	struct page **pages;
+	uint done, n = 0;
+	int ret = 0;
+
+	pages = kmalloc_array(min_t(uint, num_pages, EDGETPU_PIN_BATCH_PAGES), sizeof(*pages),
+			      GFP_KERNEL);
+	if (!pages)
+		return -ENOMEM;
+	for (done = 0; done < num_pages; done += n) {
+		n = min_t(uint, num_pages - done, EDGETPU_PIN_BATCH_PAGES);
+		ret = edgetpu_pin_pages_batch(group, addr + (ulong)done * PAGE_SIZE, n,
+					      &foll_flags, preadonly, pages);
+		if (ret)
+			break;
+		ret = sg_alloc_append_table_from_pages(&append, pages, n, 0, n * PAGE_SIZE,
+						       UINT_MAX, num_pages - done - n,
+						       GFP_KERNEL);
+		if (ret) {
+			etdev_dbg(group->etdev,
+				  "%s: sg_alloc_append_table_from_pages failed %u:%#lx-%u: %d",
+				  __func__, group->workload_id, addr, num_pages, ret);
+			/* this batch may be partially in @append, it's unpinned from @pages */
+			unpin_user_pages(pages, n);
+			break;
+		}
+	}
+	kfree(pages);
+	if (ret) {
+		edgetpu_unpin_sg_pages(append.sgt.sgl, append.sgt.nents, done);
+		sg_free_append_table(&append);
+		return ret;
 	}
-	edgetpu_device_group_put(map->priv);
-	kfree(hmap);
+	*sgt = append.sgt;
+	*ptotal_nents = append.total_nents;
+	return 0;
 }
-
-static void edgetpu_host_map_show(struct edgetpu_mapping *map,
-				  struct seq_file *s)
+#else /* LINUX_VERSION_CODE < KERNEL_VERSION(5, 15, 0) */
+/*
+ * Pins @num_pages pages from @addr in batches of EDGETPU_PIN_BATCH_PAGES and
+ * builds @sgt from them.
+ *
+ * Kernels without sg_alloc_append_table_from_pages() need the page pointers
+ * of the whole buffer to build the table.
+ */
+static int edgetpu_pin_user_pages_to_sgt(struct edgetpu_device_group *group, ulong addr,
+					 uint num_pages, unsigned int foll_flags,
+					 bool *preadonly, struct sg_table *sgt,
+					 uint *ptotal_nents)
 {
-	struct scatterlist *sg;
+	struct page **pages;
+	uint done, n = 0;
+	int ret = 0;
 	int i;
-	size_t cur_offset = 0;
 
-	for_each_sg(map->sgt.sgl, sg, map->sgt.nents, i) {
-		dma_addr_t phys_addr = sg_phys(sg);
-		dma_addr_t dma_addr = sg_dma_address(sg);
-
-		if (IS_MIRRORED(map->flags))
-			seq_puts(s, "  mirrored: ");
-		else
-			seq_printf(s, "  die %u: ", map->die_index);
-		seq_printf(s, "%#llx %lu %s %#llx %pap %pad\n",
-			   map->device_address + cur_offset,
-			   DIV_ROUND_UP(sg_dma_len(sg), PAGE_SIZE),
-			   edgetpu_dma_dir_rw_s(map->dir),
-			   map->host_address + cur_offset, &phys_addr,
-			   &dma_addr);
-		cur_offset += sg_dma_len(sg);
+	/*
+	 * "num_pages" is decided from user-space arguments, don't show warnings
+	 * when facing malicious input.
+	 */
+	pages = kvmalloc_array(num_pages, sizeof(*pages), GFP_KERNEL | __GFP_NOWARN);
+	if (!pages) {
+		etdev_err(group->etdev, "out of memory allocating pages (%lu bytes)",
+			  num_pages * sizeof(*pages));
+		return -ENOMEM;
 	}
+	for (done = 0; done < num_pages; done += n) {
+		n = min_t(uint, num_pages - done, EDGETPU_PIN_BATCH_PAGES);
+		ret = edgetpu_pin_pages_batch(group, addr + (ulong)done * PAGE_SIZE, n,
+					      &foll_flags, preadonly, pages + done);
+		if (ret)
+			break;
+	}
+	if (!ret) {
+		ret = sg_alloc_table_from_pages(sgt, pages, num_pages, 0, num_pages * PAGE_SIZE,
+						GFP_KERNEL);
+		if (ret) {
+			etdev_dbg(group->etdev,
+				  "%s: sg_alloc_table_from_pages failed %u:%#lx-%u: %d",
+				  __func__, group->workload_id, addr, num_pages, ret);
+			/* the caller must free the table even if the allocation fails */
+			sg_free_table(sgt);
+		}
+	}
+	if (ret) {
+		for (i = 0; i < done; i++)
+			unpin_user_page(pages[i]);
+	} else {
+		*ptotal_nents = sgt->orig_nents;
+	}
+	kvfree(pages);
+	return ret;
 }
-
-size_t edgetpu_group_mappings_total_size(struct edgetpu_device_group *group)
-{
-	return edgetpu_mappings_total_size(&group->host_mappings) +
-		edgetpu_mappings_total_size(&group->dmabuf_mappings);
-}
+#endif /* LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0) */
 
 /*
- * Pins the user-space address @arg->host_address and returns the pinned pages.
- * @pnum_pages is set to the number of pages.
+ * Pins the user-space address @arg->host_address and fills @sgt with the
+ * pinned pages. @pnum_pages is set to the number of pages and @ptotal_nents
+ * to the number of entries to pass to edgetpu_free_pinned_sgt().
+ *
+ * The pages are charged with edgetpu_pinned_charge() before being pinned, @pmm
+ * is set to the charged mm.
  *
- * Returns -errno if failed on pinning @size bytes.
+ * Returns -errno if failed on pinning @size bytes, nothing is pinned or
+ * charged then.
  */
-static struct page **edgetpu_pin_user_pages(struct edgetpu_device_group *group,
-					    struct edgetpu_map_ioctl *arg,
-					    uint *pnum_pages, bool *preadonly)
+static int edgetpu_pin_user_pages(struct edgetpu_device_group *group,
+				  struct edgetpu_map_ioctl *arg, struct sg_table *sgt,
+				  uint *ptotal_nents, uint *pnum_pages, bool *preadonly,
+				  struct mm_struct **pmm)
 {
 	u64 host_addr = untagged_addr(arg->host_address);
 	u64 size = arg->size;
 	uint num_pages;
 	ulong offset;
 	struct edgetpu_dev *etdev = group->etdev;
-	struct page **pages;
-	int i;
 	int ret;
 	struct vm_area_struct *vma;
-	struct vm_area_struct **vmas;
 	unsigned int foll_flags = FOLL_LONGTERM | FOLL_WRITE;
 
 	if (size == 0)
-		return ERR_PTR(-EINVAL);
+		return -EINVAL;
 	if (!access_ok((const void *)host_addr, size)) {
 		etdev_err(etdev, "invalid address range in buffer map request");
-		return ERR_PTR(-EFAULT);
+		return -EFAULT;
 	}
 	offset = host_addr & (PAGE_SIZE - 1);
 	/* overflow check (should also be caught by access_ok) */
 	if (unlikely((size + offset) / PAGE_SIZE >= UINT_MAX - 1 || size + offset < size)) {
 		etdev_err(etdev, "address overflow in buffer map request");
-		return ERR_PTR(-EFAULT);
+		return -EFAULT;
 	}
 	num_pages = DIV_ROUND_UP((size + offset), PAGE_SIZE);
 	etdev_dbg(etdev, "%s: hostaddr=%#llx pages=%u", __func__, host_addr, num_pages);
-	/*
-	 * "num_pages" is decided from user-space arguments, don't show warnings
-	 * when facing malicious input.
-	 */
-	pages = kvmalloc((num_pages * sizeof(*pages)), GFP_KERNEL | __GFP_NOWARN);
-	if (!pages) {
-		etdev_err(etdev, "out of memory allocating pages (%lu bytes)",
-			  num_pages * sizeof(*pages));
-		return ERR_PTR(-ENOMEM);
-	}
 	/*
 	 * The host pages might be read-only and could fail if we attempt to pin
 	 * it with FOLL_WRITE.
@@ -1204,96 +2327,52 @@ static struct page **edgetpu_pin_user_pages(struct edgetpu_device_group *group,
 		*preadonly = false;
 	}
 
-	/* Try fast call first, in case it's actually faster. */
-	ret = pin_user_pages_fast(host_addr & PAGE_MASK, num_pages, foll_flags,
-				  pages);
-	if (ret == num_pages) {
-		*pnum_pages = num_pages;
-		return pages;
-	}
-	if (ret == -EFAULT && !*preadonly) {
-		foll_flags &= ~FOLL_WRITE;
-		*preadonly = true;
-		ret = pin_user_pages_fast(host_addr & PAGE_MASK, num_pages,
-					  foll_flags, pages);
-	}
-	if (ret < 0) {
-		etdev_dbg(etdev, "pin_user_pages failed %u:%pK-%u: %d",
-			  group->workload_id, (void *)host_addr, num_pages,
-			  ret);
-		if (ret == -EFAULT)
-			etdev_err(etdev,
-				  "bad address locking %u pages for %s",
-				  num_pages, *preadonly ? "read" : "write");
-		if (ret != -ENOMEM) {
-			num_pages = 0;
-			goto error;
-		}
-	}
-	etdev_dbg(etdev,
-		  "pin_user_pages_fast error %u:%pK npages=%u ret=%d",
-		  group->workload_id, (void *)host_addr, num_pages,
-		  ret);
-	/* Unpin any partial mapping and start over again. */
-	for (i = 0; i < ret; i++)
-		unpin_user_page(pages[i]);
-
-	/* Allocate our own vmas array non-contiguous. */
-	vmas = kvmalloc((num_pages * sizeof(*vmas)), GFP_KERNEL | __GFP_NOWARN);
-	if (!vmas) {
-		etdev_err(etdev, "out of memory allocating vmas (%lu bytes)",
-			  num_pages * sizeof(*pages));
-		kvfree(pages);
-		return ERR_PTR(-ENOMEM);
-	}
-	ret = pin_user_pages(host_addr & PAGE_MASK, num_pages, foll_flags,
-			     pages, vmas);
-	kvfree(vmas);
-	if (ret < 0) {
-		etdev_dbg(etdev, "pin_user_pages failed %u:%pK-%u: %d",
-			  group->workload_id, (void *)host_addr, num_pages,
-			  ret);
-		if (ret == -ENOMEM)
-			etdev_err(etdev,
-				  "system out of memory locking %u pages",
-				  num_pages);
-		num_pages = 0;
-		goto error;
-	}
-	if (ret < num_pages) {
-		etdev_dbg(etdev,
-			  "pin_user_pages partial %u:%pK npages=%u pinned=%d",
-			  group->workload_id, (void *)host_addr, num_pages,
-			  ret);
-		num_pages = ret;
-		ret = -EFAULT;
-		goto error;
+	ret = edgetpu_pinned_charge(group, num_pages, pmm);
+	if (ret)
+		return ret;
+	ret = edgetpu_pin_user_pages_to_sgt(group, host_addr & PAGE_MASK, num_pages, foll_flags,
+					    preadonly, sgt, ptotal_nents);
+	if (ret) {
+		edgetpu_pinned_uncharge_pages(group, num_pages, *pmm);
+		return ret;
 	}
-
 	*pnum_pages = num_pages;
-	return pages;
+	return 0;
+}
 
-error:
-	for (i = 0; i < num_pages; i++)
-		unpin_user_page(pages[i]);
-	kvfree(pages);
+/* Allocates @dst with the same pages and layout as @src. */
+static int edgetpu_sgt_clone(struct sg_table *dst, const struct sg_table *src)
+{
+	struct scatterlist *sg, *dst_sg;
+	int i;
+	int ret;
 
-	return ERR_PTR(ret);
+	ret = sg_alloc_table(dst, src->orig_nents, GFP_KERNEL);
+	if (ret)
+		return ret;
+	dst_sg = dst->sgl;
+	for_each_sg(src->sgl, sg, src->orig_nents, i) {
+		sg_set_page(dst_sg, sg_page(sg), sg->length, sg->offset);
+		dst_sg = sg_next(dst_sg);
+	}
+	return 0;
 }
 
 /*
  * Allocates an edgetpu_host_map with the user-space address @host_addr.
+ *
+ * @sgt holds the pinned pages and is moved to the returned mapping together
+ * with its @total_nents. It is left untouched on failure.
  */
 static struct edgetpu_host_map *
 alloc_mapping_from_useraddr(struct edgetpu_device_group *group, u64 host_addr,
-			    edgetpu_map_flag_t flags, struct page **pages,
-			    uint num_pages)
+			    edgetpu_map_flag_t flags, struct sg_table *sgt,
+			    uint total_nents)
 {
 	struct edgetpu_dev *etdev = group->etdev;
 	struct edgetpu_host_map *hmap;
 	int n;
-	struct sg_table *sgt;
-	int i;
+	int i = 0;
 	int ret;
 
 	hmap = kzalloc(sizeof(*hmap), GFP_KERNEL);
@@ -1322,39 +2401,27 @@ alloc_mapping_from_useraddr(struct edgetpu_device_group *group, u64 host_addr,
 		n = 1;
 	}
 
-	for (i = 0; i < n; i++) {
-		if (i == 0)
-			sgt = &hmap->map.sgt;
-		else
-			sgt = &hmap->sg_tables[i];
-		ret = sg_alloc_table_from_pages(sgt, pages, num_pages, 0,
-						num_pages * PAGE_SIZE,
-						GFP_KERNEL);
+	/* Other dies map the same pages through their own tables. */
+	for (i = 1; i < n; i++) {
+		ret = edgetpu_sgt_clone(&hmap->sg_tables[i], sgt);
 		if (ret) {
-			etdev_dbg(etdev,
-				  "%s: sg_alloc_table_from_pages failed %u:%pK-%u: %d",
-				  __func__, group->workload_id,
-				  (void *)host_addr, num_pages, ret);
+			etdev_dbg(etdev, "%s: sg_alloc_table failed %u:%pK: %d",
+				  __func__, group->workload_id, (void *)host_addr, ret);
 			goto error_free_sgt;
 		}
 	}
+	hmap->map.sgt = *sgt;
+	hmap->sgt_total_nents = total_nents;
 
 	return hmap;
 
 error_free_sgt:
 	/*
-	 * Starting from kernel version 5.10, the caller must call sg_free_table
-	 * to clean up any leftover allocations if sg_alloc_table_from_pages
-	 * returns non-0 for failures. Calling sg_free_table is also fine with
-	 * older kernel versions since sg_free_table handles this properly.
+	 * sg_free_table is fine to be called on the table failed to be
+	 * allocated.
 	 */
-	for (; i >= 0; i--) {
-		if (i == 0)
-			sgt = &hmap->map.sgt;
-		else
-			sgt = &hmap->sg_tables[i];
-		sg_free_table(sgt);
-	}
+	for (; i >= 1; i--)
+		sg_free_table(&hmap->sg_tables[i]);
 error:
 	if (hmap) {
 		edgetpu_device_group_put(hmap->map.priv);
@@ -1465,7 +2532,8 @@ int edgetpu_device_group_map(struct edgetpu_device_group *group,
 			     struct edgetpu_map_ioctl *arg)
 {
 	uint num_pages = 0;
-	struct page **pages;
+	struct sg_table sgt;
+	uint sgt_total_nents;
 	int ret = -EINVAL;
 	u64 host_addr = arg->host_address;
 	edgetpu_map_flag_t flags = arg->flags;
@@ -1474,16 +2542,17 @@ int edgetpu_device_group_map(struct edgetpu_device_group *group,
 	struct edgetpu_dev *etdev;
 	enum edgetpu_context_id context_id;
 	const u32 mmu_flags = map_to_mmu_flags(flags) | EDGETPU_MMU_HOST;
-	int i;
+	struct mm_struct *charged_mm;
 	bool readonly;
 	tpu_addr_t tpu_addr;
 
 	if (!valid_dma_direction(flags & EDGETPU_MAP_DIR_MASK))
 		return -EINVAL;
 	/* Pin user pages before holding any lock. */
-	pages = edgetpu_pin_user_pages(group, arg, &num_pages, &readonly);
-	if (IS_ERR(pages))
-		return PTR_ERR(pages);
+	ret = edgetpu_pin_user_pages(group, arg, &sgt, &sgt_total_nents, &num_pages, &readonly,
+				     &charged_mm);
+	if (ret)
+		return ret;
 	/* If the host pages are read-only, fallback to use DMA_TO_DEVICE. */
 	if (readonly) {
 		flags &= ~EDGETPU_MAP_DIR_MASK;
@@ -1503,14 +2572,16 @@ int edgetpu_device_group_map(struct edgetpu_device_group *group,
 		}
 	}
 
-	hmap = alloc_mapping_from_useraddr(group, host_addr, flags, pages,
-					   num_pages);
+	hmap = alloc_mapping_from_useraddr(group, host_addr, flags, &sgt, sgt_total_nents);
 	if (IS_ERR(hmap)) {
 		ret = PTR_ERR(hmap);
 		goto error;
 	}
 
 	map = &hmap->map;
+	/* the mapping owns the charge from now on */
+	hmap->num_pages = num_pages;
+	hmap->mm = charged_mm;
 	if (IS_MIRRORED(flags)) {
 		map->die_index = ALL_DIES;
 		etdev = group->etdev;
@@ -1545,8 +2616,8 @@ int edgetpu_device_group_map(struct edgetpu_device_group *group,
 	}
 
 	mutex_unlock(&group->lock);
+	edgetpu_fr_record(group->etdev, EDGETPU_FR_MAP, group->workload_id, tpu_addr);
 	arg->device_address = tpu_addr;
-	kvfree(pages);
 	return 0;
 
 error:
@@ -1557,11 +2628,11 @@ error:
 		edgetpu_mapping_unlock(&group->host_mappings);
 	} else {
 		/* revert edgetpu_pin_user_pages() */
-		for (i = 0; i < num_pages; i++)
-			unpin_user_page(pages[i]);
+		edgetpu_unpin_sg_pages(sgt.sgl, sgt.orig_nents, num_pages);
+		edgetpu_free_pinned_sgt(&sgt, sgt_total_nents);
+		edgetpu_pinned_uncharge_pages(group, num_pages, charged_mm);
 	}
 	mutex_unlock(&group->lock);
-	kvfree(pages);
 	return ret;
 }
 
@@ -1597,6 +2668,7 @@ int edgetpu_device_group_unmap(struct edgetpu_device_group *group,
 	map->dma_attrs = map_to_dma_attr(flags, false);
 	edgetpu_unmap_node(map);
 	edgetpu_mapping_unlock(&group->host_mappings);
+	edgetpu_fr_record(group->etdev, EDGETPU_FR_UNMAP, group->workload_id, tpu_addr);
 unlock_group:
 	mutex_unlock(&group->lock);
 	return ret;
@@ -1648,6 +2720,167 @@ unlock_group:
 	return ret;
 }
 
+struct edgetpu_prefetch_work {
+	struct work_struct work;
+	struct edgetpu_device_group *group;
+	u32 num_ranges;
+	struct {
+		tpu_addr_t tpu_addr;
+		u32 size;
+	} ranges[];
+};
+
+static void edgetpu_group_prefetch_work(struct work_struct *work)
+{
+	struct edgetpu_prefetch_work *pwork = container_of(work, struct edgetpu_prefetch_work, work);
+	struct edgetpu_device_group *group = pwork->group;
+	struct edgetpu_dev *etdev = group->etdev;
+	int ret;
+	u32 i;
+
+	/* prefetching only helps an upcoming inference, don't power up the device for it */
+	if (edgetpu_pm_get_if_powered(etdev->pm)) {
+		for (i = 0; i < pwork->num_ranges && !READ_ONCE(group->prefetch_cancel); i++) {
+			ret = edgetpu_kci_prefetch_buffer(etdev->kci, pwork->ranges[i].tpu_addr,
+							  pwork->ranges[i].size, group->vcid);
+			if (ret == -EOPNOTSUPP) {
+				etdev_dbg(etdev, "firmware does not support prefetching\n");
+				break;
+			}
+			if (ret) {
+				etdev_dbg(etdev, "prefetch %#llx failed: %d\n",
+					  pwork->ranges[i].tpu_addr, ret);
+				break;
+			}
+		}
+		edgetpu_pm_put(etdev->pm);
+	}
+	edgetpu_group_notify(group, EDGETPU_EVENT_PREFETCHED);
+	if (atomic_dec_and_test(&group->prefetch_inflight))
+		wake_up_all(&group->prefetch_waitq);
+	edgetpu_device_group_put(group);
+	kfree(pwork);
+}
+
+/*
+ * Syncs @range for the device if it's in a host buffer, and checks it's within
+ * a mapping of @group.
+ *
+ * Caller holds @group->lock.
+ */
+static int group_prefetch_sync_range(struct edgetpu_device_group *group,
+				     const struct edgetpu_prefetch_range *range)
+{
+	struct edgetpu_mapping *map;
+	int ret = 0;
+
+	edgetpu_mapping_lock(&group->host_mappings);
+	map = edgetpu_mapping_find_locked(&group->host_mappings, ALL_DIES, range->device_address);
+	if (!map)
+		map = edgetpu_mapping_find_locked(&group->host_mappings, range->die_index,
+						  range->device_address);
+	if (map)
+		ret = group_sync_host_map(group, container_of(map, struct edgetpu_host_map, map),
+					  range->offset, range->size, DMA_TO_DEVICE, false);
+	edgetpu_mapping_unlock(&group->host_mappings);
+	if (map)
+		return ret;
+
+	/* dma-bufs are kept coherent by their exporters */
+	edgetpu_mapping_lock(&group->dmabuf_mappings);
+	map = edgetpu_mapping_find_locked(&group->dmabuf_mappings, ALL_DIES,
+					  range->device_address);
+	if (!map)
+		map = edgetpu_mapping_find_locked(&group->dmabuf_mappings, range->die_index,
+						  range->device_address);
+	if (!map || range->offset + range->size > map->map_size)
+		ret = -EINVAL;
+	edgetpu_mapping_unlock(&group->dmabuf_mappings);
+	return ret;
+}
+
+int edgetpu_device_group_prefetch(struct edgetpu_device_group *group,
+				  const struct edgetpu_prefetch_range *ranges, u32 num_ranges)
+{
+	struct edgetpu_prefetch_work *pwork;
+	int ret = 0;
+	u32 i;
+
+	if (!num_ranges || num_ranges > EDGETPU_PREFETCH_MAX_RANGES)
+		return -EINVAL;
+	for (i = 0; i < num_ranges; i++) {
+		/* invalid if size == 0, overflow, or not fitting a KCI */
+		if (ranges[i].offset + ranges[i].size <= ranges[i].offset ||
+		    ranges[i].size > U32_MAX)
+			return -EINVAL;
+	}
+	pwork = kzalloc(struct_size(pwork, ranges, num_ranges), GFP_KERNEL);
+	if (!pwork)
+		return -ENOMEM;
+
+	mutex_lock(&group->lock);
+	if (!edgetpu_device_group_is_finalized(group)) {
+		ret = edgetpu_group_errno(group);
+		goto err_unlock;
+	}
+	if (atomic_read(&group->prefetch_inflight) >= EDGETPU_PREFETCH_MAX_INFLIGHT) {
+		ret = -EAGAIN;
+		goto err_unlock;
+	}
+	for (i = 0; i < num_ranges; i++) {
+		ret = group_prefetch_sync_range(group, &ranges[i]);
+		if (ret)
+			goto err_unlock;
+		pwork->ranges[i].tpu_addr = ranges[i].device_address + ranges[i].offset;
+		pwork->ranges[i].size = ranges[i].size;
+	}
+	/* counted under the lock, so a group release in progress waits for this work */
+	atomic_inc(&group->prefetch_inflight);
+	mutex_unlock(&group->lock);
+
+	pwork->num_ranges = num_ranges;
+	pwork->group = edgetpu_device_group_get(group);
+	INIT_WORK(&pwork->work, edgetpu_group_prefetch_work);
+	/* the works wait for up to EDGETPU_PREFETCH_MAX_RANGES KCIs */
+	queue_work(system_unbound_wq, &pwork->work);
+	return 0;
+
+err_unlock:
+	mutex_unlock(&group->lock);
+	kfree(pwork);
+	return ret;
+}
+
+int edgetpu_device_group_submit_cmds(struct edgetpu_device_group *group,
+				     struct edgetpu_submit_cmds_ioctl *arg)
+{
+	int ret;
+
+	arg->submitted = 0;
+	if (!arg->count)
+		return 0;
+
+	ret = edgetpu_group_lock_swapped_in(group);
+	if (ret)
+		goto out;
+	if (!edgetpu_group_finalized_and_attached(group)) {
+		ret = edgetpu_group_errno(group);
+		goto out;
+	}
+	if (group->vii_reset_pending) {
+		ret = -ECONNRESET;
+		goto out;
+	}
+	ret = edgetpu_mailbox_vii_submit(&group->vii, u64_to_user_ptr(arg->cmds), arg->count);
+	if (ret > 0) {
+		arg->submitted = ret;
+		ret = 0;
+	}
+out:
+	mutex_unlock(&group->lock);
+	return ret;
+}
+
 void edgetpu_mappings_clear_group(struct edgetpu_device_group *group)
 {
 	edgetpu_mapping_clear(&group->host_mappings);
@@ -1725,7 +2958,13 @@ int edgetpu_mmap_csr(struct edgetpu_device_group *group,
 	if (is_external && !uid_eq(current_euid(), GLOBAL_ROOT_UID))
 		return -EPERM;
 
-	mutex_lock(&group->lock);
+	if (is_external) {
+		mutex_lock(&group->lock);
+	} else {
+		ret = edgetpu_group_lock_swapped_in(group);
+		if (ret)
+			goto out;
+	}
 	if (!edgetpu_group_finalized_and_attached(group)) {
 		ret = edgetpu_group_errno(group);
 		goto out;
@@ -1764,7 +3003,13 @@ int edgetpu_mmap_queue(struct edgetpu_device_group *group,
 	if (is_external && !uid_eq(current_euid(), GLOBAL_ROOT_UID))
 		return -EPERM;
 
-	mutex_lock(&group->lock);
+	if (is_external) {
+		mutex_lock(&group->lock);
+	} else {
+		ret = edgetpu_group_lock_swapped_in(group);
+		if (ret)
+			goto out;
+	}
 	if (!edgetpu_group_finalized_and_attached(group)) {
 		ret = edgetpu_group_errno(group);
 		goto out;
@@ -1792,7 +3037,17 @@ int edgetpu_mmap_queue(struct edgetpu_device_group *group,
 		goto out;
 	}
 
-	ret = edgetpu_iremap_mmap(etdev, vma, queue_mem);
+#ifdef EDGETPU_IS_DMA_COHERENT
+	/*
+	 * Only queues outside the iremap pool are mapped cacheable, which
+	 * excludes devices with a pool such as janeiro hardware. External
+	 * mailboxes may be consumed by non-coherent peers.
+	 */
+	if (!is_external)
+		ret = edgetpu_iremap_mmap_cacheable(etdev, vma, queue_mem);
+	else
+#endif
+		ret = edgetpu_iremap_mmap(etdev, vma, queue_mem);
 	if (!ret)
 		queue_mem->host_addr = vma->vm_start;
 
@@ -1871,6 +3126,52 @@ uint edgetpu_group_get_fatal_errors(struct edgetpu_device_group *group)
 	return fatal_errors;
 }
 
+void edgetpu_group_enable_vii_reset_ack(struct edgetpu_device_group *group)
+{
+	mutex_lock(&group->lock);
+	group->vii_reset_ack = true;
+	mutex_unlock(&group->lock);
+}
+
+int edgetpu_group_ack_vii_reset(struct edgetpu_device_group *group)
+{
+	int ret = 0;
+
+	mutex_lock(&group->lock);
+	if (!edgetpu_device_group_is_finalized(group)) {
+		ret = edgetpu_group_errno(group);
+		goto out;
+	}
+	if (!group->vii_reset_pending)
+		goto out;
+	/* drop what the runtime wrote to the queue CSRs before learning about the reset */
+	edgetpu_mailbox_reset_vii(&group->vii);
+	/*
+	 * Open with first_open set so the firmware drops the state of the VCID,
+	 * an evicted mailbox is opened so on the next swap in.
+	 */
+	if (edgetpu_group_mailbox_detached_locked(group)) {
+		group->activated = false;
+	} else {
+		ret = edgetpu_mailbox_activate(group->etdev,
+					       edgetpu_group_context_id_locked(group),
+					       group->vcid, true);
+		if (ret) {
+			/* the firmware can't take the VCID back, restart it like a failed reset */
+			etdev_err(group->etdev, "reopen VCID %u after reset failed: %d, restarting firmware",
+				  group->vcid, ret);
+			edgetpu_watchdog_bite(group->etdev, false);
+			goto out;
+		}
+		group->vii_open = true;
+	}
+	group->vii_reset_pending = false;
+	group->fatal_errors &= ~EDGETPU_ERROR_RUNTIME_TIMEOUT;
+out:
+	mutex_unlock(&group->lock);
+	return ret;
+}
+
 void edgetpu_group_detach_mailbox_locked(struct edgetpu_device_group *group)
 {
 	if (!group->mailbox_detachable)
@@ -1893,6 +3194,7 @@ void edgetpu_group_close_and_detach_mailbox(struct edgetpu_device_group *group)
 		edgetpu_group_detach_mailbox_locked(group);
 		edgetpu_group_deactivate_external_mailbox(group);
 	}
+	group->mailbox_evicted = false;
 	mutex_unlock(&group->lock);
 }
 
@@ -1902,7 +3204,7 @@ int edgetpu_group_attach_mailbox_locked(struct edgetpu_device_group *group)
 		return 0;
 	if (!edgetpu_group_mailbox_detached_locked(group))
 		return 0;
-	return do_attach_mailbox_locked(group);
+	return edgetpu_group_admit_locked(group);
 }
 
 int edgetpu_group_attach_and_open_mailbox(struct edgetpu_device_group *group)
@@ -1934,40 +3236,22 @@ out_unlock:
 	return ret;
 }
 
-/*
- * Return the group with id @vcid for device @etdev, with a reference held
- * on the group (must call edgetpu_device_group_put when done), or NULL if
- * no group with that VCID is found.
- */
-static struct edgetpu_device_group *get_group_by_vcid(
-	struct edgetpu_dev *etdev, u16 vcid)
-{
-	struct edgetpu_device_group *group = NULL;
-	struct edgetpu_device_group *tgroup;
-	struct edgetpu_list_group *g;
-
-	mutex_lock(&etdev->groups_lock);
-	etdev_for_each_group(etdev, g, tgroup) {
-		if (tgroup->vcid == vcid) {
-			group = edgetpu_device_group_get(tgroup);
-			break;
-		}
-	}
-	mutex_unlock(&etdev->groups_lock);
-	return group;
-}
-
 void edgetpu_handle_job_lockup(struct edgetpu_dev *etdev, u16 vcid)
 {
 	struct edgetpu_device_group *group;
 
 	etdev_err(etdev, "firmware-detected job lockup on VCID %u",
 		  vcid);
-	group = get_group_by_vcid(etdev, vcid);
+	group = edgetpu_device_group_get_by_vcid(etdev, vcid);
 	if (!group) {
 		etdev_warn(etdev, "VCID %u group not found", vcid);
 		return;
 	}
-	edgetpu_group_fatal_error_notify(group, EDGETPU_ERROR_RUNTIME_TIMEOUT);
-	edgetpu_device_group_put(group);
+	/* don't block the reverse KCI handler on KCI round trips */
+	if (!schedule_work(&group->lockup_work))
+		edgetpu_device_group_put(group);
 }
+
+#if IS_ENABLED(CONFIG_EDGETPU_PERF_TEST)
+#include "unittests/edgetpu-device-group-perf-test.c"
+#endif
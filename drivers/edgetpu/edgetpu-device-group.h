@@ -7,6 +7,7 @@
 #ifndef __EDGETPU_DEVICE_GROUP_H__
 #define __EDGETPU_DEVICE_GROUP_H__
 
+#include <linux/cache.h>
 #include <linux/eventfd.h>
 #include <linux/list.h>
 #include <linux/mutex.h>
@@ -15,6 +16,7 @@
 #include <linux/seq_file.h>
 #include <linux/spinlock.h>
 #include <linux/types.h>
+#include <linux/workqueue.h>
 
 #include "edgetpu-dram.h"
 #include "edgetpu-internal.h"
@@ -45,7 +47,7 @@ enum edgetpu_device_group_status {
 	EDGETPU_DEVICE_GROUP_DISBANDED,
 };
 
-#define EDGETPU_EVENT_COUNT 2
+#define EDGETPU_EVENT_COUNT 3
 
 /* eventfds registered for event notifications from kernel for a device group */
 struct edgetpu_events {
@@ -53,6 +55,13 @@ struct edgetpu_events {
 	struct eventfd_ctx *eventfds[EDGETPU_EVENT_COUNT];
 };
 
+/*
+ * Fields are grouped by access pattern: the read-mostly fields used on every
+ * command submission and notification come first, the field written by the
+ * VII IRQ handler and the @lock protected fields each start a new cache line,
+ * and the fields only used on setup, mapping and teardown are last.
+ * tools/edgetpu-layout/edgetpu-layout-check.py checks this on a built module.
+ */
 struct edgetpu_device_group {
 	/*
 	 * Reference count.
@@ -69,6 +78,12 @@ struct edgetpu_device_group {
 	 * creating this group.
 	 */
 	bool mailbox_detachable;
+	/*
+	 * Whether the VII mailbox was taken by another group while this group
+	 * holds a wakelock. The mailbox is attached again on the next use, see
+	 * edgetpu_group_swap_in_locked().
+	 */
+	bool mailbox_evicted;
 	/*
 	 * Whether group->etdev is inaccessible.
 	 * Some group operations will access device CSRs. If the device is known to be
@@ -87,27 +102,35 @@ struct edgetpu_device_group {
 	bool dev_inaccessible;
 	/* Virtual context ID to be sent to the firmware. */
 	u16 vcid;
+	struct edgetpu_events events;
+
+	/* jiffies when the VII mailbox was last used, for picking eviction victims */
+	unsigned long mailbox_last_used ____cacheline_aligned_in_smp;
 
 	/* protects everything in the following comment block */
-	struct mutex lock;
+	struct mutex lock ____cacheline_aligned_in_smp;
 	/* fields protected by @lock */
 
+	enum edgetpu_device_group_status status;
+	bool activated; /* whether this group's VII has ever been activated */
+	bool vii_open; /* whether the firmware serves the VII at the moment */
 	/*
-	 * List of clients belonging to this group.
-	 * The first client is the leader.
+	 * Whether the runtime opted in to acknowledging VII resets with
+	 * EDGETPU_ENABLE_VII_RESET_ACK. Otherwise a reset VII is reopened by
+	 * the kernel right away.
 	 */
-	struct list_head clients;
-	uint n_clients;			/* number of clients in the list */
+	bool vii_reset_ack;
 	/*
-	 * Array of the clients belonging to this group.
-	 * Clients in this field are same as @clients, but this field is
-	 * allocated only when a group is finalized. See
-	 * edgetpu_device_group_nth_etdev() for more details.
+	 * Whether the VII was reset after a job lockup and is kept closed until
+	 * the runtime acknowledges with EDGETPU_ACK_VII_RESET.
 	 */
-	struct edgetpu_client **members;
-	enum edgetpu_device_group_status status;
-	bool activated; /* whether this group's VII has ever been activated */
-	struct edgetpu_vii vii;		/* VII mailbox */
+	bool vii_reset_pending;
+	/*
+	 * Whether the VII was closed because @uid is over its TPU time quota,
+	 * see edgetpu_group_quota_work(). Cleared when the VII is closed for
+	 * another reason.
+	 */
+	bool quota_throttled;
 	/*
 	 * Context ID ranges from EDGETPU_CONTEXT_VII_BASE to
 	 * EDGETPU_NCONTEXTS - 1.
@@ -116,8 +139,24 @@ struct edgetpu_device_group {
 	 * (means the group isn't in any context at this time).
 	 */
 	enum edgetpu_context_id context_id;
+	struct edgetpu_vii vii;		/* VII mailbox */
 	/* The IOMMU domain being associated to this group */
 	struct edgetpu_iommu_domain *etdomain;
+	/*
+	 * List of clients belonging to this group.
+	 * The first client is the leader.
+	 */
+	struct list_head clients;
+	uint n_clients;			/* number of clients in the list */
+	/*
+	 * Array of the clients belonging to this group.
+	 * Clients in this field are same as @clients, but this field is
+	 * allocated only when a group is finalized. See
+	 * edgetpu_device_group_nth_etdev() for more details.
+	 */
+	struct edgetpu_client **members;
+	/* Mask of errors set for this group. */
+	uint fatal_errors;
 	/* matrix of P2P mailboxes */
 	struct edgetpu_p2p_mailbox **p2p_mailbox_matrix;
 	/*
@@ -126,18 +165,77 @@ struct edgetpu_device_group {
 	 */
 	struct edgetpu_external_mailbox *ext_mailbox;
 
-	/* Mask of errors set for this group. */
-	uint fatal_errors;
-
 	/* end of fields protected by @lock */
 
 	/* TPU IOVA mapped to host DRAM space */
-	struct edgetpu_mapping_root host_mappings;
+	struct edgetpu_mapping_root host_mappings ____cacheline_aligned_in_smp;
 	/* TPU IOVA mapped to buffers backed by dma-buf */
 	struct edgetpu_mapping_root dmabuf_mappings;
-	struct edgetpu_events events;
+	/* host pages pinned by the mappings of this group */
+	atomic_long_t pinned_pages;
 	/* Mailbox attributes used to create this group */
 	struct edgetpu_mailbox_attr mbox_attr;
+	/* attributes of EDGETPU_CREATE_GROUP_EXT, zero for EDGETPU_CREATE_GROUP */
+	u32 cmdq_overflow_order;
+	u32 deadline_class;
+	/* Resets the VII after a firmware-detected job lockup on this group */
+	struct work_struct lockup_work;
+	/* UID of the creator, whose TPU time quota the group is charged to */
+	int32_t uid;
+	/* Closes and reopens the VII while @uid is over its TPU time quota */
+	struct delayed_work quota_work;
+	/* entry of this group in the VII mailbox admission queue */
+	struct edgetpu_admission_waiter admission;
+	/* number of EDGETPU_PREFETCH_BUFFERS works queued, increased under @lock */
+	atomic_t prefetch_inflight;
+	/* set when the group is released, queued prefetch works skip their KCIs */
+	bool prefetch_cancel;
+	/* woken up when @prefetch_inflight drops to zero */
+	wait_queue_head_t prefetch_waitq;
+	/*
+	 * Nodes preallocated by the group pool for adding the group to its device and the leader
+	 * to the group, NULL once used or if the group didn't come from the pool.
+	 */
+	struct edgetpu_list_group *dev_node;
+	struct edgetpu_list_group_client *leader_node;
+	/* groups are freed after an RCU grace period for lockless lookups */
+	struct rcu_head rcu;
+};
+
+/* Maximum number of EDGETPU_PREFETCH_BUFFERS requests in flight per group. */
+#define EDGETPU_PREFETCH_MAX_INFLIGHT	4
+
+/* Maximum number of group shells kept in the pool, see group_pool_size. */
+#define EDGETPU_GROUP_POOL_MAX		8
+/* Number of recent group setups percentiles are computed from. */
+#define EDGETPU_GROUP_SETUP_SAMPLES	128
+
+struct edgetpu_group_setup_stats {
+	uint count;	/* number of setups ever recorded */
+	u32 latency_ns[EDGETPU_GROUP_SETUP_SAMPLES];
+};
+
+/*
+ * Groups allocated ahead of EDGETPU_CREATE_GROUP with their IOMMU domain and
+ * list nodes, so creating a group doesn't allocate memory or domain tokens.
+ */
+struct edgetpu_group_pool {
+	struct edgetpu_dev *etdev;
+	struct mutex lock;
+	/* fields protected by @lock */
+	struct edgetpu_device_group *shells[EDGETPU_GROUP_POOL_MAX];
+	uint count;
+	/* set by edgetpu_group_pool_exit(), no shell is taken or added afterwards */
+	bool exiting;
+	/* end of fields protected by @lock */
+	struct work_struct refill_work;
+	spinlock_t stats_lock;
+	/* fields protected by @stats_lock */
+	u64 hits;	/* groups created from a pooled shell */
+	u64 misses;	/* groups created with the pool empty */
+	struct edgetpu_group_setup_stats create;
+	struct edgetpu_group_setup_stats finalize;
+	/* end of fields protected by @stats_lock */
 };
 
 /*
@@ -234,6 +332,24 @@ edgetpu_device_group_get(struct edgetpu_device_group *group)
  */
 void edgetpu_device_group_put(struct edgetpu_device_group *group);
 
+/*
+ * Returns the group using VCID @vcid of @etdev with a reference held, or NULL
+ * if there is no such group.
+ *
+ * Doesn't sleep, safe to call from reverse KCI and IRQ handlers.
+ */
+struct edgetpu_device_group *edgetpu_device_group_get_by_vcid(struct edgetpu_dev *etdev,
+							      u16 vcid);
+
+/*
+ * Returns the group attached to the VII mailbox @mailbox_id of @etdev with a
+ * reference held, or NULL if the mailbox is not attached to any group.
+ *
+ * Doesn't sleep, safe to call from IRQ and fault handlers.
+ */
+struct edgetpu_device_group *edgetpu_device_group_get_by_mailbox(struct edgetpu_dev *etdev,
+								 uint mailbox_id);
+
 /*
  * Allocates a device group with @client as the group leader.
  *
@@ -247,7 +363,7 @@ void edgetpu_device_group_put(struct edgetpu_device_group *group);
  */
 struct edgetpu_device_group *
 edgetpu_device_group_alloc(struct edgetpu_client *client,
-			   const struct edgetpu_mailbox_attr *attr);
+			   const struct edgetpu_create_group_ext *ext);
 
 /*
  * Adds a client to the device group.
@@ -328,10 +444,33 @@ int edgetpu_device_group_unmap(struct edgetpu_device_group *group,
 			       u32 die_index, tpu_addr_t tpu_addr,
 			       edgetpu_map_flag_t flags);
 
+/*
+ * Syncs @ranges of buffers mapped to @group for the device and asynchronously
+ * requests the firmware to prefetch them. EDGETPU_EVENT_PREFETCHED is signaled
+ * when done.
+ *
+ * Returns -EAGAIN if EDGETPU_PREFETCH_MAX_INFLIGHT requests of @group are
+ * still in flight.
+ */
+int edgetpu_device_group_prefetch(struct edgetpu_device_group *group,
+				  const struct edgetpu_prefetch_range *ranges, u32 num_ranges);
+
 /* Sync the buffer previously mapped by edgetpu_device_group_map. */
 int edgetpu_device_group_sync_buffer(struct edgetpu_device_group *group,
 				     const struct edgetpu_sync_ioctl *arg);
 
+/*
+ * Submits commands to the VII of a group with an overflow command queue.
+ *
+ * @arg->submitted is set to the number of commands accepted on success.
+ *
+ * Caller holds a wakelock of the group.
+ *
+ * Returns zero on success or a negative errno on error.
+ */
+int edgetpu_device_group_submit_cmds(struct edgetpu_device_group *group,
+				     struct edgetpu_submit_cmds_ioctl *arg);
+
 /* Clear all mappings for a device group. */
 void edgetpu_mappings_clear_group(struct edgetpu_device_group *group);
 
@@ -381,6 +520,12 @@ void edgetpu_group_unset_eventfd(struct edgetpu_device_group *group,
 /* Notify group of event */
 void edgetpu_group_notify(struct edgetpu_device_group *group, uint event_id);
 
+/*
+ * Checks the TPU time quota of @group after it used the TPU, closing its VII
+ * while it's over the quota. Safe to call from IRQ handlers.
+ */
+void edgetpu_group_quota_kick(struct edgetpu_device_group *group);
+
 /* Is device in any group (and may be actively processing requests) */
 bool edgetpu_in_any_group(struct edgetpu_dev *etdev);
 
@@ -400,6 +545,22 @@ void edgetpu_fatal_error_notify(struct edgetpu_dev *etdev, uint error_mask);
 /* Return fatal error signaled bitmask for device group */
 uint edgetpu_group_get_fatal_errors(struct edgetpu_device_group *group);
 
+/*
+ * Makes the VII of @group stay closed after a job lockup reset until the
+ * runtime acknowledges it, see EDGETPU_ENABLE_VII_RESET_ACK.
+ */
+void edgetpu_group_enable_vii_reset_ack(struct edgetpu_device_group *group);
+
+/*
+ * Reopens the VII of @group reset after a job lockup and clears
+ * EDGETPU_ERROR_RUNTIME_TIMEOUT, see EDGETPU_ACK_VII_RESET.
+ *
+ * Caller holds a wakelock of @group.
+ *
+ * Returns 0 on success or if no reset is pending.
+ */
+int edgetpu_group_ack_vii_reset(struct edgetpu_device_group *group);
+
 /*
  * Detach and release the mailbox resources of VII from @group.
  * Some group operations would be disabled when a group has no mailbox attached.
@@ -418,7 +579,8 @@ void edgetpu_group_close_and_detach_mailbox(struct edgetpu_device_group *group);
 /*
  * Request and attach the mailbox resources of VII to @group.
  *
- * Return 0 on success.
+ * Return 0 on success, -EAGAIN if @group was queued for a VII mailbox, see
+ * edgetpu_group_admission_wait().
  *
  * Caller holds @group->lock.
  */
@@ -428,8 +590,31 @@ int edgetpu_group_attach_mailbox_locked(struct edgetpu_device_group *group);
  *
  * The KCI command is sent even when @group is configured as mailbox
  * non-detachable (because the mailbox was successfully "attached").
+ *
+ * Returns -EAGAIN like edgetpu_group_attach_mailbox_locked().
  */
 int edgetpu_group_attach_and_open_mailbox(struct edgetpu_device_group *group);
+/*
+ * Waits until a group queued for a VII mailbox should try attaching again,
+ * after an attach returned -EAGAIN. The caller retries the attach once this
+ * returns 0, the retry fails with -EBUSY when the admission wait times out.
+ *
+ * Caller must not hold @group->lock, nor any client or wakelock lock.
+ *
+ * Returns 0 or -ERESTARTSYS if interrupted, in which case @group leaves the
+ * queue.
+ */
+int edgetpu_group_admission_wait(struct edgetpu_device_group *group);
+
+/* Prints the statistics of VII mailbox evictions on @etdev to @s. */
+void edgetpu_group_mailbox_evict_show(struct edgetpu_dev *etdev, struct seq_file *s);
+
+/* Allocates the group pool of @etdev and starts filling it. Failure only disables the pool. */
+void edgetpu_group_pool_init(struct edgetpu_dev *etdev);
+/* Frees the group pool of @etdev and the shells it holds. */
+void edgetpu_group_pool_exit(struct edgetpu_dev *etdev);
+/* Prints the group pool state and the group setup latency percentiles of @etdev to @s. */
+void edgetpu_group_pool_show(struct edgetpu_dev *etdev, struct seq_file *s);
 
 /*
  * Checks whether @group has mailbox detached.
@@ -13,6 +13,7 @@
 #include <linux/kernel.h>
 #include <linux/ktime.h>
 #include <linux/list.h>
+#include <linux/mutex.h>
 #include <linux/seq_file.h>
 #include <linux/slab.h>
 #include <linux/spinlock.h>
@@ -64,6 +65,24 @@ struct edgetpu_dmabuf_map {
 	 */
 	struct dmabuf_map_entry *entries;
 	uint num_entries;
+	/* the shared attachment used instead of @entries for EDGETPU_MAP_SHARED mappings */
+	struct edgetpu_dmabuf_shared *shared;
+};
+
+/*
+ * A read-only dma-buf attached to a device once and used by the
+ * EDGETPU_MAP_SHARED mappings of all groups on the device.
+ *
+ * The TPU VA of a dma-buf mapping is its DMA address on the device, so all the
+ * groups mirror the same pages at the same TPU VA into their own domains.
+ */
+struct edgetpu_dmabuf_shared {
+	struct list_head list;
+	struct edgetpu_dev *etdev;
+	struct dma_buf *dmabuf;
+	struct dmabuf_map_entry entry;
+	/* number of mappings using this attachment, protected by shared_dmabufs_lock */
+	uint refs;
 };
 
 /*
@@ -87,6 +106,10 @@ struct edgetpu_dma_fence {
 static LIST_HEAD(etfence_list_head);
 static DEFINE_SPINLOCK(etfence_list_lock);
 
+/* List of dma-bufs attached for EDGETPU_MAP_SHARED mappings. */
+static LIST_HEAD(shared_dmabufs);
+static DEFINE_MUTEX(shared_dmabufs_lock);
+
 static const struct dma_fence_ops edgetpu_dma_fence_ops;
 
 static int etdev_add_translations(struct edgetpu_dev *etdev,
@@ -267,6 +290,25 @@ static void group_unmap_dmabuf(struct edgetpu_device_group *group,
 	etdev_unmap_dmabuf(group->etdev, dmap, tpu_addr);
 }
 
+/* Drops a reference of @shared, detaching the dma-buf on the last one. */
+static void edgetpu_dmabuf_shared_put(struct edgetpu_dmabuf_shared *shared)
+{
+	struct dmabuf_map_entry *entry = &shared->entry;
+
+	mutex_lock(&shared_dmabufs_lock);
+	if (--shared->refs) {
+		mutex_unlock(&shared_dmabufs_lock);
+		return;
+	}
+	list_del(&shared->list);
+	mutex_unlock(&shared_dmabufs_lock);
+	sg_free_table(&entry->shrunk_sgt);
+	dma_buf_unmap_attachment(entry->attachment, entry->sgt, DMA_TO_DEVICE);
+	dma_buf_detach(shared->dmabuf, entry->attachment);
+	dma_buf_put(shared->dmabuf);
+	kfree(shared);
+}
+
 /*
  * Clean resources recorded in @dmap.
  *
@@ -284,7 +326,11 @@ static void dmabuf_map_callback_release(struct edgetpu_mapping *map)
 	uint i;
 
 	if (tpu_addr) {
-		if (IS_MIRRORED(map->flags)) {
+		if (dmap->shared) {
+			edgetpu_mmu_tpu_unmap_sgt(dmap->shared->etdev, tpu_addr,
+						  &dmap->shared->entry.shrunk_sgt,
+						  edgetpu_group_context_id_locked(group));
+		} else if (IS_MIRRORED(map->flags)) {
 			group_unmap_dmabuf(group, dmap, tpu_addr);
 		} else {
 			etdev = edgetpu_device_group_nth_etdev(group,
@@ -302,6 +348,8 @@ static void dmabuf_map_callback_release(struct edgetpu_mapping *map)
 		if (entry->attachment)
 			dma_buf_detach(dmap->dmabufs[0], entry->attachment);
 	}
+	if (dmap->shared)
+		edgetpu_dmabuf_shared_put(dmap->shared);
 	dma_buf_put(dmap->dmabufs[0]);
 	edgetpu_device_group_put(group);
 	kfree(dmap->dmabufs);
@@ -349,8 +397,10 @@ static void dmabuf_map_callback_show(struct edgetpu_mapping *map,
 			   edgetpu_dma_dir_rw_s(map->dir));
 
 	edgetpu_device_dram_dmabuf_info_show(dmap->dmabufs[0], s);
+	if (dmap->shared)
+		seq_puts(s, " shared");
 	seq_puts(s, " dma=");
-	entry_show_dma_addrs(&dmap->entries[0], s);
+	entry_show_dma_addrs(dmap->shared ? &dmap->shared->entry : &dmap->entries[0], s);
 }
 
 /*
@@ -629,6 +679,82 @@ err_detach:
 	return ret;
 }
 
+/*
+ * Returns the shared attachment of @dmabuf on @etdev with a reference held,
+ * attaching @dmabuf if no group on @etdev has it mapped yet.
+ *
+ * Returns an ERR_PTR on failure.
+ */
+static struct edgetpu_dmabuf_shared *edgetpu_dmabuf_shared_get(struct edgetpu_dev *etdev,
+							       struct dma_buf *dmabuf)
+{
+	struct edgetpu_dmabuf_shared *shared;
+	int ret;
+
+	mutex_lock(&shared_dmabufs_lock);
+	list_for_each_entry(shared, &shared_dmabufs, list) {
+		if (shared->etdev == etdev && shared->dmabuf == dmabuf) {
+			shared->refs++;
+			goto out_unlock;
+		}
+	}
+	shared = kzalloc(sizeof(*shared), GFP_KERNEL);
+	if (!shared) {
+		shared = ERR_PTR(-ENOMEM);
+		goto out_unlock;
+	}
+	ret = etdev_attach_dmabuf_to_entry(etdev, dmabuf, &shared->entry, dmabuf->size,
+					   DMA_TO_DEVICE);
+	if (ret) {
+		kfree(shared);
+		shared = ERR_PTR(ret);
+		goto out_unlock;
+	}
+	get_dma_buf(dmabuf);
+	shared->etdev = etdev;
+	shared->dmabuf = dmabuf;
+	shared->refs = 1;
+	list_add_tail(&shared->list, &shared_dmabufs);
+out_unlock:
+	mutex_unlock(&shared_dmabufs_lock);
+	return shared;
+}
+
+/*
+ * Handles EDGETPU_MAP_SHARED requests, maps the shared attachment of the
+ * dma-buf to die @die_index of @group, or to the only die of @group for
+ * mirrored requests.
+ *
+ * Caller holds @group->lock.
+ */
+static int group_map_shared_dmabuf(struct edgetpu_device_group *group,
+				   struct edgetpu_dmabuf_map *dmap, u32 die_index,
+				   tpu_addr_t *tpu_addr_p)
+{
+	struct edgetpu_dmabuf_shared *shared;
+	struct edgetpu_dev *etdev;
+	tpu_addr_t tpu_addr;
+
+	if (IS_MIRRORED(dmap->map.flags)) {
+		if (group->n_clients != 1)
+			return -EINVAL;
+		die_index = 0;
+	}
+	etdev = edgetpu_device_group_nth_etdev(group, die_index);
+	if (!etdev)
+		return -EINVAL;
+	shared = edgetpu_dmabuf_shared_get(etdev, dmap->dmabufs[0]);
+	if (IS_ERR(shared))
+		return PTR_ERR(shared);
+	dmap->shared = shared;
+	tpu_addr = edgetpu_mmu_tpu_map_sgt(etdev, &shared->entry.shrunk_sgt, DMA_TO_DEVICE,
+					   edgetpu_group_context_id_locked(group), dmap->mmu_flags);
+	if (!tpu_addr)
+		return -ENOSPC;
+	*tpu_addr_p = tpu_addr;
+	return 0;
+}
+
 int edgetpu_map_dmabuf(struct edgetpu_device_group *group,
 		       struct edgetpu_map_dmabuf_ioctl *arg)
 {
@@ -646,6 +772,10 @@ int edgetpu_map_dmabuf(struct edgetpu_device_group *group,
 		etdev_dbg(group->etdev, "%s: invalid direction %d\n", __func__, dir);
 		return -EINVAL;
 	}
+	if ((flags & EDGETPU_MAP_SHARED) && dir != DMA_TO_DEVICE) {
+		etdev_dbg(group->etdev, "%s: shared mapping must be read-only\n", __func__);
+		return -EINVAL;
+	}
 	dmabuf = dma_buf_get(arg->dmabuf_fd);
 	if (IS_ERR(dmabuf)) {
 		etdev_dbg(group->etdev, "%s: dma_buf_get returns %ld\n",
@@ -671,7 +801,16 @@ int edgetpu_map_dmabuf(struct edgetpu_device_group *group,
 	get_dma_buf(dmabuf);
 	dmap->dmabufs[0] = dmabuf;
 	dmap->map.map_size = dmap->size = size = dmabuf->size;
-	if (IS_MIRRORED(flags)) {
+	if (flags & EDGETPU_MAP_SHARED) {
+		ret = group_map_shared_dmabuf(group, dmap, arg->die_index, &tpu_addr);
+		if (ret) {
+			etdev_dbg(group->etdev,
+				  "%s: group_map_shared_dmabuf returns %d\n",
+				  __func__, ret);
+			goto err_release_map;
+		}
+		dmap->map.die_index = IS_MIRRORED(flags) ? ALL_DIES : arg->die_index;
+	} else if (IS_MIRRORED(flags)) {
 		for (i = 0; i < group->n_clients; i++) {
 			etdev = edgetpu_device_group_nth_etdev(group, i);
 			ret = etdev_attach_dmabuf_to_entry(etdev, dmabuf, &dmap->entries[i], size,
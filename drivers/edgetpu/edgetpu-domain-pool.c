@@ -5,82 +5,226 @@
  * Copyright (C) 2022 Google, LLC.
  */
 
-#include <linux/idr.h>
+#include <linux/bitmap.h>
 #include <linux/iommu.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
 
 #include "edgetpu-domain-pool.h"
 #include "edgetpu-internal.h"
 
+/*
+ * Finds a slot that is not in use and whose domain is (@ready) or is not
+ * (!@ready) allocated. Caller holds @pool->lock.
+ *
+ * Returns the slot index, or @pool->size if there is none.
+ */
+static unsigned int find_free_slot(struct edgetpu_domain_pool *pool, bool ready)
+{
+	unsigned int id;
+
+	for_each_clear_bit(id, pool->in_use, pool->size)
+		if (!!pool->array[id] == ready)
+			return id;
+	return pool->size;
+}
+
+/* Caller holds @pool->lock. */
+static unsigned int count_ready_slots(struct edgetpu_domain_pool *pool)
+{
+	unsigned int id, n = 0;
+
+	for_each_clear_bit(id, pool->in_use, pool->size)
+		if (pool->array[id])
+			n++;
+	return n;
+}
+
+/* Frees the domains of released slots. */
+static void edgetpu_domain_pool_scrub(struct edgetpu_domain_pool *pool)
+{
+	struct iommu_domain *domain;
+	unsigned int id;
+
+	while (1) {
+		mutex_lock(&pool->lock);
+		id = find_first_bit(pool->dirty, pool->size);
+		if (id >= pool->size) {
+			mutex_unlock(&pool->lock);
+			return;
+		}
+		clear_bit(id, pool->dirty);
+		domain = pool->array[id];
+		pool->array[id] = NULL;
+		mutex_unlock(&pool->lock);
+
+		/* Tears down the page tables left by the previous owner. */
+		iommu_domain_free(domain);
+
+		mutex_lock(&pool->lock);
+		clear_bit(id, pool->in_use);
+		mutex_unlock(&pool->lock);
+		etdev_dbg(pool->etdev, "Scrubbed domain of pool slot %u\n", id);
+	}
+}
+
+/* Allocates domains until @pool->watermark domains are ready to be handed out. */
+static void edgetpu_domain_pool_refill(struct edgetpu_domain_pool *pool)
+{
+	struct iommu_domain *domain;
+	unsigned int id;
+
+	while (1) {
+		mutex_lock(&pool->lock);
+		if (count_ready_slots(pool) >= pool->watermark) {
+			mutex_unlock(&pool->lock);
+			return;
+		}
+		id = find_free_slot(pool, false);
+		if (id >= pool->size) {
+			mutex_unlock(&pool->lock);
+			return;
+		}
+		/* Reserve the slot while allocating without holding the lock. */
+		set_bit(id, pool->in_use);
+		mutex_unlock(&pool->lock);
+
+		domain = iommu_domain_alloc(pool->etdev->dev->bus);
+
+		mutex_lock(&pool->lock);
+		pool->array[id] = domain;
+		clear_bit(id, pool->in_use);
+		mutex_unlock(&pool->lock);
+		if (!domain) {
+			etdev_warn(pool->etdev, "Failed to pre-allocate iommu domain %u\n", id);
+			return;
+		}
+	}
+}
+
+static void edgetpu_domain_pool_work(struct work_struct *work)
+{
+	struct edgetpu_domain_pool *pool = container_of(work, struct edgetpu_domain_pool, work);
+
+	edgetpu_domain_pool_scrub(pool);
+	edgetpu_domain_pool_refill(pool);
+}
+
 int edgetpu_domain_pool_init(struct edgetpu_dev *etdev, struct edgetpu_domain_pool *pool,
-			     unsigned int size)
+			     unsigned int size, unsigned int watermark)
 {
 	unsigned int i;
-	struct iommu_domain *domain;
 
 	pool->size = size;
+	pool->watermark = min(watermark, size);
 	pool->etdev = etdev;
 
 	if (!size)
 		return 0;
 
-	etdev_dbg(pool->etdev, "Initializing domain pool with %u domains\n", size);
+	etdev_dbg(pool->etdev, "Initializing domain pool with %u of %u domains\n",
+		  pool->watermark, size);
 
-	ida_init(&pool->idp);
+	mutex_init(&pool->lock);
+	INIT_WORK(&pool->work, edgetpu_domain_pool_work);
 	pool->array = vzalloc(sizeof(*pool->array) * size);
-	if (!pool->array) {
+	pool->in_use = bitmap_zalloc(size, GFP_KERNEL);
+	pool->dirty = bitmap_zalloc(size, GFP_KERNEL);
+	if (!pool->array || !pool->in_use || !pool->dirty) {
 		etdev_err(etdev, "Failed to allocate memory for domain pool array\n");
+		edgetpu_domain_pool_destroy(pool);
 		return -ENOMEM;
 	}
-	for (i = 0; i < size; i++) {
-		domain = iommu_domain_alloc(pool->etdev->dev->bus);
-		if (!domain) {
+	for (i = 0; i < pool->watermark; i++) {
+		pool->array[i] = iommu_domain_alloc(pool->etdev->dev->bus);
+		if (!pool->array[i]) {
 			etdev_err(pool->etdev, "Failed to allocate iommu domain %d of %u\n", i + 1,
-				  size);
+				  pool->watermark);
 			edgetpu_domain_pool_destroy(pool);
 			return -ENOMEM;
 		}
-		pool->array[i] = domain;
 	}
 	return 0;
 }
 
-struct iommu_domain *edgetpu_domain_pool_alloc(struct edgetpu_domain_pool *pool)
+struct iommu_domain *edgetpu_domain_pool_alloc(struct edgetpu_domain_pool *pool, int *id)
 {
-	int id;
+	struct iommu_domain *domain;
+	unsigned int i;
+	bool retried = false;
 
+	*id = -1;
 	if (!pool->size)
 		return iommu_domain_alloc(pool->etdev->dev->bus);
 
-	id = ida_alloc_max(&pool->idp, pool->size - 1, GFP_KERNEL);
-
-	if (id < 0) {
+retry:
+	mutex_lock(&pool->lock);
+	i = find_free_slot(pool, true);
+	if (i >= pool->size)
+		i = find_free_slot(pool, false);
+	if (i >= pool->size) {
+		mutex_unlock(&pool->lock);
+		/* All slots may be waiting for scrubbing, wait for the worker once. */
+		if (!retried) {
+			retried = true;
+			flush_work(&pool->work);
+			goto retry;
+		}
 		etdev_err(pool->etdev, "No more domains available from pool of size %u\n",
 			  pool->size);
 		return NULL;
 	}
+	set_bit(i, pool->in_use);
+	domain = pool->array[i];
+	mutex_unlock(&pool->lock);
 
-	etdev_dbg(pool->etdev, "Allocated domain from pool with id = %d\n", id);
+	/* The pool ran dry, allocate on the caller's context. */
+	if (!domain) {
+		domain = iommu_domain_alloc(pool->etdev->dev->bus);
+		mutex_lock(&pool->lock);
+		pool->array[i] = domain;
+		if (!domain)
+			clear_bit(i, pool->in_use);
+		mutex_unlock(&pool->lock);
+		if (!domain)
+			return NULL;
+	}
+	schedule_work(&pool->work);
 
-	return pool->array[id];
+	etdev_dbg(pool->etdev, "Allocated domain from pool with id = %u\n", i);
+	*id = i;
+	return domain;
 }
 
-void edgetpu_domain_pool_free(struct edgetpu_domain_pool *pool, struct iommu_domain *domain)
+void edgetpu_domain_pool_free(struct edgetpu_domain_pool *pool, struct iommu_domain *domain,
+			      int id)
 {
-	int id;
-
 	if (!pool->size) {
 		iommu_domain_free(domain);
 		return;
 	}
-	for (id = 0; id < pool->size; id++) {
-		if (pool->array[id] == domain) {
-			etdev_dbg(pool->etdev, "Released domain from pool with id = %d\n", id);
-			ida_free(&pool->idp, id);
-			return;
-		}
+	mutex_lock(&pool->lock);
+	if (id < 0 || id >= pool->size || pool->array[id] != domain) {
+		mutex_unlock(&pool->lock);
+		etdev_err(pool->etdev, "%s: domain not found in pool", __func__);
+		return;
 	}
-	etdev_err(pool->etdev, "%s: domain not found in pool", __func__);
+	set_bit(id, pool->dirty);
+	mutex_unlock(&pool->lock);
+	etdev_dbg(pool->etdev, "Released domain from pool with id = %d\n", id);
+	schedule_work(&pool->work);
+}
+
+unsigned int edgetpu_domain_pool_headroom(struct edgetpu_domain_pool *pool)
+{
+	unsigned int n;
+
+	if (!pool->size)
+		return UINT_MAX;
+	mutex_lock(&pool->lock);
+	n = pool->size - bitmap_weight(pool->in_use, pool->size);
+	mutex_unlock(&pool->lock);
+	return n;
 }
 
 void edgetpu_domain_pool_destroy(struct edgetpu_domain_pool *pool)
@@ -92,11 +236,18 @@ void edgetpu_domain_pool_destroy(struct edgetpu_domain_pool *pool)
 
 	etdev_dbg(pool->etdev, "Destroying domain pool with %u domains\n", pool->size);
 
-	for (i = 0; i < pool->size; i++) {
-		if (pool->array[i])
-			iommu_domain_free(pool->array[i]);
+	cancel_work_sync(&pool->work);
+	if (pool->array) {
+		for (i = 0; i < pool->size; i++) {
+			if (pool->array[i])
+				iommu_domain_free(pool->array[i]);
+		}
 	}
 
-	ida_destroy(&pool->idp);
+	bitmap_free(pool->dirty);
+	bitmap_free(pool->in_use);
 	vfree(pool->array);
+	pool->array = NULL;
+	pool->in_use = NULL;
+	pool->dirty = NULL;
 }
@@ -8,19 +8,32 @@
 #ifndef __EDGETPU_DOMAIN_POOL_H__
 #define __EDGETPU_DOMAIN_POOL_H__
 
-#include <linux/idr.h>
 #include <linux/iommu.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
 
 #include "edgetpu-internal.h"
 
 struct edgetpu_domain_pool {
-	struct ida idp;			/* ID allocator to keep track of used domains. */
 	/*
-	 * Size of the pool. Can be set to 0, in which case the implementation will fall back to
-	 * dynamic domain allocation using the IOMMU API directly.
+	 * Max size of the pool. Can be set to 0, in which case the implementation will fall back
+	 * to dynamic domain allocation using the IOMMU API directly.
 	 */
 	unsigned int size;
-	struct iommu_domain **array;	/* Array holding the pointers to pre-allocated domains. */
+	/*
+	 * Number of free, allocated domains the pool tries to keep ready. Domains are allocated
+	 * lazily beyond this number, up to @size.
+	 */
+	unsigned int watermark;
+	struct mutex lock;		/* protects fields below */
+	/* Array holding the pointers to allocated domains, NULL for a slot not allocated yet. */
+	struct iommu_domain **array;
+	/* Bit set if the slot is handed out or is being scrubbed / allocated by @work. */
+	unsigned long *in_use;
+	/* Bit set if the slot is released and its domain is waiting to be scrubbed. */
+	unsigned long *dirty;
+	/* Worker to scrub released domains and to refill the pool up to @watermark. */
+	struct work_struct work;
 	struct edgetpu_dev *etdev;	/* The edgetpu device used for logging warnings/errors. */
 };
 
@@ -30,22 +43,38 @@ struct edgetpu_domain_pool {
  *
  * @etdev: pointer to edgeptu device.
  * @pool: caller-allocated pool structure.
- * @size: size of the pre-allocated domains pool.
+ * @size: max size of the domains pool.
  * Set to zero to fall back to dynamically allocated domains.
+ * @watermark: number of domains to allocate at init and to keep ready afterwards.
  *
  * returns 0 on success or negative error value.
  */
 int edgetpu_domain_pool_init(struct edgetpu_dev *etdev, struct edgetpu_domain_pool *pool,
-			     unsigned int size);
+			     unsigned int size, unsigned int watermark);
 
 /*
  * Allocates a domain from the pool
+ *
+ * @id is set to the pool slot of the domain, which must be passed to
+ * edgetpu_domain_pool_free(). It's set to -1 if the pool is disabled.
+ *
  * returns NULL on error.
  */
-struct iommu_domain *edgetpu_domain_pool_alloc(struct edgetpu_domain_pool *pool);
+struct iommu_domain *edgetpu_domain_pool_alloc(struct edgetpu_domain_pool *pool, int *id);
+
+/*
+ * Releases a domain from the pool.
+ *
+ * The domain is scrubbed asynchronously before its slot is reused.
+ */
+void edgetpu_domain_pool_free(struct edgetpu_domain_pool *pool, struct iommu_domain *domain,
+			      int id);
 
-/* Releases a domain from the pool. */
-void edgetpu_domain_pool_free(struct edgetpu_domain_pool *pool, struct iommu_domain *domain);
+/*
+ * Returns the number of domains that can still be allocated from the pool,
+ * UINT_MAX if the pool is disabled.
+ */
+unsigned int edgetpu_domain_pool_headroom(struct edgetpu_domain_pool *pool);
 
 /* Cleans up all resources used by the domain pool. */
 void edgetpu_domain_pool_destroy(struct edgetpu_domain_pool *pool);
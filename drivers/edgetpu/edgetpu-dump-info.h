@@ -98,4 +98,19 @@ struct edgetpu_mapping_info_header {
 	struct edgetpu_mapping_info mappings[];
 };
 
+/*
+ * +----------------------+--------------------------------------+------------------------------+
+ * | type FLIGHT_RECORDER | edgetpu_flight_recorder_info_header  | array of edgetpu_fr_event    |
+ * +----------------------+--------------------------------------+------------------------------+
+ *
+ * Events are sorted by timestamp, oldest first. Each event is laid out as
+ *   uint64_t timestamp (ns), uint16_t type, uint16_t cpu, uint32_t arg0, uint64_t arg1
+ * with the event types and arguments defined in the driver's edgetpu-flight-recorder.h.
+ */
+
+struct edgetpu_flight_recorder_info_header {
+	uint32_t n_events;
+	uint32_t event_size; /* sizeof(struct edgetpu_fr_event) */
+};
+
 #endif /* __EDGETPU_DUMP_INFO_H__ */
@@ -0,0 +1,144 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Always-on recorder of recent driver events, for post-mortem analysis.
+ *
+ * Each CPU owns a ring of EDGETPU_FR_NR_EVENTS events. Writers only touch the
+ * ring of the CPU they run on and claim a slot with a local atomic increment,
+ * so recording never takes a lock and is safe against IRQ handlers preempting
+ * a writer on the same CPU.
+ *
+ * Copyright (C) 2022 Google LLC
+ */
+
+#include <asm/local.h>
+#include <linux/mm.h>
+#include <linux/percpu.h>
+#include <linux/sched/clock.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+
+#include "edgetpu-flight-recorder.h"
+#include "edgetpu-internal.h"
+
+struct edgetpu_fr_ring {
+	local_t head;	/* number of events ever recorded on this CPU */
+	struct edgetpu_fr_event events[EDGETPU_FR_NR_EVENTS];
+};
+
+static const char *const edgetpu_fr_event_names[] = {
+	[EDGETPU_FR_KCI_CMD] = "kci_cmd",
+	[EDGETPU_FR_KCI_RESP] = "kci_resp",
+	[EDGETPU_FR_VII_IRQ] = "vii_irq",
+	[EDGETPU_FR_WAKELOCK_ACQUIRE] = "wakelock_acquire",
+	[EDGETPU_FR_WAKELOCK_RELEASE] = "wakelock_release",
+	[EDGETPU_FR_MAP] = "map",
+	[EDGETPU_FR_UNMAP] = "unmap",
+	[EDGETPU_FR_WATCHDOG_BITE] = "watchdog_bite",
+	[EDGETPU_FR_FW_CRASH] = "fw_crash",
+	[EDGETPU_FR_DOORBELL] = "doorbell",
+};
+
+void edgetpu_flight_recorder_init(struct edgetpu_dev *etdev)
+{
+	etdev->flight_recorder = alloc_percpu(struct edgetpu_fr_ring);
+	if (!etdev->flight_recorder)
+		etdev_warn(etdev, "flight recorder disabled: out of memory");
+}
+
+void edgetpu_flight_recorder_exit(struct edgetpu_dev *etdev)
+{
+	free_percpu(etdev->flight_recorder);
+	etdev->flight_recorder = NULL;
+}
+
+void edgetpu_fr_record(struct edgetpu_dev *etdev, enum edgetpu_fr_event_type type, u32 arg0,
+		       u64 arg1)
+{
+	struct edgetpu_fr_ring *ring;
+	struct edgetpu_fr_event *ev;
+	long idx;
+
+	if (!etdev->flight_recorder)
+		return;
+	ring = get_cpu_ptr(etdev->flight_recorder);
+	idx = local_inc_return(&ring->head) - 1;
+	ev = &ring->events[idx & (EDGETPU_FR_NR_EVENTS - 1)];
+	ev->timestamp = local_clock();
+	ev->cpu = smp_processor_id();
+	ev->arg0 = arg0;
+	ev->arg1 = arg1;
+	/* written last so a concurrent snapshot skips slots never filled */
+	WRITE_ONCE(ev->type, type);
+	put_cpu_ptr(etdev->flight_recorder);
+}
+
+size_t edgetpu_flight_recorder_capacity(struct edgetpu_dev *etdev)
+{
+	if (!etdev->flight_recorder)
+		return 0;
+	return (size_t)num_possible_cpus() * EDGETPU_FR_NR_EVENTS;
+}
+
+static int edgetpu_fr_event_cmp(const void *a, const void *b)
+{
+	const struct edgetpu_fr_event *ea = a, *eb = b;
+
+	if (ea->timestamp < eb->timestamp)
+		return -1;
+	return ea->timestamp > eb->timestamp;
+}
+
+size_t edgetpu_flight_recorder_snapshot(struct edgetpu_dev *etdev, struct edgetpu_fr_event *events,
+					size_t max)
+{
+	struct edgetpu_fr_ring *ring;
+	size_t n = 0;
+	int cpu, i;
+
+	if (!etdev->flight_recorder)
+		return 0;
+	for_each_possible_cpu(cpu) {
+		ring = per_cpu_ptr(etdev->flight_recorder, cpu);
+		for (i = 0; i < EDGETPU_FR_NR_EVENTS && n < max; i++) {
+			if (!READ_ONCE(ring->events[i].type))
+				continue;
+			events[n++] = ring->events[i];
+		}
+	}
+	sort(events, n, sizeof(*events), edgetpu_fr_event_cmp, NULL);
+	return n;
+}
+
+void edgetpu_flight_recorder_show(struct edgetpu_dev *etdev, struct seq_file *s)
+{
+	struct edgetpu_fr_event *events, *ev;
+	size_t n, i;
+	u64 ts;
+	u32 rem_ns;
+
+	n = edgetpu_flight_recorder_capacity(etdev);
+	if (!n) {
+		seq_puts(s, "flight recorder disabled\n");
+		return;
+	}
+	events = kvmalloc_array(n, sizeof(*events), GFP_KERNEL);
+	if (!events) {
+		seq_puts(s, "out of memory\n");
+		return;
+	}
+	n = edgetpu_flight_recorder_snapshot(etdev, events, n);
+	for (i = 0; i < n; i++) {
+		ev = &events[i];
+		ts = ev->timestamp;
+		rem_ns = do_div(ts, NSEC_PER_SEC);
+		seq_printf(s, "[%5llu.%06u] cpu%u %s %#x %#llx\n", ts, rem_ns / NSEC_PER_USEC,
+			   ev->cpu,
+			   ev->type < ARRAY_SIZE(edgetpu_fr_event_names) &&
+					   edgetpu_fr_event_names[ev->type] ?
+				   edgetpu_fr_event_names[ev->type] :
+				   "unknown",
+			   ev->arg0, ev->arg1);
+	}
+	kvfree(events);
+}
@@ -0,0 +1,68 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Always-on recorder of recent driver events, for post-mortem analysis.
+ *
+ * Copyright (C) 2022 Google LLC
+ */
+#ifndef __EDGETPU_FLIGHT_RECORDER_H__
+#define __EDGETPU_FLIGHT_RECORDER_H__
+
+#include <linux/seq_file.h>
+#include <linux/types.h>
+
+#include "edgetpu-internal.h"
+
+/* Number of events kept per CPU, must be a power of 2. */
+#define EDGETPU_FR_NR_EVENTS 256
+
+enum edgetpu_fr_event_type {
+	EDGETPU_FR_KCI_CMD = 1,		/* arg0: command code, arg1: seq */
+	EDGETPU_FR_KCI_RESP,		/* arg0: response code, arg1: seq */
+	EDGETPU_FR_VII_IRQ,		/* arg0: mailbox ID of a VII response interrupt */
+	EDGETPU_FR_WAKELOCK_ACQUIRE,	/* arg0: tgid, arg1: previous count */
+	EDGETPU_FR_WAKELOCK_RELEASE,	/* arg0: tgid, arg1: new count */
+	EDGETPU_FR_MAP,			/* arg0: workload ID, arg1: TPU address */
+	EDGETPU_FR_UNMAP,		/* arg0: workload ID, arg1: TPU address */
+	EDGETPU_FR_WATCHDOG_BITE,	/* arg0: whether chip reset is requested */
+	EDGETPU_FR_FW_CRASH,		/* arg0: crash type */
+	EDGETPU_FR_DOORBELL,		/* arg0: mailbox ID, arg1: commands queued */
+};
+
+/* Must be kept in sync with the dump parser, see edgetpu-dump-info.h. */
+struct edgetpu_fr_event {
+	u64 timestamp;	/* local_clock() in ns */
+	u16 type;	/* enum edgetpu_fr_event_type, 0 for an unused slot */
+	u16 cpu;
+	u32 arg0;
+	u64 arg1;
+};
+
+/* Allocates the per-CPU event rings. Failure only disables recording. */
+void edgetpu_flight_recorder_init(struct edgetpu_dev *etdev);
+void edgetpu_flight_recorder_exit(struct edgetpu_dev *etdev);
+
+/*
+ * Records an event on the ring of the current CPU.
+ *
+ * Lock-free and safe to call from any context, including IRQ handlers.
+ */
+void edgetpu_fr_record(struct edgetpu_dev *etdev, enum edgetpu_fr_event_type type, u32 arg0,
+		       u64 arg1);
+
+/*
+ * Copies up to @max recorded events of all CPUs to @events, oldest first.
+ *
+ * This is a best-effort snapshot: events recorded concurrently may be torn or missing.
+ *
+ * Returns the number of events copied.
+ */
+size_t edgetpu_flight_recorder_snapshot(struct edgetpu_dev *etdev, struct edgetpu_fr_event *events,
+					size_t max);
+
+/* Returns the maximum number of events edgetpu_flight_recorder_snapshot() may return. */
+size_t edgetpu_flight_recorder_capacity(struct edgetpu_dev *etdev);
+
+/* Prints recorded events to @s. */
+void edgetpu_flight_recorder_show(struct edgetpu_dev *etdev, struct seq_file *s);
+
+#endif /* __EDGETPU_FLIGHT_RECORDER_H__ */
@@ -25,6 +25,7 @@
 #include <linux/of.h>
 #include <linux/sched.h>
 #include <linux/slab.h>
+#include <linux/string.h>
 #include <linux/types.h>
 #include <linux/uaccess.h>
 #include <linux/uidgid.h>
@@ -34,11 +35,15 @@
 #include "edgetpu-dmabuf.h"
 #include "edgetpu-dram.h"
 #include "edgetpu-firmware.h"
+#include "edgetpu-flight-recorder.h"
 #include "edgetpu-internal.h"
+#include "edgetpu-iremap-pool.h"
 #include "edgetpu-kci.h"
 #include "edgetpu-mapping.h"
 #include "edgetpu-pm.h"
 #include "edgetpu-telemetry.h"
+#include "edgetpu-thermal.h"
+#include "edgetpu-usage-stats.h"
 #include "edgetpu-wakelock.h"
 #include "edgetpu.h"
 
@@ -57,6 +62,15 @@ static atomic_t char_minor = ATOMIC_INIT(-1);
 
 static struct dentry *edgetpu_debugfs_dir;
 
+/*
+ * How long a wakelock request waits for the device to leave thermal suspension
+ * before failing with -EAGAIN. 0 rejects the request immediately.
+ */
+static uint thermal_wakelock_wait_ms;
+module_param(thermal_wakelock_wait_ms, uint, 0660);
+MODULE_PARM_DESC(thermal_wakelock_wait_ms,
+		 "Queue wakelock requests for up to this many ms while thermal suspended");
+
 #define LOCK(client) mutex_lock(&client->group_lock)
 #define UNLOCK(client) mutex_unlock(&client->group_lock)
 /*
@@ -186,6 +200,9 @@ edgetpu_ioctl_set_perdie_eventfd(struct edgetpu_client *client,
 	case EDGETPU_PERDIE_EVENT_TRACES_AVAILABLE:
 		return edgetpu_telemetry_set_event(
 			etdev, EDGETPU_TELEMETRY_TRACE, eventreg.eventfd);
+	case EDGETPU_PERDIE_EVENT_THERMAL_BUDGET:
+		return edgetpu_thermal_set_event(etdev->thermal, client,
+						 eventreg.eventfd);
 	default:
 		return -EINVAL;
 	}
@@ -207,6 +224,9 @@ static int edgetpu_ioctl_unset_perdie_eventfd(struct edgetpu_client *client,
 	case EDGETPU_PERDIE_EVENT_TRACES_AVAILABLE:
 		edgetpu_telemetry_unset_event(etdev, EDGETPU_TELEMETRY_TRACE);
 		break;
+	case EDGETPU_PERDIE_EVENT_THERMAL_BUDGET:
+		edgetpu_thermal_unset_event(etdev->thermal, client);
+		break;
 	default:
 		return -EINVAL;
 	}
@@ -285,13 +305,30 @@ out:
 static int edgetpu_ioctl_create_group(struct edgetpu_client *client,
 				      struct edgetpu_mailbox_attr __user *argp)
 {
-	struct edgetpu_mailbox_attr attr;
+	struct edgetpu_create_group_ext ext = {};
+	struct edgetpu_device_group *group;
+
+	if (copy_from_user(&ext.attr, argp, sizeof(ext.attr)))
+		return -EFAULT;
+
+	group = edgetpu_device_group_alloc(client, &ext);
+	if (IS_ERR(group))
+		return PTR_ERR(group);
+
+	edgetpu_device_group_put(group);
+	return 0;
+}
+
+static int edgetpu_ioctl_create_group_ext(struct edgetpu_client *client,
+					  struct edgetpu_create_group_ext __user *argp)
+{
+	struct edgetpu_create_group_ext ext;
 	struct edgetpu_device_group *group;
 
-	if (copy_from_user(&attr, argp, sizeof(attr)))
+	if (copy_from_user(&ext, argp, sizeof(ext)))
 		return -EFAULT;
 
-	group = edgetpu_device_group_alloc(client, &attr);
+	group = edgetpu_device_group_alloc(client, &ext);
 	if (IS_ERR(group))
 		return PTR_ERR(group);
 
@@ -381,6 +418,34 @@ static int edgetpu_ioctl_sync_buffer(struct edgetpu_client *client,
 	return ret;
 }
 
+static int edgetpu_ioctl_prefetch_buffers(struct edgetpu_client *client,
+					  struct edgetpu_prefetch_ioctl __user *argp)
+{
+	struct edgetpu_device_group *group;
+	struct edgetpu_prefetch_ioctl ibuf;
+	struct edgetpu_prefetch_range *ranges;
+	int ret;
+
+	if (copy_from_user(&ibuf, argp, sizeof(ibuf)))
+		return -EFAULT;
+	if (!ibuf.num_ranges || ibuf.num_ranges > EDGETPU_PREFETCH_MAX_RANGES)
+		return -EINVAL;
+	ranges = memdup_user(u64_to_user_ptr(ibuf.ranges), ibuf.num_ranges * sizeof(*ranges));
+	if (IS_ERR(ranges))
+		return PTR_ERR(ranges);
+	LOCK(client);
+	group = client->group;
+	if (!group) {
+		ret = -EINVAL;
+		goto out_unlock;
+	}
+	ret = edgetpu_device_group_prefetch(group, ranges, ibuf.num_ranges);
+out_unlock:
+	UNLOCK(client);
+	kfree(ranges);
+	return ret;
+}
+
 static int
 edgetpu_ioctl_map_dmabuf(struct edgetpu_client *client,
 			 struct edgetpu_map_dmabuf_ioctl __user *argp)
@@ -570,6 +635,7 @@ static int edgetpu_ioctl_release_wakelock(struct edgetpu_client *client)
 	}
 	edgetpu_wakelock_unlock(client->wakelock);
 	UNLOCK(client);
+	edgetpu_fr_record(client->etdev, EDGETPU_FR_WAKELOCK_RELEASE, client->tgid, count);
 	etdev_dbg(client->etdev, "%s: wakelock req count = %u", __func__,
 		  count);
 	return 0;
@@ -577,10 +643,28 @@ static int edgetpu_ioctl_release_wakelock(struct edgetpu_client *client)
 
 static int edgetpu_ioctl_acquire_wakelock(struct edgetpu_client *client)
 {
+	struct edgetpu_device_group *waiting_group;
 	int count;
 	int ret;
 	struct edgetpu_thermal *thermal = client->etdev->thermal;
+	uint wait_ms = READ_ONCE(thermal_wakelock_wait_ms);
 
+	ret = edgetpu_usage_quota_check(client->etdev, from_kuid(&init_user_ns, current_uid()));
+	if (ret)
+		return ret;
+
+	/*
+	 * Queue the request until the thermal budget allows running again, without holding the
+	 * client lock so other requests of this client aren't blocked meanwhile.
+	 */
+	if (wait_ms && edgetpu_thermal_is_suspended(thermal)) {
+		ret = edgetpu_thermal_wait_resumed(thermal, wait_ms);
+		if (ret == -ERESTARTSYS)
+			return ret;
+	}
+
+retry:
+	waiting_group = NULL;
 	LOCK(client);
 	/*
 	 * Update client PID; the client may have been passed from the
@@ -619,8 +703,12 @@ static int edgetpu_ioctl_acquire_wakelock(struct edgetpu_client *client)
 		if (client->group)
 			ret = edgetpu_group_attach_and_open_mailbox(client->group);
 		if (ret) {
-			etdev_warn(client->etdev,
-				   "failed to attach mailbox: %d", ret);
+			/* queued for a VII mailbox, wait with no lock held */
+			if (ret == -EAGAIN)
+				waiting_group = edgetpu_device_group_get(client->group);
+			else
+				etdev_warn(client->etdev,
+					   "failed to attach mailbox: %d", ret);
 			edgetpu_pm_put(client->etdev->pm);
 			edgetpu_wakelock_release(client->wakelock);
 			edgetpu_wakelock_unlock(client->wakelock);
@@ -632,11 +720,18 @@ static int edgetpu_ioctl_acquire_wakelock(struct edgetpu_client *client)
 	}
 	edgetpu_wakelock_unlock(client->wakelock);
 	UNLOCK(client);
+	edgetpu_fr_record(client->etdev, EDGETPU_FR_WAKELOCK_ACQUIRE, client->tgid, count);
 	etdev_dbg(client->etdev, "%s: wakelock req count = %u", __func__,
 		  count + 1);
 	return 0;
 error_unlock:
 	UNLOCK(client);
+	if (waiting_group) {
+		ret = edgetpu_group_admission_wait(waiting_group);
+		edgetpu_device_group_put(waiting_group);
+		if (!ret)
+			goto retry;
+	}
 	etdev_err(client->etdev, "client pid %d failed to acquire wakelock",
 		  client->pid);
 	return ret;
@@ -699,6 +794,84 @@ static int edgetpu_ioctl_get_fatal_errors(struct edgetpu_client *client,
 	return ret;
 }
 
+static int edgetpu_ioctl_enable_vii_reset_ack(struct edgetpu_client *client)
+{
+	struct edgetpu_device_group *group;
+
+	LOCK_RETURN_IF_NOT_LEADER(client, group);
+	edgetpu_group_enable_vii_reset_ack(group);
+	UNLOCK(client);
+	return 0;
+}
+
+static int edgetpu_ioctl_ack_vii_reset(struct edgetpu_client *client)
+{
+	int ret;
+
+	LOCK(client);
+	if (!client->group) {
+		ret = -EINVAL;
+		goto out_unlock;
+	}
+	if (!edgetpu_wakelock_lock(client->wakelock)) {
+		edgetpu_wakelock_unlock(client->wakelock);
+		ret = -EAGAIN;
+		goto out_unlock;
+	}
+	ret = edgetpu_group_ack_vii_reset(client->group);
+	edgetpu_wakelock_unlock(client->wakelock);
+out_unlock:
+	UNLOCK(client);
+	return ret;
+}
+
+static int edgetpu_ioctl_submit_commands(struct edgetpu_client *client,
+					 struct edgetpu_submit_cmds_ioctl __user *argp)
+{
+	struct edgetpu_submit_cmds_ioctl ibuf;
+	int ret;
+
+	if (copy_from_user(&ibuf, argp, sizeof(ibuf)))
+		return -EFAULT;
+	ret = edgetpu_usage_quota_check(client->etdev, from_kuid(&init_user_ns, current_uid()));
+	if (ret)
+		return ret;
+
+	LOCK(client);
+	if (!client->group) {
+		ret = -EINVAL;
+		goto out_unlock;
+	}
+	if (!edgetpu_wakelock_lock(client->wakelock)) {
+		edgetpu_wakelock_unlock(client->wakelock);
+		ret = -EAGAIN;
+		goto out_unlock;
+	}
+	ret = edgetpu_device_group_submit_cmds(client->group, &ibuf);
+	edgetpu_wakelock_unlock(client->wakelock);
+	if (ret)
+		goto out_unlock;
+	if (copy_to_user(&argp->submitted, &ibuf.submitted, sizeof(ibuf.submitted)))
+		ret = -EFAULT;
+out_unlock:
+	UNLOCK(client);
+	return ret;
+}
+
+static int edgetpu_ioctl_get_thermal_budget(struct edgetpu_client *client,
+					    struct edgetpu_thermal_budget __user *argp)
+{
+	struct edgetpu_thermal_budget budget;
+	int ret;
+
+	ret = edgetpu_thermal_get_budget(client->etdev->thermal, &budget);
+	if (ret)
+		return ret;
+	if (copy_to_user(argp, &budget, sizeof(budget)))
+		return -EFAULT;
+	return 0;
+}
+
 #ifdef EDGETPU_FEATURE_INTEROP
 static int edgetpu_ioctl_test_external(struct edgetpu_client *client,
 				       struct edgetpu_test_ext_ioctl __user *argp)
@@ -824,6 +997,24 @@ long edgetpu_ioctl(struct file *file, uint cmd, ulong arg)
 	case EDGETPU_GET_FATAL_ERRORS:
 		ret = edgetpu_ioctl_get_fatal_errors(client, argp);
 		break;
+	case EDGETPU_SUBMIT_COMMANDS:
+		ret = edgetpu_ioctl_submit_commands(client, argp);
+		break;
+	case EDGETPU_GET_THERMAL_BUDGET:
+		ret = edgetpu_ioctl_get_thermal_budget(client, argp);
+		break;
+	case EDGETPU_PREFETCH_BUFFERS:
+		ret = edgetpu_ioctl_prefetch_buffers(client, argp);
+		break;
+	case EDGETPU_ACK_VII_RESET:
+		ret = edgetpu_ioctl_ack_vii_reset(client);
+		break;
+	case EDGETPU_ENABLE_VII_RESET_ACK:
+		ret = edgetpu_ioctl_enable_vii_reset_ack(client);
+		break;
+	case EDGETPU_CREATE_GROUP_EXT:
+		ret = edgetpu_ioctl_create_group_ext(client, argp);
+		break;
 #ifdef EDGETPU_FEATURE_INTEROP
 	case EDGETPU_TEST_EXTERNAL:
 		ret = edgetpu_ioctl_test_external(client, argp);
@@ -1023,6 +1214,90 @@ static const struct file_operations mappings_ops = {
 	.release = single_release,
 };
 
+static int iremap_pool_show(struct seq_file *s, void *data)
+{
+	struct edgetpu_dev *etdev = s->private;
+
+	edgetpu_iremap_pool_show(etdev, s);
+	return 0;
+}
+
+static int iremap_pool_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, iremap_pool_show, inode->i_private);
+}
+
+static const struct file_operations iremap_pool_ops = {
+	.open = iremap_pool_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.owner = THIS_MODULE,
+	.release = single_release,
+};
+
+static int flight_recorder_show(struct seq_file *s, void *data)
+{
+	struct edgetpu_dev *etdev = s->private;
+
+	edgetpu_flight_recorder_show(etdev, s);
+	return 0;
+}
+
+static int flight_recorder_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, flight_recorder_show, inode->i_private);
+}
+
+static const struct file_operations flight_recorder_ops = {
+	.open = flight_recorder_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.owner = THIS_MODULE,
+	.release = single_release,
+};
+
+static int mailbox_evictions_show(struct seq_file *s, void *data)
+{
+	struct edgetpu_dev *etdev = s->private;
+
+	edgetpu_group_mailbox_evict_show(etdev, s);
+	return 0;
+}
+
+static int mailbox_evictions_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, mailbox_evictions_show, inode->i_private);
+}
+
+static const struct file_operations mailbox_evictions_ops = {
+	.open = mailbox_evictions_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.owner = THIS_MODULE,
+	.release = single_release,
+};
+
+static int group_pool_show(struct seq_file *s, void *data)
+{
+	struct edgetpu_dev *etdev = s->private;
+
+	edgetpu_group_pool_show(etdev, s);
+	return 0;
+}
+
+static int group_pool_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, group_pool_show, inode->i_private);
+}
+
+static const struct file_operations group_pool_ops = {
+	.open = group_pool_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.owner = THIS_MODULE,
+	.release = single_release,
+};
+
 static void edgetpu_fs_setup_debugfs(struct edgetpu_dev *etdev)
 {
 	etdev->d_entry =
@@ -1033,6 +1308,14 @@ static void edgetpu_fs_setup_debugfs(struct edgetpu_dev *etdev)
 	}
 	debugfs_create_file("mappings", 0440, etdev->d_entry,
 			    etdev, &mappings_ops);
+	debugfs_create_file("iremap_pool", 0440, etdev->d_entry,
+			    etdev, &iremap_pool_ops);
+	debugfs_create_file("flight_recorder", 0440, etdev->d_entry,
+			    etdev, &flight_recorder_ops);
+	debugfs_create_file("mailbox_evictions", 0440, etdev->d_entry,
+			    etdev, &mailbox_evictions_ops);
+	debugfs_create_file("group_pool", 0440, etdev->d_entry,
+			    etdev, &group_pool_ops);
 #ifndef EDGETPU_FEATURE_MOBILE
 	debugfs_create_file("statusregs", 0440, etdev->d_entry, etdev,
 			    &statusregs_ops);
@@ -1147,10 +1430,11 @@ static ssize_t show_group(struct edgetpu_dev *etdev,
 		ret += len;
 	}
 
-	len = scnprintf(buf, buflen - ret, "mappings %zd %zdB\n",
+	len = scnprintf(buf, buflen - ret, "mappings %zd %zdB pinned %luB\n",
 			group->host_mappings.count +
 			group->dmabuf_mappings.count,
-			edgetpu_group_mappings_total_size(group));
+			edgetpu_group_mappings_total_size(group),
+			atomic_long_read(&group->pinned_pages) << PAGE_SHIFT);
 	buf += len;
 	ret += len;
 	return ret;
@@ -1176,11 +1460,21 @@ static ssize_t groups_show(
 }
 static DEVICE_ATTR_RO(groups);
 
+static ssize_t pinned_bytes_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct edgetpu_dev *etdev = dev_get_drvdata(dev);
+
+	return scnprintf(buf, PAGE_SIZE, "%lu\n",
+			 atomic_long_read(&etdev->pinned_pages) << PAGE_SHIFT);
+}
+static DEVICE_ATTR_RO(pinned_bytes);
+
 static struct attribute *edgetpu_dev_attrs[] = {
 	&dev_attr_firmware_crash_count.attr,
 	&dev_attr_watchdog_timeout_count.attr,
 	&dev_attr_clients.attr,
 	&dev_attr_groups.attr,
+	&dev_attr_pinned_bytes.attr,
 	NULL,
 };
 
@@ -14,6 +14,7 @@
 #include <linux/types.h>
 
 #include "edgetpu-config.h"
+#include "edgetpu-device-group.h"
 #include "edgetpu-domain-pool.h"
 #include "edgetpu-internal.h"
 #include "edgetpu-mapping.h"
@@ -23,6 +24,10 @@
 #define EDGETPU_NUM_PREALLOCATED_DOMAINS 0
 #endif
 
+#if !defined(EDGETPU_DOMAIN_POOL_WATERMARK)
+#define EDGETPU_DOMAIN_POOL_WATERMARK EDGETPU_NUM_PREALLOCATED_DOMAINS
+#endif
+
 struct edgetpu_iommu {
 	struct iommu_group *iommu_group;
 	/*
@@ -30,9 +35,11 @@ struct edgetpu_iommu {
 	 * NULL for a slot that doesn't have an attached domain.
 	 */
 	struct iommu_domain *domains[EDGETPU_NCONTEXTS];
+	/* Pool slot of domains[0] if it's not the default domain. */
+	int domain0_pool_id;
 	/*
 	 * Records IDs for all domains currently allocated, to support IOMMU (un)mapping
-	 * when the domain is not attached.
+	 * when the domain is not attached. Maps the ID to the edgetpu_iommu_domain.
 	 */
 	struct idr domain_id_pool;
 	struct mutex pool_lock;		/* protects access of @domain_id_pool */
@@ -66,10 +73,13 @@ static uint context_id_to_pasid(enum edgetpu_context_id context_id)
 static struct iommu_domain *get_domain_by_token(struct edgetpu_iommu *etiommu,
 						int token)
 {
-	struct iommu_domain *domain;
+	struct edgetpu_iommu_domain *etdomain;
+	struct iommu_domain *domain = NULL;
 
 	mutex_lock(&etiommu->pool_lock);
-	domain = idr_find(&etiommu->domain_id_pool, token);
+	etdomain = idr_find(&etiommu->domain_id_pool, token);
+	if (etdomain)
+		domain = etdomain->iommu_domain;
 	mutex_unlock(&etiommu->pool_lock);
 	return domain;
 }
@@ -105,6 +115,7 @@ static int edgetpu_iommu_dev_fault_handler(struct iommu_fault *fault,
 					   void *token)
 {
 	struct edgetpu_dev *etdev = (struct edgetpu_dev *)token;
+	struct edgetpu_device_group *group;
 
 	if (fault->type == IOMMU_FAULT_DMA_UNRECOV) {
 		etdev_warn(etdev, "Unrecoverable IOMMU fault!\n");
@@ -114,6 +125,13 @@ static int edgetpu_iommu_dev_fault_handler(struct iommu_fault *fault,
 		etdev_warn(etdev, "perms = %08X\n", fault->event.perm);
 		etdev_warn(etdev, "addr = %llX\n", fault->event.addr);
 		etdev_warn(etdev, "fetch_addr = %llX\n", fault->event.fetch_addr);
+		/* the PASID of a VII context is its mailbox ID */
+		group = edgetpu_device_group_get_by_mailbox(etdev, fault->event.pasid);
+		if (group) {
+			etdev_warn(etdev, "VCID = %u workload_id = %u\n", group->vcid,
+				   group->workload_id);
+			edgetpu_device_group_put(group);
+		}
 	} else if (fault->type == IOMMU_FAULT_PAGE_REQ) {
 		etdev_dbg(etdev, "IOMMU page request fault!\n");
 		etdev_dbg(etdev, "flags = %08X\n", fault->prm.flags);
@@ -142,10 +160,11 @@ static int edgetpu_unregister_iommu_device_fault_handler(struct edgetpu_dev *etd
 /* A callback for idr_for_each to release the domains */
 static int edgetpu_idr_free_domain_callback(int id, void *p, void *data)
 {
-	struct iommu_domain *domain = p;
+	struct edgetpu_iommu_domain *etdomain = p;
 	struct edgetpu_iommu *etiommu = data;
 
-	edgetpu_domain_pool_free(&etiommu->domain_pool, domain);
+	edgetpu_domain_pool_free(&etiommu->domain_pool, etdomain->iommu_domain,
+				 etdomain->pool_id);
 	return 0;
 }
 
@@ -164,11 +183,12 @@ static int edgetpu_iommu_fault_handler(struct iommu_domain *domain,
 
 static void edgetpu_init_etdomain(struct edgetpu_iommu_domain *etdomain,
 				  struct iommu_domain *domain,
-				  int token)
+				  int token, int pool_id)
 {
 	etdomain->iommu_domain = domain;
 	etdomain->pasid = IOMMU_PASID_INVALID;
 	etdomain->token = token;
+	etdomain->pool_id = pool_id;
 	iommu_set_fault_handler(domain, edgetpu_iommu_fault_handler, etdomain);
 }
 
@@ -194,7 +214,7 @@ static int check_default_domain(struct edgetpu_dev *etdev,
 	if (!etiommu->aux_enabled)
 		return -EINVAL;
 
-	domain = edgetpu_domain_pool_alloc(&etiommu->domain_pool);
+	domain = edgetpu_domain_pool_alloc(&etiommu->domain_pool, &etiommu->domain0_pool_id);
 	if (!domain) {
 		etdev_warn(etdev, "iommu domain alloc failed");
 		return -EINVAL;
@@ -202,7 +222,7 @@ static int check_default_domain(struct edgetpu_dev *etdev,
 	ret = iommu_aux_attach_device(domain, etdev->dev);
 	if (ret) {
 		etdev_warn(etdev, "Attach IOMMU aux failed: %d", ret);
-		edgetpu_domain_pool_free(&etiommu->domain_pool, domain);
+		edgetpu_domain_pool_free(&etiommu->domain_pool, domain, etiommu->domain0_pool_id);
 		return ret;
 	}
 	pasid = iommu_aux_get_pasid(domain, etdev->dev);
@@ -211,7 +231,7 @@ static int check_default_domain(struct edgetpu_dev *etdev,
 		etdev_warn(etdev, "Invalid PASID %d returned from iommu\n",
 			   pasid);
 		iommu_aux_detach_device(domain, etdev->dev);
-		edgetpu_domain_pool_free(&etiommu->domain_pool, domain);
+		edgetpu_domain_pool_free(&etiommu->domain_pool, domain, etiommu->domain0_pool_id);
 		return -EINVAL;
 	}
 out:
@@ -229,7 +249,8 @@ int edgetpu_mmu_attach(struct edgetpu_dev *etdev, void *mmu_info)
 	if (!etiommu)
 		return -ENOMEM;
 	ret = edgetpu_domain_pool_init(etdev, &etiommu->domain_pool,
-				       EDGETPU_NUM_PREALLOCATED_DOMAINS);
+				       EDGETPU_NUM_PREALLOCATED_DOMAINS,
+				       EDGETPU_DOMAIN_POOL_WATERMARK);
 	idr_init(&etiommu->domain_id_pool);
 	mutex_init(&etiommu->pool_lock);
 	etiommu->iommu_group = iommu_group_get(etdev->dev);
@@ -293,7 +314,8 @@ void edgetpu_mmu_detach(struct edgetpu_dev *etdev)
 
 	/* free the domain if the context 0 domain is not default */
 	if (!etiommu->context_0_default && etiommu->domains[0])
-		edgetpu_domain_pool_free(&etiommu->domain_pool, etiommu->domains[0]);
+		edgetpu_domain_pool_free(&etiommu->domain_pool, etiommu->domains[0],
+					 etiommu->domain0_pool_id);
 
 	idr_for_each(&etiommu->domain_id_pool, edgetpu_idr_free_domain_callback,
 		     etiommu);
@@ -616,6 +638,7 @@ void edgetpu_mmu_use_dev_dram(struct edgetpu_dev *etdev, bool use_dev_dram)
 static struct edgetpu_iommu_domain invalid_etdomain = {
 	.pasid = IOMMU_PASID_INVALID,
 	.token = EDGETPU_DOMAIN_TOKEN_END,
+	.pool_id = -1,
 };
 
 struct edgetpu_iommu_domain *edgetpu_mmu_alloc_domain(struct edgetpu_dev *etdev)
@@ -624,10 +647,11 @@ struct edgetpu_iommu_domain *edgetpu_mmu_alloc_domain(struct edgetpu_dev *etdev)
 	struct edgetpu_iommu *etiommu = etdev->mmu_cookie;
 	struct iommu_domain *domain;
 	int token;
+	int pool_id;
 
 	if (!etiommu->aux_enabled)
 		return &invalid_etdomain;
-	domain = edgetpu_domain_pool_alloc(&etiommu->domain_pool);
+	domain = edgetpu_domain_pool_alloc(&etiommu->domain_pool, &pool_id);
 	if (!domain) {
 		etdev_warn(etdev, "iommu domain allocation failed");
 		return NULL;
@@ -635,25 +659,36 @@ struct edgetpu_iommu_domain *edgetpu_mmu_alloc_domain(struct edgetpu_dev *etdev)
 
 	etdomain = kzalloc(sizeof(*etdomain), GFP_KERNEL);
 	if (!etdomain) {
-		edgetpu_domain_pool_free(&etiommu->domain_pool, domain);
+		edgetpu_domain_pool_free(&etiommu->domain_pool, domain, pool_id);
 		return NULL;
 	}
 
+	edgetpu_init_etdomain(etdomain, domain, EDGETPU_DOMAIN_TOKEN_END, pool_id);
 	mutex_lock(&etiommu->pool_lock);
-	token = idr_alloc(&etiommu->domain_id_pool, domain, 0,
+	token = idr_alloc(&etiommu->domain_id_pool, etdomain, 0,
 			  EDGETPU_DOMAIN_TOKEN_END, GFP_KERNEL);
+	if (token >= 0)
+		etdomain->token = token;
 	mutex_unlock(&etiommu->pool_lock);
 	if (token < 0) {
 		etdev_warn(etdev, "alloc iommu domain token failed: %d", token);
 		kfree(etdomain);
-		edgetpu_domain_pool_free(&etiommu->domain_pool, domain);
+		edgetpu_domain_pool_free(&etiommu->domain_pool, domain, pool_id);
 		return NULL;
 	}
 
-	edgetpu_init_etdomain(etdomain, domain, token);
 	return etdomain;
 }
 
+unsigned int edgetpu_mmu_domain_headroom(struct edgetpu_dev *etdev)
+{
+	struct edgetpu_iommu *etiommu = etdev->mmu_cookie;
+
+	if (!etiommu->aux_enabled)
+		return UINT_MAX;
+	return edgetpu_domain_pool_headroom(&etiommu->domain_pool);
+}
+
 void edgetpu_mmu_free_domain(struct edgetpu_dev *etdev,
 			     struct edgetpu_iommu_domain *etdomain)
 {
@@ -668,7 +703,8 @@ void edgetpu_mmu_free_domain(struct edgetpu_dev *etdev,
 	mutex_lock(&etiommu->pool_lock);
 	idr_remove(&etiommu->domain_id_pool, etdomain->token);
 	mutex_unlock(&etiommu->pool_lock);
-	edgetpu_domain_pool_free(&etiommu->domain_pool, etdomain->iommu_domain);
+	edgetpu_domain_pool_free(&etiommu->domain_pool, etdomain->iommu_domain,
+				 etdomain->pool_id);
 	kfree(etdomain);
 }
 
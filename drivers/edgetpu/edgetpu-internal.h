@@ -31,6 +31,7 @@
 #include <linux/workqueue.h>
 
 #include "edgetpu.h"
+#include "edgetpu-config.h"
 #include "edgetpu-pm.h"
 #include "edgetpu-thermal.h"
 #include "edgetpu-usage-stats.h"
@@ -85,12 +86,13 @@ struct edgetpu_coherent_mem {
 };
 
 struct edgetpu_device_group;
+struct edgetpu_group_pool;
 struct edgetpu_p2p_csr_map;
 struct edgetpu_remote_dram_map;
 struct edgetpu_wakelock;
 struct edgetpu_dev_iface;
 
-#define EDGETPU_NUM_PERDIE_EVENTS	2
+#define EDGETPU_NUM_PERDIE_EVENTS	3
 #define perdie_event_id_to_num(event_id)				      \
 	(event_id - EDGETPU_PERDIE_EVENT_LOGS_AVAILABLE)
 
@@ -150,6 +152,7 @@ struct edgetpu_kci;
 struct edgetpu_kci_response_element;
 struct edgetpu_telemetry_ctx;
 struct edgetpu_mempool;
+struct edgetpu_sim;
 
 typedef int(*edgetpu_debug_dump_handlers)(void *etdev, void *dump_setup);
 
@@ -193,9 +196,21 @@ struct edgetpu_dev {
 	uint n_groups;		   /* number of entries in @groups */
 	bool group_join_lockout;   /* disable group join while reinit */
 	u32 vcid_pool;		   /* bitmask of VCID to be allocated */
+	/*
+	 * Groups indexed by VCID, readable under RCU without holding @groups_lock.
+	 * See edgetpu_device_group_get_by_vcid().
+	 */
+	struct edgetpu_device_group __rcu *vcid_groups[EDGETPU_NUM_VCIDS];
 
 	/* end of fields protected by @groups_lock */
 
+	/*
+	 * Groups indexed by the ID of the VII mailbox they are attached to, readable under RCU.
+	 * Updated by the owner of the mailbox, see edgetpu_device_group_get_by_mailbox().
+	 */
+	struct edgetpu_device_group __rcu *mailbox_groups[EDGETPU_NUM_MAILBOXES];
+	struct edgetpu_group_pool *group_pool;	/* preallocated groups, may be NULL */
+
 	struct mutex clients_lock; /* protects clients */
 	struct list_head clients;
 	void *mmu_cookie;	   /* mmu driver private data */
@@ -212,11 +227,12 @@ struct edgetpu_dev {
 	int mcp_id;		/* multichip pkg id, or -1 for none */
 	uint mcp_die_index;	/* physical die index w/in multichip pkg */
 	u8 mcp_pkg_type;	/* multichip pkg type */
-	struct edgetpu_sw_wdt *etdev_sw_wdt;	/* software watchdog */
+	struct edgetpu_sw_wdt __rcu *etdev_sw_wdt;	/* software watchdog */
 	bool reset_needed;	/* error recovery requests full chip reset. */
 	/* version read from the firmware binary file */
 	struct edgetpu_fw_version fw_version;
 	atomic_t job_count;	/* times joined to a device group */
+	atomic_long_t pinned_pages;	/* host pages pinned by the mappings of all groups */
 
 	/* counts of error events */
 	uint firmware_crash_count;
@@ -227,6 +243,13 @@ struct edgetpu_dev {
 	edgetpu_debug_dump_handlers *debug_dump_handlers;
 	struct work_struct debug_dump_work;
 
+	/* per-CPU rings of recent driver events, see edgetpu-flight-recorder.h */
+	struct edgetpu_fr_ring __percpu *flight_recorder;
+#if IS_ENABLED(CONFIG_EDGETPU_SIM)
+	/* simulated firmware, NULL unless this is a simulated device */
+	struct edgetpu_sim *sim;
+#endif
+
 	struct mutex freq_lock;	/* protects below freq_* variables */
 	uint32_t *freq_table;	/* Array to record reported frequencies by f/w */
 	uint32_t freq_count;	/* Number of entries in freq_table */
@@ -354,6 +377,17 @@ void edgetpu_free_coherent(struct edgetpu_dev *etdev,
 			   struct edgetpu_coherent_mem *mem,
 			   enum edgetpu_context_id context_id);
 
+/*
+ * Maps / unmaps memory allocated by edgetpu_alloc_coherent() to / from the TPU
+ * address space of @context_id, for moving it between contexts.
+ */
+int edgetpu_coherent_mem_tpu_map(struct edgetpu_dev *etdev, struct edgetpu_coherent_mem *mem,
+				 enum edgetpu_context_id context_id);
+void edgetpu_coherent_mem_tpu_unmap(struct edgetpu_dev *etdev, struct edgetpu_coherent_mem *mem,
+				    enum edgetpu_context_id context_id);
+/* Frees memory allocated by edgetpu_alloc_coherent() and already unmapped from the TPU. */
+void edgetpu_free_coherent_unmapped(struct edgetpu_dev *etdev, struct edgetpu_coherent_mem *mem);
+
 /* Checks if @file belongs to edgetpu driver */
 bool is_edgetpu_file(struct file *file);
 
@@ -6,16 +6,62 @@
  * Copyright (C) 2020 Google, Inc.
  */
 
+#include <linux/bitmap.h>
 #include <linux/dma-mapping.h>
 #include <linux/genalloc.h>
 #include <linux/kernel.h>
+#include <linux/list.h>
 #include <linux/mm.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
 
 #include "edgetpu-internal.h"
 #include "edgetpu-iremap-pool.h"
 #include "edgetpu-mmu.h"
 
+/*
+ * Small KCI-private allocations (command payloads, firmware info buffers) are
+ * served from size classes carved out of granule-sized slabs instead of
+ * rounding every request up to a full granule of the gen_pool.
+ *
+ * Object sizes of the classes are EDGETPU_IREMAP_MIN_OBJ_SIZE << i, only the
+ * classes with object size no larger than half a granule are enabled.
+ */
+#define EDGETPU_IREMAP_MIN_OBJ_SIZE	64
+#define EDGETPU_IREMAP_NR_CLASSES	6
+/* Number of free objects cached per CPU per class. */
+#define EDGETPU_IREMAP_MAG_SIZE		8
+
+/* A granule taken from the gen_pool and split into objects of one class. */
+struct edgetpu_iremap_slab {
+	struct list_head list;
+	unsigned long addr;
+	struct edgetpu_iremap_class *cls;
+	uint nr_free;
+	unsigned long free_map[];	/* bit set if the object is free */
+};
+
+struct edgetpu_iremap_class {
+	spinlock_t lock;		/* protects fields below */
+	size_t obj_size;
+	uint objs_per_slab;
+	struct list_head partial;	/* slabs with at least one free object */
+	struct list_head full;		/* slabs with no free objects */
+	uint nr_slabs;
+	uint nr_inuse;			/* objects handed out, incl. cached ones */
+	/* statistics, updated without the lock */
+	atomic64_t nr_allocs;
+	atomic64_t nr_mag_hits;
+};
+
+/* Per-CPU cache of free objects, accessed with preemption disabled. */
+struct edgetpu_iremap_magazine {
+	uint count[EDGETPU_IREMAP_NR_CLASSES];
+	unsigned long objs[EDGETPU_IREMAP_NR_CLASSES][EDGETPU_IREMAP_MAG_SIZE];
+};
+
 struct edgetpu_mempool {
 	struct gen_pool *gen_pool;
 	void *base_vaddr;
@@ -23,8 +69,183 @@ struct edgetpu_mempool {
 	tpu_addr_t base_tpu_addr;
 	phys_addr_t base_phys_addr;
 	size_t granule;
+	size_t size;
+	/* number of enabled size classes */
+	uint nr_classes;
+	struct edgetpu_iremap_class classes[EDGETPU_IREMAP_NR_CLASSES];
+	struct edgetpu_iremap_magazine __percpu *mags;
+	/* slab owning each granule of the pool, NULL if not a slab */
+	struct edgetpu_iremap_slab **slabs;
+	/* statistics of granule-sized allocations */
+	atomic64_t nr_large_allocs;
+	atomic_t nr_large_inuse;
 };
 
+static void edgetpu_iremap_classes_init(struct edgetpu_mempool *pool)
+{
+	uint i;
+
+	pool->nr_classes = 0;
+	for (i = 0; i < EDGETPU_IREMAP_NR_CLASSES; i++) {
+		struct edgetpu_iremap_class *cls = &pool->classes[i];
+
+		cls->obj_size = EDGETPU_IREMAP_MIN_OBJ_SIZE << i;
+		if (cls->obj_size > pool->granule / 2)
+			break;
+		cls->objs_per_slab = pool->granule / cls->obj_size;
+		spin_lock_init(&cls->lock);
+		INIT_LIST_HEAD(&cls->partial);
+		INIT_LIST_HEAD(&cls->full);
+		cls->nr_slabs = 0;
+		cls->nr_inuse = 0;
+		atomic64_set(&cls->nr_allocs, 0);
+		atomic64_set(&cls->nr_mag_hits, 0);
+		pool->nr_classes++;
+	}
+}
+
+/* Returns the index of the class that serves @size, or -1 if none. */
+static int edgetpu_iremap_size_to_class(struct edgetpu_mempool *pool, size_t size)
+{
+	uint i;
+
+	for (i = 0; i < pool->nr_classes; i++)
+		if (size <= pool->classes[i].obj_size)
+			return i;
+	return -1;
+}
+
+static inline struct edgetpu_iremap_slab **
+edgetpu_iremap_slab_slot(struct edgetpu_mempool *pool, unsigned long addr)
+{
+	return &pool->slabs[(addr - (unsigned long)pool->base_vaddr) / pool->granule];
+}
+
+/* Takes one object from @slab, caller holds @slab->cls->lock. */
+static unsigned long edgetpu_iremap_slab_take(struct edgetpu_iremap_slab *slab)
+{
+	struct edgetpu_iremap_class *cls = slab->cls;
+	unsigned long bit = find_first_bit(slab->free_map, cls->objs_per_slab);
+
+	clear_bit(bit, slab->free_map);
+	if (--slab->nr_free == 0)
+		list_move(&slab->list, &cls->full);
+	cls->nr_inuse++;
+	return slab->addr + bit * cls->obj_size;
+}
+
+/*
+ * Returns @addr to its slab, releasing the slab back to the gen_pool once all
+ * of its objects are free. Caller holds the class lock.
+ */
+static void edgetpu_iremap_slab_put(struct edgetpu_mempool *pool,
+				    struct edgetpu_iremap_class *cls, unsigned long addr)
+{
+	struct edgetpu_iremap_slab **slot = edgetpu_iremap_slab_slot(pool, addr);
+	struct edgetpu_iremap_slab *slab = *slot;
+
+	set_bit((addr - slab->addr) / cls->obj_size, slab->free_map);
+	if (slab->nr_free++ == 0)
+		list_move(&slab->list, &cls->partial);
+	cls->nr_inuse--;
+	if (slab->nr_free < cls->objs_per_slab)
+		return;
+	list_del(&slab->list);
+	cls->nr_slabs--;
+	*slot = NULL;
+	gen_pool_free(pool->gen_pool, slab->addr, pool->granule);
+	kfree(slab);
+}
+
+static unsigned long edgetpu_iremap_small_alloc(struct edgetpu_mempool *pool, int idx)
+{
+	struct edgetpu_iremap_class *cls = &pool->classes[idx];
+	struct edgetpu_iremap_magazine *mag;
+	struct edgetpu_iremap_slab *slab;
+	unsigned long addr = 0;
+
+	atomic64_inc(&cls->nr_allocs);
+	mag = get_cpu_ptr(pool->mags);
+	if (mag->count[idx])
+		addr = mag->objs[idx][--mag->count[idx]];
+	put_cpu_ptr(pool->mags);
+	if (addr) {
+		atomic64_inc(&cls->nr_mag_hits);
+		return addr;
+	}
+
+	spin_lock(&cls->lock);
+	slab = list_first_entry_or_null(&cls->partial, struct edgetpu_iremap_slab, list);
+	if (slab) {
+		addr = edgetpu_iremap_slab_take(slab);
+		spin_unlock(&cls->lock);
+		return addr;
+	}
+	spin_unlock(&cls->lock);
+
+	/* No partial slab, carve a new one out of the gen_pool. */
+	slab = kzalloc(struct_size(slab, free_map, BITS_TO_LONGS(cls->objs_per_slab)),
+		       GFP_KERNEL);
+	if (!slab)
+		return 0;
+	slab->addr = gen_pool_alloc(pool->gen_pool, pool->granule);
+	if (!slab->addr) {
+		kfree(slab);
+		return 0;
+	}
+	slab->cls = cls;
+	slab->nr_free = cls->objs_per_slab;
+	bitmap_fill(slab->free_map, cls->objs_per_slab);
+
+	spin_lock(&cls->lock);
+	*edgetpu_iremap_slab_slot(pool, slab->addr) = slab;
+	list_add(&slab->list, &cls->partial);
+	cls->nr_slabs++;
+	addr = edgetpu_iremap_slab_take(slab);
+	spin_unlock(&cls->lock);
+	return addr;
+}
+
+static void edgetpu_iremap_small_free(struct edgetpu_mempool *pool, int idx, unsigned long addr)
+{
+	struct edgetpu_iremap_class *cls = &pool->classes[idx];
+	struct edgetpu_iremap_magazine *mag;
+	bool cached = false;
+
+	mag = get_cpu_ptr(pool->mags);
+	if (mag->count[idx] < EDGETPU_IREMAP_MAG_SIZE) {
+		mag->objs[idx][mag->count[idx]++] = addr;
+		cached = true;
+	}
+	put_cpu_ptr(pool->mags);
+	if (cached)
+		return;
+
+	spin_lock(&cls->lock);
+	edgetpu_iremap_slab_put(pool, cls, addr);
+	spin_unlock(&cls->lock);
+}
+
+/* Returns all objects cached in the per-CPU magazines to their slabs. */
+static void edgetpu_iremap_drain_magazines(struct edgetpu_mempool *pool)
+{
+	int cpu;
+	uint i;
+
+	for_each_possible_cpu(cpu) {
+		struct edgetpu_iremap_magazine *mag = per_cpu_ptr(pool->mags, cpu);
+
+		for (i = 0; i < pool->nr_classes; i++) {
+			struct edgetpu_iremap_class *cls = &pool->classes[i];
+
+			spin_lock(&cls->lock);
+			while (mag->count[i])
+				edgetpu_iremap_slab_put(pool, cls, mag->objs[i][--mag->count[i]]);
+			spin_unlock(&cls->lock);
+		}
+	}
+}
+
 int edgetpu_iremap_pool_create(struct edgetpu_dev *etdev, void *base_vaddr,
 			       dma_addr_t base_dma_addr,
 			       tpu_addr_t base_tpu_addr,
@@ -53,14 +274,29 @@ int edgetpu_iremap_pool_create(struct edgetpu_dev *etdev, void *base_vaddr,
 	pool->base_tpu_addr = base_tpu_addr;
 	pool->base_phys_addr = base_phys_addr;
 	pool->granule = granule;
+	pool->size = size;
+	atomic64_set(&pool->nr_large_allocs, 0);
+	atomic_set(&pool->nr_large_inuse, 0);
+	edgetpu_iremap_classes_init(pool);
+	pool->slabs = kcalloc(DIV_ROUND_UP(size, granule), sizeof(*pool->slabs), GFP_KERNEL);
+	pool->mags = alloc_percpu(struct edgetpu_iremap_magazine);
+	if (!pool->slabs || !pool->mags) {
+		etdev_err(etdev, "Failed to allocate iremap pool caches\n");
+		goto err_free_caches;
+	}
 	if (gen_pool_add(pool->gen_pool, (unsigned long)base_vaddr, size, -1)) {
-		gen_pool_destroy(pool->gen_pool);
-		kfree(pool);
 		etdev_err(etdev, "Failed to add memory to iremap pool\n");
-		return -ENOMEM;
+		goto err_free_caches;
 	}
 	etdev->iremap_pool = pool;
 	return 0;
+
+err_free_caches:
+	free_percpu(pool->mags);
+	kfree(pool->slabs);
+	gen_pool_destroy(pool->gen_pool);
+	kfree(pool);
+	return -ENOMEM;
 }
 
 void edgetpu_iremap_pool_destroy(struct edgetpu_dev *etdev)
@@ -69,7 +305,10 @@ void edgetpu_iremap_pool_destroy(struct edgetpu_dev *etdev)
 
 	if (!etmempool)
 		return;
+	edgetpu_iremap_drain_magazines(etmempool);
 	gen_pool_destroy(etmempool->gen_pool);
+	free_percpu(etmempool->mags);
+	kfree(etmempool->slabs);
 	kfree(etmempool);
 	etdev->iremap_pool = NULL;
 }
@@ -81,12 +320,28 @@ int edgetpu_iremap_alloc(struct edgetpu_dev *etdev, size_t size,
 	struct edgetpu_mempool *etmempool = etdev->iremap_pool;
 	unsigned long addr;
 	size_t offset;
+	int idx = -1;
 
 	if (!etmempool)
 		return edgetpu_alloc_coherent(etdev, size, mem, context_id);
 
-	size = __ALIGN_KERNEL(size, etmempool->granule);
-	addr = gen_pool_alloc(etmempool->gen_pool, size);
+	/*
+	 * Only KCI buffers may share a granule: other buffers (e.g. VII queues)
+	 * can be mapped to user space, which works on a granule basis.
+	 */
+	if (context_id == EDGETPU_CONTEXT_KCI)
+		idx = edgetpu_iremap_size_to_class(etmempool, size);
+	if (idx >= 0) {
+		size = etmempool->classes[idx].obj_size;
+		addr = edgetpu_iremap_small_alloc(etmempool, idx);
+	} else {
+		size = __ALIGN_KERNEL(size, etmempool->granule);
+		addr = gen_pool_alloc(etmempool->gen_pool, size);
+		if (addr) {
+			atomic64_inc(&etmempool->nr_large_allocs);
+			atomic_inc(&etmempool->nr_large_inuse);
+		}
+	}
 	if (!addr)
 		return -ENOMEM;
 
@@ -115,8 +370,15 @@ void edgetpu_iremap_free(struct edgetpu_dev *etdev,
 
 	etdev_dbg(etdev, "%s @ %llx IOVA = %llx size = %zu",
 		  __func__, (u64)mem->vaddr, mem->dma_addr, mem->size);
-	gen_pool_free(etmempool->gen_pool, (unsigned long)mem->vaddr,
-		      mem->size);
+	/* Sizes of granule-sized allocations are always multiples of the granule. */
+	if (mem->size < etmempool->granule) {
+		edgetpu_iremap_small_free(etmempool,
+					  edgetpu_iremap_size_to_class(etmempool, mem->size),
+					  (unsigned long)mem->vaddr);
+	} else {
+		gen_pool_free(etmempool->gen_pool, (unsigned long)mem->vaddr, mem->size);
+		atomic_dec(&etmempool->nr_large_inuse);
+	}
 	mem->vaddr = NULL;
 }
 
@@ -160,3 +422,68 @@ int edgetpu_iremap_mmap(struct edgetpu_dev *etdev, struct vm_area_struct *vma,
 	vma->vm_pgoff = orig_pgoff;
 	return ret;
 }
+
+int edgetpu_iremap_mmap_cacheable(struct edgetpu_dev *etdev, struct vm_area_struct *vma,
+				  struct edgetpu_coherent_mem *mem)
+{
+	unsigned long orig_pgoff = vma->vm_pgoff;
+	int ret;
+
+	/*
+	 * The pool is a carveout mapped write-combined by the kernel and without
+	 * IOMMU_CACHE by the TPU, a cacheable alias of it would not be coherent.
+	 */
+	if (etdev->iremap_pool)
+		return edgetpu_iremap_mmap(etdev, vma, mem);
+
+	/*
+	 * Memory from dma_alloc_coherent() of a coherent device is normal
+	 * cacheable memory, mapped by the TPU with IOMMU_CACHE. Undo the
+	 * pgprot_noncached() of edgetpu_mmap so user space gets the same
+	 * attributes as the kernel.
+	 */
+	vma->vm_page_prot = vm_get_page_prot(vma->vm_flags);
+	vma->vm_pgoff = 0;
+	ret = dma_mmap_coherent(etdev->dev, vma, mem->vaddr, mem->dma_addr, mem->size);
+	vma->vm_pgoff = orig_pgoff;
+	return ret;
+}
+
+void edgetpu_iremap_pool_show(struct edgetpu_dev *etdev, struct seq_file *s)
+{
+	struct edgetpu_mempool *etmempool = etdev->iremap_pool;
+	size_t avail;
+	uint i;
+
+	if (!etmempool) {
+		seq_puts(s, "no iremap pool\n");
+		return;
+	}
+
+	avail = gen_pool_avail(etmempool->gen_pool);
+	seq_printf(s, "pool: size %zu avail %zu used %zu granule %zu\n", etmempool->size,
+		   avail, etmempool->size - avail, etmempool->granule);
+	seq_printf(s, "large: inuse %d allocs %lld\n", atomic_read(&etmempool->nr_large_inuse),
+		   (long long)atomic64_read(&etmempool->nr_large_allocs));
+	for (i = 0; i < etmempool->nr_classes; i++) {
+		struct edgetpu_iremap_class *cls = &etmempool->classes[i];
+		uint nr_slabs, nr_inuse, capacity;
+
+		spin_lock(&cls->lock);
+		nr_slabs = cls->nr_slabs;
+		nr_inuse = cls->nr_inuse;
+		spin_unlock(&cls->lock);
+		capacity = nr_slabs * cls->objs_per_slab;
+		/* Objects cached in magazines are counted as in use. */
+		seq_printf(s,
+			   "class %zu: slabs %u objs %u/%u occupancy %u%% allocs %lld mag_hits %lld\n",
+			   cls->obj_size, nr_slabs, nr_inuse, capacity,
+			   capacity ? nr_inuse * 100 / capacity : 0,
+			   (long long)atomic64_read(&cls->nr_allocs),
+			   (long long)atomic64_read(&cls->nr_mag_hits));
+	}
+}
+
+#if IS_ENABLED(CONFIG_EDGETPU_PERF_TEST)
+#include "unittests/edgetpu-iremap-pool-perf-test.c"
+#endif
@@ -8,6 +8,8 @@
 #ifndef __EDGETPU_IREMAP_POOL_H_
 #define __EDGETPU_IREMAP_POOL_H_
 
+#include <linux/seq_file.h>
+
 #include "edgetpu-internal.h"
 
 /*
@@ -28,6 +30,10 @@ void edgetpu_iremap_pool_destroy(struct edgetpu_dev *etdev);
  * Attempt to allocate memory in the instruction remap pool if the device
  * has one.
  * Fall back to dma_alloc_coherent and edgetpu_mmu_tpu_map otherwise.
+ *
+ * Small allocations for EDGETPU_CONTEXT_KCI are served from per-size-class
+ * slabs and may share a granule with other allocations, such memory must not
+ * be mapped to user space.
  */
 int edgetpu_iremap_alloc(struct edgetpu_dev *etdev, size_t size,
 			 struct edgetpu_coherent_mem *mem,
@@ -48,4 +54,18 @@ void edgetpu_iremap_free(struct edgetpu_dev *etdev,
 int edgetpu_iremap_mmap(struct edgetpu_dev *etdev, struct vm_area_struct *vma,
 			struct edgetpu_coherent_mem *mem);
 
+/*
+ * Like edgetpu_iremap_mmap() but maps @mem write-back cacheable when it was
+ * allocated from coherent DMA memory. Memory in the pool is always mapped as
+ * edgetpu_iremap_mmap() does, so devices with a pool, which all queues are
+ * allocated from, see no change.
+ *
+ * Only for devices that are DMA coherent.
+ */
+int edgetpu_iremap_mmap_cacheable(struct edgetpu_dev *etdev, struct vm_area_struct *vma,
+				  struct edgetpu_coherent_mem *mem);
+
+/* debugfs dump of the pool occupancy and fragmentation statistics */
+void edgetpu_iremap_pool_show(struct edgetpu_dev *etdev, struct seq_file *s);
+
 #endif /* __EDGETPU_IREMAP_POOL_H_ */
@@ -16,10 +16,12 @@
 #include <linux/string.h> /* memcpy */
 
 #include "edgetpu-firmware.h"
+#include "edgetpu-flight-recorder.h"
 #include "edgetpu-internal.h"
 #include "edgetpu-iremap-pool.h"
 #include "edgetpu-kci.h"
 #include "edgetpu-mmu.h"
+#include "edgetpu-sw-watchdog.h"
 #include "edgetpu-telemetry.h"
 #include "edgetpu-usage-stats.h"
 
@@ -29,6 +31,9 @@
 /* size of queue for KCI mailbox */
 #define QUEUE_SIZE MAX_QUEUE_SIZE
 
+/* size of the buffer firmware reports usage stats to */
+#define EDGETPU_USAGE_BUFFER_SIZE	4096
+
 /* Timeout for KCI responses from the firmware (milliseconds) */
 #ifdef EDGETPU_KCI_TIMEOUT
 
@@ -88,6 +93,50 @@ static void edgetpu_kci_free_queue(struct edgetpu_dev *etdev,
 	edgetpu_iremap_free(etdev, mem, EDGETPU_CONTEXT_KCI);
 }
 
+/*
+ * Gets a buffer of @size bytes for the payload of a KCI command.
+ *
+ * A free slot of the persistent data buffer is used if possible, otherwise
+ * falls back to allocating from the iremap pool.
+ */
+static int edgetpu_kci_get_data_buf(struct edgetpu_kci *kci, size_t size,
+				    struct edgetpu_coherent_mem *mem)
+{
+	unsigned long slot;
+
+	if (kci->data_mem.vaddr && size <= KCI_DATA_SLOT_SIZE) {
+		do {
+			slot = find_first_zero_bit(&kci->data_slot_map, KCI_NUM_DATA_SLOTS);
+			if (slot >= KCI_NUM_DATA_SLOTS)
+				break;
+		} while (test_and_set_bit(slot, &kci->data_slot_map));
+		if (slot < KCI_NUM_DATA_SLOTS) {
+			*mem = kci->data_mem;
+			mem->vaddr += slot * KCI_DATA_SLOT_SIZE;
+			mem->dma_addr += slot * KCI_DATA_SLOT_SIZE;
+			mem->tpu_addr += slot * KCI_DATA_SLOT_SIZE;
+			mem->phys_addr += slot * KCI_DATA_SLOT_SIZE;
+			mem->size = KCI_DATA_SLOT_SIZE;
+			return 0;
+		}
+	}
+	return edgetpu_iremap_alloc(kci->mailbox->etdev, size, mem, EDGETPU_CONTEXT_KCI);
+}
+
+/* Releases the buffer returned by edgetpu_kci_get_data_buf(). */
+static void edgetpu_kci_put_data_buf(struct edgetpu_kci *kci,
+				     struct edgetpu_coherent_mem *mem)
+{
+	const void *base = kci->data_mem.vaddr;
+
+	if (base && mem->vaddr >= base && mem->vaddr < base + kci->data_mem.size) {
+		clear_bit((mem->vaddr - base) / KCI_DATA_SLOT_SIZE, &kci->data_slot_map);
+		mem->vaddr = NULL;
+		return;
+	}
+	edgetpu_iremap_free(kci->mailbox->etdev, mem, EDGETPU_CONTEXT_KCI);
+}
+
 /* Handle one incoming request from firmware */
 static void
 edgetpu_reverse_kci_consume_response(struct edgetpu_dev *etdev,
@@ -242,6 +291,7 @@ static void
 edgetpu_kci_handle_response(struct edgetpu_kci *kci,
 			    struct edgetpu_kci_response_element *resp)
 {
+	edgetpu_fr_record(kci->mailbox->etdev, EDGETPU_FR_KCI_RESP, resp->code, resp->seq);
 	if (resp->seq & KCI_REVERSE_FLAG) {
 		int ret = edgetpu_reverse_kci_add_response(kci, resp);
 
@@ -437,6 +487,7 @@ static void edgetpu_kci_handle_irq(struct edgetpu_mailbox *mailbox)
 {
 	struct edgetpu_kci *kci = mailbox->internal.kci;
 
+	edgetpu_sw_wdt_note_alive(mailbox->etdev);
 	/* Wake up threads that are waiting for response doorbell to be rung. */
 	wake_up(&kci->resp_doorbell_waitq);
 	/*
@@ -491,6 +542,19 @@ int edgetpu_kci_init(struct edgetpu_mailbox_manager *mgr,
 		  kci->resp_queue_mem.vaddr, kci->resp_queue_mem.tpu_addr,
 		  &kci->resp_queue_mem.dma_addr);
 
+	/*
+	 * Buffers for command payloads are optional, commands fall back to
+	 * allocating their buffers on the fly if these are missing.
+	 */
+	if (edgetpu_iremap_alloc(mgr->etdev, KCI_NUM_DATA_SLOTS * KCI_DATA_SLOT_SIZE,
+				 &kci->data_mem, EDGETPU_CONTEXT_KCI))
+		etdev_warn(mgr->etdev, "%s: failed to allocate data buffer", __func__);
+	kci->data_slot_map = 0;
+	if (edgetpu_iremap_alloc(mgr->etdev, EDGETPU_USAGE_BUFFER_SIZE, &kci->usage_mem,
+				 EDGETPU_CONTEXT_KCI))
+		etdev_warn(mgr->etdev, "%s: failed to allocate usage buffer", __func__);
+	mutex_init(&kci->usage_lock);
+
 	mailbox->handle_irq = edgetpu_kci_handle_irq;
 	mailbox->internal.kci = kci;
 	kci->mailbox = mailbox;
@@ -567,6 +631,10 @@ void edgetpu_kci_release(struct edgetpu_dev *etdev, struct edgetpu_kci *kci)
 
 	edgetpu_kci_free_queue(etdev, &kci->cmd_queue_mem);
 	edgetpu_kci_free_queue(etdev, &kci->resp_queue_mem);
+	if (kci->data_mem.vaddr)
+		edgetpu_iremap_free(etdev, &kci->data_mem, EDGETPU_CONTEXT_KCI);
+	if (kci->usage_mem.vaddr)
+		edgetpu_iremap_free(etdev, &kci->usage_mem, EDGETPU_CONTEXT_KCI);
 
 	/*
 	 * Non-empty @kci->wait_list means someone (edgetpu_kci_send_cmd) is
@@ -680,6 +748,7 @@ int edgetpu_kci_push_cmd(struct edgetpu_kci *kci,
 	edgetpu_mailbox_inc_cmd_queue_tail(kci->mailbox, 1);
 	/* triggers doorbell */
 	EDGETPU_MAILBOX_CMD_QUEUE_WRITE_SYNC(kci->mailbox, doorbell_set, 1);
+	edgetpu_fr_record(kci->mailbox->etdev, EDGETPU_FR_KCI_CMD, cmd->code, cmd->seq);
 	/* bumps sequence number after the command is sent */
 	kci->cur_seq++;
 	ret = 0;
@@ -733,7 +802,7 @@ static int edgetpu_kci_send_cmd_with_data(struct edgetpu_kci *kci,
 	struct edgetpu_coherent_mem mem;
 	int ret;
 
-	ret = edgetpu_iremap_alloc(etdev, size, &mem, EDGETPU_CONTEXT_KCI);
+	ret = edgetpu_kci_get_data_buf(kci, size, &mem);
 	if (ret)
 		return ret;
 	memcpy(mem.vaddr, data, size);
@@ -744,9 +813,9 @@ static int edgetpu_kci_send_cmd_with_data(struct edgetpu_kci *kci,
 	cmd->dma.address = mem.tpu_addr;
 	cmd->dma.size = size;
 	ret = edgetpu_kci_send_cmd(kci, cmd);
-	edgetpu_iremap_free(etdev, &mem, EDGETPU_CONTEXT_KCI);
 	etdev_dbg(etdev, "%s: unmap kva=%pK iova=%#llx dma=%pad", __func__, mem.vaddr,
 		  mem.tpu_addr, &mem.dma_addr);
+	edgetpu_kci_put_data_buf(kci, &mem);
 	return ret;
 }
 
@@ -845,8 +914,7 @@ enum edgetpu_fw_flavor edgetpu_kci_fw_info(struct edgetpu_kci *kci,
 	enum edgetpu_fw_flavor flavor = FW_FLAVOR_UNKNOWN;
 	int ret;
 
-	ret = edgetpu_iremap_alloc(etdev, sizeof(*fw_info), &mem,
-				   EDGETPU_CONTEXT_KCI);
+	ret = edgetpu_kci_get_data_buf(kci, sizeof(*fw_info), &mem);
 
 	/* If allocation failed still try handshake without full fw_info */
 	if (ret) {
@@ -862,7 +930,7 @@ enum edgetpu_fw_flavor edgetpu_kci_fw_info(struct edgetpu_kci *kci,
 	ret = edgetpu_kci_send_cmd_return_resp(kci, &cmd, &resp);
 	if (cmd.dma.address) {
 		memcpy(fw_info, mem.vaddr, sizeof(*fw_info));
-		edgetpu_iremap_free(etdev, &mem, EDGETPU_CONTEXT_KCI);
+		edgetpu_kci_put_data_buf(kci, &mem);
 	}
 
 	if (ret == KCI_ERROR_UNIMPLEMENTED) {
@@ -931,7 +999,7 @@ fw_unlock:
 
 int edgetpu_kci_update_usage_locked(struct edgetpu_dev *etdev)
 {
-#define EDGETPU_USAGE_BUFFER_SIZE	4096
+	struct edgetpu_kci *kci = etdev->kci;
 	struct edgetpu_command_element cmd = {
 		.code = KCI_CODE_GET_USAGE,
 		.dma = {
@@ -939,32 +1007,28 @@ int edgetpu_kci_update_usage_locked(struct edgetpu_dev *etdev)
 			.size = 0,
 		},
 	};
-	struct edgetpu_coherent_mem mem;
+	struct edgetpu_coherent_mem *mem = &kci->usage_mem;
 	struct edgetpu_kci_response_element resp;
 	int ret;
 
-	ret = edgetpu_iremap_alloc(etdev, EDGETPU_USAGE_BUFFER_SIZE, &mem,
-				   EDGETPU_CONTEXT_KCI);
-
-	if (ret) {
-		etdev_warn_once(etdev, "%s: failed to allocate usage buffer",
-				__func__);
-		return ret;
+	if (!mem->vaddr) {
+		etdev_warn_once(etdev, "%s: usage buffer not allocated", __func__);
+		return -ENOMEM;
 	}
 
-	cmd.dma.address = mem.tpu_addr;
+	mutex_lock(&kci->usage_lock);
+	cmd.dma.address = mem->tpu_addr;
 	cmd.dma.size = EDGETPU_USAGE_BUFFER_SIZE;
-	memset(mem.vaddr, 0, sizeof(struct edgetpu_usage_header));
-	ret = edgetpu_kci_send_cmd_return_resp(etdev->kci, &cmd, &resp);
+	memset(mem->vaddr, 0, sizeof(struct edgetpu_usage_header));
+	ret = edgetpu_kci_send_cmd_return_resp(kci, &cmd, &resp);
 
 	if (ret == KCI_ERROR_UNIMPLEMENTED || ret == KCI_ERROR_UNAVAILABLE)
 		etdev_dbg(etdev, "firmware does not report usage\n");
 	else if (ret == KCI_ERROR_OK)
-		edgetpu_usage_stats_process_buffer(etdev, mem.vaddr);
+		edgetpu_usage_stats_process_buffer(etdev, mem->vaddr);
 	else if (ret != -ETIMEDOUT)
 		etdev_warn_once(etdev, "%s: error %d", __func__, ret);
-
-	edgetpu_iremap_free(etdev, &mem, EDGETPU_CONTEXT_KCI);
+	mutex_unlock(&kci->usage_lock);
 
 	return ret;
 }
@@ -1091,3 +1155,24 @@ int edgetpu_kci_block_bus_speed_control(struct edgetpu_dev *etdev, bool block)
 
 	return edgetpu_kci_send_cmd(etdev->kci, &cmd);
 }
+
+int edgetpu_kci_prefetch_buffer(struct edgetpu_kci *kci, tpu_addr_t tpu_addr, u32 size, u16 vcid)
+{
+	struct edgetpu_command_element cmd = {
+		.code = KCI_CODE_PREFETCH_BUFFER,
+		.dma = {
+			.address = tpu_addr,
+			.size = size,
+			.flags = vcid,
+		},
+	};
+	int ret;
+
+	if (!kci)
+		return -ENODEV;
+	RETURN_ERRNO_IF_ETDEV_NOT_GOOD(kci);
+	ret = edgetpu_kci_send_cmd(kci, &cmd);
+	if (ret == KCI_ERROR_UNIMPLEMENTED)
+		return -EOPNOTSUPP;
+	return ret;
+}
@@ -26,6 +26,10 @@
  */
 #define REVERSE_KCI_BUFFER_SIZE		(32)
 
+/* Number and size of the persistent buffers for KCI command payloads. */
+#define KCI_NUM_DATA_SLOTS		(8)
+#define KCI_DATA_SLOT_SIZE		(64)
+
 /*
  * The status field in a firmware response is set to this by us when the
  * response is fetched from the queue.
@@ -110,6 +114,7 @@ enum edgetpu_kci_code {
 	KCI_CODE_GET_USAGE = 12,
 	KCI_CODE_NOTIFY_THROTTLING = 13,
 	KCI_CODE_BLOCK_BUS_SPEED_CONTROL = 14,
+	KCI_CODE_PREFETCH_BUFFER = 15,
 };
 
 /*
@@ -196,6 +201,15 @@ struct edgetpu_kci {
 	/* Handler for reverse (firmware -> kernel) requests */
 	struct edgetpu_reverse_kci rkci;
 	struct work_struct usage_work;	/* worker that sends update usage KCI */
+	/*
+	 * Persistent buffer split into KCI_NUM_DATA_SLOTS slots for payloads of
+	 * in-flight KCI commands, allocated once in edgetpu_kci_init().
+	 */
+	struct edgetpu_coherent_mem data_mem;
+	unsigned long data_slot_map;	/* bit set if the slot is in use */
+	/* Persistent buffer for the usage stats reported by firmware */
+	struct edgetpu_coherent_mem usage_mem;
+	struct mutex usage_lock;	/* protects usage_mem */
 };
 
 struct edgetpu_kci_device_group_detail {
@@ -405,4 +419,12 @@ int edgetpu_kci_notify_throttling(struct edgetpu_dev *etdev, u32 level);
  */
 int edgetpu_kci_block_bus_speed_control(struct edgetpu_dev *etdev, bool block);
 
+/*
+ * Request the firmware to prefetch [@tpu_addr, @tpu_addr + @size) of the
+ * context of @vcid into its parameter cache.
+ *
+ * Returns -EOPNOTSUPP if the firmware doesn't support prefetching.
+ */
+int edgetpu_kci_prefetch_buffer(struct edgetpu_kci *kci, tpu_addr_t tpu_addr, u32 size, u16 vcid);
+
 #endif /* __EDGETPU_KCI_H__ */
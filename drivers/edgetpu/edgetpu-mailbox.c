@@ -8,13 +8,18 @@
 #include <asm/page.h>
 #include <linux/bitops.h>
 #include <linux/bits.h>
+#include <linux/build_bug.h>
 #include <linux/dma-mapping.h>
 #include <linux/err.h>
 #include <linux/kernel.h>
 #include <linux/mmzone.h> /* MAX_ORDER_NR_PAGES */
+#include <linux/rcupdate.h>
 #include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/workqueue.h>
 
 #include "edgetpu-device-group.h"
+#include "edgetpu-flight-recorder.h"
 #include "edgetpu-iremap-pool.h"
 #include "edgetpu-kci.h"
 #include "edgetpu-mailbox.h"
@@ -34,6 +39,15 @@ static inline bool valid_circular_queue_size(u32 size)
 	return true;
 }
 
+/* Max number of released queues kept in edgetpu_mailbox_manager::queue_cache. */
+#define EDGETPU_QUEUE_CACHE_MAX 8
+
+struct edgetpu_queue_cache_entry {
+	struct list_head list;
+	enum edgetpu_context_id context_id;
+	edgetpu_queue_mem mem;
+};
+
 /* Return context ID for mailbox. */
 static inline enum edgetpu_context_id
 edgetpu_mailbox_context_id(struct edgetpu_mailbox *mailbox)
@@ -117,9 +131,18 @@ static void edgetpu_mailbox_disable_ith(struct edgetpu_mailbox_manager *mgr,
 
 static void edgetpu_vii_irq_handler(struct edgetpu_mailbox *mailbox)
 {
-	if (mailbox->internal.group)
-		edgetpu_group_notify(mailbox->internal.group,
-				     EDGETPU_EVENT_RESPDATA);
+	struct edgetpu_device_group *group = mailbox->internal.group;
+
+	edgetpu_fr_record(mailbox->etdev, EDGETPU_FR_VII_IRQ, mailbox->mailbox_id, 0);
+	edgetpu_sw_wdt_note_alive(mailbox->etdev);
+	if (!group)
+		return;
+	WRITE_ONCE(group->mailbox_last_used, jiffies);
+	edgetpu_group_quota_kick(group);
+	/* responses arrived, the firmware may have consumed commands */
+	if (group->vii.overflow)
+		schedule_work(&group->vii.overflow->refill_work);
+	edgetpu_group_notify(group, EDGETPU_EVENT_RESPDATA);
 }
 
 /*
@@ -414,6 +437,287 @@ int edgetpu_mailbox_validate_attr(const struct edgetpu_mailbox_attr *attr)
 	return 0;
 }
 
+int edgetpu_mailbox_validate_attr_ext(const struct edgetpu_create_group_ext *ext)
+{
+	const struct edgetpu_mailbox_attr *attr = &ext->attr;
+	int size;
+	int ret;
+
+	ret = edgetpu_mailbox_validate_attr(attr);
+	if (ret)
+		return ret;
+	if (ext->reserved[0] || ext->reserved[1])
+		return -EINVAL;
+	if (ext->deadline_class > EDGETPU_DEADLINE_REALTIME)
+		return -EINVAL;
+	size = convert_runtime_queue_size_to_fw(attr->cmd_queue_size, attr->sizeof_cmd);
+	if (ext->cmdq_overflow_order > EDGETPU_CMDQ_OVERFLOW_MAX_ORDER ||
+	    ((u64)size << ext->cmdq_overflow_order) * attr->sizeof_cmd >
+		    EDGETPU_CMDQ_OVERFLOW_MAX_BYTES)
+		return -EINVAL;
+	return 0;
+}
+
+/*
+ * Moves pending commands from the overflow queue of @vii to the hardware
+ * command queue, as many as the hardware queue has room for.
+ *
+ * Caller holds @vii->overflow->lock, ensures the overflow queue is attached
+ * and the device is powered.
+ */
+static void edgetpu_vii_overflow_flush_locked(struct edgetpu_vii *vii)
+{
+	struct edgetpu_vii_overflow *ov = vii->overflow;
+	struct edgetpu_mailbox *mailbox = ov->mailbox;
+	u32 size = mailbox->cmd_queue_size;
+	u32 tail = mailbox->cmd_queue_tail;
+	u32 head, n, i;
+
+	if (!ov->count)
+		return;
+	head = EDGETPU_MAILBOX_CMD_QUEUE_READ(mailbox, head);
+	n = min(size - circular_queue_count(head, tail, size), ov->count);
+	for (i = 0; i < n; i++) {
+		memcpy(vii->cmd_queue_mem.vaddr + CIRCULAR_QUEUE_REAL_INDEX(tail) * ov->elem_size,
+		       ov->buf + ov->head * ov->elem_size, ov->elem_size);
+		tail = circular_queue_inc(tail, 1, size);
+		if (++ov->head == ov->size)
+			ov->head = 0;
+	}
+	if (!n)
+		return;
+	ov->count -= n;
+	edgetpu_mailbox_inc_cmd_queue_tail(mailbox, n);
+	if (!ov->tail_doorbell)
+		EDGETPU_MAILBOX_CMD_QUEUE_WRITE_SYNC(mailbox, doorbell_set, 1);
+	/* with the tail doorbell enabled, updating the tail rang it */
+	edgetpu_fr_record(mailbox->etdev, EDGETPU_FR_DOORBELL, mailbox->mailbox_id, n);
+}
+
+static void edgetpu_vii_overflow_refill_work(struct work_struct *work)
+{
+	struct edgetpu_vii_overflow *ov =
+		container_of(work, struct edgetpu_vii_overflow, refill_work);
+	struct edgetpu_vii *vii = ov->vii;
+	struct edgetpu_dev *etdev = vii->etdev;
+
+	if (!edgetpu_pm_get_if_powered(etdev->pm))
+		return;
+	mutex_lock(&ov->lock);
+	if (ov->mailbox)
+		edgetpu_vii_overflow_flush_locked(vii);
+	mutex_unlock(&ov->lock);
+	edgetpu_pm_put(etdev->pm);
+}
+
+/*
+ * Allocates the overflow queue of @vii on the first attach and binds it to
+ * @mailbox, whose command queue holds @hw_size elements, @hw_size << @order
+ * for the overflow queue.
+ */
+static int edgetpu_vii_overflow_attach(struct edgetpu_vii *vii,
+				       struct edgetpu_mailbox *mailbox, u32 hw_size, u32 order,
+				       const struct edgetpu_mailbox_attr *attr)
+{
+	struct edgetpu_vii_overflow *ov = vii->overflow;
+
+	if (!ov) {
+		ov = kzalloc(sizeof(*ov), GFP_KERNEL);
+		if (!ov)
+			return -ENOMEM;
+		ov->size = hw_size << order;
+		ov->elem_size = attr->sizeof_cmd;
+		/* bounded by edgetpu_mailbox_validate_attr_ext(), but sized by user space */
+		ov->buf = kvmalloc_array(ov->size, ov->elem_size,
+					 GFP_KERNEL_ACCOUNT | __GFP_NOWARN);
+		if (!ov->buf) {
+			kfree(ov);
+			return -ENOMEM;
+		}
+		mutex_init(&ov->lock);
+		INIT_WORK(&ov->refill_work, edgetpu_vii_overflow_refill_work);
+		ov->vii = vii;
+		ov->tail_doorbell = attr->cmdq_tail_doorbell;
+		vii->overflow = ov;
+	}
+	mutex_lock(&ov->lock);
+	ov->mailbox = mailbox;
+	ov->head = 0;
+	ov->count = 0;
+	mutex_unlock(&ov->lock);
+	return 0;
+}
+
+/* Unbinds the overflow queue of @vii from its mailbox, pending commands are dropped. */
+static void edgetpu_vii_overflow_detach(struct edgetpu_vii *vii)
+{
+	struct edgetpu_vii_overflow *ov = vii->overflow;
+
+	if (!ov)
+		return;
+	mutex_lock(&ov->lock);
+	if (ov->count)
+		etdev_dbg(vii->etdev, "%s: dropping %u pending commands", __func__,
+			  ov->count);
+	ov->mailbox = NULL;
+	ov->count = 0;
+	mutex_unlock(&ov->lock);
+}
+
+int edgetpu_mailbox_vii_submit(struct edgetpu_vii *vii, const void __user *cmds,
+			       u32 count)
+{
+	struct edgetpu_vii_overflow *ov = vii->overflow;
+	u32 n, pos, chunk;
+	int ret = 0;
+
+	if (!ov)
+		return -EINVAL;
+	mutex_lock(&ov->lock);
+	if (!ov->mailbox) {
+		ret = -EAGAIN;
+		goto out;
+	}
+	/* make room in the overflow queue first so commands stay in order */
+	edgetpu_vii_overflow_flush_locked(vii);
+	n = min(count, ov->size - ov->count);
+	pos = (ov->head + ov->count) % ov->size;
+	chunk = min(n, ov->size - pos);
+	if (copy_from_user(ov->buf + pos * ov->elem_size, cmds, chunk * ov->elem_size) ||
+	    copy_from_user(ov->buf, cmds + chunk * ov->elem_size,
+			   (n - chunk) * ov->elem_size)) {
+		ret = -EFAULT;
+		goto out;
+	}
+	ov->count += n;
+	edgetpu_vii_overflow_flush_locked(vii);
+	ret = n ? n : -EAGAIN;
+out:
+	mutex_unlock(&ov->lock);
+	return ret;
+}
+
+/* Wakes up the groups waiting for a VII mailbox. */
+static void edgetpu_mailbox_admission_notify(struct edgetpu_mailbox_manager *mgr)
+{
+	atomic_inc(&mgr->admission.seq);
+	wake_up_all(&mgr->admission.waitq);
+}
+
+bool edgetpu_mailbox_vii_idle(struct edgetpu_vii *vii)
+{
+	struct edgetpu_vii_overflow *ov = vii->overflow;
+	struct edgetpu_mailbox *mailbox = vii->mailbox;
+	bool idle;
+
+	if (!mailbox)
+		return false;
+	if (ov)
+		mutex_lock(&ov->lock);
+	/*
+	 * Compare the CSRs rather than the shadow indexes, which runtimes
+	 * writing the mmapped CSRs don't update.
+	 */
+	idle = (!ov || !ov->count) &&
+	       EDGETPU_MAILBOX_CMD_QUEUE_READ(mailbox, head) ==
+			EDGETPU_MAILBOX_CMD_QUEUE_READ(mailbox, tail) &&
+	       EDGETPU_MAILBOX_RESP_QUEUE_READ(mailbox, tail) ==
+			EDGETPU_MAILBOX_RESP_QUEUE_READ(mailbox, head);
+	if (ov)
+		mutex_unlock(&ov->lock);
+	return idle;
+}
+
+void edgetpu_mailbox_reset_vii(struct edgetpu_vii *vii)
+{
+	struct edgetpu_vii_overflow *ov = vii->overflow;
+
+	if (ov)
+		mutex_lock(&ov->lock);
+	if (vii->mailbox) {
+		edgetpu_mailbox_reset(vii->mailbox);
+	} else if (vii->parked) {
+		vii->cmd_queue_head = 0;
+		vii->cmd_queue_tail = 0;
+		vii->resp_queue_head = 0;
+		vii->resp_queue_tail = 0;
+	}
+	if (ov) {
+		ov->count = 0;
+		mutex_unlock(&ov->lock);
+	}
+}
+
+void edgetpu_mailbox_release_vii_overflow(struct edgetpu_vii *vii)
+{
+	struct edgetpu_vii_overflow *ov = vii->overflow;
+
+	if (!ov)
+		return;
+	cancel_work_sync(&ov->refill_work);
+	kvfree(ov->buf);
+	kfree(ov);
+	vii->overflow = NULL;
+}
+
+static void edgetpu_mailbox_do_free_queue(struct edgetpu_dev *etdev,
+					  enum edgetpu_context_id context_id,
+					  edgetpu_queue_mem *mem);
+
+static int edgetpu_mailbox_alloc_vii_queues(struct edgetpu_vii *vii, struct edgetpu_dev *etdev,
+					    struct edgetpu_mailbox *mailbox, u32 cmd_queue_size,
+					    u32 resp_queue_size,
+					    const struct edgetpu_mailbox_attr *attr)
+{
+	int ret;
+
+	ret = edgetpu_mailbox_alloc_queue(etdev, mailbox, cmd_queue_size, attr->sizeof_cmd,
+					  MAILBOX_CMD_QUEUE, &vii->cmd_queue_mem);
+	if (ret)
+		return ret;
+
+	etdev_dbg(etdev, "%s: mbox %u cmdq iova=%#llx dma=%pad\n", __func__,
+		  mailbox->mailbox_id, vii->cmd_queue_mem.tpu_addr, &vii->cmd_queue_mem.dma_addr);
+	ret = edgetpu_mailbox_alloc_queue(etdev, mailbox, resp_queue_size, attr->sizeof_resp,
+					  MAILBOX_RESP_QUEUE, &vii->resp_queue_mem);
+	if (ret) {
+		edgetpu_mailbox_free_queue(etdev, mailbox, &vii->cmd_queue_mem);
+		return ret;
+	}
+
+	etdev_dbg(etdev, "%s: mbox %u rspq iova=%#llx dma=%pad\n", __func__,
+		  mailbox->mailbox_id, vii->resp_queue_mem.tpu_addr, &vii->resp_queue_mem.dma_addr);
+	return 0;
+}
+
+/*
+ * Programs the queues kept by edgetpu_mailbox_park_vii() to @mailbox and
+ * restores the saved queue indexes.
+ *
+ * The queues stay mapped at the same TPU addresses: they are either in the
+ * remap pool or in the group's domain, which is attached again before this.
+ */
+static int edgetpu_mailbox_restore_vii_queues(struct edgetpu_vii *vii,
+					      struct edgetpu_mailbox *mailbox,
+					      u32 cmd_queue_size, u32 resp_queue_size)
+{
+	int ret;
+
+	ret = edgetpu_mailbox_set_queue(mailbox, MAILBOX_CMD_QUEUE, vii->cmd_queue_mem.tpu_addr,
+					cmd_queue_size);
+	if (ret)
+		return ret;
+	ret = edgetpu_mailbox_set_queue(mailbox, MAILBOX_RESP_QUEUE, vii->resp_queue_mem.tpu_addr,
+					resp_queue_size);
+	if (ret)
+		return ret;
+	EDGETPU_MAILBOX_CMD_QUEUE_WRITE(mailbox, head, vii->cmd_queue_head);
+	edgetpu_mailbox_set_cmd_queue_tail(mailbox, vii->cmd_queue_tail);
+	edgetpu_mailbox_set_resp_queue_head(mailbox, vii->resp_queue_head);
+	EDGETPU_MAILBOX_RESP_QUEUE_WRITE(mailbox, tail, vii->resp_queue_tail);
+	return 0;
+}
+
 int edgetpu_mailbox_init_vii(struct edgetpu_vii *vii,
 			     struct edgetpu_device_group *group)
 {
@@ -440,37 +744,33 @@ int edgetpu_mailbox_init_vii(struct edgetpu_vii *vii,
 				      cmd_queue_tail_doorbell_enable,
 				      attr->cmdq_tail_doorbell);
 
-	ret = edgetpu_mailbox_alloc_queue(group->etdev, mailbox, cmd_queue_size,
-					  attr->sizeof_cmd, MAILBOX_CMD_QUEUE,
-					  &vii->cmd_queue_mem);
+	if (vii->parked)
+		ret = edgetpu_mailbox_restore_vii_queues(vii, mailbox, cmd_queue_size,
+							 resp_queue_size);
+	else
+		ret = edgetpu_mailbox_alloc_vii_queues(vii, group->etdev, mailbox,
+						       cmd_queue_size, resp_queue_size, attr);
 	if (ret) {
 		edgetpu_mailbox_remove(mgr, mailbox);
 		return ret;
 	}
+	vii->parked = false;
 
-	etdev_dbg(group->etdev,
-		  "%s: mbox %u cmdq iova=%#llx dma=%pad\n",
-		  __func__, mailbox->mailbox_id, vii->cmd_queue_mem.tpu_addr,
-		  &vii->cmd_queue_mem.dma_addr);
-	ret = edgetpu_mailbox_alloc_queue(group->etdev, mailbox,
-					  resp_queue_size, attr->sizeof_resp,
-					  MAILBOX_RESP_QUEUE,
-					  &vii->resp_queue_mem);
-
-	if (ret) {
-		edgetpu_mailbox_free_queue(group->etdev, mailbox,
-					   &vii->cmd_queue_mem);
-		edgetpu_mailbox_remove(mgr, mailbox);
-		return ret;
+	if (group->cmdq_overflow_order) {
+		ret = edgetpu_vii_overflow_attach(vii, mailbox, cmd_queue_size,
+						  group->cmdq_overflow_order, attr);
+		if (ret) {
+			edgetpu_mailbox_free_queue(group->etdev, mailbox, &vii->resp_queue_mem);
+			edgetpu_mailbox_free_queue(group->etdev, mailbox, &vii->cmd_queue_mem);
+			edgetpu_mailbox_remove(mgr, mailbox);
+			return ret;
+		}
 	}
 
-	etdev_dbg(group->etdev,
-		  "%s: mbox %u rspq iova=%#llx dma=%pad\n",
-		  __func__, mailbox->mailbox_id, vii->resp_queue_mem.tpu_addr,
-		  &vii->resp_queue_mem.dma_addr);
 	mailbox->internal.group = edgetpu_device_group_get(group);
 	vii->etdev = group->etdev;
 	vii->mailbox = mailbox;
+	rcu_assign_pointer(group->etdev->mailbox_groups[mailbox->mailbox_id], group);
 	edgetpu_mailbox_enable(mailbox);
 	return 0;
 }
@@ -478,17 +778,161 @@ int edgetpu_mailbox_init_vii(struct edgetpu_vii *vii,
 void edgetpu_mailbox_remove_vii(struct edgetpu_vii *vii)
 {
 	struct edgetpu_dev *etdev;
+	enum edgetpu_context_id context_id;
 
 	etdev = vii->etdev;
-	edgetpu_mailbox_free_queue(etdev, vii->mailbox, &vii->cmd_queue_mem);
-	edgetpu_mailbox_free_queue(etdev, vii->mailbox, &vii->resp_queue_mem);
+	if (vii->parked) {
+		edgetpu_mailbox_do_free_queue(etdev, vii->parked_context_id, &vii->cmd_queue_mem);
+		edgetpu_mailbox_do_free_queue(etdev, vii->parked_context_id, &vii->resp_queue_mem);
+		vii->parked = false;
+		return;
+	}
+	edgetpu_vii_overflow_detach(vii);
+	context_id = edgetpu_mailbox_context_id(vii->mailbox);
+	/*
+	 * Disable and unpublish the mailbox before releasing its queues, so
+	 * nothing serving the mailbox can write to them after they are freed.
+	 */
 	if (vii->mailbox) {
 		if (!vii->mailbox->internal.group->dev_inaccessible)
 			edgetpu_mailbox_disable(vii->mailbox);
+		RCU_INIT_POINTER(etdev->mailbox_groups[vii->mailbox->mailbox_id], NULL);
 		edgetpu_device_group_put(vii->mailbox->internal.group);
 		edgetpu_mailbox_remove(etdev->mailbox_manager, vii->mailbox);
 		vii->mailbox = NULL;
+		edgetpu_mailbox_admission_notify(etdev->mailbox_manager);
+	}
+	edgetpu_mailbox_do_free_queue(etdev, context_id, &vii->cmd_queue_mem);
+	edgetpu_mailbox_do_free_queue(etdev, context_id, &vii->resp_queue_mem);
+}
+
+void edgetpu_mailbox_park_vii(struct edgetpu_vii *vii,
+			      enum edgetpu_context_id context_id)
+{
+	struct edgetpu_mailbox *mailbox = vii->mailbox;
+	struct edgetpu_device_group *group;
+
+	if (!mailbox)
+		return;
+	group = mailbox->internal.group;
+	edgetpu_vii_overflow_detach(vii);
+	if (group->dev_inaccessible) {
+		/* the queues can't be trusted anymore, start over on the next attach */
+		vii->cmd_queue_head = vii->cmd_queue_tail = 0;
+		vii->resp_queue_head = vii->resp_queue_tail = 0;
+	} else {
+		/*
+		 * Runtimes that mmap the CSRs move the cmd tail and resp head
+		 * without updating the shadow copies, read the CSRs instead.
+		 */
+		vii->cmd_queue_head = EDGETPU_MAILBOX_CMD_QUEUE_READ(mailbox, head);
+		vii->cmd_queue_tail = EDGETPU_MAILBOX_CMD_QUEUE_READ(mailbox, tail);
+		vii->resp_queue_head = EDGETPU_MAILBOX_RESP_QUEUE_READ(mailbox, head);
+		vii->resp_queue_tail = EDGETPU_MAILBOX_RESP_QUEUE_READ(mailbox, tail);
+		edgetpu_mailbox_disable(mailbox);
 	}
+	vii->parked = true;
+	vii->parked_context_id = context_id;
+	vii->mailbox = NULL;
+	RCU_INIT_POINTER(vii->etdev->mailbox_groups[mailbox->mailbox_id], NULL);
+	edgetpu_device_group_put(group);
+	edgetpu_mailbox_remove(vii->etdev->mailbox_manager, mailbox);
+	edgetpu_mailbox_admission_notify(vii->etdev->mailbox_manager);
+}
+
+/*
+ * Takes a released queue of @size bytes from the cache for @context_id,
+ * returns true and sets @mem on success. The queue memory is cleared before
+ * being reused.
+ *
+ * Queues in the remap pool are visible to all contexts, so the context the
+ * queue was allocated for doesn't need to match. Other queues were unmapped
+ * from their previous context when released and are mapped to @context_id
+ * here, which still saves allocating and clearing the coherent memory.
+ */
+static bool edgetpu_queue_cache_get(struct edgetpu_mailbox_manager *mgr,
+				    enum edgetpu_context_id context_id, size_t size,
+				    edgetpu_queue_mem *mem)
+{
+	struct edgetpu_queue_mem_cache *cache = &mgr->queue_cache;
+	struct edgetpu_queue_cache_entry *cur, *found = NULL;
+
+	mutex_lock(&cache->lock);
+	list_for_each_entry(cur, &cache->entries, list) {
+		if (cur->mem.size == size) {
+			found = cur;
+			list_del(&found->list);
+			cache->count--;
+			break;
+		}
+	}
+	mutex_unlock(&cache->lock);
+	if (!found)
+		return false;
+	*mem = found->mem;
+	kfree(found);
+	if (!mgr->etdev->iremap_pool && edgetpu_coherent_mem_tpu_map(mgr->etdev, mem, context_id)) {
+		edgetpu_free_coherent_unmapped(mgr->etdev, mem);
+		return false;
+	}
+	memset(mem->vaddr, 0, mem->size);
+	return true;
+}
+
+/* Puts a released queue to the cache, returns false if the cache is full. */
+static bool edgetpu_queue_cache_put(struct edgetpu_mailbox_manager *mgr,
+				    enum edgetpu_context_id context_id, edgetpu_queue_mem *mem)
+{
+	struct edgetpu_queue_mem_cache *cache = &mgr->queue_cache;
+	struct edgetpu_queue_cache_entry *entry;
+
+	if (READ_ONCE(cache->count) >= EDGETPU_QUEUE_CACHE_MAX)
+		return false;
+	entry = kmalloc(sizeof(*entry), GFP_KERNEL);
+	if (!entry)
+		return false;
+	mutex_lock(&cache->lock);
+	if (cache->count >= EDGETPU_QUEUE_CACHE_MAX) {
+		mutex_unlock(&cache->lock);
+		kfree(entry);
+		return false;
+	}
+	/* the context may go away with its domain before the queue is reused */
+	if (!mgr->etdev->iremap_pool)
+		edgetpu_coherent_mem_tpu_unmap(mgr->etdev, mem, context_id);
+	entry->context_id = context_id;
+	entry->mem = *mem;
+	list_add(&entry->list, &cache->entries);
+	cache->count++;
+	mutex_unlock(&cache->lock);
+	mem->vaddr = NULL;
+	return true;
+}
+
+/*
+ * Frees all the queues in the cache.
+ *
+ * Returns whether any queue was freed.
+ */
+static bool edgetpu_queue_cache_drain(struct edgetpu_mailbox_manager *mgr)
+{
+	struct edgetpu_queue_mem_cache *cache = &mgr->queue_cache;
+	struct edgetpu_queue_cache_entry *cur, *nxt;
+	bool freed;
+
+	mutex_lock(&cache->lock);
+	freed = cache->count;
+	list_for_each_entry_safe(cur, nxt, &cache->entries, list) {
+		list_del(&cur->list);
+		if (mgr->etdev->iremap_pool)
+			edgetpu_iremap_free(mgr->etdev, &cur->mem, cur->context_id);
+		else
+			edgetpu_free_coherent_unmapped(mgr->etdev, &cur->mem);
+		kfree(cur);
+	}
+	cache->count = 0;
+	mutex_unlock(&cache->lock);
+	return freed;
 }
 
 static int edgetpu_mailbox_do_alloc_queue(struct edgetpu_dev *etdev,
@@ -496,11 +940,18 @@ static int edgetpu_mailbox_do_alloc_queue(struct edgetpu_dev *etdev,
 					  u32 unit, edgetpu_queue_mem *mem)
 {
 	u32 size = unit * queue_size;
+	enum edgetpu_context_id context_id = edgetpu_mailbox_context_id(mailbox);
+	int ret;
 
 	/* Align queue size to page size for TPU MMU map. */
 	size = __ALIGN_KERNEL(size, PAGE_SIZE);
-	return edgetpu_iremap_alloc(etdev, size, mem,
-				    edgetpu_mailbox_context_id(mailbox));
+	if (edgetpu_queue_cache_get(etdev->mailbox_manager, context_id, size, mem))
+		return 0;
+	ret = edgetpu_iremap_alloc(etdev, size, mem, context_id);
+	/* cached queues of other sizes may be what's holding the memory */
+	if (ret == -ENOMEM && edgetpu_queue_cache_drain(etdev->mailbox_manager))
+		ret = edgetpu_iremap_alloc(etdev, size, mem, context_id);
+	return ret;
 }
 
 /*
@@ -530,6 +981,18 @@ int edgetpu_mailbox_alloc_queue(struct edgetpu_dev *etdev,
 	return 0;
 }
 
+static void edgetpu_mailbox_do_free_queue(struct edgetpu_dev *etdev,
+					  enum edgetpu_context_id context_id,
+					  edgetpu_queue_mem *mem)
+{
+	if (!mem->vaddr)
+		return;
+
+	if (edgetpu_queue_cache_put(etdev->mailbox_manager, context_id, mem))
+		return;
+	edgetpu_iremap_free(etdev, mem, context_id);
+}
+
 /*
  * Releases the queue memory previously allocated with
  * edgetpu_mailbox_alloc_queue().
@@ -540,10 +1003,7 @@ void edgetpu_mailbox_free_queue(struct edgetpu_dev *etdev,
 				struct edgetpu_mailbox *mailbox,
 				edgetpu_queue_mem *mem)
 {
-	if (!mem->vaddr)
-		return;
-
-	edgetpu_iremap_free(etdev, mem, edgetpu_mailbox_context_id(mailbox));
+	edgetpu_mailbox_do_free_queue(etdev, edgetpu_mailbox_context_id(mailbox), mem);
 }
 
 /*
@@ -556,6 +1016,11 @@ edgetpu_mailbox_create_mgr(struct edgetpu_dev *etdev,
 	struct edgetpu_mailbox_manager *mgr;
 	uint total = 0;
 
+	/* the submission and response paths must not write to the same cache line */
+	BUILD_BUG_ON(IS_ENABLED(CONFIG_SMP) &&
+		     offsetof(struct edgetpu_mailbox, cmd_queue_tail) / SMP_CACHE_BYTES ==
+		     offsetof(struct edgetpu_mailbox, resp_queue_head) / SMP_CACHE_BYTES);
+
 	total += 1; /* KCI mailbox */
 	total += desc->num_vii_mailbox;
 	total += desc->num_p2p_mailbox;
@@ -586,6 +1051,12 @@ edgetpu_mailbox_create_mgr(struct edgetpu_dev *etdev,
 		return ERR_PTR(-ENOMEM);
 	rwlock_init(&mgr->mailboxes_lock);
 	mutex_init(&mgr->open_devices.lock);
+	mutex_init(&mgr->queue_cache.lock);
+	INIT_LIST_HEAD(&mgr->queue_cache.entries);
+	spin_lock_init(&mgr->evict_stats.lock);
+	mutex_init(&mgr->admission.lock);
+	INIT_LIST_HEAD(&mgr->admission.waiters);
+	init_waitqueue_head(&mgr->admission.waitq);
 
 	return mgr;
 }
@@ -621,6 +1092,7 @@ void edgetpu_mailbox_remove_all(struct edgetpu_mailbox_manager *mgr)
 				    kci_mailbox->internal.kci);
 		kfree(kci_mailbox);
 	}
+	edgetpu_queue_cache_drain(mgr);
 }
 
 /*
@@ -818,6 +1290,10 @@ void edgetpu_mailbox_restore_active_mailbox_queues(struct edgetpu_dev *etdev)
 		if (edgetpu_group_finalized_and_attached(group)) {
 			edgetpu_mailbox_reinit_vii(group);
 			edgetpu_mailbox_reinit_external_mailbox(group);
+		} else if (group->vii.parked) {
+			/* the restarted firmware starts over, so do the parked queues */
+			group->vii.cmd_queue_head = group->vii.cmd_queue_tail = 0;
+			group->vii.resp_queue_head = group->vii.resp_queue_tail = 0;
 		}
 		mutex_unlock(&group->lock);
 		edgetpu_device_group_put(group);
@@ -1245,7 +1721,7 @@ int edgetpu_mailbox_activate(struct edgetpu_dev *etdev, u32 mailbox_id, s16 vcid
 	return edgetpu_mailbox_activate_bulk(etdev, BIT(mailbox_id), vcid, first_open);
 }
 
-void edgetpu_mailbox_deactivate_bulk(struct edgetpu_dev *etdev, u32 mailbox_map)
+int edgetpu_mailbox_deactivate_bulk(struct edgetpu_dev *etdev, u32 mailbox_map)
 {
 	struct edgetpu_handshake *eh = &etdev->mailbox_manager->open_devices;
 	int ret = 0;
@@ -1262,11 +1738,12 @@ void edgetpu_mailbox_deactivate_bulk(struct edgetpu_dev *etdev, u32 mailbox_map)
 	eh->state &= ~mailbox_map;
 	eh->fw_state &= ~mailbox_map;
 	mutex_unlock(&eh->lock);
+	return ret;
 }
 
-void edgetpu_mailbox_deactivate(struct edgetpu_dev *etdev, u32 mailbox_id)
+int edgetpu_mailbox_deactivate(struct edgetpu_dev *etdev, u32 mailbox_id)
 {
-	edgetpu_mailbox_deactivate_bulk(etdev, BIT(mailbox_id));
+	return edgetpu_mailbox_deactivate_bulk(etdev, BIT(mailbox_id));
 }
 
 void edgetpu_handshake_clear_fw_state(struct edgetpu_handshake *eh)
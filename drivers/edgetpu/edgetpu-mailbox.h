@@ -7,10 +7,16 @@
 #ifndef __EDGETPU_MAILBOX_H__
 #define __EDGETPU_MAILBOX_H__
 
+#include <linux/atomic.h>
+#include <linux/cache.h>
 #include <linux/compiler.h>
 #include <linux/irqreturn.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
 #include <linux/spinlock.h>
 #include <linux/types.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
 
 #include "edgetpu-internal.h"
 #include "edgetpu.h"
@@ -51,9 +57,7 @@ struct edgetpu_mailbox {
 	 */
 
 	u32 cmd_queue_size; /* size of cmd queue */
-	u32 cmd_queue_tail; /* offset within the cmd queue */
 	u32 resp_queue_size; /* size of resp queue */
-	u32 resp_queue_head; /* offset within the resp queue */
 
 	/* IRQ handler */
 	void (*handle_irq)(struct edgetpu_mailbox *mailbox);
@@ -66,10 +70,41 @@ struct edgetpu_mailbox {
 		struct edgetpu_kci *kci;
 		struct edgetpu_device_group *group;
 	} internal;
+
+	/*
+	 * The queue indices are written by command submitters and the response
+	 * handler respectively, keep them on separate cache lines. Checked by
+	 * tools/edgetpu-layout/edgetpu-layout-check.py.
+	 */
+	u32 cmd_queue_tail ____cacheline_aligned_in_smp; /* offset within the cmd queue */
+	u32 resp_queue_head ____cacheline_aligned_in_smp; /* offset within the resp queue */
 };
 
 typedef struct edgetpu_coherent_mem edgetpu_queue_mem;
 
+/*
+ * Kernel-side extension of a VII command queue.
+ *
+ * Commands that don't fit in the hardware command queue are kept here and
+ * moved to the hardware queue from @refill_work, which is scheduled on each
+ * response doorbell.
+ */
+struct edgetpu_vii_overflow {
+	/* protects all fields below and the hardware command queue tail */
+	struct mutex lock;
+	/* the attached mailbox, NULL when the VII is removed */
+	struct edgetpu_mailbox *mailbox;
+	void *buf;
+	u32 size;		/* capacity of @buf in elements */
+	u32 elem_size;		/* size of one command element in bytes */
+	u32 head;		/* index of the oldest pending element */
+	u32 count;		/* number of pending elements */
+	/* whether the tail CSR update rings the doorbell by itself */
+	bool tail_doorbell;
+	struct edgetpu_vii *vii;
+	struct work_struct refill_work;
+};
+
 struct edgetpu_vii {
 	/*
 	 * The mailbox this VII uses, can be NULL when uninitialized or mailbox
@@ -79,6 +114,19 @@ struct edgetpu_vii {
 	struct edgetpu_dev *etdev;
 	edgetpu_queue_mem cmd_queue_mem;
 	edgetpu_queue_mem resp_queue_mem;
+	/* NULL unless the group asked for an overflow command queue */
+	struct edgetpu_vii_overflow *overflow;
+	/*
+	 * Whether the mailbox is released but the queues are kept allocated and
+	 * mapped in @parked_context_id, see edgetpu_mailbox_park_vii().
+	 */
+	bool parked;
+	enum edgetpu_context_id parked_context_id;
+	/* queue indexes saved when parked, restored on the next attach */
+	u32 cmd_queue_head;
+	u32 cmd_queue_tail;
+	u32 resp_queue_head;
+	u32 resp_queue_tail;
 };
 
 /* Structure to hold info about mailbox and its queues. */
@@ -135,8 +183,57 @@ struct edgetpu_handshake {
 	u32 fw_state;
 };
 
+/*
+ * Cache of queue memory released by VII and external mailboxes, reused by
+ * queues of the same size instead of allocating fresh memory.
+ *
+ * Memory from the instruction remap pool keeps its static TPU mapping. Other
+ * queue memory is unmapped from its context while cached, as the context's
+ * domain may be freed, and is mapped again to the context reusing it.
+ */
+struct edgetpu_queue_mem_cache {
+	struct mutex lock;
+	/* fields protected by @lock */
+	struct list_head entries;
+	uint count;
+};
+
 typedef u32 (*get_csr_base_t)(uint index);
 
+/*
+ * Statistics of VII mailboxes taken from idle groups when all are in use, see
+ * edgetpu_group_attach_or_evict_locked().
+ */
+struct edgetpu_mailbox_evict_stats {
+	spinlock_t lock;	/* protects all fields below */
+	u64 evictions;
+	u64 evict_ns_total;
+	u64 evict_ns_max;
+	u64 swap_ins;		/* evicted groups attached again */
+	u64 swap_in_ns_total;
+	u64 swap_in_ns_max;
+};
+
+/* A group waiting for a VII mailbox, fields protected by the admission lock. */
+struct edgetpu_admission_waiter {
+	struct list_head list;
+	bool queued;		/* whether @list is in the waiters list */
+	u32 rank;
+	/* jiffies after which the group stops waiting */
+	unsigned long deadline;
+	/* admission sequence number seen by the last failed attempt */
+	int seq;
+};
+
+/* Groups waiting for a VII mailbox, see edgetpu_group_admit_locked(). */
+struct edgetpu_mailbox_admission {
+	struct mutex lock;		/* protects @waiters */
+	struct list_head waiters;	/* sorted by descending rank */
+	/* increased and @waitq woken up whenever a VII mailbox is released */
+	atomic_t seq;
+	wait_queue_head_t waitq;
+};
+
 struct edgetpu_mailbox_manager {
 	struct edgetpu_dev *etdev;
 	/* total number of mailboxes that edgetpu device could provide */
@@ -154,6 +251,9 @@ struct edgetpu_mailbox_manager {
 	get_csr_base_t get_cmd_queue_csr_base;
 	get_csr_base_t get_resp_queue_csr_base;
 	struct edgetpu_handshake open_devices;
+	struct edgetpu_queue_mem_cache queue_cache;
+	struct edgetpu_mailbox_evict_stats evict_stats;
+	struct edgetpu_mailbox_admission admission;
 };
 
 /* the structure to configure a mailbox manager */
@@ -292,7 +392,13 @@ edgetpu_mailbox_vii_add(struct edgetpu_mailbox_manager *mgr, uint id);
  */
 int edgetpu_mailbox_validate_attr(const struct edgetpu_mailbox_attr *attr);
 /*
- * Sets mailbox and allocates queues to @vii.
+ * Validates the mailbox attributes of EDGETPU_CREATE_GROUP_EXT, see its error
+ * cases in edgetpu.h.
+ */
+int edgetpu_mailbox_validate_attr_ext(const struct edgetpu_create_group_ext *ext);
+/*
+ * Sets mailbox and allocates queues to @vii, or reuses the queues of a parked
+ * @vii.
  *
  * @group is the device group that @vii will be associated with,
  * @group->mbox_attr is used to set the VII mailbox attributes.
@@ -305,6 +411,47 @@ int edgetpu_mailbox_validate_attr(const struct edgetpu_mailbox_attr *attr);
 int edgetpu_mailbox_init_vii(struct edgetpu_vii *vii,
 			     struct edgetpu_device_group *group);
 void edgetpu_mailbox_remove_vii(struct edgetpu_vii *vii);
+/*
+ * Releases the mailbox of @vii but keeps its queues allocated, with the queue
+ * indexes saved.
+ *
+ * @context_id is a context the queues stay mapped in after the mailbox is
+ * released, used for freeing them later.
+ *
+ * The next edgetpu_mailbox_init_vii() takes a new mailbox and only programs
+ * its CSRs with the kept queues and indexes. edgetpu_mailbox_remove_vii()
+ * frees the kept queues.
+ */
+void edgetpu_mailbox_park_vii(struct edgetpu_vii *vii,
+			      enum edgetpu_context_id context_id);
+/*
+ * Submits @count command elements from user address @cmds to @vii, queuing
+ * the ones that don't fit in the hardware command queue in the overflow queue.
+ *
+ * Caller holds the group lock and a wakelock of the group.
+ *
+ * Returns the number of elements accepted, or a negative errno on error.
+ */
+int edgetpu_mailbox_vii_submit(struct edgetpu_vii *vii, const void __user *cmds,
+			       u32 count);
+/*
+ * Returns whether the firmware has fetched all the commands of @vii, nothing is
+ * left in the overflow queue and the runtime has consumed all the responses,
+ * i.e. the mailbox can be released without dropping any command or response.
+ *
+ * Caller holds the group lock and the device is powered.
+ */
+bool edgetpu_mailbox_vii_idle(struct edgetpu_vii *vii);
+/*
+ * Resets the queue indexes of the VII mailbox, or the ones saved if @vii is
+ * parked, and drops commands pending in the overflow queue, for recovering the
+ * VII after a job lockup.
+ *
+ * The device is powered if @vii has a mailbox.
+ */
+void edgetpu_mailbox_reset_vii(struct edgetpu_vii *vii);
+/* Frees the overflow queue of @vii. Called once the group is released. */
+void edgetpu_mailbox_release_vii_overflow(struct edgetpu_vii *vii);
 
 
 /*
@@ -379,13 +526,17 @@ int edgetpu_mailbox_activate(struct edgetpu_dev *etdev, u32 mailbox_id, s16 vcid
 /*
  * Similar to edgetpu_mailbox_activate_bulk() but sends CLOSE_DEVICE KCI with the @mailbox_map
  * instead.
+ *
+ * The mailboxes are considered closed even if the KCI fails.
+ *
+ * Returns what edgetpu_kci_close_device() returned.
  */
-void edgetpu_mailbox_deactivate_bulk(struct edgetpu_dev *etdev, u32 mailbox_map);
+int edgetpu_mailbox_deactivate_bulk(struct edgetpu_dev *etdev, u32 mailbox_map);
 
 /*
  * Similar to edgetpu_mailbox_activate() but sends CLOSE_DEVICE KCI instead.
  */
-void edgetpu_mailbox_deactivate(struct edgetpu_dev *etdev, u32 mailbox_id);
+int edgetpu_mailbox_deactivate(struct edgetpu_dev *etdev, u32 mailbox_id);
 
 /* Sets @eh->fw_state to 0. */
 void edgetpu_handshake_clear_fw_state(struct edgetpu_handshake *eh);
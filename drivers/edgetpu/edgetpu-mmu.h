@@ -57,6 +57,8 @@ struct edgetpu_iommu_domain {
 	 * edgetpu_mmu_add_translation() about @context_id for more details.
 	 */
 	int token;
+	/* Slot of @iommu_domain in the domain pool, -1 if not from the pool. */
+	int pool_id;
 };
 
 /*
@@ -307,6 +309,12 @@ void edgetpu_mmu_use_dev_dram(struct edgetpu_dev *etdev, bool use_dev_dram);
 struct edgetpu_iommu_domain *
 edgetpu_mmu_alloc_domain(struct edgetpu_dev *etdev);
 
+/*
+ * Returns how many more domains edgetpu_mmu_alloc_domain() can hand out,
+ * UINT_MAX if the number is not bounded.
+ */
+unsigned int edgetpu_mmu_domain_headroom(struct edgetpu_dev *etdev);
+
 /* Frees the domain previously allocated by edgetpu_mmu_alloc_domain(). */
 void edgetpu_mmu_free_domain(struct edgetpu_dev *etdev,
 			     struct edgetpu_iommu_domain *etdomain);
@@ -18,6 +18,7 @@
 #include "edgetpu-iremap-pool.h"
 #include "edgetpu-mmu.h"
 #include "edgetpu-mobile-platform.h"
+#include "edgetpu-sim.h"
 #include "edgetpu-telemetry.h"
 #include "mobile-firmware.h"
 #include "mobile-pm.h"
@@ -318,6 +319,7 @@ static int edgetpu_mobile_platform_probe(struct platform_device *pdev,
 	struct edgetpu_dev *etdev = &etmdev->edgetpu_dev;
 	struct resource *r;
 	struct edgetpu_mapped_resource regs;
+	bool is_sim = edgetpu_sim_is_sim_device(dev);
 	int ret;
 	struct edgetpu_iface_params iface_params[] = {
 		/* Default interface  */
@@ -332,18 +334,26 @@ static int edgetpu_mobile_platform_probe(struct platform_device *pdev,
 	etdev->dev = dev;
 	etdev->num_cores = EDGETPU_NUM_CORES;
 
-	r = platform_get_resource(pdev, IORESOURCE_MEM, 0);
-	if (IS_ERR_OR_NULL(r)) {
-		dev_err(dev, "failed to get memory resource");
-		return -ENODEV;
-	}
+	if (is_sim) {
+		ret = edgetpu_sim_regs_create(dev, &regs);
+		if (ret) {
+			dev_err(dev, "failed to allocate simulated registers: %d", ret);
+			return ret;
+		}
+	} else {
+		r = platform_get_resource(pdev, IORESOURCE_MEM, 0);
+		if (IS_ERR_OR_NULL(r)) {
+			dev_err(dev, "failed to get memory resource");
+			return -ENODEV;
+		}
 
-	regs.phys = r->start;
-	regs.size = resource_size(r);
-	regs.mem = devm_ioremap_resource(dev, r);
-	if (IS_ERR_OR_NULL(regs.mem)) {
-		dev_err(dev, "failed to map registers");
-		return -ENODEV;
+		regs.phys = r->start;
+		regs.size = resource_size(r);
+		regs.mem = devm_ioremap_resource(dev, r);
+		if (IS_ERR_OR_NULL(regs.mem)) {
+			dev_err(dev, "failed to map registers");
+			return -ENODEV;
+		}
 	}
 
 	mutex_init(&etmdev->platform_pwr.policy_lock);
@@ -355,6 +365,13 @@ static int edgetpu_mobile_platform_probe(struct platform_device *pdev,
 		return ret;
 	}
 
+	/*
+	 * A simulated device has no carveout: firmware, queues and logs all come from the DMA
+	 * API instead.
+	 */
+	if (is_sim)
+		goto add_device;
+
 	ret = edgetpu_platform_setup_fw_region(etmdev);
 	if (ret) {
 		dev_err(dev, "setup fw regions failed: %d", ret);
@@ -379,6 +396,7 @@ static int edgetpu_mobile_platform_probe(struct platform_device *pdev,
 		goto out_cleanup_fw;
 	}
 
+add_device:
 	etdev->mcp_id = -1;
 	etdev->mcp_die_index = 0;
 	ret = edgetpu_device_add(etdev, &regs, iface_params, ARRAY_SIZE(iface_params));
@@ -412,15 +430,28 @@ static int edgetpu_mobile_platform_probe(struct platform_device *pdev,
 	}
 #endif
 
-	edgetpu_mobile_get_telemetry_mem(etmdev);
-	ret = edgetpu_telemetry_init(etdev, etmdev->log_mem, etmdev->trace_mem);
+	if (is_sim) {
+		ret = edgetpu_telemetry_init(etdev, NULL, NULL);
+	} else {
+		edgetpu_mobile_get_telemetry_mem(etmdev);
+		ret = edgetpu_telemetry_init(etdev, etmdev->log_mem, etmdev->trace_mem);
+	}
 	if (ret)
 		goto out_remove_irq;
 
-	ret = edgetpu_mobile_firmware_create(etdev);
+	if (is_sim) {
+		ret = edgetpu_sim_create(etdev);
+		if (ret) {
+			dev_err(dev, "simulator setup failed: %d", ret);
+			goto out_tel_exit;
+		}
+		ret = edgetpu_sim_firmware_create(etdev);
+	} else {
+		ret = edgetpu_mobile_firmware_create(etdev);
+	}
 	if (ret) {
 		dev_err(dev, "initialize firmware downloader failed: %d", ret);
-		goto out_tel_exit;
+		goto out_destroy_sim;
 	}
 
 	etdev_dbg(etdev, "Creating thermal device");
@@ -441,6 +472,8 @@ static int edgetpu_mobile_platform_probe(struct platform_device *pdev,
 	return 0;
 out_destroy_fw:
 	edgetpu_mobile_firmware_destroy(etdev);
+out_destroy_sim:
+	edgetpu_sim_destroy(etdev);
 out_tel_exit:
 	edgetpu_telemetry_exit(etdev);
 out_remove_irq:
@@ -465,6 +498,7 @@ static int edgetpu_mobile_platform_remove(struct platform_device *pdev)
 	if (etmdev->before_remove)
 		etmdev->before_remove(etmdev);
 	edgetpu_mobile_firmware_destroy(etdev);
+	edgetpu_sim_destroy(etdev);
 	edgetpu_platform_remove_irq(etmdev);
 	edgetpu_pm_get(etdev->pm);
 	edgetpu_telemetry_exit(etdev);
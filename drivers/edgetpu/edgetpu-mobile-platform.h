@@ -59,6 +59,12 @@ struct edgetpu_mobile_platform_pwr {
 
 	/* ACPM set rate callback. Must be implemented */
 	int (*acpm_set_rate)(unsigned int id, unsigned long rate);
+
+	/*
+	 * ACPM get rate callback, may be NULL to read the rate from ACPM. Chips
+	 * providing it keep the rate themselves, the ACPM init frequency is not set.
+	 */
+	unsigned long (*acpm_get_rate)(unsigned int id, unsigned long dbg_val);
 };
 
 struct edgetpu_mobile_platform_dev {
@@ -21,6 +21,9 @@
 #if IS_ENABLED(CONFIG_EDGETPU_TEST)
 #include "unittests/factory/fake-edgetpu-firmware.h"
 #define SIM_PCHANNEL(etdev) fake_edgetpu_firmware_sim_pchannel(etdev)
+#elif IS_ENABLED(CONFIG_EDGETPU_SIM)
+#include "edgetpu-sim.h"
+#define SIM_PCHANNEL(etdev) edgetpu_sim_pchannel(etdev)
 #else
 #define SIM_PCHANNEL(...)
 #endif
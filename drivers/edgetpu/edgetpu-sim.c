@@ -0,0 +1,836 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Software simulator of the TPU and its firmware, for running the driver
+ * without the hardware.
+ *
+ * A simulated device is a platform device compatible with
+ * EDGETPU_SIM_COMPATIBLE. Its CSRs are backed by RAM, and a kernel thread
+ * plays the role of the firmware: it polls the KCI and VII command queues
+ * through the same CSRs the firmware would, answers the commands in the
+ * response queues and then calls the mailbox and telemetry interrupt handlers
+ * as the interrupt controller would.
+ *
+ * KCI commands are acknowledged, FIRMWARE_INFO and GET_USAGE fill their
+ * payloads. VII commands are opaque to the driver, each of them is answered by
+ * a response whose leading bytes echo the command.
+ *
+ * Latency and faults are injected through debugfs, see edgetpu_sim_create().
+ *
+ * Copyright (C) 2022 Google LLC
+ */
+
+#include <linux/debugfs.h>
+#include <linux/delay.h>
+#include <linux/device.h>
+#include <linux/gfp.h>
+#include <linux/irqflags.h>
+#include <linux/kthread.h>
+#include <linux/list.h>
+#include <linux/minmax.h>
+#include <linux/mm.h>
+#include <linux/moduleparam.h>
+#include <linux/mutex.h>
+#include <linux/of.h>
+#include <linux/sched/clock.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/timekeeping.h>
+#include <linux/wait.h>
+
+#include "edgetpu-config.h"
+#include "edgetpu-device-group.h"
+#include "edgetpu-firmware.h"
+#include "edgetpu-internal.h"
+#include "edgetpu-kci.h"
+#include "edgetpu-mailbox.h"
+#include "edgetpu-sim.h"
+#include "edgetpu-telemetry.h"
+#include "edgetpu-usage-stats.h"
+
+/* Number of injected reverse KCIs waiting to be sent. */
+#define EDGETPU_SIM_MAX_PENDING_RKCI	8
+
+/* Longest log message injected through debugfs. */
+#define EDGETPU_SIM_LOG_MSG_MAX		64
+
+/*
+ * Interval of polling the command queues when they are empty. The thread only
+ * polls while the firmware runs, it sleeps while the device is off or hung.
+ */
+static uint sim_poll_us = 50;
+module_param(sim_poll_us, uint, 0660);
+MODULE_PARM_DESC(sim_poll_us,
+		 "Interval in microseconds the running simulated firmware polls idle queues");
+
+/* Simulated devices bound to the driver, for in-kernel tests. */
+static LIST_HEAD(edgetpu_sim_devices);
+static DEFINE_MUTEX(edgetpu_sim_devices_lock);
+
+struct edgetpu_sim {
+	struct edgetpu_dev *etdev;
+	struct list_head list;		/* in edgetpu_sim_devices */
+	struct task_struct *thread;
+	struct dentry *d_entry;
+	/* the thread waits here while the firmware isn't running */
+	wait_queue_head_t waitq;
+	/* whether the firmware is running, cleared on shutdown and power down */
+	bool running;
+	/* whether the host sent the log buffer, messages are dropped until then */
+	bool log_mapped;
+	/* mailboxes opened with OPEN_DEVICE, only those are served */
+	unsigned long open_mailboxes;
+	/* delay before serving newly posted commands, in microseconds */
+	u32 latency_us;
+	u32 fault;			/* enum edgetpu_sim_fault */
+	u64 boot_time;			/* seconds since 1970 of the last firmware start */
+
+	/* reverse KCIs injected from debugfs, sent by the firmware thread */
+	spinlock_t rkci_lock;
+	struct edgetpu_kci_response_element rkci[EDGETPU_SIM_MAX_PENDING_RKCI];
+	uint n_rkci;
+
+	/* protects the log buffer against concurrent writers */
+	spinlock_t log_lock;
+
+	/* statistics */
+	atomic64_t kci_cmds;
+	atomic64_t vii_cmds;
+	atomic64_t rkcis;
+	atomic64_t dropped;
+	u32 max_outstanding;		/* most VII commands seen pending at once */
+};
+
+static inline struct edgetpu_sim *to_sim(struct edgetpu_dev *etdev)
+{
+	return etdev->sim;
+}
+
+bool edgetpu_sim_is_sim_device(struct device *dev)
+{
+	return of_device_is_compatible(dev->of_node, EDGETPU_SIM_COMPATIBLE);
+}
+
+struct edgetpu_dev *edgetpu_sim_test_device(void)
+{
+	struct edgetpu_sim *sim;
+
+	mutex_lock(&edgetpu_sim_devices_lock);
+	sim = list_first_entry_or_null(&edgetpu_sim_devices, struct edgetpu_sim, list);
+	mutex_unlock(&edgetpu_sim_devices_lock);
+	return sim ? sim->etdev : NULL;
+}
+
+static void edgetpu_sim_regs_free(void *data)
+{
+	free_pages_exact(data, EDGETPU_SIM_CSR_SIZE);
+}
+
+int edgetpu_sim_regs_create(struct device *dev, struct edgetpu_mapped_resource *regs)
+{
+	void *mem;
+	int ret;
+
+	/*
+	 * Physically contiguous so the CSR pages can be mapped to user space
+	 * like those of a real device.
+	 */
+	mem = alloc_pages_exact(EDGETPU_SIM_CSR_SIZE, GFP_KERNEL | __GFP_ZERO);
+	if (!mem)
+		return -ENOMEM;
+	ret = devm_add_action_or_reset(dev, edgetpu_sim_regs_free, mem);
+	if (ret)
+		return ret;
+	regs->mem = (void __iomem *)mem;
+	regs->phys = virt_to_phys(mem);
+	regs->size = EDGETPU_SIM_CSR_SIZE;
+	return 0;
+}
+
+void edgetpu_sim_pchannel(struct edgetpu_dev *etdev)
+{
+	u32 val;
+
+	if (!to_sim(etdev))
+		return;
+	val = edgetpu_dev_read_32(etdev, EDGETPU_REG_POWER_CONTROL);
+	/* Accept every state change request, drop the acceptance with the request. */
+	if (val & PREQ)
+		val = (val | PACCEPT) & ~PDENY;
+	else
+		val &= ~(PACCEPT | PDENY);
+	edgetpu_dev_write_32(etdev, EDGETPU_REG_POWER_CONTROL, val);
+}
+
+void edgetpu_sim_power_down(struct edgetpu_dev *etdev)
+{
+	struct edgetpu_sim *sim = to_sim(etdev);
+
+	if (!sim)
+		return;
+	/* The firmware may not have been shut down, e.g. after a crash. */
+	WRITE_ONCE(sim->running, false);
+	WRITE_ONCE(sim->log_mapped, false);
+	WRITE_ONCE(sim->open_mailboxes, 0);
+}
+
+/* Simulated devices share one rate, like the TPUs share their ACPM domain. */
+static unsigned long edgetpu_sim_acpm_rate;
+
+int edgetpu_sim_acpm_set_rate(unsigned int id, unsigned long rate)
+{
+	WRITE_ONCE(edgetpu_sim_acpm_rate, rate);
+	return 0;
+}
+
+unsigned long edgetpu_sim_acpm_get_rate(unsigned int id, unsigned long dbg_val)
+{
+	return READ_ONCE(edgetpu_sim_acpm_rate);
+}
+
+/* Copies @length bytes to the log ring, the inverse of copy_with_wrap() in edgetpu-telemetry.c */
+static void edgetpu_sim_log_copy(struct edgetpu_telemetry_header *header, const void *src,
+				 u32 length, u32 size, void *start)
+{
+	const u32 wrap_bit = size + sizeof(*header);
+	u32 remaining = 0;
+	u32 tail = header->tail & (wrap_bit - 1);
+
+	if (tail + length < size) {
+		memcpy(start + tail, src, length);
+		header->tail += length;
+	} else {
+		remaining = size - tail;
+		memcpy(start + tail, src, remaining);
+		memcpy(start, src + remaining, length - remaining);
+		header->tail = (header->tail & wrap_bit) ^ wrap_bit;
+		header->tail |= length - remaining;
+	}
+}
+
+/*
+ * Appends a message to the log buffer of the first core.
+ *
+ * Returns true if the message is written, false if it is dropped.
+ */
+static bool edgetpu_sim_log(struct edgetpu_sim *sim, s16 level, const char *msg)
+{
+	struct edgetpu_telemetry *log;
+	struct edgetpu_telemetry_header *header;
+	struct edgetpu_log_entry_header entry = {
+		.code = level,
+		.length = strlen(msg),
+		.timestamp = local_clock(),
+	};
+	u32 size, wrap_bit, head, tail, used;
+	bool written = false;
+
+	if (!sim->etdev->telemetry || !READ_ONCE(sim->log_mapped) || !entry.length)
+		return false;
+	log = &sim->etdev->telemetry[0].log;
+	if (!log->inited)
+		return false;
+	header = log->header;
+	size = log->coherent_mem.size - sizeof(*header);
+	wrap_bit = size + sizeof(*header);
+
+	spin_lock(&sim->log_lock);
+	head = READ_ONCE(header->head);
+	tail = header->tail;
+	if ((head & wrap_bit) == (tail & wrap_bit))
+		used = (tail & (wrap_bit - 1)) - (head & (wrap_bit - 1));
+	else
+		used = size - (head & (wrap_bit - 1)) + (tail & (wrap_bit - 1));
+	if (used + sizeof(entry) + entry.length > size) {
+		header->entries_dropped++;
+	} else {
+		edgetpu_sim_log_copy(header, &entry, sizeof(entry), size, header + 1);
+		edgetpu_sim_log_copy(header, msg, entry.length, size, header + 1);
+		written = true;
+	}
+	spin_unlock(&sim->log_lock);
+	return written;
+}
+
+/* Delivers the response doorbells rung in @rung, a bitmap of mailbox indexes. */
+static void edgetpu_sim_raise_irq(struct edgetpu_sim *sim, unsigned long rung)
+{
+	struct edgetpu_dev *etdev = sim->etdev;
+	struct edgetpu_mailbox_manager *mgr = etdev->mailbox_manager;
+	unsigned long flags;
+	uint i;
+	u32 base;
+
+	for_each_set_bit(i, &rung, BITS_PER_LONG) {
+		base = mgr->get_resp_queue_csr_base(i);
+		edgetpu_dev_write_32_sync(etdev, base + offsetof(struct edgetpu_mailbox_resp_queue_csr,
+								 doorbell_status), 1);
+	}
+	/* the handlers expect to run in hard IRQ context */
+	local_irq_save(flags);
+	edgetpu_telemetry_irq_handler(etdev);
+	edgetpu_mailbox_handle_irq(mgr);
+	local_irq_restore(flags);
+	/* doorbell_clear is write-1-to-clear on hardware, emulate it */
+	for_each_set_bit(i, &rung, BITS_PER_LONG) {
+		base = mgr->get_resp_queue_csr_base(i);
+		edgetpu_dev_write_32(etdev, base + offsetof(struct edgetpu_mailbox_resp_queue_csr,
+							    doorbell_status), 0);
+		edgetpu_dev_write_32(etdev, base + offsetof(struct edgetpu_mailbox_resp_queue_csr,
+							    doorbell_clear), 0);
+	}
+}
+
+/* Returns the number of elements pending in the command queue of @mailbox. */
+static u32 edgetpu_sim_cmd_count(struct edgetpu_mailbox *mailbox)
+{
+	u32 head = EDGETPU_MAILBOX_CMD_QUEUE_READ(mailbox, head);
+	u32 tail = EDGETPU_MAILBOX_CMD_QUEUE_READ(mailbox, tail);
+
+	return circular_queue_count(head, tail, mailbox->cmd_queue_size);
+}
+
+/* Returns whether the response queue of @mailbox has no room. */
+static bool edgetpu_sim_resp_full(struct edgetpu_mailbox *mailbox)
+{
+	u32 head = EDGETPU_MAILBOX_RESP_QUEUE_READ(mailbox, head);
+	u32 tail = EDGETPU_MAILBOX_RESP_QUEUE_READ(mailbox, tail);
+
+	return circular_queue_count(head, tail, mailbox->resp_queue_size) ==
+	       mailbox->resp_queue_size;
+}
+
+/* Returns the slot at the tail of the response queue of @mailbox, of @elem_size bytes each. */
+static void *edgetpu_sim_resp_slot(struct edgetpu_mailbox *mailbox, void *queue, u32 elem_size)
+{
+	u32 tail = EDGETPU_MAILBOX_RESP_QUEUE_READ(mailbox, tail);
+
+	return queue + CIRCULAR_QUEUE_REAL_INDEX(tail) * elem_size;
+}
+
+/* Publishes the response written to edgetpu_sim_resp_slot(). */
+static void edgetpu_sim_resp_push(struct edgetpu_mailbox *mailbox)
+{
+	u32 tail = EDGETPU_MAILBOX_RESP_QUEUE_READ(mailbox, tail);
+
+	EDGETPU_MAILBOX_WRITE_SYNC(mailbox, mailbox->resp_queue_csr_base,
+				   struct edgetpu_mailbox_resp_queue_csr, tail,
+				   circular_queue_inc(tail, 1, mailbox->resp_queue_size));
+}
+
+/* Returns the kernel address of the KCI payload described by @dma, or NULL. */
+static void *edgetpu_sim_kci_payload(struct edgetpu_kci *kci,
+				     const struct edgetpu_dma_descriptor *dma, size_t min_size)
+{
+	const struct edgetpu_coherent_mem *mems[] = { &kci->data_mem, &kci->usage_mem };
+	const struct edgetpu_coherent_mem *mem;
+	int i;
+
+	if (!dma->address || dma->size < min_size)
+		return NULL;
+	for (i = 0; i < ARRAY_SIZE(mems); i++) {
+		mem = mems[i];
+		if (mem->vaddr && dma->address >= mem->tpu_addr &&
+		    dma->address + dma->size <= mem->tpu_addr + mem->size)
+			return mem->vaddr + (dma->address - mem->tpu_addr);
+	}
+	return NULL;
+}
+
+static u16 edgetpu_sim_fw_info(struct edgetpu_sim *sim, struct edgetpu_kci *kci,
+			       const struct edgetpu_command_element *cmd)
+{
+	struct edgetpu_fw_info *info = edgetpu_sim_kci_payload(kci, &cmd->dma, sizeof(*info));
+
+	if (info) {
+		memset(info, 0, sizeof(*info));
+		info->fw_build_time = sim->boot_time;
+		info->fw_flavor = FW_FLAVOR_SYSTEST;
+	}
+	return KCI_ERROR_OK;
+}
+
+static u16 edgetpu_sim_get_usage(struct edgetpu_sim *sim, struct edgetpu_kci *kci,
+				 const struct edgetpu_command_element *cmd)
+{
+	struct edgetpu_usage_header *header;
+	struct edgetpu_usage_metric *metric;
+
+	header = edgetpu_sim_kci_payload(kci, &cmd->dma, sizeof(*header) + 2 * sizeof(*metric));
+	if (!header)
+		return KCI_ERROR_INVALID_ARGUMENT;
+	metric = (struct edgetpu_usage_metric *)(header + 1);
+	memset(metric, 0, 2 * sizeof(*metric));
+	metric[0].type = EDGETPU_METRIC_TYPE_COUNTER;
+	metric[0].counter.type = EDGETPU_COUNTER_INFERENCES;
+	metric[0].counter.value = atomic64_read(&sim->vii_cmds);
+	metric[1].type = EDGETPU_METRIC_TYPE_MAX_WATERMARK;
+	metric[1].max_watermark.type = EDGETPU_MAX_WATERMARK_OUT_CMDS;
+	metric[1].max_watermark.value = sim->max_outstanding;
+	header->metric_size = sizeof(*metric);
+	header->num_metrics = 2;
+	return KCI_ERROR_OK;
+}
+
+/* Executes a KCI command, returns the response code. */
+static u16 edgetpu_sim_kci_cmd(struct edgetpu_sim *sim, struct edgetpu_kci *kci,
+			       const struct edgetpu_command_element *cmd)
+{
+	if (READ_ONCE(sim->fault) == EDGETPU_SIM_FAULT_KCI_ERROR)
+		return KCI_ERROR_UNKNOWN;
+
+	switch (cmd->code) {
+	case KCI_CODE_FIRMWARE_INFO:
+		return edgetpu_sim_fw_info(sim, kci, cmd);
+	case KCI_CODE_GET_USAGE:
+		return edgetpu_sim_get_usage(sim, kci, cmd);
+	case KCI_CODE_MAP_LOG_BUFFER:
+		WRITE_ONCE(sim->log_mapped, true);
+		return KCI_ERROR_OK;
+	case KCI_CODE_OPEN_DEVICE:
+		WRITE_ONCE(sim->open_mailboxes, sim->open_mailboxes | cmd->dma.flags);
+		return KCI_ERROR_OK;
+	case KCI_CODE_CLOSE_DEVICE:
+		if (READ_ONCE(sim->fault) == EDGETPU_SIM_FAULT_CLOSE_DEVICE)
+			return KCI_ERROR_UNKNOWN;
+		WRITE_ONCE(sim->open_mailboxes, sim->open_mailboxes & ~(unsigned long)cmd->dma.flags);
+		return KCI_ERROR_OK;
+	case KCI_CODE_SHUTDOWN:
+		WRITE_ONCE(sim->running, false);
+		WRITE_ONCE(sim->log_mapped, false);
+		WRITE_ONCE(sim->open_mailboxes, 0);
+		return KCI_ERROR_OK;
+	case KCI_CODE_GET_DEBUG_DUMP:
+	case KCI_CODE_PREFETCH_BUFFER:
+		return KCI_ERROR_UNIMPLEMENTED;
+	default:
+		return KCI_ERROR_OK;
+	}
+}
+
+/*
+ * Serves the KCI mailbox: sends injected reverse KCIs, then answers pending
+ * commands while the response queue has room.
+ *
+ * Returns whether the response doorbell should be rung.
+ */
+static bool edgetpu_sim_serve_kci(struct edgetpu_sim *sim, struct edgetpu_mailbox *mailbox)
+{
+	struct edgetpu_kci *kci = mailbox->internal.kci;
+	struct edgetpu_command_element *cmd;
+	struct edgetpu_kci_response_element *resp;
+	bool rung = false;
+	u32 head, tail;
+
+	if (!kci || !EDGETPU_MAILBOX_CONTEXT_READ(mailbox, context_enable))
+		return false;
+
+	spin_lock(&sim->rkci_lock);
+	while (sim->n_rkci && !edgetpu_sim_resp_full(mailbox)) {
+		resp = edgetpu_sim_resp_slot(mailbox, kci->resp_queue, sizeof(*resp));
+		*resp = sim->rkci[0];
+		edgetpu_sim_resp_push(mailbox);
+		memmove(&sim->rkci[0], &sim->rkci[1], --sim->n_rkci * sizeof(sim->rkci[0]));
+		atomic64_inc(&sim->rkcis);
+		rung = true;
+	}
+	spin_unlock(&sim->rkci_lock);
+
+	/* a crashed firmware only gets the crash report out */
+	if (READ_ONCE(sim->fault) == EDGETPU_SIM_FAULT_CRASH)
+		return rung;
+	head = EDGETPU_MAILBOX_CMD_QUEUE_READ(mailbox, head);
+	tail = EDGETPU_MAILBOX_CMD_QUEUE_READ(mailbox, tail);
+	while (head != tail && READ_ONCE(sim->running)) {
+		if (edgetpu_sim_resp_full(mailbox))
+			break;
+		cmd = &kci->cmd_queue[CIRCULAR_QUEUE_REAL_INDEX(head)];
+		atomic64_inc(&sim->kci_cmds);
+		if (READ_ONCE(sim->fault) == EDGETPU_SIM_FAULT_KCI_DROP) {
+			atomic64_inc(&sim->dropped);
+		} else {
+			resp = edgetpu_sim_resp_slot(mailbox, kci->resp_queue, sizeof(*resp));
+			memset(resp, 0, sizeof(*resp));
+			resp->seq = cmd->seq;
+			resp->code = edgetpu_sim_kci_cmd(sim, kci, cmd);
+			edgetpu_sim_resp_push(mailbox);
+			rung = true;
+		}
+		head = circular_queue_inc(head, 1, mailbox->cmd_queue_size);
+		EDGETPU_MAILBOX_CMD_QUEUE_WRITE(mailbox, head, head);
+	}
+	return rung;
+}
+
+/*
+ * Serves a VII mailbox, answering each command with a response echoing its
+ * leading bytes.
+ *
+ * Returns whether the response doorbell should be rung.
+ */
+static bool edgetpu_sim_serve_vii(struct edgetpu_sim *sim, struct edgetpu_mailbox *mailbox)
+{
+	struct edgetpu_device_group *group = mailbox->internal.group;
+	void *cmd_queue, *resp_queue, *cmd, *resp;
+	u32 cmd_size, resp_size, head, tail, count;
+	bool rung = false;
+
+	if (!group || !test_bit(mailbox->mailbox_id, &sim->open_mailboxes) ||
+	    !EDGETPU_MAILBOX_CONTEXT_READ(mailbox, context_enable))
+		return false;
+	cmd_queue = group->vii.cmd_queue_mem.vaddr;
+	resp_queue = group->vii.resp_queue_mem.vaddr;
+	cmd_size = group->mbox_attr.sizeof_cmd;
+	resp_size = group->mbox_attr.sizeof_resp;
+	if (!cmd_queue || !resp_queue)
+		return false;
+
+	head = EDGETPU_MAILBOX_CMD_QUEUE_READ(mailbox, head);
+	tail = EDGETPU_MAILBOX_CMD_QUEUE_READ(mailbox, tail);
+	count = circular_queue_count(head, tail, mailbox->cmd_queue_size);
+	if (count > sim->max_outstanding)
+		sim->max_outstanding = count;
+	while (head != tail) {
+		if (edgetpu_sim_resp_full(mailbox))
+			break;
+		cmd = cmd_queue + CIRCULAR_QUEUE_REAL_INDEX(head) * cmd_size;
+		resp = edgetpu_sim_resp_slot(mailbox, resp_queue, resp_size);
+		memset(resp, 0, resp_size);
+		memcpy(resp, cmd, min(cmd_size, resp_size));
+		edgetpu_sim_resp_push(mailbox);
+		atomic64_inc(&sim->vii_cmds);
+		rung = true;
+		head = circular_queue_inc(head, 1, mailbox->cmd_queue_size);
+		EDGETPU_MAILBOX_CMD_QUEUE_WRITE(mailbox, head, head);
+	}
+	return rung;
+}
+
+/* Returns whether any mailbox has commands or reverse KCIs to be served. */
+static bool edgetpu_sim_pending(struct edgetpu_sim *sim)
+{
+	struct edgetpu_mailbox_manager *mgr = sim->etdev->mailbox_manager;
+	struct edgetpu_mailbox *mailbox;
+	bool pending = READ_ONCE(sim->n_rkci);
+	uint i;
+
+	read_lock(&mgr->mailboxes_lock);
+	for (i = 0; i < mgr->vii_index_to && !pending; i++) {
+		mailbox = mgr->mailboxes[i];
+		if (mailbox && edgetpu_sim_cmd_count(mailbox))
+			pending = true;
+	}
+	read_unlock(&mgr->mailboxes_lock);
+	return pending;
+}
+
+/* Serves all mailboxes once, returns whether any response was sent. */
+static bool edgetpu_sim_step(struct edgetpu_sim *sim)
+{
+	struct edgetpu_mailbox_manager *mgr = sim->etdev->mailbox_manager;
+	struct edgetpu_mailbox *mailbox;
+	unsigned long rung = 0;
+	u32 latency_us, fault;
+	bool served;
+	uint i;
+
+	fault = READ_ONCE(sim->fault);
+	if (!READ_ONCE(sim->running) || fault == EDGETPU_SIM_FAULT_HANG)
+		return false;
+	if (!edgetpu_sim_pending(sim))
+		return false;
+	latency_us = READ_ONCE(sim->latency_us);
+	if (latency_us)
+		usleep_range(latency_us, latency_us + latency_us / 8 + 1);
+
+	read_lock(&mgr->mailboxes_lock);
+	for (i = 0; i < mgr->vii_index_to; i++) {
+		mailbox = mgr->mailboxes[i];
+		if (!mailbox)
+			continue;
+		if (i == KERNEL_MAILBOX_INDEX)
+			served = edgetpu_sim_serve_kci(sim, mailbox);
+		else
+			served = fault != EDGETPU_SIM_FAULT_CRASH &&
+				 edgetpu_sim_serve_vii(sim, mailbox);
+		if (served)
+			__set_bit(i, &rung);
+	}
+	read_unlock(&mgr->mailboxes_lock);
+	if (!rung)
+		return false;
+	edgetpu_sim_raise_irq(sim, rung);
+	return true;
+}
+
+/* Whether the firmware is running and able to serve the queues. */
+static bool edgetpu_sim_active(struct edgetpu_sim *sim)
+{
+	return READ_ONCE(sim->running) && READ_ONCE(sim->fault) != EDGETPU_SIM_FAULT_HANG;
+}
+
+static int edgetpu_sim_thread(void *data)
+{
+	struct edgetpu_sim *sim = data;
+	uint poll_us;
+
+	while (!kthread_should_stop()) {
+		if (!edgetpu_sim_active(sim)) {
+			wait_event_interruptible(sim->waitq,
+						 kthread_should_stop() || edgetpu_sim_active(sim));
+			continue;
+		}
+		if (edgetpu_sim_step(sim)) {
+			cond_resched();
+			continue;
+		}
+		poll_us = max(READ_ONCE(sim_poll_us), 1u);
+		usleep_range(poll_us, poll_us * 2);
+	}
+	return 0;
+}
+
+/* Queues a reverse KCI to be sent by the firmware thread. */
+static int edgetpu_sim_queue_rkci(struct edgetpu_sim *sim, u16 code, u64 retval)
+{
+	struct edgetpu_kci_response_element *resp;
+	int ret = 0;
+
+	spin_lock(&sim->rkci_lock);
+	if (sim->n_rkci == EDGETPU_SIM_MAX_PENDING_RKCI) {
+		ret = -EBUSY;
+	} else {
+		resp = &sim->rkci[sim->n_rkci++];
+		memset(resp, 0, sizeof(*resp));
+		resp->seq = KCI_REVERSE_FLAG;
+		resp->code = code;
+		resp->retval = retval;
+	}
+	spin_unlock(&sim->rkci_lock);
+	return ret;
+}
+
+/* Firmware "boot": clears fatal faults and resumes serving the queues. */
+static void edgetpu_sim_boot(struct edgetpu_sim *sim)
+{
+	u32 fault = READ_ONCE(sim->fault);
+
+	if (fault == EDGETPU_SIM_FAULT_CRASH || fault == EDGETPU_SIM_FAULT_HANG)
+		WRITE_ONCE(sim->fault, EDGETPU_SIM_FAULT_NONE);
+	sim->boot_time = ktime_get_real_seconds();
+	WRITE_ONCE(sim->running, true);
+	wake_up(&sim->waitq);
+	etdev_dbg(sim->etdev, "simulated firmware started");
+}
+
+static int edgetpu_sim_firmware_prepare_run(struct edgetpu_firmware *et_fw,
+					    struct edgetpu_firmware_buffer *fw_buf)
+{
+	struct edgetpu_dev *etdev = et_fw->etdev;
+
+	if (!to_sim(etdev))
+		return -ENODEV;
+	/* Reset KCI mailbox before starting f/w, don't process anything old.*/
+	edgetpu_mailbox_reset(etdev->kci->mailbox);
+	edgetpu_sim_boot(to_sim(etdev));
+	return 0;
+}
+
+static int edgetpu_sim_firmware_restart(struct edgetpu_firmware *et_fw, bool force_reset)
+{
+	struct edgetpu_dev *etdev = et_fw->etdev;
+
+	if (!to_sim(etdev))
+		return -ENODEV;
+	edgetpu_sim_boot(to_sim(etdev));
+	return 0;
+}
+
+static const struct edgetpu_firmware_chip_data edgetpu_sim_firmware_chip_data = {
+	.default_firmware_name = EDGETPU_DEFAULT_FIRMWARE_NAME,
+	.prepare_run = edgetpu_sim_firmware_prepare_run,
+	.restart = edgetpu_sim_firmware_restart,
+};
+
+int edgetpu_sim_firmware_create(struct edgetpu_dev *etdev)
+{
+	return edgetpu_firmware_create(etdev, &edgetpu_sim_firmware_chip_data);
+}
+
+int edgetpu_sim_firmware_load(struct edgetpu_firmware *et_fw,
+			      struct edgetpu_firmware_desc *fw_desc, const char *name)
+{
+	struct edgetpu_dev *etdev = et_fw->etdev;
+
+	memset(&etdev->fw_version, 0, sizeof(etdev->fw_version));
+	fw_desc->buf.used_size = 0;
+	/* May return NULL on out of memory, driver must handle properly */
+	fw_desc->buf.name = kstrdup(name, GFP_KERNEL);
+	return 0;
+}
+
+static int edgetpu_sim_latency_get(void *data, u64 *val)
+{
+	struct edgetpu_sim *sim = data;
+
+	*val = READ_ONCE(sim->latency_us);
+	return 0;
+}
+
+static int edgetpu_sim_latency_set(void *data, u64 val)
+{
+	struct edgetpu_sim *sim = data;
+
+	if (val > USEC_PER_SEC)
+		return -EINVAL;
+	WRITE_ONCE(sim->latency_us, val);
+	return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(fops_sim_latency, edgetpu_sim_latency_get, edgetpu_sim_latency_set,
+			 "%llu\n");
+
+static int edgetpu_sim_fault_get(void *data, u64 *val)
+{
+	struct edgetpu_sim *sim = data;
+
+	*val = READ_ONCE(sim->fault);
+	return 0;
+}
+
+static int edgetpu_sim_fault_set(void *data, u64 val)
+{
+	struct edgetpu_sim *sim = data;
+	int ret;
+
+	if (val > EDGETPU_SIM_FAULT_CLOSE_DEVICE)
+		return -EINVAL;
+	if (val == EDGETPU_SIM_FAULT_CRASH) {
+		ret = edgetpu_sim_queue_rkci(sim, RKCI_FIRMWARE_CRASH, EDGETPU_FW_CRASH_ASSERT);
+		if (ret)
+			return ret;
+	}
+	WRITE_ONCE(sim->fault, val);
+	wake_up(&sim->waitq);
+	return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(fops_sim_fault, edgetpu_sim_fault_get, edgetpu_sim_fault_set, "%llu\n");
+
+int edgetpu_sim_reverse_kci(struct edgetpu_dev *etdev, u16 code, u64 retval)
+{
+	struct edgetpu_sim *sim = to_sim(etdev);
+
+	if (!sim)
+		return -ENODEV;
+	return edgetpu_sim_queue_rkci(sim, code, retval);
+}
+
+int edgetpu_sim_set_fault(struct edgetpu_dev *etdev, enum edgetpu_sim_fault fault)
+{
+	struct edgetpu_sim *sim = to_sim(etdev);
+
+	if (!sim)
+		return -ENODEV;
+	return edgetpu_sim_fault_set(sim, fault);
+}
+
+/* Writing (retval << 16 | code) sends a reverse KCI. */
+static int edgetpu_sim_rkci_set(void *data, u64 val)
+{
+	return edgetpu_sim_queue_rkci(data, val & 0xffff, val >> 16);
+}
+DEFINE_DEBUGFS_ATTRIBUTE(fops_sim_rkci, NULL, edgetpu_sim_rkci_set, "%llu\n");
+
+/* Writing a log level emits a firmware log message of that level. */
+static int edgetpu_sim_log_set(void *data, u64 val)
+{
+	struct edgetpu_sim *sim = data;
+	char msg[EDGETPU_SIM_LOG_MSG_MAX];
+	s16 level = (s16)val;
+
+	if (level < EDGETPU_FW_LOG_LEVEL_ERROR || level > EDGETPU_FW_LOG_LEVEL_VERBOSE)
+		return -EINVAL;
+	scnprintf(msg, sizeof(msg), "simulated log message at level %d", level);
+	if (!edgetpu_sim_log(sim, level, msg))
+		return -ENOSPC;
+	edgetpu_sim_raise_irq(sim, 0);
+	return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(fops_sim_log, NULL, edgetpu_sim_log_set, "%lld\n");
+
+static int edgetpu_sim_stats_show(struct seq_file *s, void *data)
+{
+	struct edgetpu_sim *sim = s->private;
+
+	seq_printf(s, "running: %d\n", READ_ONCE(sim->running));
+	seq_printf(s, "open_mailboxes: %#lx\n", READ_ONCE(sim->open_mailboxes));
+	seq_printf(s, "fault: %u\n", READ_ONCE(sim->fault));
+	seq_printf(s, "latency_us: %u\n", READ_ONCE(sim->latency_us));
+	seq_printf(s, "kci_cmds: %lld\n", atomic64_read(&sim->kci_cmds));
+	seq_printf(s, "kci_dropped: %lld\n", atomic64_read(&sim->dropped));
+	seq_printf(s, "reverse_kcis: %lld\n", atomic64_read(&sim->rkcis));
+	seq_printf(s, "vii_cmds: %lld\n", atomic64_read(&sim->vii_cmds));
+	seq_printf(s, "vii_max_outstanding: %u\n", sim->max_outstanding);
+	return 0;
+}
+
+static int edgetpu_sim_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, edgetpu_sim_stats_show, inode->i_private);
+}
+
+static const struct file_operations edgetpu_sim_stats_ops = {
+	.open = edgetpu_sim_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.owner = THIS_MODULE,
+	.release = single_release,
+};
+
+int edgetpu_sim_create(struct edgetpu_dev *etdev)
+{
+	struct edgetpu_sim *sim;
+
+	sim = kzalloc(sizeof(*sim), GFP_KERNEL);
+	if (!sim)
+		return -ENOMEM;
+	sim->etdev = etdev;
+	spin_lock_init(&sim->rkci_lock);
+	spin_lock_init(&sim->log_lock);
+	init_waitqueue_head(&sim->waitq);
+	sim->thread = kthread_run(edgetpu_sim_thread, sim, "edgetpu-sim/%s", etdev->dev_name);
+	if (IS_ERR(sim->thread)) {
+		int ret = PTR_ERR(sim->thread);
+
+		kfree(sim);
+		return ret;
+	}
+	etdev->sim = sim;
+
+	sim->d_entry = debugfs_create_dir("sim", etdev->d_entry);
+	debugfs_create_file("latency_us", 0660, sim->d_entry, sim, &fops_sim_latency);
+	debugfs_create_file("fault", 0660, sim->d_entry, sim, &fops_sim_fault);
+	debugfs_create_file("reverse_kci", 0220, sim->d_entry, sim, &fops_sim_rkci);
+	debugfs_create_file("log", 0220, sim->d_entry, sim, &fops_sim_log);
+	debugfs_create_file("stats", 0440, sim->d_entry, sim, &edgetpu_sim_stats_ops);
+	mutex_lock(&edgetpu_sim_devices_lock);
+	list_add_tail(&sim->list, &edgetpu_sim_devices);
+	mutex_unlock(&edgetpu_sim_devices_lock);
+	etdev_info(etdev, "simulated device, no TPU hardware is used");
+	return 0;
+}
+
+void edgetpu_sim_destroy(struct edgetpu_dev *etdev)
+{
+	struct edgetpu_sim *sim = to_sim(etdev);
+
+	if (!sim)
+		return;
+	mutex_lock(&edgetpu_sim_devices_lock);
+	list_del(&sim->list);
+	mutex_unlock(&edgetpu_sim_devices_lock);
+	debugfs_remove_recursive(sim->d_entry);
+	kthread_stop(sim->thread);
+	etdev->sim = NULL;
+	kfree(sim);
+}
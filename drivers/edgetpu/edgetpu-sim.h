@@ -0,0 +1,178 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Software simulator of the TPU and its firmware, for running the driver
+ * without the hardware.
+ *
+ * Copyright (C) 2022 Google LLC
+ */
+#ifndef __EDGETPU_SIM_H__
+#define __EDGETPU_SIM_H__
+
+#include <linux/device.h>
+#include <linux/kconfig.h>
+#include <linux/sizes.h>
+#include <linux/types.h>
+
+#include "edgetpu-firmware.h"
+#include "edgetpu-internal.h"
+
+/* Device tree compatible string of a simulated device. */
+#define EDGETPU_SIM_COMPATIBLE	"google,edgetpu-sim"
+
+/* Size of the RAM backing the CSRs, must cover every CSR offset of the chip. */
+#define EDGETPU_SIM_CSR_SIZE	SZ_2M
+
+/* Faults the simulated firmware can be asked to inject, see debugfs "sim/fault". */
+enum edgetpu_sim_fault {
+	EDGETPU_SIM_FAULT_NONE = 0,
+	/* Drop KCI responses, commands time out. */
+	EDGETPU_SIM_FAULT_KCI_DROP = 1,
+	/* Answer every KCI command with KCI_ERROR_UNKNOWN. */
+	EDGETPU_SIM_FAULT_KCI_ERROR = 2,
+	/* Report a firmware crash with a reverse KCI and stop until restarted. */
+	EDGETPU_SIM_FAULT_CRASH = 3,
+	/* Stop answering anything until restarted, trips the software watchdog. */
+	EDGETPU_SIM_FAULT_HANG = 4,
+	/* Fail CLOSE_DEVICE, as a firmware that can't release a hung core does. */
+	EDGETPU_SIM_FAULT_CLOSE_DEVICE = 5,
+};
+
+#if IS_ENABLED(CONFIG_EDGETPU_SIM)
+
+/* Returns whether @dev is a simulated device. */
+bool edgetpu_sim_is_sim_device(struct device *dev);
+
+/*
+ * Returns the first bound simulated device, or NULL if there is none.
+ *
+ * For in-kernel tests, which must not run while the device is being removed.
+ */
+struct edgetpu_dev *edgetpu_sim_test_device(void);
+
+/*
+ * Allocates device-managed RAM standing in for the CSRs of @dev and fills
+ * @regs with it.
+ *
+ * Returns 0 on success, or -ENOMEM.
+ */
+int edgetpu_sim_regs_create(struct device *dev, struct edgetpu_mapped_resource *regs);
+
+/*
+ * Creates the simulated firmware of @etdev and its debugfs controls.
+ *
+ * Must be called after edgetpu_device_add(). The firmware is started by
+ * running a firmware image through the loader created by
+ * edgetpu_sim_firmware_create().
+ */
+int edgetpu_sim_create(struct edgetpu_dev *etdev);
+void edgetpu_sim_destroy(struct edgetpu_dev *etdev);
+
+/* Creates the firmware loader of a simulated device. */
+int edgetpu_sim_firmware_create(struct edgetpu_dev *etdev);
+
+/* Stands in for edgetpu_firmware_chip_load_locked(), no image is read. */
+int edgetpu_sim_firmware_load(struct edgetpu_firmware *et_fw,
+			      struct edgetpu_firmware_desc *fw_desc, const char *name);
+
+/*
+ * Makes the simulated firmware send a reverse KCI with @code and @retval, as
+ * the debugfs "sim/reverse_kci" does.
+ *
+ * Returns 0 on success, -EBUSY if too many reverse KCIs are pending.
+ */
+int edgetpu_sim_reverse_kci(struct edgetpu_dev *etdev, u16 code, u64 retval);
+
+/*
+ * Makes the simulated firmware inject @fault, as writing it to the debugfs
+ * "sim/fault" does.
+ *
+ * Returns 0 on success, -EINVAL for an unknown fault.
+ */
+int edgetpu_sim_set_fault(struct edgetpu_dev *etdev, enum edgetpu_sim_fault fault);
+
+/* Acknowledges the P-channel request pending in the power control CSR. */
+void edgetpu_sim_pchannel(struct edgetpu_dev *etdev);
+
+/*
+ * Stops the simulated firmware when the TPU block is powered off, the firmware
+ * thread sleeps until the next boot.
+ */
+void edgetpu_sim_power_down(struct edgetpu_dev *etdev);
+
+/*
+ * ACPM callbacks of simulated devices: there is no ACPM behind them, the rate
+ * is only kept in memory.
+ */
+int edgetpu_sim_acpm_set_rate(unsigned int id, unsigned long rate);
+unsigned long edgetpu_sim_acpm_get_rate(unsigned int id, unsigned long dbg_val);
+
+#else /* !IS_ENABLED(CONFIG_EDGETPU_SIM) */
+
+static inline bool edgetpu_sim_is_sim_device(struct device *dev)
+{
+	return false;
+}
+
+static inline struct edgetpu_dev *edgetpu_sim_test_device(void)
+{
+	return NULL;
+}
+
+static inline int edgetpu_sim_regs_create(struct device *dev,
+					  struct edgetpu_mapped_resource *regs)
+{
+	return -ENODEV;
+}
+
+static inline int edgetpu_sim_create(struct edgetpu_dev *etdev)
+{
+	return 0;
+}
+
+static inline void edgetpu_sim_destroy(struct edgetpu_dev *etdev)
+{
+}
+
+static inline int edgetpu_sim_firmware_create(struct edgetpu_dev *etdev)
+{
+	return -ENODEV;
+}
+
+static inline int edgetpu_sim_firmware_load(struct edgetpu_firmware *et_fw,
+					    struct edgetpu_firmware_desc *fw_desc,
+					    const char *name)
+{
+	return -ENODEV;
+}
+
+static inline int edgetpu_sim_reverse_kci(struct edgetpu_dev *etdev, u16 code, u64 retval)
+{
+	return -ENODEV;
+}
+
+static inline int edgetpu_sim_set_fault(struct edgetpu_dev *etdev, enum edgetpu_sim_fault fault)
+{
+	return -ENODEV;
+}
+
+static inline void edgetpu_sim_pchannel(struct edgetpu_dev *etdev)
+{
+}
+
+static inline void edgetpu_sim_power_down(struct edgetpu_dev *etdev)
+{
+}
+
+static inline int edgetpu_sim_acpm_set_rate(unsigned int id, unsigned long rate)
+{
+	return -ENODEV;
+}
+
+static inline unsigned long edgetpu_sim_acpm_get_rate(unsigned int id, unsigned long dbg_val)
+{
+	return 0;
+}
+
+#endif /* IS_ENABLED(CONFIG_EDGETPU_SIM) */
+
+#endif /* __EDGETPU_SIM_H__ */
@@ -11,6 +11,7 @@
 #include <linux/slab.h>
 #include <linux/workqueue.h>
 
+#include "edgetpu-flight-recorder.h"
 #include "edgetpu-internal.h"
 #include "edgetpu-kci.h"
 #include "edgetpu-sw-watchdog.h"
@@ -18,6 +19,18 @@
 static bool wdt_disable;
 module_param(wdt_disable, bool, 0660);
 
+static uint wdt_usage_refresh_ms = EDGETPU_USAGE_REFRESH_MS;
+module_param(wdt_usage_refresh_ms, uint, 0660);
+
+/*
+ * Returns the watchdog of @etdev for callers that are serialized with
+ * edgetpu_sw_wdt_destroy(), i.e. not from IRQ context.
+ */
+static inline struct edgetpu_sw_wdt *sw_wdt_of(struct edgetpu_dev *etdev)
+{
+	return rcu_dereference_protected(etdev->etdev_sw_wdt, true);
+}
+
 /* Worker to execute action callback handler on watchdog bite. */
 static void sw_wdt_handler_work(struct work_struct *work)
 {
@@ -35,6 +48,8 @@ static void sw_wdt_start(struct edgetpu_sw_wdt *wdt)
 		return;
 	}
 	etdev_dbg(wdt->etdev, "sw wdt: started\n");
+	/* the firmware is known to be alive when the watchdog is (re)started */
+	wdt->last_alive = jiffies;
 	schedule_delayed_work(&wdt->dwork, wdt->hrtbeat_jiffs);
 }
 
@@ -60,8 +75,16 @@ static void sw_wdt_modify_rate(struct edgetpu_sw_wdt *wdt, unsigned long rate)
 
 void edgetpu_watchdog_bite(struct edgetpu_dev *etdev, bool reset)
 {
-	if (!etdev->etdev_sw_wdt)
+	struct edgetpu_sw_wdt *wdt;
+
+	edgetpu_fr_record(etdev, EDGETPU_FR_WATCHDOG_BITE, reset, 0);
+	/* may be called from IRQ context, see edgetpu_sw_wdt_destroy() */
+	rcu_read_lock();
+	wdt = rcu_dereference(etdev->etdev_sw_wdt);
+	if (!wdt) {
+		rcu_read_unlock();
 		return;
+	}
 	/*
 	 * Stop sw wdog delayed worker, to reduce chance this explicit call
 	 * races with a sw wdog timeout.  May be in IRQ context, no sync,
@@ -69,15 +92,31 @@ void edgetpu_watchdog_bite(struct edgetpu_dev *etdev, bool reset)
 	 * and need a chip reset, hopefully the P-channel reset will fail
 	 * and the bigger hammer chip reset will kick in at that point.
 	 */
-	cancel_delayed_work(&etdev->etdev_sw_wdt->dwork);
+	cancel_delayed_work(&wdt->dwork);
 	etdev_err(etdev, "watchdog %s", reset ? "reset" : "restart");
 	etdev->reset_needed = reset;
-	schedule_work(&etdev->etdev_sw_wdt->et_action_work.work);
+	schedule_work(&wdt->et_action_work.work);
+	rcu_read_unlock();
 }
 
 /*
- * Ping the f/w for a response. Reschedule the work for next beat in case of f/w
- * is responded, or schedule a worker for action callback in case of TIMEOUT.
+ * Returns the jiffies when sw_wdt_work() next has something to do: either the
+ * heartbeat after the last sign of life, or the next usage stats refresh.
+ */
+static unsigned long sw_wdt_next_deadline(struct edgetpu_sw_wdt *wdt)
+{
+	unsigned long deadline = READ_ONCE(wdt->last_alive) + wdt->hrtbeat_jiffs;
+	unsigned long refresh = msecs_to_jiffies(READ_ONCE(wdt_usage_refresh_ms));
+
+	if (refresh && time_before(wdt->last_usage_update + refresh, deadline))
+		deadline = wdt->last_usage_update + refresh;
+	return deadline;
+}
+
+/*
+ * Ping the f/w for a response unless it has responded to something else within
+ * the last heartbeat. Reschedule the work for next deadline in case of f/w is
+ * alive, or schedule a worker for action callback in case of TIMEOUT.
  */
 static void sw_wdt_work(struct work_struct *work)
 {
@@ -86,6 +125,14 @@ static void sw_wdt_work(struct work_struct *work)
 	struct edgetpu_sw_wdt *etdev_sw_wdt =
 		container_of(dwork, struct edgetpu_sw_wdt, dwork);
 	struct edgetpu_dev *etdev = etdev_sw_wdt->etdev;
+	unsigned long now = jiffies;
+	unsigned long deadline = sw_wdt_next_deadline(etdev_sw_wdt);
+
+	if (time_before(now, deadline)) {
+		/* Recent KCI/VII responses proved the f/w alive. */
+		schedule_delayed_work(dwork, deadline - now);
+		return;
+	}
 
 	/* Ping f/w, and grab updated usage stats while we're at it. */
 	etdev_dbg(etdev, "sw wdt: pinging firmware\n");
@@ -95,10 +142,16 @@ static void sw_wdt_work(struct work_struct *work)
 	if (ret == -ETIMEDOUT) {
 		etdev_err(etdev, "sw-watchdog response timed out\n");
 		schedule_work(&etdev_sw_wdt->et_action_work.work);
-	} else {
-		/* reschedule to next beat. */
-		schedule_delayed_work(dwork, etdev_sw_wdt->hrtbeat_jiffs);
+		return;
 	}
+	if (!ret)
+		etdev_sw_wdt->last_usage_update = now;
+	/*
+	 * Don't spin if the ping was skipped (e.g. f/w being reloaded), try
+	 * again on the next beat.
+	 */
+	WRITE_ONCE(etdev_sw_wdt->last_alive, now);
+	schedule_delayed_work(dwork, sw_wdt_next_deadline(etdev_sw_wdt) - now);
 }
 
 int edgetpu_sw_wdt_create(struct edgetpu_dev *etdev, unsigned long active_ms,
@@ -116,10 +169,11 @@ int edgetpu_sw_wdt_create(struct edgetpu_dev *etdev, unsigned long active_ms,
 	atomic_set(&etdev_sw_wdt->active_counter, 0);
 	/* init to dormant rate */
 	etdev_sw_wdt->hrtbeat_jiffs = etdev_sw_wdt->hrtbeat_dormant;
+	etdev_sw_wdt->last_usage_update = jiffies;
 	INIT_DELAYED_WORK(&etdev_sw_wdt->dwork, sw_wdt_work);
 	INIT_WORK(&etdev_sw_wdt->et_action_work.work, sw_wdt_handler_work);
 	etdev_sw_wdt->is_wdt_disabled = wdt_disable;
-	etdev->etdev_sw_wdt = etdev_sw_wdt;
+	rcu_assign_pointer(etdev->etdev_sw_wdt, etdev_sw_wdt);
 	return 0;
 }
 
@@ -129,7 +183,7 @@ int edgetpu_sw_wdt_start(struct edgetpu_dev *etdev)
 
 	/* to match edgetpu_sw_wdt_destroy() */
 	smp_mb();
-	wdt = etdev->etdev_sw_wdt;
+	wdt = sw_wdt_of(etdev);
 	if (!wdt)
 		return -EINVAL;
 	if (!wdt->et_action_work.edgetpu_sw_wdt_handler)
@@ -144,7 +198,7 @@ void edgetpu_sw_wdt_stop(struct edgetpu_dev *etdev)
 
 	/* to match edgetpu_sw_wdt_destroy() */
 	smp_mb();
-	wdt = etdev->etdev_sw_wdt;
+	wdt = sw_wdt_of(etdev);
 	if (!wdt)
 		return;
 	sw_wdt_stop(wdt);
@@ -152,17 +206,22 @@ void edgetpu_sw_wdt_stop(struct edgetpu_dev *etdev)
 
 void edgetpu_sw_wdt_destroy(struct edgetpu_dev *etdev)
 {
-	struct edgetpu_sw_wdt *wdt = etdev->etdev_sw_wdt;
+	struct edgetpu_sw_wdt *wdt = sw_wdt_of(etdev);
 	int counter;
 
 	if (!wdt)
 		return;
-	etdev->etdev_sw_wdt = NULL;
+	RCU_INIT_POINTER(etdev->etdev_sw_wdt, NULL);
 	/*
 	 * To ensure that etdev->etdev_sw_wdt is NULL so wdt_start() calls from other processes
 	 * won't start the watchdog again.
 	 */
 	smp_mb();
+	/*
+	 * Doorbell IRQs can still arrive here, wait for handlers which may have seen @wdt
+	 * before stopping the works they may schedule.
+	 */
+	synchronize_rcu();
 	sw_wdt_stop(wdt);
 	/* cancel and sync work due to watchdog bite to prevent UAF */
 	cancel_work_sync(&wdt->et_action_work.work);
@@ -175,7 +234,7 @@ void edgetpu_sw_wdt_destroy(struct edgetpu_dev *etdev)
 void edgetpu_sw_wdt_set_handler(struct edgetpu_dev *etdev,
 				void (*handler_cb)(void *), void *data)
 {
-	struct edgetpu_sw_wdt *et_sw_wdt = etdev->etdev_sw_wdt;
+	struct edgetpu_sw_wdt *et_sw_wdt = sw_wdt_of(etdev);
 
 	if (!et_sw_wdt)
 		return;
@@ -185,7 +244,7 @@ void edgetpu_sw_wdt_set_handler(struct edgetpu_dev *etdev,
 
 void edgetpu_sw_wdt_inc_active_ref(struct edgetpu_dev *etdev)
 {
-	struct edgetpu_sw_wdt *wdt = etdev->etdev_sw_wdt;
+	struct edgetpu_sw_wdt *wdt = sw_wdt_of(etdev);
 
 	if (!wdt)
 		return;
@@ -195,7 +254,7 @@ void edgetpu_sw_wdt_inc_active_ref(struct edgetpu_dev *etdev)
 
 void edgetpu_sw_wdt_dec_active_ref(struct edgetpu_dev *etdev)
 {
-	struct edgetpu_sw_wdt *wdt = etdev->etdev_sw_wdt;
+	struct edgetpu_sw_wdt *wdt = sw_wdt_of(etdev);
 
 	if (!wdt)
 		return;
@@ -8,12 +8,15 @@
 #define __EDGETPU_SW_WDT_H__
 
 #include <linux/atomic.h>
+#include <linux/rcupdate.h>
 #include <linux/workqueue.h>
 
 #include "edgetpu-internal.h"
 
 #define EDGETPU_ACTIVE_DEV_BEAT_MS 15000 /* 15 seconds */
 #define EDGETPU_DORMANT_DEV_BEAT_MS 60000 /* 60 seconds */
+/* Default period of refreshing usage stats from the firmware. */
+#define EDGETPU_USAGE_REFRESH_MS 60000 /* 60 seconds */
 
 struct edgetpu_sw_wdt_action_work {
 	struct work_struct work;
@@ -41,6 +44,13 @@ struct edgetpu_sw_wdt {
 	 * rate, otherwise @hrtbeat_dormant.  Initial value is zero.
 	 */
 	atomic_t active_counter;
+	/*
+	 * Jiffies when the firmware last rang a response doorbell. A response
+	 * within the last heartbeat proves liveness and saves the ping.
+	 */
+	unsigned long last_alive;
+	/* Jiffies of the last usage stats refresh. */
+	unsigned long last_usage_update;
 };
 
 /*
@@ -75,6 +85,26 @@ void edgetpu_sw_wdt_inc_active_ref(struct edgetpu_dev *etdev);
  */
 void edgetpu_sw_wdt_dec_active_ref(struct edgetpu_dev *etdev);
 
+/*
+ * Records that the firmware responded just now, called from response
+ * doorbell handlers. Cheap enough for IRQ context.
+ *
+ * The watchdog may be destroyed concurrently, edgetpu_sw_wdt_destroy() waits
+ * for an RCU grace period before freeing it.
+ */
+static inline void edgetpu_sw_wdt_note_alive(struct edgetpu_dev *etdev)
+{
+	struct edgetpu_sw_wdt *wdt;
+	unsigned long now = jiffies;
+
+	rcu_read_lock();
+	wdt = rcu_dereference(etdev->etdev_sw_wdt);
+	/* avoid dirtying the cache line more than once per jiffy */
+	if (wdt && READ_ONCE(wdt->last_alive) != now)
+		WRITE_ONCE(wdt->last_alive, now);
+	rcu_read_unlock();
+}
+
 /*
  * Schedule sw watchdog action immediately.  Called on fatal errors.
  * @reset: true if error recovery requires a full chip reset, not just
@@ -524,3 +524,7 @@ void edgetpu_telemetry_dec_mmap_count(struct edgetpu_dev *etdev, enum edgetpu_te
 		return;
 	telemetry_inc_mmap_count(select_telemetry(&etdev->telemetry[core_id], type), -1);
 }
+
+#if IS_ENABLED(CONFIG_EDGETPU_PERF_TEST)
+#include "unittests/edgetpu-telemetry-perf-test.c"
+#endif
@@ -9,10 +9,14 @@
 
 #include <linux/debugfs.h>
 #include <linux/device.h>
+#include <linux/eventfd.h>
+#include <linux/list.h>
 #include <linux/mutex.h>
 #include <linux/thermal.h>
+#include <linux/wait.h>
 
 #include "edgetpu-internal.h"
+#include "edgetpu.h"
 
 #define EDGETPU_COOLING_NAME "tpu_cooling"
 
@@ -27,6 +31,20 @@ struct edgetpu_thermal {
 	unsigned int tpu_num_states;
 	struct edgetpu_dev *etdev;
 	bool thermal_suspended; /* TPU thermal suspended state */
+	/*
+	 * List of edgetpu_thermal_event, signaled when the cooling state or
+	 * thermal_suspended changes, protected by @lock.
+	 */
+	struct list_head budget_events;
+	/* woken up when thermal_suspended is cleared */
+	wait_queue_head_t resume_waitq;
+};
+
+/* A thermal budget eventfd registered by a client. */
+struct edgetpu_thermal_event {
+	struct list_head list;
+	struct edgetpu_client *client;
+	struct eventfd_ctx *ctx;
 };
 
 struct edgetpu_state_pwr {
@@ -55,6 +73,35 @@ int edgetpu_thermal_suspend(struct device *dev);
  */
 int edgetpu_thermal_resume(struct device *dev);
 
+/*
+ * Fills @budget with the current thermal budget.
+ *
+ * Returns -ENODEV if the thermal management is not supported.
+ */
+int edgetpu_thermal_get_budget(struct edgetpu_thermal *thermal,
+			       struct edgetpu_thermal_budget *budget);
+
+/*
+ * Sets the eventfd of @client signaled on thermal budget changes, replacing the
+ * one previously set by the same client.
+ *
+ * Returns 0 on success, -errno on error.
+ */
+int edgetpu_thermal_set_event(struct edgetpu_thermal *thermal,
+			      struct edgetpu_client *client, u32 eventfd);
+/* Releases the eventfd of @client set by edgetpu_thermal_set_event(), if any. */
+void edgetpu_thermal_unset_event(struct edgetpu_thermal *thermal,
+				 struct edgetpu_client *client);
+
+/*
+ * Waits up to @timeout_ms until the device is no longer thermal suspended.
+ *
+ * Returns 0 if the device is not suspended, -EAGAIN on timeout, or -ERESTARTSYS
+ * if interrupted by a signal. Returns 0 immediately if the thermal management is
+ * not supported.
+ */
+int edgetpu_thermal_wait_resumed(struct edgetpu_thermal *thermal, unsigned int timeout_ms);
+
 /*
  * Holds thermal->lock.
  *
@@ -5,6 +5,7 @@
  * Copyright (C) 2020 Google, Inc.
  */
 
+#include <linux/jiffies.h>
 #include <linux/slab.h>
 #include <linux/sysfs.h>
 
@@ -51,6 +52,108 @@ static int tpu_state_map(struct edgetpu_dev *etdev, uint32_t state)
 	return 0;
 }
 
+struct uid_quota {
+	int32_t uid;
+	uint64_t budget_us;	/* TPU time allowed per period */
+	uint64_t used_us;	/* TPU time used in the current period */
+	unsigned long period_start;	/* jiffies */
+	uint64_t throttled;	/* number of rejected requests */
+	struct hlist_node node;
+};
+
+/* Caller must hold usage_stats lock */
+static struct uid_quota *find_uid_quota_locked(int32_t uid, struct edgetpu_usage_stats *ustats)
+{
+	struct uid_quota *quota;
+
+	hash_for_each_possible(ustats->uid_quota_table, quota, node, uid) {
+		if (quota->uid == uid)
+			return quota;
+	}
+
+	return NULL;
+}
+
+/* Starts a new period for @quota if the current one has ended. Caller must hold usage_stats lock */
+static void uid_quota_roll_locked(struct uid_quota *quota, struct edgetpu_usage_stats *ustats)
+{
+	unsigned long period = msecs_to_jiffies(ustats->quota_period_ms);
+
+	if (time_before(jiffies, quota->period_start + period))
+		return;
+	quota->used_us = 0;
+	quota->period_start = jiffies;
+}
+
+/* Caller must hold usage_stats lock */
+static void uid_quota_charge_locked(struct edgetpu_usage_stats *ustats,
+				    struct tpu_usage *tpu_usage)
+{
+	struct uid_quota *quota;
+
+	if (!ustats->n_quotas)
+		return;
+	quota = find_uid_quota_locked(tpu_usage->uid, ustats);
+	if (!quota)
+		return;
+	uid_quota_roll_locked(quota, ustats);
+	quota->used_us += tpu_usage->duration_us;
+}
+
+bool edgetpu_usage_has_quotas(struct edgetpu_dev *etdev)
+{
+	return etdev->usage_stats && READ_ONCE(etdev->usage_stats->n_quotas);
+}
+
+/*
+ * Returns the jiffies until the current period of the quota of @uid ends if @uid
+ * is over it, 0 otherwise. Counts a rejected request if @count is set.
+ */
+static unsigned long uid_quota_wait(struct edgetpu_dev *etdev, int32_t uid, bool count)
+{
+	struct edgetpu_usage_stats *ustats = etdev->usage_stats;
+	struct uid_quota *quota;
+	unsigned long period;
+	unsigned long wait = 0;
+	bool refresh = false;
+
+	if (!edgetpu_usage_has_quotas(etdev))
+		return 0;
+	mutex_lock(&ustats->usage_stats_lock);
+	quota = find_uid_quota_locked(uid, ustats);
+	if (quota) {
+		uid_quota_roll_locked(quota, ustats);
+		if (quota->used_us >= quota->budget_us) {
+			period = msecs_to_jiffies(ustats->quota_period_ms);
+			wait = max(quota->period_start + period - jiffies, 1UL);
+			if (count)
+				quota->throttled++;
+		}
+		/* keep the accounting within a quarter of the period */
+		if (time_after_eq(jiffies, ustats->quota_refresh +
+					       msecs_to_jiffies(ustats->quota_period_ms / 4))) {
+			ustats->quota_refresh = jiffies;
+			refresh = true;
+		}
+	}
+	mutex_unlock(&ustats->usage_stats_lock);
+	if (refresh)
+		edgetpu_kci_update_usage_async(etdev);
+	if (wait)
+		etdev_dbg(etdev, "uid %d is over its TPU time quota", uid);
+	return wait;
+}
+
+int edgetpu_usage_quota_check(struct edgetpu_dev *etdev, int32_t uid)
+{
+	return uid_quota_wait(etdev, uid, true) ? -EAGAIN : 0;
+}
+
+unsigned long edgetpu_usage_quota_wait(struct edgetpu_dev *etdev, int32_t uid)
+{
+	return uid_quota_wait(etdev, uid, false);
+}
+
 /* Caller must hold usage_stats lock */
 static struct uid_entry *
 find_uid_entry_locked(int32_t uid, struct edgetpu_usage_stats *ustats)
@@ -79,6 +182,8 @@ int edgetpu_usage_add(struct edgetpu_dev *etdev, struct tpu_usage *tpu_usage)
 		  tpu_usage->duration_us);
 	mutex_lock(&ustats->usage_stats_lock);
 
+	uid_quota_charge_locked(ustats, tpu_usage);
+
 	/* Find the uid in uid_hash_table first */
 	uid_entry = find_uid_entry_locked(tpu_usage->uid, ustats);
 	if (uid_entry) {
@@ -143,6 +248,17 @@ static void edgetpu_counter_update(
 	mutex_unlock(&ustats->usage_stats_lock);
 }
 
+void edgetpu_usage_counter_add(struct edgetpu_dev *etdev,
+			       enum edgetpu_usage_counter_type counter_type, u64 value)
+{
+	struct edgetpu_usage_counter counter = {
+		.type = counter_type,
+		.value = value,
+	};
+
+	edgetpu_counter_update(etdev, &counter);
+}
+
 static void edgetpu_counter_clear(
 	struct edgetpu_dev *etdev,
 	enum edgetpu_usage_counter_type counter_type)
@@ -400,6 +516,23 @@ static void usage_stats_remove_uids(struct edgetpu_usage_stats *ustats)
 	mutex_unlock(&ustats->usage_stats_lock);
 }
 
+static void usage_stats_remove_quotas(struct edgetpu_usage_stats *ustats)
+{
+	unsigned int bkt;
+	struct uid_quota *quota;
+	struct hlist_node *tmp;
+
+	mutex_lock(&ustats->usage_stats_lock);
+
+	hash_for_each_safe(ustats->uid_quota_table, bkt, tmp, quota, node) {
+		hash_del(&quota->node);
+		kfree(quota);
+	}
+	ustats->n_quotas = 0;
+
+	mutex_unlock(&ustats->usage_stats_lock);
+}
+
 /* Write to clear all entries in uid_hash_table */
 static ssize_t tpu_usage_clear(struct device *dev,
 			       struct device_attribute *attr,
@@ -416,6 +549,111 @@ static ssize_t tpu_usage_clear(struct device *dev,
 
 static DEVICE_ATTR(tpu_usage, 0664, tpu_usage_show, tpu_usage_clear);
 
+static ssize_t tpu_quota_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct edgetpu_dev *etdev = dev_get_drvdata(dev);
+	struct edgetpu_usage_stats *ustats = etdev->usage_stats;
+	struct uid_quota *quota;
+	unsigned int bkt;
+	ssize_t ret = 0;
+
+	if (!ustats)
+		return 0;
+
+	mutex_lock(&ustats->usage_stats_lock);
+	hash_for_each(ustats->uid_quota_table, bkt, quota, node) {
+		uid_quota_roll_locked(quota, ustats);
+		ret += scnprintf(buf + ret, PAGE_SIZE - ret, "%d: %llu %llu %llu\n", quota->uid,
+				 quota->budget_us, quota->used_us, quota->throttled);
+	}
+	mutex_unlock(&ustats->usage_stats_lock);
+
+	return ret;
+}
+
+/*
+ * Write "<uid> <budget_us>" to allow @uid at most @budget_us of TPU time per
+ * quota period, or "<uid> 0" to remove the quota of @uid.
+ */
+static ssize_t tpu_quota_store(struct device *dev, struct device_attribute *attr, const char *buf,
+			       size_t count)
+{
+	struct edgetpu_dev *etdev = dev_get_drvdata(dev);
+	struct edgetpu_usage_stats *ustats = etdev->usage_stats;
+	struct uid_quota *quota, *new_quota;
+	int32_t uid;
+	u64 budget_us;
+
+	if (!ustats)
+		return -ENODEV;
+	if (sscanf(buf, "%d %llu", &uid, &budget_us) != 2)
+		return -EINVAL;
+
+	new_quota = kzalloc(sizeof(*new_quota), GFP_KERNEL);
+	if (!new_quota)
+		return -ENOMEM;
+
+	mutex_lock(&ustats->usage_stats_lock);
+	quota = find_uid_quota_locked(uid, ustats);
+	if (!budget_us) {
+		if (quota) {
+			hash_del(&quota->node);
+			kfree(quota);
+			WRITE_ONCE(ustats->n_quotas, ustats->n_quotas - 1);
+		}
+	} else if (quota) {
+		quota->budget_us = budget_us;
+	} else {
+		new_quota->uid = uid;
+		new_quota->budget_us = budget_us;
+		new_quota->period_start = jiffies;
+		hash_add(ustats->uid_quota_table, &new_quota->node, uid);
+		WRITE_ONCE(ustats->n_quotas, ustats->n_quotas + 1);
+		new_quota = NULL;
+	}
+	mutex_unlock(&ustats->usage_stats_lock);
+	kfree(new_quota);
+
+	return count;
+}
+
+static DEVICE_ATTR_RW(tpu_quota);
+
+static ssize_t tpu_quota_period_ms_show(struct device *dev, struct device_attribute *attr,
+					char *buf)
+{
+	struct edgetpu_dev *etdev = dev_get_drvdata(dev);
+	struct edgetpu_usage_stats *ustats = etdev->usage_stats;
+
+	if (!ustats)
+		return -ENODEV;
+	return scnprintf(buf, PAGE_SIZE, "%u\n", READ_ONCE(ustats->quota_period_ms));
+}
+
+static ssize_t tpu_quota_period_ms_store(struct device *dev, struct device_attribute *attr,
+					 const char *buf, size_t count)
+{
+	struct edgetpu_dev *etdev = dev_get_drvdata(dev);
+	struct edgetpu_usage_stats *ustats = etdev->usage_stats;
+	uint period_ms;
+	int ret;
+
+	if (!ustats)
+		return -ENODEV;
+	ret = kstrtouint(buf, 0, &period_ms);
+	if (ret)
+		return ret;
+	if (!period_ms)
+		return -EINVAL;
+	mutex_lock(&ustats->usage_stats_lock);
+	ustats->quota_period_ms = period_ms;
+	mutex_unlock(&ustats->usage_stats_lock);
+
+	return count;
+}
+
+static DEVICE_ATTR_RW(tpu_quota_period_ms);
+
 static ssize_t device_utilization_show(struct device *dev,
 				       struct device_attribute *attr,
 				       char *buf)
@@ -887,6 +1125,8 @@ static DEVICE_ATTR(fw_thread_stats, 0664, fw_thread_stats_show,
 
 static struct attribute *usage_stats_dev_attrs[] = {
 	&dev_attr_tpu_usage.attr,
+	&dev_attr_tpu_quota.attr,
+	&dev_attr_tpu_quota_period_ms.attr,
 	&dev_attr_device_utilization.attr,
 	&dev_attr_tpu_utilization.attr,
 	&dev_attr_tpu_active_cycle_count.attr,
@@ -926,6 +1166,8 @@ void edgetpu_usage_stats_init(struct edgetpu_dev *etdev)
 	}
 
 	hash_init(ustats->uid_hash_table);
+	hash_init(ustats->uid_quota_table);
+	ustats->quota_period_ms = EDGETPU_QUOTA_PERIOD_MS;
 	mutex_init(&ustats->usage_stats_lock);
 	etdev->usage_stats = ustats;
 
@@ -942,6 +1184,7 @@ void edgetpu_usage_stats_exit(struct edgetpu_dev *etdev)
 
 	if (ustats) {
 		usage_stats_remove_uids(ustats);
+		usage_stats_remove_quotas(ustats);
 		device_remove_group(etdev->dev, &usage_stats_attr_group);
 		/* free the frequency table if allocated */
 		mutex_lock(&etdev->freq_lock);
@@ -172,8 +172,16 @@ struct edgetpu_usage_metric {
 
 #define UID_HASH_BITS 3
 
+/* Default length of the period per-UID TPU time quotas apply to. */
+#define EDGETPU_QUOTA_PERIOD_MS	1000
+
 struct edgetpu_usage_stats {
 	DECLARE_HASHTABLE(uid_hash_table, UID_HASH_BITS);
+	/* per-UID TPU time quotas, see edgetpu_usage_quota_check() */
+	DECLARE_HASHTABLE(uid_quota_table, UID_HASH_BITS);
+	uint n_quotas;			/* number of entries in @uid_quota_table */
+	uint quota_period_ms;
+	unsigned long quota_refresh;	/* jiffies of the last usage refresh for quotas */
 	/* component utilization values reported by firmware */
 	int32_t component_utilization[EDGETPU_USAGE_COMPONENT_COUNT];
 	int64_t counter[EDGETPU_COUNTER_COUNT];
@@ -186,6 +194,28 @@ int edgetpu_usage_add(struct edgetpu_dev *etdev, struct tpu_usage *tpu_usage);
 int edgetpu_usage_get_utilization(struct edgetpu_dev *etdev,
 				  enum edgetpu_usage_component component);
 void edgetpu_usage_stats_process_buffer(struct edgetpu_dev *etdev, void *buf);
+/*
+ * Checks whether @uid is within its TPU time quota of the current period.
+ *
+ * The TPU time is accounted from the firmware usage reports, so a UID may
+ * exceed its quota by up to the time used since the last report. This requests
+ * a new report when the last one is getting old.
+ *
+ * Returns 0 if @uid has no quota or is within it, -EAGAIN otherwise.
+ */
+int edgetpu_usage_quota_check(struct edgetpu_dev *etdev, int32_t uid);
+/*
+ * Like edgetpu_usage_quota_check(), but doesn't count a rejected request.
+ *
+ * Returns the jiffies until the current quota period of @uid ends if @uid is
+ * over its quota, 0 otherwise.
+ */
+unsigned long edgetpu_usage_quota_wait(struct edgetpu_dev *etdev, int32_t uid);
+/* Returns whether any UID has a TPU time quota, cheap enough for IRQ handlers. */
+bool edgetpu_usage_has_quotas(struct edgetpu_dev *etdev);
+/* Adds @value to a counter for events the host observes, e.g. preemptions by the host. */
+void edgetpu_usage_counter_add(struct edgetpu_dev *etdev,
+			       enum edgetpu_usage_counter_type counter_type, u64 value);
 void edgetpu_usage_stats_init(struct edgetpu_dev *etdev);
 void edgetpu_usage_stats_exit(struct edgetpu_dev *etdev);
 
@@ -47,6 +47,11 @@ typedef __u32 edgetpu_map_flag_t;
 #define EDGETPU_MAP_ATTR_PBHA_MASK	0xf
 /* Create coherent mapping of the buffer */
 #define EDGETPU_MAP_COHERENT		(1u << 9)
+/*
+ * Share the device mapping of a read-only dma-buf with other groups mapping the
+ * same buffer, only valid for EDGETPU_MAP_DMABUF with EDGETPU_MAP_DMA_TO_DEVICE.
+ */
+#define EDGETPU_MAP_SHARED		(1u << 10)
 
 /* External mailbox types */
 #define EDGETPU_EXT_MAILBOX_TYPE_TZ		1
@@ -119,6 +124,8 @@ struct edgetpu_map_ioctl {
  * EINVAL: (for EDGETPU_MAP_NONMIRRORED case) If @die_index exceeds the number
  *         of clients in the group.
  * EINVAL: If the target device group is disbanded.
+ * ENOMEM: If pinning the buffer exceeds the pinned memory limit of the device
+ *         or, when charging is enabled, RLIMIT_MEMLOCK of the caller.
  */
 #define EDGETPU_MAP_BUFFER \
 	_IOWR(EDGETPU_IOCTL_BASE, 0, struct edgetpu_map_ioctl)
@@ -145,6 +152,8 @@ struct edgetpu_map_ioctl {
  */
 #define EDGETPU_EVENT_RESPDATA		0
 #define EDGETPU_EVENT_FATAL_ERROR	1
+/* A request of EDGETPU_PREFETCH_BUFFERS has completed. */
+#define EDGETPU_EVENT_PREFETCHED	2
 
 struct edgetpu_event_register {
 	__u32 event_id;
@@ -163,6 +172,10 @@ struct edgetpu_event_register {
 /*
  * @priority with this bit means the mailbox could be released when wakelock is
  * released.
+ *
+ * The queues stay allocated while the mailbox is released and their head and
+ * tail indexes are kept: they are not reset to zero when the mailbox is
+ * attached again, the runtime continues from the indexes it last used.
  */
 #define EDGETPU_PRIORITY_DETACHABLE (1u << 3)
 /* For @partition_type. */
@@ -220,6 +233,8 @@ struct edgetpu_mailbox_attr {
  */
 #define EDGETPU_PERDIE_EVENT_LOGS_AVAILABLE		0x1000
 #define EDGETPU_PERDIE_EVENT_TRACES_AVAILABLE		0x1001
+/* The cooling state or thermal suspension changed, see EDGETPU_GET_THERMAL_BUDGET. */
+#define EDGETPU_PERDIE_EVENT_THERMAL_BUDGET		0x1002
 
 /*
  * Set eventfd for notification of per-die events from kernel.
@@ -321,10 +336,18 @@ struct edgetpu_map_dmabuf_ioctl {
  *
  * On success, @device_address is set and the syscall returns zero.
  *
+ * With EDGETPU_MAP_SHARED, the dma-buf is attached to and mapped by the device
+ * once for all the groups mapping it, and every group gets the same
+ * @device_address. Weights of a model loaded by several apps are then pinned
+ * and mapped once.
+ *
  * EINVAL: If @offset is not page-aligned.
  * EINVAL: (for EDGETPU_MAP_NONMIRRORED case) If @die_index exceeds the number
  *         of clients in the group.
  * EINVAL: If the target device group is disbanded.
+ * EINVAL: If EDGETPU_MAP_SHARED is set with a direction other than
+ *         EDGETPU_MAP_DMA_TO_DEVICE, or for a mirrored mapping of a group with
+ *         multiple dies.
  */
 #define EDGETPU_MAP_DMABUF \
 	_IOWR(EDGETPU_IOCTL_BASE, 17, struct edgetpu_map_dmabuf_ioctl)
@@ -483,6 +506,14 @@ struct edgetpu_sync_fence_status {
 
 /*
  * Acquire the wakelock for this client, ensures firmware keeps running.
+ *
+ * EAGAIN: If the caller's UID has used up its TPU time quota of the current
+ *         period.
+ *
+ * The TPU time quota is also enforced while the wakelock is held: once the
+ * UID of the group creator goes over its quota, the kernel closes the VII of
+ * the group the next time it's idle and opens it again when the quota period
+ * ends. Commands written to the mmapped queues meanwhile are run then.
  */
 #define EDGETPU_ACQUIRE_WAKE_LOCK	_IO(EDGETPU_IOCTL_BASE, 26)
 
@@ -572,7 +603,11 @@ struct edgetpu_ext_mailbox_ioctl {
 #define EDGETPU_ERROR_HW_NO_ACCESS	0x8
 /* Various hardware failures */
 #define EDGETPU_ERROR_HW_FAIL		0x10
-/* Firmware-reported timeout on runtime processing of workload */
+/*
+ * Firmware-reported timeout on runtime processing of workload. If the group
+ * stays usable its VII queues were reset to 0 and the commands in flight were
+ * dropped, see EDGETPU_ENABLE_VII_RESET_ACK.
+ */
 #define EDGETPU_ERROR_RUNTIME_TIMEOUT	0x20
 
 /*
@@ -608,4 +643,197 @@ struct edgetpu_test_ext_ioctl {
 #define EDGETPU_TEST_EXTERNAL \
 	_IOW(EDGETPU_IOCTL_BASE, 33, struct edgetpu_test_ext_ioctl)
 
+/*
+ * struct edgetpu_submit_cmds_ioctl
+ * @cmds:		user address of @count command elements, each of
+ *			edgetpu_mailbox_attr.sizeof_cmd bytes
+ * @count:		number of command elements in @cmds
+ * @submitted:		[out] number of elements accepted by the kernel
+ */
+struct edgetpu_submit_cmds_ioctl {
+	__u64 cmds;
+	__u32 count;
+	__u32 submitted;
+};
+
+/*
+ * Submit commands to the VII command queue of a group created by
+ * EDGETPU_CREATE_GROUP_EXT with a non-zero cmdq_overflow_order.
+ *
+ * Commands are written to the hardware queue while it has room, the rest are
+ * held in the kernel overflow queue and moved to the hardware queue when the
+ * firmware rings the response doorbell. Commands are accepted in order, a
+ * partial submission is reported via @submitted.
+ *
+ * EAGAIN: If no command can be accepted, or the caller holds no wakelock.
+ * EAGAIN: If the caller's UID has used up its TPU time quota of the current
+ *         period, see the tpu_quota sysfs attribute.
+ * EINVAL: If the group has no overflow queue.
+ * ECONNRESET: If the queues were reset and the runtime hasn't acknowledged it
+ *             yet, only for groups opted in with EDGETPU_ENABLE_VII_RESET_ACK.
+ */
+#define EDGETPU_SUBMIT_COMMANDS \
+	_IOWR(EDGETPU_IOCTL_BASE, 34, struct edgetpu_submit_cmds_ioctl)
+
+/* The device is thermal suspended, wakelock acquisition is rejected or queued. */
+#define EDGETPU_THERMAL_SUSPENDED	(1 << 0)
+
+/*
+ * Thermal budget of the device.
+ *
+ * @cooling_state:	current cooling state, 0 means no cooling
+ * @max_cooling_state:	deepest cooling state supported
+ * @power_mw:		power budget of the current cooling state
+ * @max_power_mw:	power budget when not cooling
+ * @budget_pct:		@power_mw as a percentage of @max_power_mw, 0 when
+ *			suspended; clients may use it as a throughput or duty
+ *			cycle target
+ * @flags:		EDGETPU_THERMAL_* flags
+ */
+struct edgetpu_thermal_budget {
+	__u32 cooling_state;
+	__u32 max_cooling_state;
+	__u32 power_mw;
+	__u32 max_power_mw;
+	__u32 budget_pct;
+	__u32 flags;
+};
+
+/*
+ * Query the current thermal budget.
+ *
+ * Register an eventfd for EDGETPU_PERDIE_EVENT_THERMAL_BUDGET to be notified
+ * when the budget changes instead of polling. Each client keeps its own eventfd,
+ * all of them are signaled on a change.
+ *
+ * ENODEV: If thermal management is not supported.
+ */
+#define EDGETPU_GET_THERMAL_BUDGET \
+	_IOR(EDGETPU_IOCTL_BASE, 35, struct edgetpu_thermal_budget)
+
+/* Maximum number of ranges in one EDGETPU_PREFETCH_BUFFERS request. */
+#define EDGETPU_PREFETCH_MAX_RANGES	64
+
+struct edgetpu_prefetch_range {
+	/*
+	 * The starting address of a buffer returned by EDGETPU_MAP_BUFFER or
+	 * EDGETPU_MAP_DMABUF.
+	 */
+	__u64 device_address;
+	/* Offset in bytes from @device_address where the range starts. */
+	__u64 offset;
+	/* Size of the range in bytes, must be less than 4GB. */
+	__u64 size;
+	/*
+	 * The die index passed when mapping the buffer if it was an
+	 * EDGETPU_MAP_NONMIRRORED request, otherwise this field is ignored.
+	 */
+	__u32 die_index;
+	__u32 reserved;
+};
+
+struct edgetpu_prefetch_ioctl {
+	/* User pointer to an array of struct edgetpu_prefetch_range. */
+	__u64 ranges;
+	/* Number of elements in @ranges. */
+	__u32 num_ranges;
+	__u32 reserved;
+};
+
+/*
+ * Warm up buffers, typically model parameters, ahead of the first inference.
+ *
+ * Syncs host buffers in the ranges for the device, then asks the firmware to
+ * prefetch the ranges into its parameter cache. The firmware requests are sent
+ * asynchronously and EDGETPU_EVENT_PREFETCHED is signaled when they are done,
+ * so the runtime can do other work meanwhile. Firmware without prefetch support
+ * and devices powered off (no wakelock held) skip the firmware requests; the
+ * event is signaled in all cases.
+ *
+ * EAGAIN: If the group already has 4 requests in flight.
+ * EINVAL: If @num_ranges is 0 or exceeds EDGETPU_PREFETCH_MAX_RANGES.
+ * EINVAL: If a range is not within a buffer mapped to the group.
+ */
+#define EDGETPU_PREFETCH_BUFFERS \
+	_IOW(EDGETPU_IOCTL_BASE, 36, struct edgetpu_prefetch_ioctl)
+
+/*
+ * Acknowledge the reset of the group's VII queues after a job lockup.
+ *
+ * For groups opted in with EDGETPU_ENABLE_VII_RESET_ACK, the mailbox reset
+ * after a job lockup stays closed, and EDGETPU_SUBMIT_COMMANDS fails with
+ * ECONNRESET, until the runtime has failed its in-flight jobs, reset its own
+ * copies of the queue indexes to 0 and issued this ioctl while holding a
+ * wakelock.
+ *
+ * The kernel then resets the queue indexes again, discarding anything written
+ * to the queue CSRs in the meantime, reopens the mailbox and clears
+ * EDGETPU_ERROR_RUNTIME_TIMEOUT from EDGETPU_GET_FATAL_ERRORS.
+ *
+ * Succeeds with nothing done if no reset is pending. Fails with EAGAIN if the
+ * client holds no wakelock, ECANCELED if the group is errored.
+ */
+#define EDGETPU_ACK_VII_RESET _IO(EDGETPU_IOCTL_BASE, 37)
+
+/*
+ * Opt the group in to acknowledging VII resets. Only the group leader can
+ * issue this.
+ *
+ * When the firmware reports a job lockup on the group, the kernel closes its
+ * VII mailbox, drops the commands in flight, resets the head and tail of both
+ * queues to 0, sets EDGETPU_ERROR_RUNTIME_TIMEOUT and signals
+ * EDGETPU_EVENT_FATAL_ERROR.
+ *
+ * By default the kernel reopens the mailbox right away, and
+ * EDGETPU_ERROR_RUNTIME_TIMEOUT stays set. Anything the runtime writes to the
+ * queues based on its stale copies of the indexes reaches the firmware.
+ *
+ * Once opted in, the mailbox stays closed until the runtime issues
+ * EDGETPU_ACK_VII_RESET.
+ */
+#define EDGETPU_ENABLE_VII_RESET_ACK _IO(EDGETPU_IOCTL_BASE, 38)
+
+/* Limits of the kernel overflow queue set by edgetpu_create_group_ext.cmdq_overflow_order. */
+#define EDGETPU_CMDQ_OVERFLOW_MAX_ORDER 4
+#define EDGETPU_CMDQ_OVERFLOW_MAX_BYTES (1024 * 1024)
+/*
+ * For @deadline_class. The host admits groups to VII mailboxes in order of
+ * deadline class, then of @attr.priority (without EDGETPU_PRIORITY_DETACHABLE),
+ * higher values first.
+ */
+#define EDGETPU_DEADLINE_BEST_EFFORT 0
+#define EDGETPU_DEADLINE_INTERACTIVE 1
+#define EDGETPU_DEADLINE_REALTIME 2
+
+struct edgetpu_create_group_ext {
+	struct edgetpu_mailbox_attr attr;
+	/*
+	 * Log2 of the kernel overflow queue depth relative to the hardware
+	 * command queue, 0 to disable. See EDGETPU_SUBMIT_COMMANDS.
+	 */
+	__u32 cmdq_overflow_order;
+	__u32 deadline_class; /* EDGETPU_DEADLINE_* */
+	__u32 reserved[2]; /* must be zero */
+};
+
+/*
+ * Create a new device group with the caller as the master, like
+ * EDGETPU_CREATE_GROUP, with the attributes @attr has no room for.
+ *
+ * Same error cases as EDGETPU_CREATE_GROUP for @attr, and:
+ * EINVAL: If @reserved is not zero.
+ * EINVAL: If @deadline_class is not one of EDGETPU_DEADLINE_*.
+ * EINVAL: If @cmdq_overflow_order is greater than
+ *         EDGETPU_CMDQ_OVERFLOW_MAX_ORDER, or the overflow queue would take
+ *         more than EDGETPU_CMDQ_OVERFLOW_MAX_BYTES.
+ *
+ * Set @cmdq_overflow_order to have the kernel keep up to (hardware queue
+ * depth << @cmdq_overflow_order) additional commands and feed them to the
+ * hardware queue as the firmware consumes it. Such groups must submit commands
+ * with EDGETPU_SUBMIT_COMMANDS instead of writing the command queue directly.
+ * The overflow queue is charged to the memory cgroup of the caller.
+ */
+#define EDGETPU_CREATE_GROUP_EXT \
+	_IOW(EDGETPU_IOCTL_BASE, 39, struct edgetpu_create_group_ext)
+
 #endif /* __EDGETPU_H__ */
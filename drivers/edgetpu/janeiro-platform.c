@@ -15,6 +15,7 @@
 #include "edgetpu-config.h"
 #include "edgetpu-internal.h"
 #include "edgetpu-mobile-platform.h"
+#include "edgetpu-sim.h"
 #include "janeiro-platform.h"
 
 #include "edgetpu-mobile-platform.c"
@@ -23,6 +24,9 @@ static const struct of_device_id edgetpu_of_match[] = {
 	/* TODO(b/190677977): remove  */
 	{ .compatible = "google,darwinn", },
 	{ .compatible = "google,edgetpu-gs201", },
+#if IS_ENABLED(CONFIG_EDGETPU_SIM)
+	{ .compatible = EDGETPU_SIM_COMPATIBLE, },
+#endif
 	{ /* end of list */ },
 };
 
@@ -77,6 +81,9 @@ err:
 
 static int janeiro_platform_after_probe(struct edgetpu_mobile_platform_dev *etmdev)
 {
+	/* No firmware context carveout nor sysreg to set up on a simulated device. */
+	if (edgetpu_sim_is_sim_device(etmdev->edgetpu_dev.dev))
+		return 0;
 	return janeiro_parse_set_dt_property(etmdev);
 }
 
@@ -11,6 +11,7 @@
 #include "edgetpu-config.h"
 #include "edgetpu-internal.h"
 #include "edgetpu-mobile-platform.h"
+#include "edgetpu-sim.h"
 #include "mobile-pm.h"
 
 #define TPU_DEFAULT_POWER_STATE		TPU_ACTIVE_UUD
@@ -136,11 +137,21 @@ int edgetpu_chip_pm_create(struct edgetpu_dev *etdev)
 	struct edgetpu_mobile_platform_dev *etmdev = to_mobile_dev(etdev);
 	struct edgetpu_mobile_platform_pwr *platform_pwr = &etmdev->platform_pwr;
 
+	platform_pwr->firmware_down = janeiro_firmware_down;
+	platform_pwr->acpm_set_rate = janeiro_acpm_set_rate;
+	/*
+	 * The PSM of a simulated device never reports a state change, don't wait for one,
+	 * and keep its power state away from the ACPM of the TPU it may be running next to.
+	 */
+	if (edgetpu_sim_is_sim_device(etdev->dev)) {
+		platform_pwr->acpm_set_rate = edgetpu_sim_acpm_set_rate;
+		platform_pwr->acpm_get_rate = edgetpu_sim_acpm_get_rate;
+		platform_pwr->block_down = edgetpu_sim_power_down;
+		return mobile_pm_create(etdev);
+	}
 	platform_pwr->lpm_up = janeiro_lpm_up;
 	platform_pwr->lpm_down = janeiro_lpm_down;
 	platform_pwr->block_down = janeiro_block_down;
-	platform_pwr->firmware_down = janeiro_firmware_down;
-	platform_pwr->acpm_set_rate = janeiro_acpm_set_rate;
 
 	return mobile_pm_create(etdev);
 }
@@ -30,8 +30,10 @@
 /* Reserved VCID that uses the extra partition. */
 #define EDGETPU_VCID_EXTRA_PARTITION 0
 
-/* Pre-allocate 1 IOMMU domain per VCID */
+/* Pool up to 1 IOMMU domain per VCID */
 #define EDGETPU_NUM_PREALLOCATED_DOMAINS EDGETPU_NUM_VCIDS
+/* Allocate this many domains at probe and keep them ready for new groups */
+#define EDGETPU_DOMAIN_POOL_WATERMARK 2
 
 /* Is a "mobile" style device. */
 #define EDGETPU_FEATURE_MOBILE
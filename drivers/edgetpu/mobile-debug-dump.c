@@ -8,15 +8,21 @@
 
 #include <linux/atomic.h>
 #include <linux/bits.h>
+#include <linux/lz4.h>
+#include <linux/mm.h>
+#include <linux/module.h>
 #include <linux/mutex.h>
 #include <linux/platform_data/sscoredump.h>
 #include <linux/platform_device.h>
 #include <linux/rbtree.h>
+#include <linux/sizes.h>
 #include <linux/slab.h>
+#include <linux/workqueue.h>
 
 #include "edgetpu-config.h"
 #include "edgetpu-device-group.h"
 #include "edgetpu-dump-info.h"
+#include "edgetpu-flight-recorder.h"
 #include "edgetpu-internal.h"
 #include "edgetpu-mailbox.h"
 #include "edgetpu-mapping.h"
@@ -28,6 +34,22 @@
 
 #define SET_FIELD(info, obj, __field) ((info)->__field = (obj)->__field)
 
+/* Firmware segments smaller than this are reported as-is even with compression enabled. */
+#define DUMP_COMPRESS_MIN_SIZE SZ_64K
+
+static bool debug_dump_compress;
+module_param(debug_dump_compress, bool, 0660);
+MODULE_PARM_DESC(debug_dump_compress, "LZ4-compress large firmware dump segments");
+
+/* A firmware dump segment being compressed in the background. */
+struct sscd_compress_job {
+	struct work_struct work;
+	const struct edgetpu_dump_segment *src;
+	size_t seg_idx;		/* index of the segment in sscd_segments_context */
+	void *buf;		/* the compressed segment, NULL if compression didn't help */
+	size_t size;
+};
+
 /* Helper structure to hold the segments to be reported to SSCD. */
 struct sscd_segments_context {
 	size_t n_segs; /* current number of recorded segments */
@@ -61,7 +83,7 @@ static void sscd_ctx_release(struct sscd_segments_context *ctx)
 
 	for (i = 0; i < ctx->n_segs; i++)
 		if (ctx->free_on_release[i])
-			kfree(ctx->segs[i].addr);
+			kvfree(ctx->segs[i].addr);
 	kfree(ctx->segs);
 	kfree(ctx->free_on_release);
 }
@@ -69,7 +91,7 @@ static void sscd_ctx_release(struct sscd_segments_context *ctx)
 /*
  * Pushes the segment.
  *
- * If @free_on_release is true, kfree(@seg->addr) is called when releasing @ctx.
+ * If @free_on_release is true, kvfree(@seg->addr) is called when releasing @ctx.
  *
  * Returns 0 on success.
  */
@@ -131,32 +153,37 @@ static struct platform_device sscd_dev;
 static int mobile_sscd_collect_mappings_info(struct edgetpu_mapping_root *root, u32 workload_id,
 					     u8 type, struct sscd_segments_context *ctx)
 {
-	int ret = 0;
+	int ret;
 	struct edgetpu_dump_segment *seg_hdr;
 	struct edgetpu_mapping_info_header *hdr;
 	struct edgetpu_mapping_info *info;
-	size_t seg_size;
-	void *buffer = NULL;
+	size_t seg_size, count, n = 0;
+	void *buffer;
 	struct rb_node *node;
+	struct sscd_segment seg = {};
 
-	mutex_lock(&root->lock);
+	/*
+	 * Size the buffer without holding @root->lock so that a large allocation doesn't stall
+	 * map/unmap on this group, retry if mappings were added in the meantime.
+	 */
+	count = READ_ONCE(root->count);
+retry:
+	if (!count)
+		return 0;
+	seg_size = sizeof(*seg_hdr) + sizeof(*hdr) + sizeof(*info) * count;
+	buffer = kvzalloc(seg_size, GFP_KERNEL);
+	if (!buffer)
+		return -ENOMEM;
 
-	if (!root->count)
-		goto out_unlock;
-	seg_size = sizeof(*seg_hdr) + sizeof(*hdr) + sizeof(*info) * root->count;
-	buffer = kzalloc(seg_size, GFP_KERNEL);
-	if (!buffer) {
-		ret = -ENOMEM;
-		goto out_unlock;
+	mutex_lock(&root->lock);
+	if (root->count > count) {
+		count = root->count;
+		mutex_unlock(&root->lock);
+		kvfree(buffer);
+		goto retry;
 	}
-
 	seg_hdr = buffer;
-	seg_hdr->type = BIT_ULL(DUMP_TYPE_KERNEL_MAPPINGS_BIT);
-	seg_hdr->size = seg_size - sizeof(*seg_hdr);
 	hdr = (typeof(hdr))(seg_hdr + 1);
-	hdr->n_mappings = root->count;
-	hdr->group_workload_id = workload_id;
-	hdr->mapping_type = type;
 	info = hdr->mappings;
 	for (node = rb_first(&root->rb); node; node = rb_next(node)) {
 		struct edgetpu_mapping *map = container_of(node, struct edgetpu_mapping, node);
@@ -167,20 +194,25 @@ static int mobile_sscd_collect_mappings_info(struct edgetpu_mapping_root *root,
 		SET_FIELD(info, map, dir);
 		info->size = (u64)map->map_size;
 		info++;
+		n++;
 	}
-
-out_unlock:
 	mutex_unlock(&root->lock);
-	if (buffer) {
-		struct sscd_segment seg = {
-			.addr = buffer,
-			.size = seg_size,
-		};
 
-		ret = sscd_ctx_push_segment(ctx, &seg, true);
-		if (ret)
-			kfree(buffer);
+	if (!n) {
+		kvfree(buffer);
+		return 0;
 	}
+	seg_size = sizeof(*seg_hdr) + sizeof(*hdr) + sizeof(*info) * n;
+	seg_hdr->type = BIT_ULL(DUMP_TYPE_KERNEL_MAPPINGS_BIT);
+	seg_hdr->size = seg_size - sizeof(*seg_hdr);
+	hdr->n_mappings = n;
+	hdr->group_workload_id = workload_id;
+	hdr->mapping_type = type;
+	seg.addr = buffer;
+	seg.size = seg_size;
+	ret = sscd_ctx_push_segment(ctx, &seg, true);
+	if (ret)
+		kvfree(buffer);
 	return ret;
 }
 
@@ -320,6 +352,38 @@ static int mobile_sscd_collect_groups_info(struct edgetpu_device_group **groups,
 	return sscd_ctx_push_segment(ctx, &seg, true);
 }
 
+static int mobile_sscd_collect_flight_recorder(struct edgetpu_dev *etdev,
+					       struct sscd_segments_context *ctx)
+{
+	struct edgetpu_dump_segment *seg_hdr;
+	struct edgetpu_flight_recorder_info_header *hdr;
+	struct edgetpu_fr_event *events;
+	size_t n = edgetpu_flight_recorder_capacity(etdev);
+	void *buffer;
+	struct sscd_segment seg = {};
+	int ret;
+
+	if (!n)
+		return 0;
+	buffer = kvzalloc(sizeof(*seg_hdr) + sizeof(*hdr) + sizeof(*events) * n, GFP_KERNEL);
+	if (!buffer)
+		return -ENOMEM;
+	seg_hdr = buffer;
+	hdr = (typeof(hdr))(seg_hdr + 1);
+	events = (typeof(events))(hdr + 1);
+	n = edgetpu_flight_recorder_snapshot(etdev, events, n);
+	hdr->n_events = n;
+	hdr->event_size = sizeof(*events);
+	seg_hdr->type = BIT_ULL(DUMP_TYPE_KERNEL_FLIGHT_RECORDER_BIT);
+	seg_hdr->size = sizeof(*hdr) + sizeof(*events) * n;
+	seg.addr = buffer;
+	seg.size = sizeof(*seg_hdr) + seg_hdr->size;
+	ret = sscd_ctx_push_segment(ctx, &seg, true);
+	if (ret)
+		kvfree(buffer);
+	return ret;
+}
+
 static struct edgetpu_client **edgetpu_get_clients(struct edgetpu_dev *etdev, size_t *p_num_clients)
 {
 	struct edgetpu_client **clients;
@@ -390,6 +454,9 @@ static int mobile_collect_device_info(struct edgetpu_dev *etdev, struct sscd_seg
 	if (ret)
 		goto out_put_groups;
 	ret = mobile_sscd_collect_group_mappings_info(groups, num_groups, ctx);
+	if (ret)
+		goto out_put_groups;
+	ret = mobile_sscd_collect_flight_recorder(etdev, ctx);
 
 out_put_groups:
 	for (i = 0; i < num_groups; i++)
@@ -402,6 +469,91 @@ out_put_clients:
 	return ret;
 }
 
+#if IS_ENABLED(CONFIG_LZ4_COMPRESS)
+
+static void sscd_compress_work(struct work_struct *work)
+{
+	struct sscd_compress_job *job = container_of(work, struct sscd_compress_job, work);
+	const size_t src_len = sizeof(*job->src) + job->src->size;
+	const int bound = LZ4_compressBound(src_len);
+	struct edgetpu_dump_segment *hdr;
+	void *wrkmem, *buf;
+	int len;
+
+	wrkmem = kvmalloc(LZ4_MEM_COMPRESS, GFP_KERNEL);
+	buf = kvmalloc(sizeof(*hdr) + sizeof(u64) + bound, GFP_KERNEL);
+	if (!wrkmem || !buf)
+		goto out_free;
+	len = LZ4_compress_default((const char *)job->src, buf + sizeof(*hdr) + sizeof(u64),
+				   src_len, bound, wrkmem);
+	/* report the segment uncompressed if LZ4 failed or didn't help */
+	if (len <= 0 || sizeof(u64) + len >= src_len)
+		goto out_free;
+	hdr = buf;
+	hdr->type = job->src->type | BIT_ULL(DUMP_TYPE_HOST_LZ4_BIT);
+	hdr->size = sizeof(u64) + len;
+	hdr->src_addr = job->src->src_addr;
+	*(u64 *)(hdr + 1) = src_len;
+	job->buf = buf;
+	job->size = sizeof(*hdr) + hdr->size;
+	buf = NULL;
+out_free:
+	kvfree(buf);
+	kvfree(wrkmem);
+}
+
+/*
+ * Starts compressing @src in the background, the result replaces the @seg_idx-th segment of the
+ * context once sscd_compress_finish() is called.
+ *
+ * Returns the job, or NULL if compression is disabled or not worthwhile for @src.
+ */
+static struct sscd_compress_job *sscd_compress_start(const struct edgetpu_dump_segment *src,
+						     size_t seg_idx)
+{
+	struct sscd_compress_job *job;
+
+	if (!debug_dump_compress || src->size < DUMP_COMPRESS_MIN_SIZE)
+		return NULL;
+	job = kzalloc(sizeof(*job), GFP_KERNEL);
+	if (!job)
+		return NULL;
+	job->src = src;
+	job->seg_idx = seg_idx;
+	INIT_WORK(&job->work, sscd_compress_work);
+	queue_work(system_unbound_wq, &job->work);
+	return job;
+}
+
+#else /* !IS_ENABLED(CONFIG_LZ4_COMPRESS) */
+
+static struct sscd_compress_job *sscd_compress_start(const struct edgetpu_dump_segment *src,
+						     size_t seg_idx)
+{
+	return NULL;
+}
+
+#endif /* IS_ENABLED(CONFIG_LZ4_COMPRESS) */
+
+/*
+ * Waits for @job and, if compression paid off, swaps the compressed segment into @ctx.
+ * @ctx may be NULL to discard the result. @job is freed.
+ */
+static void sscd_compress_finish(struct sscd_compress_job *job, struct sscd_segments_context *ctx)
+{
+	flush_work(&job->work);
+	if (ctx && job->buf) {
+		ctx->segs[job->seg_idx] = (struct sscd_segment){
+			.addr = job->buf,
+			.size = job->size,
+		};
+		ctx->free_on_release[job->seg_idx] = true;
+	} else {
+		kvfree(job->buf);
+	}
+	kfree(job);
+}
+
 static int mobile_sscd_generate_coredump(void *p_etdev, void *p_dump_setup)
 {
 	struct edgetpu_dev *etdev;
@@ -411,6 +563,7 @@ static int mobile_sscd_generate_coredump(void *p_etdev, void *p_dump_setup)
 	struct edgetpu_debug_dump *debug_dump;
 	struct edgetpu_crash_reason *crash_reason;
 	struct edgetpu_dump_segment *dump_seg;
+	struct sscd_compress_job **jobs = NULL;
 	char crash_info[128];
 	int i, ret;
 	u64 offset;
@@ -433,7 +586,13 @@ static int mobile_sscd_generate_coredump(void *p_etdev, void *p_dump_setup)
 	scnprintf(crash_info, sizeof(crash_info), "[edgetpu_coredump] error code: %#llx",
 		  crash_reason->code);
 
-	/* Populate sscd segments */
+	if (debug_dump_compress && debug_dump->dump_segments_num)
+		jobs = kcalloc(debug_dump->dump_segments_num, sizeof(*jobs), GFP_KERNEL);
+
+	/*
+	 * Populate sscd segments. Large segments are compressed in the background while the rest
+	 * of the dump, including the driver-side info below, is being collected.
+	 */
 	dump_seg = (struct edgetpu_dump_segment *)((u8 *)dump_setup +
 						   debug_dump->dump_segments_offset);
 	offset = debug_dump->dump_segments_offset;
@@ -448,6 +607,8 @@ static int mobile_sscd_generate_coredump(void *p_etdev, void *p_dump_setup)
 		ret = sscd_ctx_push_segment(&sscd_ctx, &seg, false);
 		if (ret)
 			goto err_release;
+		if (jobs)
+			jobs[i] = sscd_compress_start(dump_seg, sscd_ctx.n_segs - 1);
 		offset += sizeof(struct edgetpu_dump_segment) + dump_seg->size;
 		dump_seg = (struct edgetpu_dump_segment *)((u8 *)dump_setup +
 							   ALIGN(offset, sizeof(uint64_t)));
@@ -457,6 +618,11 @@ static int mobile_sscd_generate_coredump(void *p_etdev, void *p_dump_setup)
 	if (ret)
 		goto err_release;
 
+	for (i = 0; jobs && i < debug_dump->dump_segments_num; i++)
+		if (jobs[i])
+			sscd_compress_finish(jobs[i], &sscd_ctx);
+	kfree(jobs);
+
 	ret = sscd_ctx_report_and_release(&sscd_ctx, crash_info);
 	if (ret)
 		goto err;
@@ -464,6 +630,10 @@ static int mobile_sscd_generate_coredump(void *p_etdev, void *p_dump_setup)
 	return 0;
 
 err_release:
+	for (i = 0; jobs && i < debug_dump->dump_segments_num; i++)
+		if (jobs[i])
+			sscd_compress_finish(jobs[i], NULL);
+	kfree(jobs);
 	sscd_ctx_release(&sscd_ctx);
 err:
 	etdev_err(etdev, "failed to generate coredump: %d", ret);
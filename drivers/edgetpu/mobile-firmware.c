@@ -22,6 +22,7 @@
 #include "edgetpu-mailbox.h"
 #include "edgetpu-mmu.h"
 #include "edgetpu-mobile-platform.h"
+#include "edgetpu-sim.h"
 #include "mobile-firmware.h"
 
 #define SSMT_NS_READ_STREAM_VID_OFFSET(n) (0x1000u + (0x4u * (n)))
@@ -476,6 +477,9 @@ int edgetpu_firmware_chip_load_locked(
 	const struct firmware *fw;
 	size_t aligned_size;
 
+	if (edgetpu_sim_is_sim_device(dev))
+		return edgetpu_sim_firmware_load(et_fw, fw_desc, name);
+
 	ret = request_firmware(&fw, name, dev);
 	if (ret) {
 		etdev_dbg(etdev,
@@ -514,9 +518,14 @@ void edgetpu_firmware_chip_unload_locked(
 int edgetpu_mobile_firmware_reset_cpu(struct edgetpu_dev *etdev, bool assert_reset)
 {
 	struct edgetpu_mobile_platform_dev *etmdev = to_mobile_dev(etdev);
-	struct mobile_image_config *image_config = mobile_firmware_get_image_config(etdev);
+	struct mobile_image_config *image_config;
 	int ret = 0;
 
+	/* The simulated firmware has no CPU to hold in reset. */
+	if (edgetpu_sim_is_sim_device(etdev->dev))
+		return 0;
+
+	image_config = mobile_firmware_get_image_config(etdev);
 	if (image_config->privilege_level == FW_PRIV_LEVEL_NS) {
 		int i;
 
@@ -52,13 +52,22 @@ enum edgetpu_pwr_state edgetpu_active_states[EDGETPU_NUM_STATES] = {
 
 uint32_t *edgetpu_states_display = edgetpu_active_states;
 
-static int mobile_pwr_state_init(struct device *dev)
+static unsigned long mobile_acpm_get_rate(struct edgetpu_mobile_platform_pwr *platform_pwr)
+{
+	if (platform_pwr->acpm_get_rate)
+		return platform_pwr->acpm_get_rate(TPU_ACPM_DOMAIN, 0);
+	return exynos_acpm_get_rate(TPU_ACPM_DOMAIN, 0);
+}
+
+static int mobile_pwr_state_init(struct edgetpu_mobile_platform_dev *etmdev)
 {
 	int ret;
 	int curr_state;
+	struct device *dev = etmdev->edgetpu_dev.dev;
+	struct edgetpu_mobile_platform_pwr *platform_pwr = &etmdev->platform_pwr;
 
 	pm_runtime_enable(dev);
-	curr_state = exynos_acpm_get_rate(TPU_ACPM_DOMAIN, 0);
+	curr_state = mobile_acpm_get_rate(platform_pwr);
 
 	if (curr_state > TPU_OFF) {
 		ret = pm_runtime_get_sync(dev);
@@ -69,6 +78,9 @@ static int mobile_pwr_state_init(struct device *dev)
 		}
 	}
 
+	if (platform_pwr->acpm_get_rate)
+		return 0;
+
 	ret = exynos_acpm_set_init_freq(TPU_ACPM_DOMAIN, curr_state);
 	if (ret) {
 		dev_err(dev, "error initializing tpu state: %d\n", ret);
@@ -229,7 +241,7 @@ static int mobile_pwr_state_set_locked(struct edgetpu_mobile_platform_dev *etmde
 	struct edgetpu_mobile_platform_pwr *platform_pwr = &etmdev->platform_pwr;
 	struct device *dev = etdev->dev;
 
-	curr_state = exynos_acpm_get_rate(TPU_ACPM_DOMAIN, 0);
+	curr_state = mobile_acpm_get_rate(platform_pwr);
 
 	dev_dbg(dev, "Power state %d -> %llu\n", curr_state, val);
 
@@ -265,9 +277,10 @@ static int mobile_pwr_state_set_locked(struct edgetpu_mobile_platform_dev *etmde
 static int mobile_pwr_state_get_locked(void *data, u64 *val)
 {
 	struct edgetpu_dev *etdev = (typeof(etdev))data;
+	struct edgetpu_mobile_platform_dev *etmdev = to_mobile_dev(etdev);
 	struct device *dev = etdev->dev;
 
-	*val = exynos_acpm_get_rate(TPU_ACPM_DOMAIN, 0);
+	*val = mobile_acpm_get_rate(&etmdev->platform_pwr);
 	dev_dbg(dev, "current tpu state: %llu\n", *val);
 
 	return 0;
@@ -601,7 +614,7 @@ static int mobile_pm_after_create(struct edgetpu_pm *etpm)
 	struct device *dev = etdev->dev;
 	struct edgetpu_mobile_platform_pwr *platform_pwr = &etmdev->platform_pwr;
 
-	ret = mobile_pwr_state_init(dev);
+	ret = mobile_pwr_state_init(etmdev);
 	if (ret)
 		return ret;
 
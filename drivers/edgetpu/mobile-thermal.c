@@ -7,6 +7,7 @@
 
 #include <linux/debugfs.h>
 #include <linux/device.h>
+#include <linux/eventfd.h>
 #include <linux/gfp.h>
 #include <linux/kernel.h>
 #include <linux/mutex.h>
@@ -16,6 +17,7 @@
 #include <linux/slab.h>
 #include <linux/thermal.h>
 #include <linux/version.h>
+#include <linux/wait.h>
 
 #include "edgetpu-config.h"
 #include "edgetpu-internal.h"
@@ -49,6 +51,21 @@ static int edgetpu_thermal_kci_if_powered(struct edgetpu_dev *etdev, enum edgetp
 	return ret;
 }
 
+/*
+ * Notifies waiters that the cooling state or the suspended state changed.
+ *
+ * Caller holds thermal->lock.
+ */
+static void edgetpu_thermal_budget_changed(struct edgetpu_thermal *thermal)
+{
+	struct edgetpu_thermal_event *event;
+
+	list_for_each_entry(event, &thermal->budget_events, list)
+		eventfd_signal(event->ctx, 1);
+	if (!thermal->thermal_suspended)
+		wake_up_all(&thermal->resume_waitq);
+}
+
 static int edgetpu_get_max_state(struct thermal_cooling_device *cdev, unsigned long *state)
 {
 	struct edgetpu_thermal *thermal = cdev->devdata;
@@ -122,6 +139,7 @@ static int edgetpu_set_cur_state(struct thermal_cooling_device *cdev, unsigned l
 		goto out;
 	}
 	cooling->cooling_state = state_original;
+	edgetpu_thermal_budget_changed(cooling);
 out:
 	mutex_unlock(&cooling->lock);
 	return ret;
@@ -152,6 +170,7 @@ static int edgetpu_get_cur_state(struct thermal_cooling_device *cdev, unsigned l
 
 	/* setting back to "no cooling" */
 	cooling->cooling_state = 0;
+	edgetpu_thermal_budget_changed(cooling);
 	mutex_unlock(&cooling->lock);
 
 	return 0;
@@ -250,8 +269,15 @@ static void tpu_thermal_exit_cooling(struct edgetpu_thermal *thermal)
 
 static void tpu_thermal_exit(struct edgetpu_thermal *thermal)
 {
+	struct edgetpu_thermal_event *event, *n;
+
 	tpu_thermal_exit_cooling(thermal);
 	debugfs_remove_recursive(thermal->cooling_root);
+	list_for_each_entry_safe(event, n, &thermal->budget_events, list) {
+		list_del(&event->list);
+		eventfd_ctx_put(event->ctx);
+		kfree(event);
+	}
 }
 
 static void devm_tpu_thermal_release(struct device *dev, void *res)
@@ -375,6 +401,8 @@ static int tpu_thermal_cooling_register(struct edgetpu_thermal *thermal, char *t
 		return err;
 
 	mutex_init(&thermal->lock);
+	INIT_LIST_HEAD(&thermal->budget_events);
+	init_waitqueue_head(&thermal->resume_waitq);
 	cooling_node = of_find_node_by_name(NULL, "tpu-cooling");
 	if (!cooling_node)
 		dev_warn(thermal->dev, "failed to find cooling node\n");
@@ -447,6 +475,7 @@ int edgetpu_thermal_suspend(struct device *dev)
 	 * unknown reasons) because we still want to prevent the runtime from using TPU.
 	 */
 	cooling->thermal_suspended = true;
+	edgetpu_thermal_budget_changed(cooling);
 	ret = edgetpu_thermal_kci_if_powered(etdev, TPU_OFF);
 	mutex_unlock(&cooling->lock);
 	return ret;
@@ -467,8 +496,109 @@ int edgetpu_thermal_resume(struct device *dev)
 	 * Unlike edgetpu_thermal_suspend(), only set the device is resumed if the FW handled the
 	 * KCI request.
 	 */
-	if (!ret)
+	if (!ret && cooling->thermal_suspended) {
 		cooling->thermal_suspended = false;
+		edgetpu_thermal_budget_changed(cooling);
+	}
 	mutex_unlock(&cooling->lock);
 	return ret;
 }
+
+int edgetpu_thermal_get_budget(struct edgetpu_thermal *thermal,
+			       struct edgetpu_thermal_budget *budget)
+{
+	u32 max_power;
+
+	if (IS_ERR_OR_NULL(thermal) || !thermal->tpu_num_states)
+		return -ENODEV;
+	memset(budget, 0, sizeof(*budget));
+	mutex_lock(&thermal->lock);
+	budget->cooling_state = thermal->cooling_state;
+	budget->max_cooling_state = thermal->tpu_num_states - 1;
+	if (thermal->cooling_state < thermal->tpu_num_states)
+		budget->power_mw = state_pwr_map[thermal->cooling_state].power;
+	/* state_pwr_map is in descending order of power */
+	max_power = state_pwr_map[0].power;
+	budget->max_power_mw = max_power;
+	if (thermal->thermal_suspended)
+		budget->flags |= EDGETPU_THERMAL_SUSPENDED;
+	else if (max_power)
+		budget->budget_pct = min_t(u32, 100, (u64)budget->power_mw * 100 / max_power);
+	mutex_unlock(&thermal->lock);
+	return 0;
+}
+
+/* Caller holds thermal->lock. */
+static struct edgetpu_thermal_event *
+edgetpu_thermal_find_event_locked(struct edgetpu_thermal *thermal,
+				  struct edgetpu_client *client)
+{
+	struct edgetpu_thermal_event *event;
+
+	list_for_each_entry(event, &thermal->budget_events, list)
+		if (event->client == client)
+			return event;
+	return NULL;
+}
+
+int edgetpu_thermal_set_event(struct edgetpu_thermal *thermal,
+			      struct edgetpu_client *client, u32 eventfd)
+{
+	struct edgetpu_thermal_event *event, *new_event;
+	struct eventfd_ctx *ctx;
+
+	if (IS_ERR_OR_NULL(thermal))
+		return -ENODEV;
+	new_event = kzalloc(sizeof(*new_event), GFP_KERNEL);
+	if (!new_event)
+		return -ENOMEM;
+	ctx = eventfd_ctx_fdget(eventfd);
+	if (IS_ERR(ctx)) {
+		kfree(new_event);
+		return PTR_ERR(ctx);
+	}
+	mutex_lock(&thermal->lock);
+	event = edgetpu_thermal_find_event_locked(thermal, client);
+	if (event) {
+		eventfd_ctx_put(event->ctx);
+		event->ctx = ctx;
+		kfree(new_event);
+	} else {
+		new_event->client = client;
+		new_event->ctx = ctx;
+		list_add_tail(&new_event->list, &thermal->budget_events);
+	}
+	mutex_unlock(&thermal->lock);
+	return 0;
+}
+
+void edgetpu_thermal_unset_event(struct edgetpu_thermal *thermal,
+				 struct edgetpu_client *client)
+{
+	struct edgetpu_thermal_event *event;
+
+	if (IS_ERR_OR_NULL(thermal))
+		return;
+	mutex_lock(&thermal->lock);
+	event = edgetpu_thermal_find_event_locked(thermal, client);
+	if (event) {
+		list_del(&event->list);
+		eventfd_ctx_put(event->ctx);
+		kfree(event);
+	}
+	mutex_unlock(&thermal->lock);
+}
+
+int edgetpu_thermal_wait_resumed(struct edgetpu_thermal *thermal, unsigned int timeout_ms)
+{
+	long ret;
+
+	if (IS_ERR_OR_NULL(thermal))
+		return 0;
+	ret = wait_event_interruptible_timeout(thermal->resume_waitq,
+					       !READ_ONCE(thermal->thermal_suspended),
+					       msecs_to_jiffies(timeout_ms));
+	if (ret < 0)
+		return ret;
+	return ret ? 0 : -EAGAIN;
+}
@@ -0,0 +1,14 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Fallback header for CONFIG_EDGETPU_SIM builds on kernels without Google BCL
+ * support.
+ *
+ * Copyright (C) 2022 Google LLC
+ */
+
+#ifndef __BCL_H__
+#define __BCL_H__
+
+struct bcl_device;
+
+#endif /* __BCL_H__ */
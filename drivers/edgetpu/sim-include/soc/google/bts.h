@@ -0,0 +1,27 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Fallback header for CONFIG_EDGETPU_SIM builds on kernels without Exynos BTS
+ * support.
+ *
+ * Copyright (C) 2022 Google LLC
+ */
+
+#ifndef __BTS_H__
+#define __BTS_H__
+
+static inline unsigned int bts_get_scenindex(const char *name)
+{
+	return 0;
+}
+
+static inline int bts_add_scenario(unsigned int index)
+{
+	return 0;
+}
+
+static inline int bts_del_scenario(unsigned int index)
+{
+	return 0;
+}
+
+#endif /* __BTS_H__ */
@@ -0,0 +1,40 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Fallback header for CONFIG_EDGETPU_SIM builds on kernels without Exynos PM
+ * QoS support.
+ *
+ * Copyright (C) 2022 Google LLC
+ */
+
+#ifndef __EXYNOS_PM_QOS_H__
+#define __EXYNOS_PM_QOS_H__
+
+#include <linux/types.h>
+
+enum exynos_pm_qos_class {
+	PM_QOS_DEVICE_THROUGHPUT,
+	PM_QOS_BUS_THROUGHPUT,
+};
+
+struct exynos_pm_qos_request {
+	int exynos_pm_qos_class;
+	s32 value;
+};
+
+static inline void exynos_pm_qos_add_request(struct exynos_pm_qos_request *req,
+					     int exynos_pm_qos_class, s32 value)
+{
+	req->exynos_pm_qos_class = exynos_pm_qos_class;
+	req->value = value;
+}
+
+static inline void exynos_pm_qos_update_request(struct exynos_pm_qos_request *req, s32 new_value)
+{
+	req->value = new_value;
+}
+
+static inline void exynos_pm_qos_remove_request(struct exynos_pm_qos_request *req)
+{
+}
+
+#endif /* __EXYNOS_PM_QOS_H__ */
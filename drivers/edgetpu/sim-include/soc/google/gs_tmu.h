@@ -0,0 +1,12 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Fallback header for CONFIG_EDGETPU_SIM builds on kernels without GS TMU
+ * support.
+ *
+ * Copyright (C) 2022 Google LLC
+ */
+
+#ifndef __GS_TMU_H__
+#define __GS_TMU_H__
+
+#endif /* __GS_TMU_H__ */
@@ -0,0 +1,50 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Fallback header for CONFIG_EDGETPU_SIM builds on kernels without the TPU
+ * external client interface, the driver itself implements
+ * edgetpu_ext_driver_cmd().
+ *
+ * Copyright (C) 2022 Google LLC
+ */
+
+#ifndef __TPU_EXT_H__
+#define __TPU_EXT_H__
+
+#include <linux/compiler.h>
+#include <linux/types.h>
+
+struct device;
+struct edgetpu_mailbox_attr;
+
+struct edgetpu_ext_mailbox_descriptor {
+	phys_addr_t cmdq_pa;
+	phys_addr_t respq_pa;
+};
+
+struct edgetpu_ext_mailbox_info {
+	u32 cmdq_size;
+	u32 respq_size;
+	struct edgetpu_ext_mailbox_descriptor mailboxes[];
+};
+
+struct edgetpu_ext_client_info {
+	int tpu_fd;
+	u32 mbox_map;
+	struct edgetpu_mailbox_attr __user *attr;
+};
+
+enum edgetpu_ext_client_type {
+	EDGETPU_EXTERNAL_CLIENT_TYPE_DSP,
+	EDGETPU_EXTERNAL_CLIENT_TYPE_AOC,
+};
+
+enum edgetpu_ext_commands {
+	ALLOCATE_EXTERNAL_MAILBOX,
+	FREE_EXTERNAL_MAILBOX,
+};
+
+int edgetpu_ext_driver_cmd(struct device *edgetpu_dev,
+			   enum edgetpu_ext_client_type client_type,
+			   enum edgetpu_ext_commands cmd_id, void *in_data, void *out_data);
+
+#endif /* __TPU_EXT_H__ */
@@ -0,0 +1,69 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Performance KUnit suite of the device group helpers, included by
+ * edgetpu-device-group.c to reach its static functions.
+ *
+ * Copyright (C) 2022 Google LLC
+ */
+
+#include <kunit/test.h>
+#include <linux/scatterlist.h>
+
+#include "edgetpu-perf.h"
+
+/* A 16MB buffer of scattered pages, the worst case of find_sg_to_sync(). */
+#define PERF_SG_NENTS		4096
+#define PERF_SG_ROUNDS		10000
+
+static void edgetpu_perf_find_sg_range(struct kunit *test, struct sg_table *sgt,
+				       const char *name, u64 start, u64 end, u64 max_ns)
+{
+	struct sglist_to_sync sglist;
+	struct edgetpu_perf perf;
+	int i;
+
+	edgetpu_perf_start(&perf, name, max_ns);
+	for (i = 0; i < PERF_SG_ROUNDS; i++) {
+		find_sg_to_sync(sgt, start, end, &sglist);
+		if (!sglist.nelems)
+			break;
+		restore_sg_after_sync(&sglist);
+	}
+	edgetpu_perf_end(test, &perf, i);
+	KUNIT_EXPECT_EQ(test, i, PERF_SG_ROUNDS);
+}
+
+static void edgetpu_perf_find_sg_to_sync(struct kunit *test)
+{
+	const u64 size = (u64)PERF_SG_NENTS * PAGE_SIZE;
+	struct scatterlist *sg;
+	struct sg_table sgt;
+	int i;
+
+	KUNIT_ASSERT_EQ(test, sg_alloc_table(&sgt, PERF_SG_NENTS, GFP_KERNEL), 0);
+	/* Only the lengths are looked at, no pages are needed. */
+	for_each_sg(sgt.sgl, sg, sgt.orig_nents, i)
+		sg->length = PAGE_SIZE;
+
+	/* ranges past the head walk the table from its start */
+	edgetpu_perf_find_sg_range(test, &sgt, "find_sg_head_page", 0, PAGE_SIZE,
+				   10 * NSEC_PER_USEC);
+	edgetpu_perf_find_sg_range(test, &sgt, "find_sg_tail_page", size - PAGE_SIZE, size,
+				   200 * NSEC_PER_USEC);
+	edgetpu_perf_find_sg_range(test, &sgt, "find_sg_unaligned_middle", size / 2 + 100,
+				   size / 2 + 3 * PAGE_SIZE, 200 * NSEC_PER_USEC);
+	edgetpu_perf_find_sg_range(test, &sgt, "find_sg_whole", 0, size, 200 * NSEC_PER_USEC);
+	sg_free_table(&sgt);
+}
+
+static struct kunit_case edgetpu_device_group_perf_test_cases[] = {
+	KUNIT_CASE(edgetpu_perf_find_sg_to_sync),
+	{},
+};
+
+static struct kunit_suite edgetpu_device_group_perf_test_suite = {
+	.name = "edgetpu-device-group-perf",
+	.test_cases = edgetpu_device_group_perf_test_cases,
+};
+
+kunit_test_suites(&edgetpu_device_group_perf_test_suite);
@@ -0,0 +1,247 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Performance KUnit suite of the iremap pool sub-allocator, included by
+ * edgetpu-iremap-pool.c to reach the pool internals.
+ *
+ * Allocations from the size classes are compared with what every small
+ * allocation cost before the classes existed: a granule from the gen_pool.
+ *
+ * Copyright (C) 2022 Google LLC
+ */
+
+#include <kunit/test.h>
+#include <linux/completion.h>
+#include <linux/cpumask.h>
+#include <linux/kthread.h>
+#include <linux/sizes.h>
+
+#include "edgetpu-perf.h"
+
+#define PERF_IREMAP_POOL_SIZE	SZ_1M
+#define PERF_IREMAP_ROUNDS	10000
+/* More live objects than a magazine holds, to go through the class lock. */
+#define PERF_IREMAP_WORKING_SET	(4 * EDGETPU_IREMAP_MAG_SIZE)
+#define PERF_IREMAP_MAX_THREADS	8
+/* Ceiling of the time an allocation and its free take. */
+#define PERF_IREMAP_MAX_NS	(20 * NSEC_PER_USEC)
+
+/* Allocates with the size classes, or with a granule of the gen_pool if @gen_pool. */
+static int perf_iremap_alloc(struct edgetpu_dev *etdev, size_t size, bool gen_pool,
+			     struct edgetpu_coherent_mem *mem)
+{
+	struct edgetpu_mempool *pool = etdev->iremap_pool;
+
+	if (!gen_pool)
+		return edgetpu_iremap_alloc(etdev, size, mem, EDGETPU_CONTEXT_KCI);
+	mem->size = pool->granule;
+	mem->vaddr = (void *)gen_pool_alloc(pool->gen_pool, pool->granule);
+	return mem->vaddr ? 0 : -ENOMEM;
+}
+
+static void perf_iremap_free(struct edgetpu_dev *etdev, bool gen_pool,
+			     struct edgetpu_coherent_mem *mem)
+{
+	struct edgetpu_mempool *pool = etdev->iremap_pool;
+
+	if (!gen_pool)
+		edgetpu_iremap_free(etdev, mem, EDGETPU_CONTEXT_KCI);
+	else
+		gen_pool_free(pool->gen_pool, (unsigned long)mem->vaddr, mem->size);
+}
+
+/*
+ * The simulated device has no carveout and hence no pool, measure a pool
+ * created on kernel memory for a stand-in device instead.
+ */
+static struct edgetpu_dev *perf_iremap_pool_dev(struct kunit *test)
+{
+	struct edgetpu_dev *etdev = edgetpu_perf_sim_device(test);
+	struct edgetpu_dev *pool_dev;
+	void *backing;
+
+	backing = kunit_kzalloc(test, PERF_IREMAP_POOL_SIZE, GFP_KERNEL);
+	pool_dev = kunit_kzalloc(test, sizeof(*pool_dev), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, backing);
+	KUNIT_ASSERT_NOT_NULL(test, pool_dev);
+	pool_dev->dev = etdev->dev;
+	KUNIT_ASSERT_EQ(test, edgetpu_iremap_pool_create(pool_dev, backing, 0, 0,
+							 virt_to_phys(backing),
+							 PERF_IREMAP_POOL_SIZE, PAGE_SIZE), 0);
+	return pool_dev;
+}
+
+static void edgetpu_perf_iremap_alloc_free(struct kunit *test)
+{
+	static const size_t sizes[] = { 64, 256, 1024, PAGE_SIZE };
+	struct edgetpu_dev *pool_dev = perf_iremap_pool_dev(test);
+	struct edgetpu_coherent_mem mem;
+	struct edgetpu_perf perf;
+	char name[32];
+	int i, s, ret = 0;
+
+	for (s = 0; s < ARRAY_SIZE(sizes); s++) {
+		scnprintf(name, sizeof(name), "iremap_kci_%zu", sizes[s]);
+		edgetpu_perf_start(&perf, name, PERF_IREMAP_MAX_NS);
+		for (i = 0; i < PERF_IREMAP_ROUNDS; i++) {
+			ret = edgetpu_iremap_alloc(pool_dev, sizes[s], &mem, EDGETPU_CONTEXT_KCI);
+			if (ret)
+				break;
+			edgetpu_iremap_free(pool_dev, &mem, EDGETPU_CONTEXT_KCI);
+		}
+		edgetpu_perf_end(test, &perf, i);
+		KUNIT_EXPECT_EQ(test, ret, 0);
+	}
+
+	edgetpu_perf_start(&perf, "iremap_vii_page", PERF_IREMAP_MAX_NS);
+	for (i = 0; i < PERF_IREMAP_ROUNDS; i++) {
+		ret = edgetpu_iremap_alloc(pool_dev, PAGE_SIZE, &mem, EDGETPU_CONTEXT_VII_BASE);
+		if (ret)
+			break;
+		edgetpu_iremap_free(pool_dev, &mem, EDGETPU_CONTEXT_VII_BASE);
+	}
+	edgetpu_perf_end(test, &perf, i);
+	KUNIT_EXPECT_EQ(test, ret, 0);
+
+	edgetpu_iremap_pool_destroy(pool_dev);
+}
+
+/*
+ * Keeps PERF_IREMAP_WORKING_SET objects live: allocates them all, then frees
+ * them all. One op is one allocation and its free.
+ */
+static void edgetpu_perf_iremap_working_set(struct kunit *test)
+{
+	static const size_t sizes[] = { 64, 256, 1024 };
+	struct edgetpu_dev *pool_dev = perf_iremap_pool_dev(test);
+	struct edgetpu_coherent_mem *mems;
+	struct edgetpu_perf perf;
+	char name[48];
+	int i, j, s, ret = 0;
+	int gen_pool;
+
+	mems = kunit_kcalloc(test, PERF_IREMAP_WORKING_SET, sizeof(*mems), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, mems);
+	for (s = 0; s < ARRAY_SIZE(sizes); s++) {
+		for (gen_pool = 0; gen_pool < 2; gen_pool++) {
+			scnprintf(name, sizeof(name), "iremap_%s_set%u_%zu",
+				  gen_pool ? "gen_pool" : "classes", PERF_IREMAP_WORKING_SET,
+				  sizes[s]);
+			edgetpu_perf_start(&perf, name, PERF_IREMAP_MAX_NS);
+			for (i = 0; i < PERF_IREMAP_ROUNDS / PERF_IREMAP_WORKING_SET && !ret; i++) {
+				for (j = 0; j < PERF_IREMAP_WORKING_SET; j++) {
+					ret = perf_iremap_alloc(pool_dev, sizes[s], gen_pool,
+								&mems[j]);
+					if (ret)
+						break;
+				}
+				while (j--)
+					perf_iremap_free(pool_dev, gen_pool, &mems[j]);
+			}
+			edgetpu_perf_end(test, &perf, (u64)i * PERF_IREMAP_WORKING_SET);
+			KUNIT_EXPECT_EQ(test, ret, 0);
+		}
+	}
+	edgetpu_iremap_pool_destroy(pool_dev);
+}
+
+struct perf_iremap_worker {
+	struct edgetpu_dev *pool_dev;
+	struct completion *start;
+	struct completion done;
+	bool gen_pool;
+	int ret;
+};
+
+static int perf_iremap_worker_fn(void *data)
+{
+	struct perf_iremap_worker *w = data;
+	struct edgetpu_coherent_mem mem;
+	int i;
+
+	wait_for_completion(w->start);
+	for (i = 0; i < PERF_IREMAP_ROUNDS; i++) {
+		w->ret = perf_iremap_alloc(w->pool_dev, 256, w->gen_pool, &mem);
+		if (w->ret)
+			break;
+		perf_iremap_free(w->pool_dev, w->gen_pool, &mem);
+	}
+	complete(&w->done);
+	return 0;
+}
+
+/*
+ * Runs alloc/free loops on 1 to PERF_IREMAP_MAX_THREADS CPUs at once. The
+ * gen_pool serializes every call on its lock, the per-CPU magazines should
+ * keep the aggregate throughput growing with the number of CPUs.
+ */
+static void edgetpu_perf_iremap_contention(struct kunit *test)
+{
+	struct edgetpu_dev *pool_dev = perf_iremap_pool_dev(test);
+	struct perf_iremap_worker *workers;
+	struct task_struct *task;
+	struct completion start;
+	struct edgetpu_perf perf;
+	uint nthreads, max_threads, i;
+	char name[48];
+	int gen_pool, cpu;
+	long ret;
+
+	max_threads = min_t(uint, num_online_cpus(), PERF_IREMAP_MAX_THREADS);
+	workers = kunit_kcalloc(test, max_threads, sizeof(*workers), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, workers);
+	for (nthreads = 1; nthreads <= max_threads; nthreads *= 2) {
+		for (gen_pool = 0; gen_pool < 2; gen_pool++) {
+			init_completion(&start);
+			ret = 0;
+			i = 0;
+			for_each_online_cpu(cpu) {
+				if (i == nthreads)
+					break;
+				workers[i].pool_dev = pool_dev;
+				workers[i].start = &start;
+				workers[i].gen_pool = gen_pool;
+				workers[i].ret = 0;
+				init_completion(&workers[i].done);
+				task = kthread_create(perf_iremap_worker_fn, &workers[i],
+						     "edgetpu-perf/%u", i);
+				if (IS_ERR(task)) {
+					ret = PTR_ERR(task);
+					break;
+				}
+				kthread_bind(task, cpu);
+				wake_up_process(task);
+				i++;
+			}
+			scnprintf(name, sizeof(name), "iremap_%s_contention_%ut",
+				  gen_pool ? "gen_pool" : "classes", nthreads);
+			edgetpu_perf_start(&perf, name, PERF_IREMAP_MAX_NS);
+			complete_all(&start);
+			/* the workers started must finish before the pool can go */
+			while (i--)
+				wait_for_completion(&workers[i].done);
+			edgetpu_perf_end(test, &perf, (u64)nthreads * PERF_IREMAP_ROUNDS);
+			if (ret)
+				break;
+			for (i = 0; i < nthreads; i++)
+				KUNIT_EXPECT_EQ(test, workers[i].ret, 0);
+		}
+		if (ret)
+			break;
+	}
+	edgetpu_iremap_pool_destroy(pool_dev);
+	KUNIT_EXPECT_EQ(test, ret, 0);
+}
+
+static struct kunit_case edgetpu_iremap_pool_perf_test_cases[] = {
+	KUNIT_CASE(edgetpu_perf_iremap_alloc_free),
+	KUNIT_CASE(edgetpu_perf_iremap_working_set),
+	KUNIT_CASE(edgetpu_perf_iremap_contention),
+	{},
+};
+
+static struct kunit_suite edgetpu_iremap_pool_perf_test_suite = {
+	.name = "edgetpu-iremap-pool-perf",
+	.test_cases = edgetpu_iremap_pool_perf_test_cases,
+};
+
+kunit_test_suites(&edgetpu_iremap_pool_perf_test_suite);
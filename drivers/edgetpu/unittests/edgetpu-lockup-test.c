@@ -0,0 +1,252 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * KUnit tests of the per-VCID recovery from firmware-detected job lockups,
+ * run against the simulated firmware.
+ *
+ * Copyright (C) 2022 Google LLC
+ */
+
+#include <kunit/test.h>
+#include <linux/delay.h>
+#include <linux/err.h>
+#include <linux/workqueue.h>
+
+#include "../edgetpu-device-group.h"
+#include "../edgetpu-internal.h"
+#include "../edgetpu-kci.h"
+#include "../edgetpu-mailbox.h"
+#include "../edgetpu-pm.h"
+#include "../edgetpu-sim.h"
+#include "../edgetpu-sw-watchdog.h"
+#include "../edgetpu-wakelock.h"
+#include "../edgetpu.h"
+
+/* Time the simulated firmware gets to react, it polls every sim_poll_us. */
+#define LOCKUP_TEST_TIMEOUT_MS	1000
+/* Time a closed mailbox must stay unserved. */
+#define LOCKUP_TEST_IDLE_MS	20
+
+struct lockup_test {
+	struct edgetpu_dev *etdev;
+	struct edgetpu_client *client;
+	struct edgetpu_device_group *group;
+	struct edgetpu_mailbox *mailbox;
+};
+
+static bool lockup_test_wait_resp_tail(struct edgetpu_mailbox *mailbox, u32 tail)
+{
+	int i;
+
+	for (i = 0; i < LOCKUP_TEST_TIMEOUT_MS; i++) {
+		if (EDGETPU_MAILBOX_RESP_QUEUE_READ(mailbox, tail) == tail)
+			return true;
+		msleep(1);
+	}
+	return false;
+}
+
+/* Makes the firmware report a lockup on the group and waits for the recovery to finish. */
+static void lockup_test_inject(struct kunit *test, struct lockup_test *lt)
+{
+	int i;
+
+	KUNIT_ASSERT_EQ(test, edgetpu_sim_reverse_kci(lt->etdev, RKCI_JOB_LOCKUP, lt->group->vcid),
+			0);
+	for (i = 0; i < LOCKUP_TEST_TIMEOUT_MS; i++) {
+		if (edgetpu_group_get_fatal_errors(lt->group) & EDGETPU_ERROR_RUNTIME_TIMEOUT)
+			break;
+		msleep(1);
+	}
+	flush_work(&lt->group->lockup_work);
+	KUNIT_ASSERT_LT(test, i, LOCKUP_TEST_TIMEOUT_MS);
+}
+
+/* Runs one command through the VII the way a runtime writing the mmapped CSRs does. */
+static void lockup_test_run_cmd(struct kunit *test, struct lockup_test *lt, u32 tail)
+{
+	EDGETPU_MAILBOX_CMD_QUEUE_WRITE(lt->mailbox, tail, tail);
+	KUNIT_EXPECT_TRUE(test, lockup_test_wait_resp_tail(lt->mailbox, tail));
+	EDGETPU_MAILBOX_RESP_QUEUE_WRITE(lt->mailbox, head, tail);
+}
+
+static void edgetpu_lockup_test_reset_reopen(struct kunit *test)
+{
+	struct lockup_test *lt = test->priv;
+
+	lockup_test_run_cmd(test, lt, 1);
+	lockup_test_run_cmd(test, lt, 2);
+
+	lockup_test_inject(test, lt);
+	/* without the opt-in the kernel reopens the VCID itself */
+	KUNIT_EXPECT_FALSE(test, lt->group->vii_reset_pending);
+	KUNIT_EXPECT_TRUE(test, edgetpu_device_group_is_finalized(lt->group));
+	KUNIT_EXPECT_TRUE(test, edgetpu_group_get_fatal_errors(lt->group) &
+			  EDGETPU_ERROR_RUNTIME_TIMEOUT);
+	KUNIT_EXPECT_EQ(test, EDGETPU_MAILBOX_CMD_QUEUE_READ(lt->mailbox, tail), 0);
+	KUNIT_EXPECT_EQ(test, EDGETPU_MAILBOX_RESP_QUEUE_READ(lt->mailbox, tail), 0);
+	/* a runtime restarting from index 0 is served again */
+	lockup_test_run_cmd(test, lt, 1);
+}
+
+static void edgetpu_lockup_test_reset_and_ack(struct kunit *test)
+{
+	struct lockup_test *lt = test->priv;
+	struct edgetpu_submit_cmds_ioctl submit = { .count = 1 };
+
+	edgetpu_group_enable_vii_reset_ack(lt->group);
+	lockup_test_run_cmd(test, lt, 1);
+	lockup_test_run_cmd(test, lt, 2);
+
+	lockup_test_inject(test, lt);
+	/* the queues are reset and kept closed until the runtime acknowledges */
+	KUNIT_EXPECT_TRUE(test, lt->group->vii_reset_pending);
+	KUNIT_EXPECT_TRUE(test, edgetpu_device_group_is_finalized(lt->group));
+	KUNIT_EXPECT_EQ(test, EDGETPU_MAILBOX_CMD_QUEUE_READ(lt->mailbox, head), 0);
+	KUNIT_EXPECT_EQ(test, EDGETPU_MAILBOX_CMD_QUEUE_READ(lt->mailbox, tail), 0);
+	KUNIT_EXPECT_EQ(test, EDGETPU_MAILBOX_RESP_QUEUE_READ(lt->mailbox, head), 0);
+	KUNIT_EXPECT_EQ(test, EDGETPU_MAILBOX_RESP_QUEUE_READ(lt->mailbox, tail), 0);
+	KUNIT_EXPECT_EQ(test, edgetpu_device_group_submit_cmds(lt->group, &submit), -ECONNRESET);
+
+	/* a runtime unaware of the reset bumps its stale tail, the firmware must ignore it */
+	EDGETPU_MAILBOX_CMD_QUEUE_WRITE(lt->mailbox, tail, 3);
+	msleep(LOCKUP_TEST_IDLE_MS);
+	KUNIT_EXPECT_EQ(test, EDGETPU_MAILBOX_RESP_QUEUE_READ(lt->mailbox, tail), 0);
+
+	KUNIT_ASSERT_EQ(test, edgetpu_group_ack_vii_reset(lt->group), 0);
+	KUNIT_EXPECT_FALSE(test, lt->group->vii_reset_pending);
+	KUNIT_EXPECT_EQ(test, edgetpu_group_get_fatal_errors(lt->group), 0);
+	/* the stale write is dropped and the runtime restarts from index 0 */
+	KUNIT_EXPECT_EQ(test, EDGETPU_MAILBOX_CMD_QUEUE_READ(lt->mailbox, tail), 0);
+	lockup_test_run_cmd(test, lt, 1);
+
+	/* acknowledging again is a no-op */
+	KUNIT_EXPECT_EQ(test, edgetpu_group_ack_vii_reset(lt->group), 0);
+}
+
+static void edgetpu_lockup_test_other_vcid(struct kunit *test)
+{
+	struct lockup_test *lt = test->priv;
+	struct edgetpu_device_group *group = lt->group;
+	u32 free_vcids;
+
+	mutex_lock(&lt->etdev->groups_lock);
+	free_vcids = lt->etdev->vcid_pool;
+	mutex_unlock(&lt->etdev->groups_lock);
+	if (!free_vcids)
+		kunit_skip(test, "no free VCID");
+	/* a lockup on a VCID no group uses changes nothing */
+	KUNIT_ASSERT_EQ(test, edgetpu_sim_reverse_kci(lt->etdev, RKCI_JOB_LOCKUP,
+						      __ffs(free_vcids)), 0);
+	msleep(LOCKUP_TEST_IDLE_MS);
+	flush_work(&group->lockup_work);
+	KUNIT_EXPECT_FALSE(test, group->vii_reset_pending);
+	KUNIT_EXPECT_EQ(test, edgetpu_group_get_fatal_errors(group), 0);
+	lockup_test_run_cmd(test, lt, 1);
+}
+
+static void edgetpu_lockup_test_close_fails(struct kunit *test)
+{
+	struct lockup_test *lt = test->priv;
+	struct edgetpu_sw_wdt *wdt;
+
+	lockup_test_run_cmd(test, lt, 1);
+	KUNIT_ASSERT_EQ(test, edgetpu_sim_set_fault(lt->etdev, EDGETPU_SIM_FAULT_CLOSE_DEVICE), 0);
+	lockup_test_inject(test, lt);
+	edgetpu_sim_set_fault(lt->etdev, EDGETPU_SIM_FAULT_NONE);
+
+	/* the VCID can't be recovered alone, the firmware is restarted instead */
+	KUNIT_EXPECT_FALSE(test, lt->group->vii_reset_pending);
+	KUNIT_EXPECT_FALSE(test, edgetpu_device_group_is_finalized(lt->group));
+	/* let the restart finish before the next case needs the firmware */
+	wdt = rcu_access_pointer(lt->etdev->etdev_sw_wdt);
+	if (wdt)
+		flush_work(&wdt->et_action_work.work);
+	KUNIT_EXPECT_TRUE(test, edgetpu_group_get_fatal_errors(lt->group) &
+			  EDGETPU_ERROR_WATCHDOG_TIMEOUT);
+}
+
+static int edgetpu_lockup_test_init(struct kunit *test)
+{
+	const struct edgetpu_create_group_ext ext = {
+		.attr = {
+			.cmd_queue_size = 4,
+			.resp_queue_size = 4,
+			.sizeof_cmd = 16,
+			.sizeof_resp = 16,
+		},
+	};
+	struct edgetpu_dev *etdev = edgetpu_sim_test_device();
+	struct lockup_test *lt;
+	int ret;
+
+	if (!etdev)
+		kunit_skip(test, "no simulated device bound");
+	lt = kunit_kzalloc(test, sizeof(*lt), GFP_KERNEL);
+	if (!lt)
+		return -ENOMEM;
+	lt->etdev = etdev;
+	lt->client = edgetpu_client_add(etdev->etiface);
+	if (IS_ERR(lt->client))
+		return PTR_ERR(lt->client);
+	test->priv = lt;
+
+	/* what EDGETPU_ACQUIRE_WAKE_LOCK does before the client has a group */
+	ret = edgetpu_pm_get(etdev->pm);
+	if (ret)
+		goto err_remove_client;
+	edgetpu_wakelock_lock(lt->client->wakelock);
+	ret = edgetpu_wakelock_acquire(lt->client->wakelock);
+	edgetpu_wakelock_unlock(lt->client->wakelock);
+	if (ret < 0)
+		goto err_pm_put;
+
+	lt->group = edgetpu_device_group_alloc(lt->client, &ext);
+	if (IS_ERR(lt->group)) {
+		ret = PTR_ERR(lt->group);
+		goto err_pm_put;
+	}
+	ret = edgetpu_device_group_finalize(lt->group);
+	if (ret)
+		goto err_pm_put;
+	lt->mailbox = lt->group->vii.mailbox;
+	if (!lt->mailbox) {
+		ret = -ENODEV;
+		goto err_pm_put;
+	}
+	return 0;
+
+err_pm_put:
+	edgetpu_pm_put(etdev->pm);
+err_remove_client:
+	edgetpu_client_remove(lt->client);
+	test->priv = NULL;
+	return ret;
+}
+
+static void edgetpu_lockup_test_exit(struct kunit *test)
+{
+	struct lockup_test *lt = test->priv;
+
+	if (!lt)
+		return;
+	/* what closing the file of a client holding a wakelock does */
+	edgetpu_client_remove(lt->client);
+	edgetpu_pm_put(lt->etdev->pm);
+}
+
+static struct kunit_case edgetpu_lockup_test_cases[] = {
+	KUNIT_CASE(edgetpu_lockup_test_reset_reopen),
+	KUNIT_CASE(edgetpu_lockup_test_reset_and_ack),
+	KUNIT_CASE(edgetpu_lockup_test_other_vcid),
+	KUNIT_CASE(edgetpu_lockup_test_close_fails),
+	{},
+};
+
+static struct kunit_suite edgetpu_lockup_test_suite = {
+	.name = "edgetpu-lockup",
+	.init = edgetpu_lockup_test_init,
+	.exit = edgetpu_lockup_test_exit,
+	.test_cases = edgetpu_lockup_test_cases,
+};
+
+kunit_test_suites(&edgetpu_lockup_test_suite);
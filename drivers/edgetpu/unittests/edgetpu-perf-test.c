@@ -0,0 +1,338 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Performance KUnit suite of the EdgeTPU driver: mappings, domain pool,
+ * async jobs, KCI round trips against the simulated firmware and cache line
+ * contention between the submission and IRQ paths.
+ *
+ * Results are reported in the format described in edgetpu-perf.h.
+ *
+ * Copyright (C) 2022 Google LLC
+ */
+
+#include <kunit/test.h>
+#include <linux/atomic.h>
+#include <linux/cache.h>
+#include <linux/completion.h>
+#include <linux/cpumask.h>
+#include <linux/iommu.h>
+#include <linux/kthread.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+
+#include "../edgetpu-async.h"
+#include "../edgetpu-device-group.h"
+#include "../edgetpu-domain-pool.h"
+#include "../edgetpu-internal.h"
+#include "../edgetpu-kci.h"
+#include "../edgetpu-mailbox.h"
+#include "../edgetpu-mapping.h"
+#include "../edgetpu-pm.h"
+#include "edgetpu-perf.h"
+
+#define PERF_NUM_MAPPINGS	10000
+#define PERF_DOMAIN_POOL_SIZE	8
+#define PERF_DOMAIN_ROUNDS	1000
+#define PERF_ASYNC_ROUNDS	100
+#define PERF_KCI_ROUNDS		1000
+#define PERF_LINE_ROUNDS	1000000
+
+uint edgetpu_perf_ceiling_pct;
+module_param_named(perf_ceiling_pct, edgetpu_perf_ceiling_pct, uint, 0660);
+MODULE_PARM_DESC(perf_ceiling_pct,
+		 "Percentage of the per-op ceilings the perf suites fail above, 0 to only report");
+
+static void perf_mapping_release(struct edgetpu_mapping *map)
+{
+}
+
+static void edgetpu_perf_mapping_add_find(struct kunit *test)
+{
+	struct edgetpu_mapping_root root;
+	struct edgetpu_mapping *maps, *map;
+	struct edgetpu_perf perf;
+	int i, ret;
+
+	maps = kvcalloc(PERF_NUM_MAPPINGS, sizeof(*maps), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, maps);
+	edgetpu_mapping_init(&root);
+
+	edgetpu_perf_start(&perf, "mapping_add_10k", 20 * NSEC_PER_USEC);
+	for (i = 0; i < PERF_NUM_MAPPINGS; i++) {
+		/* Interleave the addresses so the tree sees out-of-order inserts. */
+		maps[i].device_address = (tpu_addr_t)((i * 7919) % PERF_NUM_MAPPINGS) << PAGE_SHIFT;
+		maps[i].die_index = 0;
+		maps[i].map_size = PAGE_SIZE;
+		maps[i].release = perf_mapping_release;
+		ret = edgetpu_mapping_add(&root, &maps[i]);
+		if (ret)
+			break;
+	}
+	edgetpu_perf_end(test, &perf, i);
+	KUNIT_EXPECT_EQ(test, ret, 0);
+
+	edgetpu_perf_start(&perf, "mapping_find_10k", 20 * NSEC_PER_USEC);
+	edgetpu_mapping_lock(&root);
+	for (i = 0; i < PERF_NUM_MAPPINGS; i++) {
+		map = edgetpu_mapping_find_locked(&root, 0, (tpu_addr_t)i << PAGE_SHIFT);
+		if (!map)
+			break;
+	}
+	edgetpu_mapping_unlock(&root);
+	edgetpu_perf_end(test, &perf, i);
+	KUNIT_EXPECT_EQ(test, i, PERF_NUM_MAPPINGS);
+
+	edgetpu_perf_start(&perf, "mapping_clear_10k", 20 * NSEC_PER_USEC);
+	edgetpu_mapping_clear(&root);
+	edgetpu_perf_end(test, &perf, PERF_NUM_MAPPINGS);
+	kvfree(maps);
+}
+
+static void edgetpu_perf_domain_pool_alloc_free(struct kunit *test)
+{
+	struct edgetpu_dev *etdev = edgetpu_perf_sim_device(test);
+	struct edgetpu_domain_pool pool;
+	struct iommu_domain *domain;
+	struct edgetpu_perf perf;
+	int i, id;
+
+	KUNIT_ASSERT_EQ(test, edgetpu_domain_pool_init(etdev, &pool, PERF_DOMAIN_POOL_SIZE,
+						       PERF_DOMAIN_POOL_SIZE / 2), 0);
+
+	edgetpu_perf_start(&perf, "domain_pool_alloc_free", NSEC_PER_MSEC);
+	for (i = 0; i < PERF_DOMAIN_ROUNDS; i++) {
+		domain = edgetpu_domain_pool_alloc(&pool, &id);
+		if (!domain)
+			break;
+		edgetpu_domain_pool_free(&pool, domain, id);
+	}
+	edgetpu_perf_end(test, &perf, i);
+	KUNIT_EXPECT_EQ(test, i, PERF_DOMAIN_ROUNDS);
+	edgetpu_domain_pool_destroy(&pool);
+
+	/* Same loop with the pool disabled, i.e. plain IOMMU API domains. */
+	KUNIT_ASSERT_EQ(test, edgetpu_domain_pool_init(etdev, &pool, 0, 0), 0);
+	edgetpu_perf_start(&perf, "domain_dynamic_alloc_free", 5 * NSEC_PER_MSEC);
+	for (i = 0; i < PERF_DOMAIN_ROUNDS; i++) {
+		domain = edgetpu_domain_pool_alloc(&pool, &id);
+		if (!domain)
+			break;
+		edgetpu_domain_pool_free(&pool, domain, id);
+	}
+	edgetpu_perf_end(test, &perf, i);
+	KUNIT_EXPECT_EQ(test, i, PERF_DOMAIN_ROUNDS);
+	edgetpu_domain_pool_destroy(&pool);
+}
+
+static int perf_async_job(void *data)
+{
+	atomic_inc(data);
+	return 0;
+}
+
+static void edgetpu_perf_async_fanout(struct kunit *test)
+{
+	static const uint fanouts[] = { 1, 4, 16, 64 };
+	struct edgetpu_async_ctx *ctx;
+	struct edgetpu_perf perf;
+	atomic_t done;
+	char name[32];
+	int i, f, ret = 0;
+	uint j;
+
+	for (f = 0; f < ARRAY_SIZE(fanouts); f++) {
+		atomic_set(&done, 0);
+		scnprintf(name, sizeof(name), "async_fanout_%u", fanouts[f]);
+		edgetpu_perf_start(&perf, name, fanouts[f] * NSEC_PER_MSEC);
+		for (i = 0; i < PERF_ASYNC_ROUNDS; i++) {
+			ctx = edgetpu_async_alloc_ctx();
+			if (!ctx) {
+				ret = -ENOMEM;
+				break;
+			}
+			for (j = 0; j < fanouts[f] && !ret; j++)
+				ret = edgetpu_async_add_job(ctx, &done, perf_async_job);
+			if (!ret)
+				ret = edgetpu_async_wait(ctx);
+			edgetpu_async_free_ctx(ctx);
+			if (ret)
+				break;
+		}
+		/* One op is one context: alloc, fan out, wait and free. */
+		edgetpu_perf_end(test, &perf, i);
+		KUNIT_EXPECT_EQ(test, ret, 0);
+		KUNIT_EXPECT_EQ(test, atomic_read(&done), i * fanouts[f]);
+	}
+}
+
+static void edgetpu_perf_kci_round_trip(struct kunit *test)
+{
+	struct edgetpu_dev *etdev = edgetpu_perf_sim_device(test);
+	struct edgetpu_command_element cmd = {
+		.code = KCI_CODE_ACK,
+	};
+	struct edgetpu_perf perf;
+	int i, ret = 0;
+
+	ret = edgetpu_pm_get(etdev->pm);
+	if (ret)
+		kunit_skip(test, "failed to power up the simulated device: %d", ret);
+
+	edgetpu_perf_start(&perf, "kci_ack_round_trip", 10 * NSEC_PER_MSEC);
+	for (i = 0; i < PERF_KCI_ROUNDS; i++) {
+		ret = edgetpu_kci_send_cmd(etdev->kci, &cmd);
+		if (ret)
+			break;
+	}
+	edgetpu_perf_end(test, &perf, i);
+	edgetpu_pm_put(etdev->pm);
+	KUNIT_EXPECT_EQ(test, ret, KCI_ERROR_OK);
+}
+
+/*
+ * The mailbox and group fields written by the submission and IRQ paths, all
+ * on one cache line as they were before struct edgetpu_mailbox and struct
+ * edgetpu_device_group were split by access pattern.
+ */
+struct perf_mailbox_one_line {
+	u32 cmd_queue_size;
+	u32 resp_queue_size;
+	u32 cmd_queue_tail;
+	u32 resp_queue_head;
+} ____cacheline_aligned;
+
+struct perf_group_one_line {
+	u16 vcid;
+	unsigned long mailbox_last_used;
+} ____cacheline_aligned;
+
+/* One side of a contention run, each round does what the set fields say. */
+struct perf_line_worker {
+	struct completion *start;
+	struct completion done;
+	/* queue index advanced every round, wrapping at *@size */
+	u32 *index;
+	const u32 *size;
+	/* time stamp bumped every round */
+	unsigned long *stamp;
+	/* read-mostly field read every round */
+	const u16 *vcid;
+	u64 sink;
+};
+
+static int perf_line_worker_fn(void *data)
+{
+	struct perf_line_worker *w = data;
+	int i;
+
+	wait_for_completion(w->start);
+	for (i = 0; i < PERF_LINE_ROUNDS; i++) {
+		if (w->index)
+			WRITE_ONCE(*w->index, (READ_ONCE(*w->index) + 1) % READ_ONCE(*w->size));
+		if (w->stamp)
+			WRITE_ONCE(*w->stamp, READ_ONCE(*w->stamp) + 1);
+		if (w->vcid)
+			w->sink += READ_ONCE(*w->vcid);
+	}
+	complete(&w->done);
+	return 0;
+}
+
+/* Runs @workers[0] and @workers[1] at once on two CPUs and reports both sides' rounds. */
+static void perf_line_run(struct kunit *test, const char *name, struct perf_line_worker *workers)
+{
+	struct task_struct *tasks[2];
+	struct completion start;
+	struct edgetpu_perf perf;
+	int i, cpu = -1;
+
+	init_completion(&start);
+	for (i = 0; i < 2; i++) {
+		workers[i].start = &start;
+		init_completion(&workers[i].done);
+		tasks[i] = kthread_create(perf_line_worker_fn, &workers[i], "edgetpu-perf/%d", i);
+		if (IS_ERR(tasks[i])) {
+			KUNIT_FAIL(test, "failed to create worker: %ld", PTR_ERR(tasks[i]));
+			/* the workers started must finish before their data goes */
+			complete_all(&start);
+			while (i--)
+				wait_for_completion(&workers[i].done);
+			return;
+		}
+		cpu = cpumask_next(cpu, cpu_online_mask);
+		kthread_bind(tasks[i], cpu);
+		wake_up_process(tasks[i]);
+	}
+	edgetpu_perf_start(&perf, name, 10 * NSEC_PER_USEC);
+	complete_all(&start);
+	for (i = 0; i < 2; i++)
+		wait_for_completion(&workers[i].done);
+	edgetpu_perf_end(test, &perf, 2 * PERF_LINE_ROUNDS);
+}
+
+/*
+ * The submission path advances the command queue tail while the response IRQ
+ * advances the response queue head, and the VII IRQ stamps the group while
+ * submitters read its read-mostly fields. Each pair runs on two CPUs, with the
+ * fields on one cache line and then with the driver's layouts.
+ */
+static void edgetpu_perf_submit_irq_contention(struct kunit *test)
+{
+	struct perf_mailbox_one_line *mb_line;
+	struct perf_group_one_line *group_line;
+	struct perf_line_worker workers[2];
+	struct edgetpu_device_group *group;
+	struct edgetpu_mailbox *mailbox;
+
+	if (!IS_ENABLED(CONFIG_SMP) || num_online_cpus() < 2)
+		kunit_skip(test, "needs two CPUs");
+	mb_line = kunit_kzalloc(test, sizeof(*mb_line), GFP_KERNEL);
+	group_line = kunit_kzalloc(test, sizeof(*group_line), GFP_KERNEL);
+	mailbox = kunit_kzalloc(test, sizeof(*mailbox), GFP_KERNEL);
+	group = kunit_kzalloc(test, sizeof(*group), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, mb_line);
+	KUNIT_ASSERT_NOT_NULL(test, group_line);
+	KUNIT_ASSERT_NOT_NULL(test, mailbox);
+	KUNIT_ASSERT_NOT_NULL(test, group);
+
+	mb_line->cmd_queue_size = mb_line->resp_queue_size = 1024;
+	memset(workers, 0, sizeof(workers));
+	workers[0].index = &mb_line->cmd_queue_tail;
+	workers[0].size = &mb_line->cmd_queue_size;
+	workers[1].index = &mb_line->resp_queue_head;
+	workers[1].size = &mb_line->resp_queue_size;
+	perf_line_run(test, "contention_mailbox_one_line", workers);
+
+	mailbox->cmd_queue_size = mailbox->resp_queue_size = 1024;
+	memset(workers, 0, sizeof(workers));
+	workers[0].index = &mailbox->cmd_queue_tail;
+	workers[0].size = &mailbox->cmd_queue_size;
+	workers[1].index = &mailbox->resp_queue_head;
+	workers[1].size = &mailbox->resp_queue_size;
+	perf_line_run(test, "contention_mailbox_layout", workers);
+
+	memset(workers, 0, sizeof(workers));
+	workers[0].vcid = &group_line->vcid;
+	workers[1].stamp = &group_line->mailbox_last_used;
+	perf_line_run(test, "contention_group_one_line", workers);
+
+	memset(workers, 0, sizeof(workers));
+	workers[0].vcid = &group->vcid;
+	workers[1].stamp = &group->mailbox_last_used;
+	perf_line_run(test, "contention_group_layout", workers);
+}
+
+static struct kunit_case edgetpu_perf_test_cases[] = {
+	KUNIT_CASE(edgetpu_perf_mapping_add_find),
+	KUNIT_CASE(edgetpu_perf_domain_pool_alloc_free),
+	KUNIT_CASE(edgetpu_perf_async_fanout),
+	KUNIT_CASE(edgetpu_perf_kci_round_trip),
+	KUNIT_CASE(edgetpu_perf_submit_irq_contention),
+	{},
+};
+
+static struct kunit_suite edgetpu_perf_test_suite = {
+	.name = "edgetpu-perf",
+	.test_cases = edgetpu_perf_test_cases,
+};
+
+kunit_test_suites(&edgetpu_perf_test_suite);
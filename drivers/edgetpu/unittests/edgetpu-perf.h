@@ -0,0 +1,89 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Helpers of the EdgeTPU performance KUnit suites.
+ *
+ * Every measurement is reported as one line of the KUnit log:
+ *
+ *   # <case>: perf name=<name> ops=<n> total_ns=<ns> ns_per_op=<ns> ops_per_sec=<n>
+ *
+ * so results can be collected from dmesg or the debugfs KUnit results with
+ * e.g. `grep -o 'perf .*'`.
+ *
+ * Measurements also carry a coarse ceiling of the time per op, far above what
+ * the paths take on any machine the suites are meant for, to catch regressions
+ * by orders of magnitude. Ceilings are only checked when the perf_ceiling_pct
+ * module parameter is set, to the percentage of them to allow, since slow or
+ * loaded machines, e.g. emulators, can miss them.
+ *
+ * Copyright (C) 2022 Google LLC
+ */
+#ifndef __EDGETPU_PERF_H__
+#define __EDGETPU_PERF_H__
+
+#include <kunit/test.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/types.h>
+
+#include "../edgetpu-internal.h"
+#include "../edgetpu-sim.h"
+
+/* Percentage of the ceilings to check measurements against, 0 to not check. */
+extern uint edgetpu_perf_ceiling_pct;
+
+struct edgetpu_perf {
+	const char *name;
+	u64 ops;
+	u64 start_ns;
+	u64 total_ns;
+	u64 max_ns_per_op;
+};
+
+/* Starts measuring @name, whose ops should take less than @max_ns_per_op each. */
+static inline void edgetpu_perf_start(struct edgetpu_perf *perf, const char *name,
+				      u64 max_ns_per_op)
+{
+	perf->name = name;
+	perf->ops = 0;
+	perf->total_ns = 0;
+	perf->max_ns_per_op = max_ns_per_op;
+	perf->start_ns = ktime_get_ns();
+}
+
+/*
+ * Reports @ops operations taking @total_ns nanoseconds in total, and checks
+ * them against @max_ns_per_op if ceilings are enabled.
+ */
+static inline void edgetpu_perf_report(struct kunit *test, const char *name, u64 ops,
+				       u64 total_ns, u64 max_ns_per_op)
+{
+	uint pct = READ_ONCE(edgetpu_perf_ceiling_pct);
+	u64 ns_per_op = ops ? div64_u64(total_ns, ops) : 0;
+
+	kunit_info(test, "perf name=%s ops=%llu total_ns=%llu ns_per_op=%llu ops_per_sec=%llu\n",
+		   name, ops, total_ns, ns_per_op,
+		   total_ns ? div64_u64(ops * NSEC_PER_SEC, total_ns) : 0);
+	if (pct && ops)
+		KUNIT_EXPECT_LE_MSG(test, ns_per_op, div_u64(max_ns_per_op * pct, 100),
+				    "%s is over %u%% of its ceiling", name, pct);
+}
+
+/* Stops the clock and reports @ops operations done since edgetpu_perf_start(). */
+static inline void edgetpu_perf_end(struct kunit *test, struct edgetpu_perf *perf, u64 ops)
+{
+	perf->total_ns = ktime_get_ns() - perf->start_ns;
+	perf->ops = ops;
+	edgetpu_perf_report(test, perf->name, perf->ops, perf->total_ns, perf->max_ns_per_op);
+}
+
+/* Returns the simulated device to measure on, skips the test if none is bound. */
+static inline struct edgetpu_dev *edgetpu_perf_sim_device(struct kunit *test)
+{
+	struct edgetpu_dev *etdev = edgetpu_sim_test_device();
+
+	if (!etdev)
+		kunit_skip(test, "no simulated device bound");
+	return etdev;
+}
+
+#endif /* __EDGETPU_PERF_H__ */
@@ -0,0 +1,103 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Performance KUnit suite of the telemetry log parsing, included by
+ * edgetpu-telemetry.c to reach its static functions.
+ *
+ * Copyright (C) 2022 Google LLC
+ */
+
+#include <kunit/test.h>
+#include <linux/sizes.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "edgetpu-perf.h"
+
+/* Header and ring together, must be a power of two like the firmware's buffer. */
+#define PERF_LOG_BUFFER_SIZE	SZ_64K
+#define PERF_LOG_ROUNDS		200
+
+/* Writer side of copy_with_wrap(), as the firmware does it. */
+static void perf_log_write(struct edgetpu_telemetry_header *header, const void *src,
+			   u32 length, u32 size, void *start)
+{
+	const u32 wrap_bit = size + sizeof(*header);
+	u32 remaining;
+	u32 tail = header->tail & (wrap_bit - 1);
+
+	if (tail + length < size) {
+		memcpy(start + tail, src, length);
+		header->tail += length;
+	} else {
+		remaining = size - tail;
+		memcpy(start + tail, src, remaining);
+		memcpy(start, src + remaining, length - remaining);
+		header->tail = (header->tail & wrap_bit) ^ wrap_bit;
+		header->tail |= length - remaining;
+	}
+}
+
+static void edgetpu_perf_log_parse(struct kunit *test, u16 msg_len)
+{
+	const u32 size = PERF_LOG_BUFFER_SIZE - sizeof(struct edgetpu_telemetry_header);
+	struct edgetpu_log_entry_header entry = { .code = EDGETPU_FW_LOG_LEVEL_INFO };
+	const uint n_entries = (size - 1) / (sizeof(entry) + msg_len);
+	struct edgetpu_telemetry_header *header;
+	u64 start_ns, total_ns = 0, ops = 0;
+	char *msg, *buffer;
+	char name[32];
+	void *start;
+	uint i, r;
+
+	header = kunit_kzalloc(test, PERF_LOG_BUFFER_SIZE, GFP_KERNEL);
+	msg = kunit_kzalloc(test, msg_len, GFP_KERNEL);
+	buffer = kunit_kzalloc(test, size, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, header);
+	KUNIT_ASSERT_NOT_NULL(test, msg);
+	KUNIT_ASSERT_NOT_NULL(test, buffer);
+	memset(msg, 'x', msg_len);
+	start = header + 1;
+	entry.length = msg_len;
+
+	scnprintf(name, sizeof(name), "log_parse_%u", msg_len);
+	for (r = 0; r < PERF_LOG_ROUNDS; r++) {
+		/* Fill the ring, the entries wrap at a different offset every round. */
+		for (i = 0; i < n_entries; i++) {
+			perf_log_write(header, &entry, sizeof(entry), size, start);
+			perf_log_write(header, msg, msg_len, size, start);
+		}
+		/* Only the reader is timed. */
+		start_ns = ktime_get_ns();
+		i = 0;
+		while (header->head != header->tail) {
+			copy_with_wrap(header, &entry, sizeof(entry), size, start);
+			if (entry.length != msg_len)
+				break;
+			copy_with_wrap(header, buffer, entry.length, size, start);
+			i++;
+		}
+		total_ns += ktime_get_ns() - start_ns;
+		ops += i;
+		KUNIT_ASSERT_EQ(test, i, n_entries);
+	}
+	edgetpu_perf_report(test, name, ops, total_ns, 10 * NSEC_PER_USEC);
+}
+
+static void edgetpu_perf_copy_with_wrap(struct kunit *test)
+{
+	edgetpu_perf_log_parse(test, 16);
+	edgetpu_perf_log_parse(test, 64);
+	edgetpu_perf_log_parse(test, 256);
+}
+
+static struct kunit_case edgetpu_telemetry_perf_test_cases[] = {
+	KUNIT_CASE(edgetpu_perf_copy_with_wrap),
+	{},
+};
+
+static struct kunit_suite edgetpu_telemetry_perf_test_suite = {
+	.name = "edgetpu-telemetry-perf",
+	.test_cases = edgetpu_telemetry_perf_test_cases,
+};
+
+kunit_test_suites(&edgetpu_telemetry_perf_test_suite);
@@ -0,0 +1,1248 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Userspace ioctl load generator and latency benchmark of the EdgeTPU driver.
+ *
+ * Worker threads each open the device, form a finalized group and then run a
+ * weighted mix of operations on the public edgetpu.h interface, timing every
+ * ioctl. Latencies go to per-thread log-linear histograms which are merged at
+ * the end to report throughput and p50/p99/p999 per ioctl.
+ *
+ * The queue workload times userspace accesses to the mmapped VII command and
+ * response queues instead, against the same accesses to cacheable memory.
+ *
+ * The pin workload maps large buffers, e.g. 4 GB, while a sampler thread
+ * polls /proc/meminfo, to report how much kernel memory a map holds while it
+ * pins the buffer and how much it keeps once it returns.
+ *
+ * The tool only uses the edgetpu.h interface, so it runs the same against TPU
+ * hardware and against a device served by the driver's firmware simulator
+ * (CONFIG_EDGETPU_SIM).
+ *
+ * Copyright (C) 2022 Google LLC
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/dma-heap.h>
+
+#include "edgetpu.h"
+
+#define DEFAULT_DEVICE		"/dev/janeiro"
+#define DEFAULT_DMA_HEAP	"/dev/dma_heap/system"
+#define DEFAULT_SIZE_DIST	"fixed:64K"
+#define DEFAULT_MAX_SIZE	(64ULL << 20)
+#define DEFAULT_ELEM_SIZE	16
+#define MAX_ELEM_SIZE		256
+#define MEMINFO_SAMPLE_US	200
+
+/*
+ * Log-linear latency histogram: values below HIST_LINEAR nanoseconds get a
+ * bucket each, larger values are split in HIST_SUB_BUCKETS buckets per power
+ * of two, which keeps the relative error of a percentile under 3%.
+ */
+#define HIST_SUB_BITS		5
+#define HIST_SUB_BUCKETS	(1u << HIST_SUB_BITS)
+#define HIST_LINEAR		(2u * HIST_SUB_BUCKETS)
+#define HIST_BUCKETS		(HIST_LINEAR + (64 - HIST_SUB_BITS - 1) * HIST_SUB_BUCKETS)
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+/* Timed operations, each gets its own line in the report. */
+enum bench_stat {
+	STAT_MAP_BUFFER,
+	STAT_UNMAP_BUFFER,
+	STAT_SYNC_FOR_DEVICE,
+	STAT_SYNC_FOR_CPU,
+	STAT_MAP_DMABUF,
+	STAT_UNMAP_DMABUF,
+	STAT_RELEASE_WAKE_LOCK,
+	STAT_ACQUIRE_WAKE_LOCK,
+	STAT_CREATE_SYNC_FENCE,
+	STAT_SIGNAL_SYNC_FENCE,
+	STAT_CREATE_GROUP,
+	STAT_FINALIZE_GROUP,
+	/* per element, averaged over a pass of the whole queue */
+	STAT_CMD_QUEUE_WRITE,
+	STAT_RESP_QUEUE_READ,
+	STAT_CACHEABLE_WRITE,
+	STAT_CACHEABLE_READ,
+	/* MAP_BUFFER + UNMAP_BUFFER watched by the meminfo sampler */
+	STAT_PIN_MAP,
+	STAT_PIN_UNMAP,
+	STAT_NUM,
+};
+
+static const char *const stat_names[STAT_NUM] = {
+	[STAT_MAP_BUFFER] = "map_buffer",
+	[STAT_UNMAP_BUFFER] = "unmap_buffer",
+	[STAT_SYNC_FOR_DEVICE] = "sync_for_device",
+	[STAT_SYNC_FOR_CPU] = "sync_for_cpu",
+	[STAT_MAP_DMABUF] = "map_dmabuf",
+	[STAT_UNMAP_DMABUF] = "unmap_dmabuf",
+	[STAT_RELEASE_WAKE_LOCK] = "release_wake_lock",
+	[STAT_ACQUIRE_WAKE_LOCK] = "acquire_wake_lock",
+	[STAT_CREATE_SYNC_FENCE] = "create_sync_fence",
+	[STAT_SIGNAL_SYNC_FENCE] = "signal_sync_fence",
+	[STAT_CREATE_GROUP] = "create_group",
+	[STAT_FINALIZE_GROUP] = "finalize_group",
+	[STAT_CMD_QUEUE_WRITE] = "cmd_queue_write",
+	[STAT_RESP_QUEUE_READ] = "resp_queue_read",
+	[STAT_CACHEABLE_WRITE] = "cacheable_write",
+	[STAT_CACHEABLE_READ] = "cacheable_read",
+	[STAT_PIN_MAP] = "pin_map",
+	[STAT_PIN_UNMAP] = "pin_unmap",
+};
+
+struct bench_hist {
+	uint64_t count;
+	uint64_t errors;
+	uint64_t sum_ns;
+	uint64_t max_ns;
+	uint64_t buckets[HIST_BUCKETS];
+};
+
+enum size_dist_type {
+	SIZE_FIXED,
+	SIZE_UNIFORM,
+	SIZE_LOGNORMAL,
+	SIZE_LIST,
+};
+
+#define SIZE_LIST_MAX 64
+
+struct size_dist {
+	enum size_dist_type type;
+	uint64_t min, max;
+	/* lognormal: log of the median and the standard deviation of the log */
+	double mu, sigma;
+	uint64_t list[SIZE_LIST_MAX];
+	unsigned int list_len;
+};
+
+/*
+ * /proc/meminfo fields watched during the maps of the pin workload. Values
+ * are kept as KB in use, i.e. negated for @free fields.
+ *   MemFree:     every page the kernel takes, but pages recycled through the
+ *                per-CPU free lists between two maps don't show
+ *   SUnreclaim:  kmalloc, including large kmalloc and scatterlist chunks
+ *   VmallocUsed: vmalloc, e.g. a kvmalloc too large for kmalloc
+ */
+static const struct {
+	const char *name;
+	bool free;
+} meminfo_fields[] = {
+	{ "MemFree", true },
+	{ "SUnreclaim", false },
+	{ "VmallocUsed", false },
+};
+
+#define MEMINFO_NUM ARRAY_SIZE(meminfo_fields)
+
+/*
+ * Kernel memory used by the maps of the pin workload, in KB per meminfo
+ * field, the largest of any recorded map.
+ *   peak:     most used while the map ioctl ran
+ *   retained: still used after it returned, i.e. held by the mapping
+ */
+struct pin_mem {
+	int64_t peak_kb[MEMINFO_NUM];
+	int64_t retained_kb[MEMINFO_NUM];
+	uint64_t maps;
+	uint64_t samples;
+};
+
+struct bench_thread;
+
+/*
+ * A workload is one entry of the mix, run as a unit by a worker. @run returns
+ * false if the workload can't go on, e.g. its setup failed.
+ */
+struct bench_workload {
+	const char *name;
+	bool (*run)(struct bench_thread *t);
+	unsigned int weight;
+};
+
+struct bench_config {
+	const char *device;
+	const char *dma_heap;
+	unsigned int threads;
+	uint64_t iterations;
+	uint64_t warmup;
+	unsigned int duration_s;
+	struct size_dist sizes;
+	uint64_t max_size;
+	unsigned int elem_size;
+	uint64_t seed;
+	bool kv_output;
+};
+
+struct bench_thread {
+	pthread_t thread;
+	unsigned int id;
+	int fd;
+	uint64_t rng;
+	uint32_t fence_seqno;
+	/* anonymous buffer of max_size bytes, fully mapped once if sync runs */
+	void *buf;
+	struct edgetpu_map_ioctl buf_map;
+	bool buf_mapped;
+	/* cacheable stand-in of the queues, for the queue workload */
+	void *queue_ref;
+	uint8_t queue_sink;
+	bool recording;
+	bool failed;
+	struct bench_hist hist[STAT_NUM];
+	struct pin_mem pin_mem;
+};
+
+/*
+ * Polls /proc/meminfo every MEMINFO_SAMPLE_US. A pin round opens a window
+ * before its map and closes it after, the window keeps the most memory in
+ * use seen meanwhile. Memory is system wide, so the numbers are only
+ * meaningful with a single thread on an idle system.
+ */
+struct meminfo_sampler {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	int fd;
+	atomic_bool stop;
+	bool running;
+	int64_t max_kb[MEMINFO_NUM];
+	uint64_t samples;
+};
+
+static struct bench_config cfg = {
+	.device = DEFAULT_DEVICE,
+	.dma_heap = DEFAULT_DMA_HEAP,
+	.threads = 1,
+	.iterations = 1000,
+	.warmup = 10,
+	.max_size = DEFAULT_MAX_SIZE,
+	.elem_size = DEFAULT_ELEM_SIZE,
+	.seed = 1,
+};
+
+static struct bench_workload *workloads;
+static unsigned int num_workloads;
+static unsigned int total_weight;
+
+static pthread_barrier_t start_barrier;
+static atomic_bool stop;
+static atomic_uint first_error_reported[STAT_NUM];
+static int dma_heap_fd = -1;
+static struct meminfo_sampler sampler = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.fd = -1,
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* xorshift64*, seeded per thread so runs are reproducible with --seed. */
+static uint64_t rng_next(struct bench_thread *t)
+{
+	t->rng ^= t->rng >> 12;
+	t->rng ^= t->rng << 25;
+	t->rng ^= t->rng >> 27;
+	return t->rng * 0x2545F4914F6CDD1DULL;
+}
+
+static double rng_unit(struct bench_thread *t)
+{
+	return (rng_next(t) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static unsigned int hist_index(uint64_t ns)
+{
+	unsigned int msb;
+
+	if (ns < HIST_LINEAR)
+		return ns;
+	msb = 63 - __builtin_clzll(ns);
+	return HIST_LINEAR + (msb - HIST_SUB_BITS - 1) * HIST_SUB_BUCKETS +
+	       ((ns >> (msb - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1));
+}
+
+/* Upper bound of the values counted in bucket @idx. */
+static uint64_t hist_value(unsigned int idx)
+{
+	unsigned int shift, sub;
+
+	if (idx < HIST_LINEAR)
+		return idx;
+	idx -= HIST_LINEAR;
+	shift = idx / HIST_SUB_BUCKETS + 1;
+	sub = idx % HIST_SUB_BUCKETS;
+	return (((uint64_t)HIST_SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+static void hist_add(struct bench_hist *h, uint64_t ns)
+{
+	h->count++;
+	h->sum_ns += ns;
+	if (ns > h->max_ns)
+		h->max_ns = ns;
+	h->buckets[hist_index(ns)]++;
+}
+
+static void hist_merge(struct bench_hist *dst, const struct bench_hist *src)
+{
+	unsigned int i;
+
+	dst->count += src->count;
+	dst->errors += src->errors;
+	dst->sum_ns += src->sum_ns;
+	if (src->max_ns > dst->max_ns)
+		dst->max_ns = src->max_ns;
+	for (i = 0; i < HIST_BUCKETS; i++)
+		dst->buckets[i] += src->buckets[i];
+}
+
+static uint64_t hist_percentile(const struct bench_hist *h, double pct)
+{
+	uint64_t rank, seen = 0;
+	unsigned int i;
+
+	if (!h->count)
+		return 0;
+	rank = (uint64_t)ceil(pct / 100.0 * h->count);
+	if (!rank)
+		rank = 1;
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= rank)
+			return hist_value(i) < h->max_ns ? hist_value(i) : h->max_ns;
+	}
+	return h->max_ns;
+}
+
+/*
+ * Issues @req on @fd and accounts its latency to @stat. Failures are counted
+ * as errors, the first one of each ioctl is reported.
+ */
+static int timed_ioctl(struct bench_thread *t, int fd, enum bench_stat stat,
+		       unsigned long req, void *arg)
+{
+	uint64_t start, end;
+	int ret;
+
+	start = now_ns();
+	ret = ioctl(fd, req, arg);
+	end = now_ns();
+	if (ret < 0) {
+		ret = -errno;
+		if (t->recording)
+			t->hist[stat].errors++;
+		if (!atomic_exchange(&first_error_reported[stat], 1))
+			fprintf(stderr, "thread %u: %s failed: %s\n", t->id, stat_names[stat],
+				strerror(-ret));
+		return ret;
+	}
+	if (t->recording)
+		hist_add(&t->hist[stat], end - start);
+	return 0;
+}
+
+static uint64_t draw_size(struct bench_thread *t)
+{
+	const struct size_dist *d = &cfg.sizes;
+	double v;
+
+	switch (d->type) {
+	case SIZE_UNIFORM:
+		return d->min + rng_next(t) % (d->max - d->min + 1);
+	case SIZE_LOGNORMAL:
+		/* Box-Muller, only one of the pair is used */
+		v = sqrt(-2.0 * log(1.0 - rng_unit(t))) * cos(2.0 * M_PI * rng_unit(t));
+		v = exp(d->mu + d->sigma * v);
+		if (v < 1.0)
+			return 1;
+		return v > d->max ? d->max : (uint64_t)v;
+	case SIZE_LIST:
+		return d->list[rng_next(t) % d->list_len];
+	case SIZE_FIXED:
+	default:
+		return d->min;
+	}
+}
+
+static bool run_map(struct bench_thread *t)
+{
+	struct edgetpu_map_ioctl map = {
+		.host_address = (uintptr_t)t->buf,
+		.size = draw_size(t),
+		.flags = EDGETPU_MAP_DMA_BIDIRECTIONAL,
+	};
+
+	if (timed_ioctl(t, t->fd, STAT_MAP_BUFFER, EDGETPU_MAP_BUFFER, &map))
+		return true;
+	timed_ioctl(t, t->fd, STAT_UNMAP_BUFFER, EDGETPU_UNMAP_BUFFER, &map);
+	return true;
+}
+
+static int meminfo_read(int fd, int64_t *kb)
+{
+	char buf[8192], *line, *colon;
+	unsigned int i, found = 0;
+	ssize_t len;
+
+	len = pread(fd, buf, sizeof(buf) - 1, 0);
+	if (len <= 0)
+		return -EIO;
+	buf[len] = '\0';
+	for (line = buf; line && *line; line = strchr(line, '\n')) {
+		line += *line == '\n';
+		colon = strchr(line, ':');
+		if (!colon)
+			break;
+		for (i = 0; i < MEMINFO_NUM; i++) {
+			if (strncmp(line, meminfo_fields[i].name, colon - line) ||
+			    meminfo_fields[i].name[colon - line])
+				continue;
+			kb[i] = strtoll(colon + 1, NULL, 10);
+			if (meminfo_fields[i].free)
+				kb[i] = -kb[i];
+			found++;
+		}
+	}
+	return found == MEMINFO_NUM ? 0 : -ENOENT;
+}
+
+static void *meminfo_sampler_fn(void *arg)
+{
+	int64_t kb[MEMINFO_NUM];
+	unsigned int i;
+
+	while (!atomic_load(&sampler.stop)) {
+		if (!meminfo_read(sampler.fd, kb)) {
+			pthread_mutex_lock(&sampler.lock);
+			for (i = 0; i < MEMINFO_NUM; i++)
+				if (kb[i] > sampler.max_kb[i])
+					sampler.max_kb[i] = kb[i];
+			sampler.samples++;
+			pthread_mutex_unlock(&sampler.lock);
+		}
+		usleep(MEMINFO_SAMPLE_US);
+	}
+	return NULL;
+}
+
+static int meminfo_sampler_start(void)
+{
+	int64_t kb[MEMINFO_NUM];
+
+	sampler.fd = open("/proc/meminfo", O_RDONLY | O_CLOEXEC);
+	if (sampler.fd < 0)
+		return -errno;
+	if (meminfo_read(sampler.fd, kb) ||
+	    pthread_create(&sampler.thread, NULL, meminfo_sampler_fn, NULL)) {
+		close(sampler.fd);
+		sampler.fd = -1;
+		return -EIO;
+	}
+	sampler.running = true;
+	return 0;
+}
+
+static void meminfo_sampler_stop(void)
+{
+	if (!sampler.running)
+		return;
+	atomic_store(&sampler.stop, true);
+	pthread_join(sampler.thread, NULL);
+	close(sampler.fd);
+	sampler.running = false;
+}
+
+/*
+ * Maps and unmaps a buffer of the drawn size, pinning every page of it, and
+ * records the kernel memory the map used on top of the ioctl latencies.
+ */
+static bool run_pin(struct bench_thread *t)
+{
+	struct edgetpu_map_ioctl map = {
+		.host_address = (uintptr_t)t->buf,
+		.size = draw_size(t),
+		.flags = EDGETPU_MAP_DMA_BIDIRECTIONAL,
+	};
+	int64_t base[MEMINFO_NUM], after[MEMINFO_NUM], peak[MEMINFO_NUM];
+	struct pin_mem *pm = &t->pin_mem;
+	uint64_t samples;
+	unsigned int i;
+	int ret;
+
+	if (meminfo_read(sampler.fd, base))
+		return false;
+	pthread_mutex_lock(&sampler.lock);
+	memcpy(sampler.max_kb, base, sizeof(base));
+	sampler.samples = 0;
+	pthread_mutex_unlock(&sampler.lock);
+
+	ret = timed_ioctl(t, t->fd, STAT_PIN_MAP, EDGETPU_MAP_BUFFER, &map);
+
+	if (meminfo_read(sampler.fd, after))
+		return false;
+	pthread_mutex_lock(&sampler.lock);
+	memcpy(peak, sampler.max_kb, sizeof(peak));
+	samples = sampler.samples;
+	pthread_mutex_unlock(&sampler.lock);
+	if (ret)
+		return true;
+	if (t->recording) {
+		for (i = 0; i < MEMINFO_NUM; i++) {
+			if (after[i] > peak[i])
+				peak[i] = after[i];
+			if (!pm->maps || peak[i] - base[i] > pm->peak_kb[i])
+				pm->peak_kb[i] = peak[i] - base[i];
+			if (!pm->maps || after[i] - base[i] > pm->retained_kb[i])
+				pm->retained_kb[i] = after[i] - base[i];
+		}
+		pm->maps++;
+		pm->samples += samples;
+	}
+	timed_ioctl(t, t->fd, STAT_PIN_UNMAP, EDGETPU_UNMAP_BUFFER, &map);
+	return true;
+}
+
+static bool run_sync(struct bench_thread *t)
+{
+	struct edgetpu_sync_ioctl sync = {
+		.device_address = t->buf_map.device_address,
+		.size = draw_size(t),
+		.flags = EDGETPU_MAP_DMA_BIDIRECTIONAL | EDGETPU_SYNC_FOR_DEVICE,
+	};
+
+	if (!t->buf_mapped)
+		return false;
+	timed_ioctl(t, t->fd, STAT_SYNC_FOR_DEVICE, EDGETPU_SYNC_BUFFER, &sync);
+	sync.flags = EDGETPU_MAP_DMA_BIDIRECTIONAL | EDGETPU_SYNC_FOR_CPU;
+	timed_ioctl(t, t->fd, STAT_SYNC_FOR_CPU, EDGETPU_SYNC_BUFFER, &sync);
+	return true;
+}
+
+static bool run_dmabuf(struct bench_thread *t)
+{
+	struct dma_heap_allocation_data alloc = {
+		.len = draw_size(t),
+		.fd_flags = O_RDWR | O_CLOEXEC,
+	};
+	struct edgetpu_map_dmabuf_ioctl map = {
+		.flags = EDGETPU_MAP_DMA_BIDIRECTIONAL,
+	};
+
+	if (dma_heap_fd < 0)
+		return false;
+	/* the exporter's allocation isn't what is measured */
+	if (ioctl(dma_heap_fd, DMA_HEAP_IOCTL_ALLOC, &alloc) < 0) {
+		fprintf(stderr, "thread %u: dma-heap allocation of %llu bytes failed: %s\n",
+			t->id, (unsigned long long)alloc.len, strerror(errno));
+		return false;
+	}
+	map.dmabuf_fd = alloc.fd;
+	if (!timed_ioctl(t, t->fd, STAT_MAP_DMABUF, EDGETPU_MAP_DMABUF, &map))
+		timed_ioctl(t, t->fd, STAT_UNMAP_DMABUF, EDGETPU_UNMAP_DMABUF, &map);
+	close(alloc.fd);
+	return true;
+}
+
+static bool run_wakelock(struct bench_thread *t)
+{
+	if (timed_ioctl(t, t->fd, STAT_RELEASE_WAKE_LOCK, EDGETPU_RELEASE_WAKE_LOCK, NULL))
+		return true;
+	/* without the wakelock back the other workloads of this thread can't run */
+	return !timed_ioctl(t, t->fd, STAT_ACQUIRE_WAKE_LOCK, EDGETPU_ACQUIRE_WAKE_LOCK, NULL);
+}
+
+static bool run_fence(struct bench_thread *t)
+{
+	struct edgetpu_create_sync_fence_data create = {
+		.seqno = ++t->fence_seqno,
+	};
+	struct edgetpu_signal_sync_fence_data signal = {};
+
+	snprintf(create.timeline_name, sizeof(create.timeline_name), "edgetpu-bench.%u", t->id);
+	if (timed_ioctl(t, t->fd, STAT_CREATE_SYNC_FENCE, EDGETPU_CREATE_SYNC_FENCE, &create))
+		return true;
+	signal.fence = create.fence;
+	timed_ioctl(t, t->fd, STAT_SIGNAL_SYNC_FENCE, EDGETPU_SIGNAL_SYNC_FENCE, &signal);
+	close(create.fence);
+	return true;
+}
+
+/* element sizes are set from --elem-size */
+static struct edgetpu_mailbox_attr bench_group_attr = {
+	.cmd_queue_size = 4,
+	.resp_queue_size = 4,
+};
+
+/* A group lives as long as its leader's file, each round uses a new one. */
+static bool run_group(struct bench_thread *t)
+{
+	struct edgetpu_mailbox_attr attr = bench_group_attr;
+	int fd = open(cfg.device, O_RDWR | O_CLOEXEC);
+
+	if (fd < 0) {
+		fprintf(stderr, "thread %u: open %s: %s\n", t->id, cfg.device, strerror(errno));
+		return false;
+	}
+	if (!timed_ioctl(t, fd, STAT_CREATE_GROUP, EDGETPU_CREATE_GROUP, &attr))
+		timed_ioctl(t, fd, STAT_FINALIZE_GROUP, EDGETPU_FINALIZE_GROUP, NULL);
+	close(fd);
+	return true;
+}
+
+/*
+ * Writes or reads every element of @queue once, the way the runtime writes
+ * commands and reads responses, and records the mean cost of one element.
+ * Writes end with a barrier so write-combined data is flushed in the timing.
+ */
+static void queue_pass(struct bench_thread *t, enum bench_stat stat, uint8_t *queue,
+		       size_t queue_size, bool write)
+{
+	size_t elem = cfg.elem_size, n = queue_size / elem, i;
+	uint8_t tmp[MAX_ELEM_SIZE];
+	uint64_t start, end;
+
+	memset(tmp, t->queue_sink, elem);
+	start = now_ns();
+	for (i = 0; i < n; i++) {
+		if (write) {
+			memcpy(queue + i * elem, tmp, elem);
+		} else {
+			memcpy(tmp, queue + i * elem, elem);
+			t->queue_sink += tmp[elem - 1];
+		}
+	}
+	atomic_thread_fence(memory_order_seq_cst);
+	end = now_ns();
+	if (t->recording)
+		hist_add(&t->hist[stat], (end - start) / n);
+}
+
+/*
+ * The queues are mapped with the attributes the driver picks for the device,
+ * e.g. write-combined on hardware or cacheable on coherent devices without an
+ * iremap pool. They are unmapped again so the wakelock workload can release
+ * the wakelock. The queue indexes aren't moved, the firmware sees nothing.
+ */
+static bool run_queue(struct bench_thread *t)
+{
+	size_t cmdq_size = bench_group_attr.cmd_queue_size * 1024;
+	size_t respq_size = bench_group_attr.resp_queue_size * 1024;
+	void *cmdq, *respq;
+	size_t i;
+
+	cmdq = mmap(NULL, cmdq_size, PROT_READ | PROT_WRITE, MAP_SHARED, t->fd,
+		    EDGETPU_MMAP_CMD_QUEUE_OFFSET);
+	if (cmdq == MAP_FAILED) {
+		fprintf(stderr, "thread %u: mmap command queue: %s\n", t->id, strerror(errno));
+		return false;
+	}
+	respq = mmap(NULL, respq_size, PROT_READ | PROT_WRITE, MAP_SHARED, t->fd,
+		     EDGETPU_MMAP_RESP_QUEUE_OFFSET);
+	if (respq == MAP_FAILED) {
+		fprintf(stderr, "thread %u: mmap response queue: %s\n", t->id, strerror(errno));
+		munmap(cmdq, cmdq_size);
+		return false;
+	}
+	/* the runtime keeps its mappings, leave page faults out of the timing */
+	for (i = 0; i < cmdq_size; i += getpagesize())
+		((volatile uint8_t *)cmdq)[i] = 0;
+	for (i = 0; i < respq_size; i += getpagesize())
+		t->queue_sink += ((volatile uint8_t *)respq)[i];
+	queue_pass(t, STAT_CMD_QUEUE_WRITE, cmdq, cmdq_size, true);
+	queue_pass(t, STAT_CACHEABLE_WRITE, t->queue_ref, cmdq_size, true);
+	queue_pass(t, STAT_RESP_QUEUE_READ, respq, respq_size, false);
+	queue_pass(t, STAT_CACHEABLE_READ, t->queue_ref, respq_size, false);
+	munmap(respq, respq_size);
+	munmap(cmdq, cmdq_size);
+	return true;
+}
+
+static struct bench_workload all_workloads[] = {
+	{ "map", run_map },
+	{ "sync", run_sync },
+	{ "dmabuf", run_dmabuf },
+	{ "wakelock", run_wakelock },
+	{ "fence", run_fence },
+	{ "group", run_group },
+	{ "queue", run_queue },
+	{ "pin", run_pin },
+};
+
+static struct bench_workload *pick_workload(struct bench_thread *t)
+{
+	unsigned int i, w = rng_next(t) % total_weight;
+
+	for (i = 0; i < num_workloads; i++) {
+		if (w < workloads[i].weight)
+			break;
+		w -= workloads[i].weight;
+	}
+	return &workloads[i];
+}
+
+static bool workload_enabled(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < num_workloads; i++)
+		if (!strcmp(workloads[i].name, name))
+			return true;
+	return false;
+}
+
+/* Drops @name from the mix, returns false if nothing is left to run. */
+static bool workload_disable(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < num_workloads; i++) {
+		if (strcmp(workloads[i].name, name))
+			continue;
+		total_weight -= workloads[i].weight;
+		memmove(&workloads[i], &workloads[i + 1],
+			(num_workloads - i - 1) * sizeof(*workloads));
+		num_workloads--;
+		break;
+	}
+	return num_workloads;
+}
+
+/* Opens the device and sets up the wakelock, a finalized group and the buffers. */
+static int thread_setup(struct bench_thread *t)
+{
+	struct edgetpu_mailbox_attr attr = bench_group_attr;
+
+	t->fd = open(cfg.device, O_RDWR | O_CLOEXEC);
+	if (t->fd < 0) {
+		fprintf(stderr, "thread %u: open %s: %s\n", t->id, cfg.device, strerror(errno));
+		return -ENODEV;
+	}
+	if (ioctl(t->fd, EDGETPU_ACQUIRE_WAKE_LOCK) < 0) {
+		fprintf(stderr, "thread %u: acquire wakelock: %s\n", t->id, strerror(errno));
+		return -EIO;
+	}
+	if (ioctl(t->fd, EDGETPU_CREATE_GROUP, &attr) < 0 ||
+	    ioctl(t->fd, EDGETPU_FINALIZE_GROUP) < 0) {
+		fprintf(stderr, "thread %u: group setup: %s\n", t->id, strerror(errno));
+		return -EIO;
+	}
+	t->buf = mmap(NULL, cfg.max_size, PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (t->buf == MAP_FAILED) {
+		t->buf = NULL;
+		fprintf(stderr, "thread %u: mmap %llu bytes: %s\n", t->id,
+			(unsigned long long)cfg.max_size, strerror(errno));
+		return -ENOMEM;
+	}
+	/* a second mapping would pin the buffer twice, e.g. 8 GB for 4 GB pin maps */
+	if (workload_enabled("sync")) {
+		t->buf_map.host_address = (uintptr_t)t->buf;
+		t->buf_map.size = cfg.max_size;
+		t->buf_map.flags = EDGETPU_MAP_DMA_BIDIRECTIONAL;
+		if (ioctl(t->fd, EDGETPU_MAP_BUFFER, &t->buf_map) < 0)
+			fprintf(stderr, "thread %u: sync buffer map failed: %s, sync is skipped\n",
+				t->id, strerror(errno));
+		else
+			t->buf_mapped = true;
+	}
+	t->queue_ref = calloc(1, bench_group_attr.cmd_queue_size > bench_group_attr.resp_queue_size ?
+				 bench_group_attr.cmd_queue_size * 1024 :
+				 bench_group_attr.resp_queue_size * 1024);
+	if (!t->queue_ref)
+		return -ENOMEM;
+	return 0;
+}
+
+static void thread_teardown(struct bench_thread *t)
+{
+	if (t->buf_mapped)
+		ioctl(t->fd, EDGETPU_UNMAP_BUFFER, &t->buf_map);
+	if (t->buf)
+		munmap(t->buf, cfg.max_size);
+	free(t->queue_ref);
+	/* closing the file releases the wakelock and disbands the group */
+	if (t->fd >= 0)
+		close(t->fd);
+}
+
+static void *bench_thread_fn(void *arg)
+{
+	struct bench_thread *t = arg;
+	struct bench_workload *w;
+	uint64_t i;
+	int ret;
+
+	ret = thread_setup(t);
+	t->failed = ret;
+	/* everyone waits so the timed phase starts together, failed threads just leave */
+	pthread_barrier_wait(&start_barrier);
+	for (i = 0; !ret && i < cfg.warmup; i++)
+		pick_workload(t)->run(t);
+	t->recording = true;
+	pthread_barrier_wait(&start_barrier);
+	if (ret)
+		return NULL;
+
+	for (i = 0; cfg.duration_s || i < cfg.iterations; i++) {
+		if (atomic_load_explicit(&stop, memory_order_relaxed))
+			break;
+		w = pick_workload(t);
+		if (!w->run(t)) {
+			fprintf(stderr, "thread %u: workload %s stopped the thread\n", t->id,
+				w->name);
+			break;
+		}
+	}
+	return NULL;
+}
+
+static int parse_size(const char *s, uint64_t *out)
+{
+	char *end;
+	unsigned long long v;
+
+	errno = 0;
+	v = strtoull(s, &end, 0);
+	if (errno || end == s)
+		return -EINVAL;
+	switch (*end) {
+	case 'k':
+	case 'K':
+		v <<= 10;
+		end++;
+		break;
+	case 'm':
+	case 'M':
+		v <<= 20;
+		end++;
+		break;
+	case 'g':
+	case 'G':
+		v <<= 30;
+		end++;
+		break;
+	}
+	if (*end || !v)
+		return -EINVAL;
+	*out = v;
+	return 0;
+}
+
+/*
+ * Parses a buffer size distribution:
+ *   fixed:SIZE
+ *   uniform:MIN,MAX
+ *   lognormal:MEDIAN,SIGMA
+ *   list:SIZE[,SIZE...]	(repeat a size to weigh it)
+ */
+static int parse_size_dist(const char *arg, struct size_dist *d)
+{
+	char *s = strdup(arg), *sep, *tok, *save = NULL;
+	int ret = -EINVAL;
+
+	if (!s)
+		return -ENOMEM;
+	sep = strchr(s, ':');
+	if (!sep)
+		goto out;
+	*sep++ = '\0';
+	memset(d, 0, sizeof(*d));
+	if (!strcmp(s, "fixed")) {
+		d->type = SIZE_FIXED;
+		ret = parse_size(sep, &d->min);
+		d->max = d->min;
+	} else if (!strcmp(s, "uniform")) {
+		d->type = SIZE_UNIFORM;
+		tok = strchr(sep, ',');
+		if (!tok)
+			goto out;
+		*tok++ = '\0';
+		ret = parse_size(sep, &d->min);
+		if (!ret)
+			ret = parse_size(tok, &d->max);
+		if (!ret && d->min > d->max)
+			ret = -EINVAL;
+	} else if (!strcmp(s, "lognormal")) {
+		uint64_t median;
+
+		d->type = SIZE_LOGNORMAL;
+		tok = strchr(sep, ',');
+		if (!tok)
+			goto out;
+		*tok++ = '\0';
+		ret = parse_size(sep, &median);
+		d->sigma = strtod(tok, NULL);
+		if (!ret && d->sigma <= 0)
+			ret = -EINVAL;
+		d->mu = log((double)median);
+		d->min = 1;
+		/* the tail is capped to --max-size below */
+		d->max = UINT64_MAX;
+	} else if (!strcmp(s, "list")) {
+		d->type = SIZE_LIST;
+		for (tok = strtok_r(sep, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+			if (d->list_len == SIZE_LIST_MAX)
+				goto out;
+			ret = parse_size(tok, &d->list[d->list_len]);
+			if (ret)
+				goto out;
+			if (d->list[d->list_len] > d->max)
+				d->max = d->list[d->list_len];
+			d->list_len++;
+		}
+		if (!d->list_len)
+			ret = -EINVAL;
+	}
+out:
+	free(s);
+	return ret;
+}
+
+/* Parses "NAME[:WEIGHT][,NAME[:WEIGHT]...]" into the workload mix. */
+static int parse_workloads(const char *arg)
+{
+	char *s = strdup(arg), *tok, *save = NULL, *colon;
+	unsigned int i;
+	int ret = 0;
+
+	if (!s)
+		return -ENOMEM;
+	free(workloads);
+	workloads = calloc(ARRAY_SIZE(all_workloads), sizeof(*workloads));
+	num_workloads = 0;
+	total_weight = 0;
+	for (tok = strtok_r(s, ",", &save); tok && !ret; tok = strtok_r(NULL, ",", &save)) {
+		unsigned long weight = 1;
+
+		colon = strchr(tok, ':');
+		if (colon) {
+			*colon++ = '\0';
+			weight = strtoul(colon, NULL, 0);
+		}
+		for (i = 0; i < ARRAY_SIZE(all_workloads); i++)
+			if (!strcmp(tok, all_workloads[i].name))
+				break;
+		if (i == ARRAY_SIZE(all_workloads) || !weight ||
+		    num_workloads == ARRAY_SIZE(all_workloads)) {
+			fprintf(stderr, "invalid workload: %s\n", tok);
+			ret = -EINVAL;
+			break;
+		}
+		workloads[num_workloads] = all_workloads[i];
+		workloads[num_workloads].weight = weight;
+		total_weight += weight;
+		num_workloads++;
+	}
+	if (!ret && !num_workloads)
+		ret = -EINVAL;
+	free(s);
+	return ret;
+}
+
+static void report_pin_mem(struct bench_thread *threads)
+{
+	struct pin_mem pm = {};
+	unsigned int i, f;
+
+	for (i = 0; i < cfg.threads; i++) {
+		const struct pin_mem *p = &threads[i].pin_mem;
+
+		if (!p->maps)
+			continue;
+		for (f = 0; f < MEMINFO_NUM; f++) {
+			if (!pm.maps || p->peak_kb[f] > pm.peak_kb[f])
+				pm.peak_kb[f] = p->peak_kb[f];
+			if (!pm.maps || p->retained_kb[f] > pm.retained_kb[f])
+				pm.retained_kb[f] = p->retained_kb[f];
+		}
+		pm.maps += p->maps;
+		pm.samples += p->samples;
+	}
+	if (!pm.maps)
+		return;
+	if (cfg.kv_output) {
+		for (f = 0; f < MEMINFO_NUM; f++)
+			printf("bench mem op=pin_map field=%s maps=%" PRIu64 " samples_per_map=%" PRIu64
+			       " peak_kb=%" PRId64 " retained_kb=%" PRId64 "\n", meminfo_fields[f].name,
+			       pm.maps, pm.samples / pm.maps, pm.peak_kb[f], pm.retained_kb[f]);
+		return;
+	}
+	printf("\npin_map kernel memory, worst of %" PRIu64 " maps, %" PRIu64
+	       " samples per map:\n", pm.maps, pm.samples / pm.maps);
+	printf("%-18s %12s %12s\n", "meminfo", "peak_kb", "retained_kb");
+	for (f = 0; f < MEMINFO_NUM; f++)
+		printf("%-18s %12" PRId64 " %12" PRId64 "\n", meminfo_fields[f].name,
+		       pm.peak_kb[f], pm.retained_kb[f]);
+}
+
+static void report(struct bench_thread *threads, uint64_t wall_ns)
+{
+	struct bench_hist *total = calloc(1, sizeof(*total));
+	double wall_s = wall_ns / 1e9;
+	uint64_t all_ops = 0;
+	unsigned int s, i;
+
+	if (!total)
+		return;
+	if (!cfg.kv_output)
+		printf("%-18s %10s %7s %11s %10s %10s %10s %10s %10s\n", "op", "count", "errors",
+		       "ops/s", "mean_us", "p50_us", "p99_us", "p999_us", "max_us");
+	for (s = 0; s < STAT_NUM; s++) {
+		memset(total, 0, sizeof(*total));
+		for (i = 0; i < cfg.threads; i++)
+			hist_merge(total, &threads[i].hist[s]);
+		if (!total->count && !total->errors)
+			continue;
+		all_ops += total->count;
+		if (cfg.kv_output) {
+			printf("bench op=%s count=%" PRIu64 " errors=%" PRIu64
+			       " ops_per_sec=%.0f mean_ns=%" PRIu64 " p50_ns=%" PRIu64
+			       " p99_ns=%" PRIu64 " p999_ns=%" PRIu64 " max_ns=%" PRIu64 "\n",
+			       stat_names[s], total->count, total->errors, total->count / wall_s,
+			       total->count ? total->sum_ns / total->count : 0,
+			       hist_percentile(total, 50), hist_percentile(total, 99),
+			       hist_percentile(total, 99.9), total->max_ns);
+			continue;
+		}
+		printf("%-18s %10" PRIu64 " %7" PRIu64 " %11.0f %10.3f %10.3f %10.3f %10.3f %10.3f\n",
+		       stat_names[s], total->count, total->errors, total->count / wall_s,
+		       total->count ? total->sum_ns / 1e3 / total->count : 0.0,
+		       hist_percentile(total, 50) / 1e3, hist_percentile(total, 99) / 1e3,
+		       hist_percentile(total, 99.9) / 1e3, total->max_ns / 1e3);
+	}
+	report_pin_mem(threads);
+	if (cfg.kv_output)
+		printf("bench total threads=%u wall_ns=%" PRIu64 " ops=%" PRIu64 " ops_per_sec=%.0f\n",
+		       cfg.threads, wall_ns, all_ops, all_ops / wall_s);
+	else
+		printf("\n%u threads, %.3f s, %" PRIu64 " ops, %.0f ops/s\n", cfg.threads,
+		       wall_s, all_ops, all_ops / wall_s);
+	free(total);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [OPTIONS]\n"
+		"\n"
+		"  -d, --device PATH       EdgeTPU device node (default " DEFAULT_DEVICE ")\n"
+		"  -t, --threads N         concurrent clients, each with its own fd and group\n"
+		"                          (default 1)\n"
+		"  -n, --iterations N      workloads run by each thread (default 1000)\n"
+		"  -T, --duration SEC      run for SEC seconds instead of --iterations\n"
+		"  -w, --warmup N          untimed workloads per thread first (default 10)\n"
+		"  -o, --ops MIX           workloads to run with optional weights, e.g.\n"
+		"                          map:4,sync:4,fence:1 (default: all but queue\n"
+		"                          and pin, weight 1)\n"
+		"                          map      - MAP_BUFFER + UNMAP_BUFFER\n"
+		"                          sync     - SYNC_BUFFER for device + for cpu\n"
+		"                          dmabuf   - MAP_DMABUF + UNMAP_DMABUF\n"
+		"                          wakelock - RELEASE_WAKE_LOCK + ACQUIRE_WAKE_LOCK\n"
+		"                          fence    - CREATE_SYNC_FENCE + SIGNAL_SYNC_FENCE\n"
+		"                          group    - CREATE_GROUP + FINALIZE_GROUP\n"
+		"                          queue    - write every command queue element and\n"
+		"                                     read every response queue element of\n"
+		"                                     the mmapped VII queues, and the same on\n"
+		"                                     cacheable memory; reported per element\n"
+		"                          pin      - MAP_BUFFER + UNMAP_BUFFER, also reports\n"
+		"                                     the kernel memory used by the maps from\n"
+		"                                     /proc/meminfo; use one thread and large\n"
+		"                                     sizes, e.g. -s fixed:4G -m 4G\n"
+		"  -s, --sizes DIST        buffer sizes of map, sync, dmabuf and pin:\n"
+		"                          fixed:SIZE, uniform:MIN,MAX, lognormal:MEDIAN,SIGMA\n"
+		"                          or list:SIZE[,SIZE...] (default " DEFAULT_SIZE_DIST ")\n"
+		"  -m, --max-size SIZE     cap of the size distribution (default 64M)\n"
+		"  -H, --dma-heap PATH     dma-buf exporter for dmabuf (default " DEFAULT_DMA_HEAP ")\n"
+		"  -e, --elem-size BYTES   command and response size of the groups, 8 to 256\n"
+		"                          (default 16)\n"
+		"  -S, --seed N            random seed (default 1)\n"
+		"  -k, --kv                print key=value lines instead of a table\n"
+		"  -h, --help              show this help\n"
+		"\n"
+		"Sizes take K, M and G suffixes.\n",
+		prog);
+}
+
+int main(int argc, char **argv)
+{
+	static const struct option long_opts[] = {
+		{ "device", required_argument, NULL, 'd' },
+		{ "threads", required_argument, NULL, 't' },
+		{ "iterations", required_argument, NULL, 'n' },
+		{ "duration", required_argument, NULL, 'T' },
+		{ "warmup", required_argument, NULL, 'w' },
+		{ "ops", required_argument, NULL, 'o' },
+		{ "sizes", required_argument, NULL, 's' },
+		{ "max-size", required_argument, NULL, 'm' },
+		{ "dma-heap", required_argument, NULL, 'H' },
+		{ "elem-size", required_argument, NULL, 'e' },
+		{ "seed", required_argument, NULL, 'S' },
+		{ "kv", no_argument, NULL, 'k' },
+		{ "help", no_argument, NULL, 'h' },
+		{},
+	};
+	const char *sizes = DEFAULT_SIZE_DIST;
+	const char *ops = "map,sync,dmabuf,wakelock,fence,group";
+	struct bench_thread *threads;
+	uint64_t start, wall_ns;
+	unsigned int i;
+	int opt, ret = 0;
+
+	while ((opt = getopt_long(argc, argv, "d:t:n:T:w:o:s:m:H:e:S:kh", long_opts, NULL)) != -1) {
+		switch (opt) {
+		case 'd':
+			cfg.device = optarg;
+			break;
+		case 't':
+			cfg.threads = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			cfg.iterations = strtoull(optarg, NULL, 0);
+			break;
+		case 'T':
+			cfg.duration_s = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			cfg.warmup = strtoull(optarg, NULL, 0);
+			break;
+		case 'o':
+			ops = optarg;
+			break;
+		case 's':
+			sizes = optarg;
+			break;
+		case 'm':
+			if (parse_size(optarg, &cfg.max_size)) {
+				fprintf(stderr, "invalid size: %s\n", optarg);
+				return 2;
+			}
+			break;
+		case 'H':
+			cfg.dma_heap = optarg;
+			break;
+		case 'e':
+			cfg.elem_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'S':
+			cfg.seed = strtoull(optarg, NULL, 0);
+			break;
+		case 'k':
+			cfg.kv_output = true;
+			break;
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		default:
+			usage(argv[0]);
+			return 2;
+		}
+	}
+	/* a 4 KB queue must hold fewer than 1024 elements, see EDGETPU_CREATE_GROUP */
+	if (!cfg.threads || (!cfg.iterations && !cfg.duration_s) || cfg.elem_size < 8 ||
+	    cfg.elem_size > MAX_ELEM_SIZE) {
+		usage(argv[0]);
+		return 2;
+	}
+	if (parse_size_dist(sizes, &cfg.sizes)) {
+		fprintf(stderr, "invalid size distribution: %s\n", sizes);
+		return 2;
+	}
+	if (parse_workloads(ops)) {
+		usage(argv[0]);
+		return 2;
+	}
+	if (cfg.sizes.max > cfg.max_size)
+		cfg.sizes.max = cfg.max_size;
+	if (cfg.sizes.min > cfg.sizes.max) {
+		fprintf(stderr, "sizes exceed --max-size\n");
+		return 2;
+	}
+	/* the sync buffer covers every size the distribution draws */
+	cfg.max_size = cfg.sizes.max;
+	bench_group_attr.sizeof_cmd = cfg.elem_size;
+	bench_group_attr.sizeof_resp = cfg.elem_size;
+
+	if (workload_enabled("dmabuf")) {
+		dma_heap_fd = open(cfg.dma_heap, O_RDONLY | O_CLOEXEC);
+		if (dma_heap_fd < 0) {
+			fprintf(stderr, "open %s: %s, dmabuf is skipped\n", cfg.dma_heap,
+				strerror(errno));
+			if (!workload_disable("dmabuf"))
+				return 1;
+		}
+	}
+
+	if (workload_enabled("pin")) {
+		if (cfg.threads > 1)
+			fprintf(stderr, "pin memory is system wide, the maps of %u threads add up\n",
+				cfg.threads);
+		ret = meminfo_sampler_start();
+		if (ret) {
+			fprintf(stderr, "meminfo sampler: %s\n", strerror(-ret));
+			return 1;
+		}
+	}
+
+	threads = calloc(cfg.threads, sizeof(*threads));
+	if (!threads)
+		return 1;
+	pthread_barrier_init(&start_barrier, NULL, cfg.threads + 1);
+	for (i = 0; i < cfg.threads; i++) {
+		threads[i].id = i;
+		threads[i].fd = -1;
+		threads[i].rng = (cfg.seed + i) * 0x9E3779B97F4A7C15ULL | 1;
+		if (pthread_create(&threads[i].thread, NULL, bench_thread_fn, &threads[i])) {
+			fprintf(stderr, "failed to create thread %u\n", i);
+			return 1;
+		}
+	}
+
+	/* setup done, then warm-up done */
+	pthread_barrier_wait(&start_barrier);
+	pthread_barrier_wait(&start_barrier);
+	start = now_ns();
+	if (cfg.duration_s) {
+		sleep(cfg.duration_s);
+		atomic_store(&stop, true);
+	}
+	for (i = 0; i < cfg.threads; i++)
+		pthread_join(threads[i].thread, NULL);
+	wall_ns = now_ns() - start;
+	meminfo_sampler_stop();
+
+	report(threads, wall_ns);
+	for (i = 0; i < cfg.threads; i++) {
+		if (threads[i].failed)
+			ret = 1;
+		thread_teardown(&threads[i]);
+	}
+	if (dma_heap_fd >= 0)
+		close(dma_heap_fd);
+	free(threads);
+	free(workloads);
+	return ret;
+}
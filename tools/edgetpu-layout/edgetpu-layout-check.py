@@ -0,0 +1,148 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0
+#
+# Checks the cache line layout of the hot EdgeTPU driver structures with
+# pahole, using the DWARF of a module built with CONFIG_DEBUG_INFO.
+#
+# The fields of each checked structure are split in groups by who accesses
+# them. A cache line holding fields of two groups is reported: a write by one
+# side would invalidate the line the other side is using. Fields in no group
+# are not checked.
+#
+# Usage:
+#   edgetpu-layout-check.py [--cacheline BYTES] [--pahole PATH] [-v] janeiro.ko
+#
+# Exits with 1 if a structure breaks its groups, 2 if the check can't run.
+#
+# Copyright (C) 2022 Google LLC
+
+import argparse
+import re
+import subprocess
+import sys
+
+# struct name -> {group name: [fields]}, see the layout notes of each struct.
+LAYOUTS = {
+    'edgetpu_mailbox': {
+        'read-mostly': ['cmd_queue_csr_base', 'resp_queue_csr_base', 'cmd_queue_size',
+                        'resp_queue_size', 'handle_irq', 'internal'],
+        'submission': ['cmd_queue_tail'],
+        'response IRQ': ['resp_queue_head'],
+    },
+    'edgetpu_device_group': {
+        'read-mostly': ['etdev', 'mailbox_detachable', 'dev_inaccessible', 'vcid', 'events'],
+        'VII IRQ': ['mailbox_last_used'],
+        'lock': ['lock', 'status', 'context_id', 'vii', 'fatal_errors'],
+        'cold': ['host_mappings', 'dmabuf_mappings', 'mbox_attr'],
+    },
+}
+
+OFFSET_RE = re.compile(r'/\*\s*(\d+)(?:\s*:\s*\d+)?\s+(\d+)\s*\*/\s*$')
+ATTR_RE = re.compile(r'__attribute__\(\((?:[^()]|\([^()]*\))*\)\)')
+FUNC_PTR_RE = re.compile(r'\(\s*\*\s*(\w+)\s*\)')
+NAME_RE = re.compile(r'(\w+)\s*(?:\[[^\]]*\]\s*)*(?::\s*\d+\s*)?;$')
+
+
+def parse_members(lines):
+    """Returns [(name, offset, size)] of the top-level members of a pahole struct dump."""
+    members = []
+    depth = 0
+    for line in lines:
+        code = line.split('/*', 1)[0].strip()
+        opening = code.count('{')
+        closing = code.count('}')
+        # only members of the outermost struct, nested ones are part of their parent
+        if depth == 1 or (depth - closing == 1 and closing):
+            match = OFFSET_RE.search(line)
+            if match and code.endswith(';'):
+                decl = ATTR_RE.sub('', code).strip()
+                name = FUNC_PTR_RE.search(decl) or NAME_RE.search(decl)
+                if name:
+                    members.append((name.group(1), int(match.group(1)), int(match.group(2))))
+        depth += opening - closing
+    return members
+
+
+def split_structs(text):
+    """Splits pahole output into {struct name: lines}."""
+    structs = {}
+    name = None
+    for line in text.splitlines():
+        match = re.match(r'^struct (\w+) \{', line)
+        if match:
+            name = match.group(1)
+            structs[name] = []
+        if name:
+            structs[name].append(line)
+            if line.startswith('}'):
+                name = None
+    return structs
+
+
+def lines_of(offset, size, cacheline):
+    return range(offset // cacheline, (offset + max(size, 1) - 1) // cacheline + 1)
+
+
+def check_struct(name, members, groups, cacheline, verbose):
+    by_name = {m[0]: m for m in members}
+    owners = {}  # cache line -> {group: [fields]}
+    ok = True
+
+    for group, fields in groups.items():
+        for field in fields:
+            if field not in by_name:
+                print(f'struct {name}: no field {field}, update {sys.argv[0]}')
+                ok = False
+                continue
+            _, offset, size = by_name[field]
+            for line in lines_of(offset, size, cacheline):
+                owners.setdefault(line, {}).setdefault(group, []).append(field)
+
+    for line in sorted(owners):
+        if len(owners[line]) > 1:
+            desc = '; '.join(f'{g}: {", ".join(f)}' for g, f in owners[line].items())
+            print(f'struct {name}: cache line {line} is shared by {desc}')
+            ok = False
+
+    if verbose:
+        for field, offset, size in members:
+            group = next((g for g, f in groups.items() if field in f), '-')
+            print(f'  {name}.{field:<28} line {offset // cacheline:<3} '
+                  f'offset {offset:<5} size {size:<5} {group}')
+    return ok
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Check the cache line layout of EdgeTPU driver structures.')
+    parser.add_argument('module', help='module or object built with debug info')
+    parser.add_argument('--cacheline', type=int, default=64,
+                        help='cache line size in bytes (default 64)')
+    parser.add_argument('--pahole', default='pahole', help='pahole binary')
+    parser.add_argument('-v', '--verbose', action='store_true',
+                        help='print the offset and group of every field')
+    args = parser.parse_args()
+
+    try:
+        out = subprocess.run([args.pahole, '-C', ','.join(LAYOUTS), args.module],
+                             check=True, capture_output=True, text=True).stdout
+    except (OSError, subprocess.CalledProcessError) as err:
+        print(f'failed to run pahole: {err}', file=sys.stderr)
+        return 2
+
+    structs = split_structs(out)
+    ok = True
+    for name, groups in LAYOUTS.items():
+        if name not in structs:
+            print(f'struct {name} not found in {args.module}, built without debug info?',
+                  file=sys.stderr)
+            return 2
+        ok &= check_struct(name, parse_members(structs[name]), groups, args.cacheline,
+                           args.verbose)
+    if ok:
+        print(f'{", ".join(LAYOUTS)}: layout OK')
+    return 0 if ok else 1
+
+
+if __name__ == '__main__':
+    sys.exit(main())